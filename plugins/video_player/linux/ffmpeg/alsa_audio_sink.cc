@@ -0,0 +1,84 @@
+#ifndef FFMPEG_ALSA_AUDIO_SINK
+#define FFMPEG_ALSA_AUDIO_SINK
+
+#include <alsa/asoundlib.h>
+
+#include <string>
+
+#include "audio_sink.cc"
+
+// Plays through an ALSA device. Write blocks while the device buffer is
+// full, which paces the mixer and the clocks that follow it.
+class AlsaAudioSink : public AudioSink
+{
+private:
+    std::string device;
+    snd_pcm_t *pcm;
+    AudioFormat format;
+
+public:
+    // Device buffer length; a few mixer blocks, so underruns stay rare.
+    static constexpr unsigned int kLatency = 30000;
+
+    explicit AlsaAudioSink(const std::string &device = "default") : device(device), pcm(NULL) {}
+    virtual ~AlsaAudioSink() { Close(); }
+
+    virtual int Open(const AudioFormat &format);
+    virtual int Write(const float *samples, int frames);
+    virtual void Close();
+    virtual int64_t Delay() const;
+};
+
+int AlsaAudioSink::Open(const AudioFormat &format) {
+    Close();
+    this->format = format;
+    int ret = snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot open audio device %s: %s\n", device.c_str(), snd_strerror(ret));
+        pcm = NULL;
+        return ret;
+    }
+    ret = snd_pcm_set_params(pcm, SND_PCM_FORMAT_FLOAT_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                             format.channels, format.sample_rate, 1, kLatency);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot configure audio device %s: %s\n", device.c_str(), snd_strerror(ret));
+        Close();
+        return ret;
+    }
+    return 0;
+}
+
+int AlsaAudioSink::Write(const float *samples, int frames) {
+    if (!pcm)
+        return AVERROR(EINVAL);
+    while (frames > 0) {
+        snd_pcm_sframes_t written = snd_pcm_writei(pcm, samples, frames);
+        if (written < 0) {
+            /* an underrun after a stall is recoverable; anything else is not */
+            int ret = snd_pcm_recover(pcm, written, 1);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        samples += written * format.channels;
+        frames -= written;
+    }
+    return 0;
+}
+
+void AlsaAudioSink::Close() {
+    if (!pcm)
+        return;
+    snd_pcm_drop(pcm);
+    snd_pcm_close(pcm);
+    pcm = NULL;
+}
+
+int64_t AlsaAudioSink::Delay() const {
+    snd_pcm_sframes_t delay;
+    if (!pcm || snd_pcm_delay(pcm, &delay) < 0)
+        return 0;
+    return delay;
+}
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef FFMPEG_AUDIO_MIXER
+#define FFMPEG_AUDIO_MIXER
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "audio_sink.cc"
+#include "audio_stream.cc"
+
+// dst[i] += src[i] * gain, with the gain moving by |step| every sample so
+// that volume changes ramp instead of clicking.
+void MixInto(float *dst, const float *src, size_t count, float gain, float step) {
+    size_t i = 0;
+#if defined(__SSE__)
+    __m128 g = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    __m128 g_step = _mm_set1_ps(4 * step);
+    for (; i + 4 <= count; i += 4) {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), s));
+        g = _mm_add_ps(g, g_step);
+    }
+#elif defined(__ARM_NEON)
+    float start[4] = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    float32x4_t g = vld1q_f32(start);
+    float32x4_t g_step = vdupq_n_f32(4 * step);
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(dst + i, vmlaq_f32(vld1q_f32(dst + i), vld1q_f32(src + i), g));
+        g = vaddq_f32(g, g_step);
+    }
+#endif
+    gain += step * i;
+    for (; i < count; i++) {
+        dst[i] += src[i] * gain;
+        gain += step;
+    }
+}
+
+// The plain loop MixInto replaces; kept as the benchmark's baseline.
+void MixIntoScalar(float *dst, const float *src, size_t count, float gain, float step) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] += src[i] * gain;
+        gain += step;
+    }
+}
+
+// Clamps to [-1, 1] so that loud overlapping inputs saturate instead of
+// wrapping when a sink converts to integers.
+void ClampSamples(float *samples, size_t count) {
+    size_t i = 0;
+#if defined(__SSE__)
+    __m128 low = _mm_set1_ps(-1.0f), high = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 s = _mm_loadu_ps(samples + i);
+        _mm_storeu_ps(samples + i, _mm_min_ps(_mm_max_ps(s, low), high));
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t low = vdupq_n_f32(-1.0f), high = vdupq_n_f32(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(samples + i, vminq_f32(vmaxq_f32(vld1q_f32(samples + i), low), high));
+    }
+#endif
+    for (; i < count; i++) {
+        samples[i] = std::min(std::max(samples[i], -1.0f), 1.0f);
+    }
+}
+
+// Mixes any number of AudioStreams into one sink, so that a wall of players
+// costs a single output stream. Each stream's gain is ramped over a block.
+class AudioMixer
+{
+private:
+    struct Input
+    {
+        AudioStream *stream;
+        // The gain applied at the end of the last block.
+        float gain;
+    };
+
+    AudioFormat format;
+    std::unique_ptr<AudioSink> sink;
+    /* serializes AddInput, RemoveInput and SetSink */
+    std::mutex control_mutex;
+    /* guards inputs against the mixing thread */
+    std::mutex mutex;
+    std::vector<Input> inputs;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::vector<float> scratch;
+
+    void start();
+    void stop();
+    void mix_loop();
+
+public:
+    // Around 5 ms at 48 kHz: the latency a block adds, and how long a
+    // volume ramp takes.
+    static constexpr int kBlockFrames = 256;
+
+    explicit AudioMixer(std::unique_ptr<AudioSink> sink = nullptr,
+                        const AudioFormat &format = AudioFormat());
+    ~AudioMixer();
+
+    // The mixer every player without a sink of its own plays into.
+    static AudioMixer &Shared();
+
+    const AudioFormat &Format() const { return format; }
+    // Replaces the output. Playback moves to it from the next block.
+    void SetSink(std::unique_ptr<AudioSink> sink);
+    // The first input opens the sink and starts mixing; the last one
+    // removed stops it again.
+    int AddInput(AudioStream *stream);
+    void RemoveInput(AudioStream *stream);
+
+    // Pulls one block of |frames| from every input into |out|. Returns the
+    // number of inputs that had audio. Called by the mixing thread.
+    int MixBlock(float *out, int frames);
+};
+
+AudioMixer::AudioMixer(std::unique_ptr<AudioSink> sink, const AudioFormat &format)
+    : format(format), sink(std::move(sink)), running(false)
+{
+}
+
+AudioMixer::~AudioMixer()
+{
+    std::lock_guard<std::mutex> control(control_mutex);
+    stop();
+}
+
+AudioMixer &AudioMixer::Shared() {
+    static AudioMixer mixer;
+    return mixer;
+}
+
+void AudioMixer::SetSink(std::unique_ptr<AudioSink> replacement) {
+    std::lock_guard<std::mutex> control(control_mutex);
+    bool was_running = running;
+    stop();
+    sink = std::move(replacement);
+    if (was_running)
+        start();
+}
+
+void AudioMixer::start() {
+    /* a mix that ended on its own still has a thread to join */
+    stop();
+    if (!sink)
+        sink.reset(new NullAudioSink());
+    if (sink->Open(format) < 0) {
+        /* no device: keep the clocks running all the same */
+        fprintf(stderr, "Cannot open audio sink, discarding audio\n");
+        sink.reset(new NullAudioSink());
+        sink->Open(format);
+    }
+    running = true;
+    thread = std::thread(&AudioMixer::mix_loop, this);
+}
+
+void AudioMixer::stop() {
+    running = false;
+    if (!thread.joinable())
+        return;
+    thread.join();
+    sink->Close();
+}
+
+int AudioMixer::AddInput(AudioStream *stream) {
+    std::lock_guard<std::mutex> control(control_mutex);
+    if (stream->Format().sample_rate != format.sample_rate ||
+        stream->Format().channels != format.channels)
+        return AVERROR(EINVAL);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inputs.push_back(Input{stream, stream->Gain()});
+    }
+    if (!running)
+        start();
+    return 0;
+}
+
+void AudioMixer::RemoveInput(AudioStream *stream) {
+    std::lock_guard<std::mutex> control(control_mutex);
+    bool empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inputs.erase(std::remove_if(inputs.begin(), inputs.end(),
+                                    [stream](const Input &input) { return input.stream == stream; }),
+                     inputs.end());
+        empty = inputs.empty();
+    }
+    if (empty)
+        stop();
+}
+
+int AudioMixer::MixBlock(float *out, int frames) {
+    size_t count = size_t(frames) * format.channels;
+    scratch.resize(count);
+    memset(out, 0, count * sizeof(float));
+
+    int active = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &input : inputs) {
+        int pulled = input.stream->Pull(scratch.data(), frames);
+        float target = input.stream->Gain();
+        if (pulled == 0 || (target == 0.0f && input.gain == 0.0f)) {
+            input.gain = target;
+            active += pulled > 0;
+            continue;
+        }
+        MixInto(out, scratch.data(), count, input.gain, (target - input.gain) / count);
+        input.gain = target;
+        active++;
+    }
+    return active;
+}
+
+void AudioMixer::mix_loop() {
+    std::vector<float> block(size_t(kBlockFrames) * format.channels);
+    int64_t block_us = int64_t(kBlockFrames) * AV_TIME_BASE / format.sample_rate;
+    while (running) {
+        if (MixBlock(block.data(), kBlockFrames) == 0) {
+            /* everyone is paused or starved: nothing worth writing */
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &input : inputs) {
+                input.stream->Played(sink->Delay());
+            }
+            usleep(block_us / 2);
+            continue;
+        }
+        ClampSamples(block.data(), block.size());
+        if (sink->Write(block.data(), kBlockFrames) < 0) {
+            /* the device went away: the players still follow the clock */
+            fprintf(stderr, "Audio sink failed, discarding audio\n");
+            sink->Close();
+            sink.reset(new NullAudioSink());
+            if (sink->Open(format) < 0) {
+                /* the next AddInput starts over */
+                running = false;
+                break;
+            }
+            continue;
+        }
+
+        int64_t delay = sink->Delay();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &input : inputs) {
+            input.stream->Played(delay);
+        }
+    }
+}
+
+#endif
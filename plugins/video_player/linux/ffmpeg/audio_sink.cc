@@ -0,0 +1,181 @@
+#ifndef FFMPEG_AUDIO_SINK
+#define FFMPEG_AUDIO_SINK
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/time.h>
+}
+
+// The one format audio leaves the decoders in: interleaved float32.
+struct AudioFormat
+{
+    int sample_rate = 48000;
+    int channels = 2;
+};
+
+// Where rendered audio goes. Write is called from a single rendering thread
+// and blocks the way a device would; that blocking is what paces the audio
+// clock, and through it the video.
+class AudioSink
+{
+public:
+    virtual ~AudioSink() {}
+    virtual int Open(const AudioFormat &format) = 0;
+    // Plays |frames| frames of interleaved samples. Returns < 0 on error.
+    virtual int Write(const float *samples, int frames) = 0;
+    virtual void Close() = 0;
+    // Frames accepted by Write that have not been heard yet.
+    virtual int64_t Delay() const { return 0; }
+};
+
+// Sleeps so that frames are consumed no faster than real time, measured
+// from the first write so that rounding does not accumulate.
+class AudioPacer
+{
+private:
+    int sample_rate;
+    int64_t start;
+    int64_t frames;
+
+public:
+    AudioPacer() : sample_rate(0), start(AV_NOPTS_VALUE), frames(0) {}
+
+    void Reset(int rate) {
+        sample_rate = rate;
+        start = AV_NOPTS_VALUE;
+        frames = 0;
+    }
+
+    void Pace(int count) {
+        int64_t now = av_gettime_relative();
+        /* a pause or a stall restarts the schedule instead of bursting */
+        if (start == AV_NOPTS_VALUE ||
+            now - start - frames * AV_TIME_BASE / sample_rate > AV_TIME_BASE / 10) {
+            start = now;
+            frames = 0;
+        }
+        frames += count;
+        int64_t delay = start + frames * AV_TIME_BASE / sample_rate - now;
+        if (delay > 0)
+            usleep(delay);
+    }
+};
+
+// Discards everything, in real time unless told otherwise. Keeps the audio
+// clock running where there is no device, and benchmarks the decode side.
+class NullAudioSink : public AudioSink
+{
+private:
+    bool realtime;
+    AudioPacer pacer;
+
+public:
+    explicit NullAudioSink(bool realtime = true) : realtime(realtime) {}
+
+    virtual int Open(const AudioFormat &format) {
+        pacer.Reset(format.sample_rate);
+        return 0;
+    }
+    virtual int Write(const float *samples, int frames) {
+        if (realtime)
+            pacer.Pace(frames);
+        return 0;
+    }
+    virtual void Close() {}
+};
+
+// Records to a 32-bit float WAV file, for headless tests.
+class WavFileAudioSink : public AudioSink
+{
+private:
+    std::string path;
+    bool realtime;
+    AudioPacer pacer;
+    AudioFormat format;
+    FILE *file;
+    uint32_t data_bytes;
+
+    void write_header();
+
+public:
+    explicit WavFileAudioSink(const std::string &path, bool realtime = false)
+        : path(path), realtime(realtime), file(NULL), data_bytes(0) {}
+    virtual ~WavFileAudioSink() { Close(); }
+
+    virtual int Open(const AudioFormat &format);
+    virtual int Write(const float *samples, int frames);
+    virtual void Close();
+};
+
+int WavFileAudioSink::Open(const AudioFormat &format) {
+    Close();
+    this->format = format;
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return AVERROR(errno);
+    data_bytes = 0;
+    pacer.Reset(format.sample_rate);
+    /* the sizes are filled in again on close */
+    write_header();
+    return 0;
+}
+
+void WavFileAudioSink::write_header() {
+    uint32_t block_align = format.channels * sizeof(float);
+    uint32_t byte_rate = format.sample_rate * block_align;
+    uint32_t riff_bytes = 4 + (8 + 18) + (8 + 4) + (8 + data_bytes);
+    uint32_t fmt_bytes = 18, fact_bytes = 4;
+    uint32_t frames = data_bytes / block_align;
+    uint16_t format_tag = 3; /* WAVE_FORMAT_IEEE_FLOAT */
+    uint16_t channels = format.channels;
+    uint32_t sample_rate = format.sample_rate;
+    uint16_t align = block_align, bits = 32, extra = 0;
+
+    fseek(file, 0, SEEK_SET);
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_bytes, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_bytes, 4, 1, file);
+    fwrite(&format_tag, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite(&extra, 2, 1, file);
+    /* non-PCM formats carry a fact chunk with the frame count */
+    fwrite("fact", 1, 4, file);
+    fwrite(&fact_bytes, 4, 1, file);
+    fwrite(&frames, 4, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_bytes, 4, 1, file);
+}
+
+int WavFileAudioSink::Write(const float *samples, int frames) {
+    if (!file)
+        return AVERROR(EINVAL);
+    size_t count = size_t(frames) * format.channels;
+    if (fwrite(samples, sizeof(float), count, file) != count)
+        return AVERROR(EIO);
+    data_bytes += count * sizeof(float);
+    if (realtime)
+        pacer.Pace(frames);
+    return 0;
+}
+
+void WavFileAudioSink::Close() {
+    if (!file)
+        return;
+    write_header();
+    fclose(file);
+    file = NULL;
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef FFMPEG_AUDIO_STREAM
+#define FFMPEG_AUDIO_STREAM
+
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "audio_sink.cc"
+#include "sample_ring.cc"
+
+// One player's decoded audio on its way to a sink, and the clock derived
+// from how much of it has been played. The decoder thread produces, an
+// AudioMixer consumes; the consumer side never blocks.
+class AudioStream
+{
+private:
+    AudioFormat format;
+    SampleRing ring;
+    std::atomic<bool> paused;
+    std::atomic<float> gain;
+
+    /* Producer side: the next write starts a new timeline. Marks are handed
+     * to the consumer through the atomics below, published by mark_serial. */
+    bool rebase_pending;
+    bool rebase_discard;
+    std::atomic<uint64_t> mark_position;
+    std::atomic<int64_t> mark_time;
+    std::atomic<bool> mark_discard;
+    std::atomic<uint32_t> mark_serial;
+
+    /* consumer side */
+    uint32_t seen_serial;
+    bool has_pending;
+    uint64_t pending_position;
+    int64_t pending_time;
+    bool pending_discard;
+    uint64_t base_position;
+    int64_t base_time;
+    bool live;
+
+    mutable std::mutex clock_mutex;
+    int64_t clock_time;
+    int64_t clock_updated_at;
+    bool clock_valid;
+    bool clock_paused;
+
+    void take_mark();
+    void apply_mark();
+
+public:
+    // Half a second of audio at most sits between decoder and sink.
+    explicit AudioStream(const AudioFormat &format = AudioFormat());
+
+    const AudioFormat &Format() const { return format; }
+
+    // Producer side. The next Write begins a new timeline, after whatever is
+    // still queued has played out or, with |discard|, in its place.
+    void Rebase(bool discard);
+    // Writes as many whole frames as fit. |time| is the media time of the
+    // first one, in AV_TIME_BASE units. Returns the frames written.
+    int Write(const float *samples, int frames, int64_t time);
+
+    // Consumer side. Fills |out| with up to |frames| frames, padding with
+    // silence, and returns how many came from the stream.
+    int Pull(float *out, int frames);
+    // Reports that everything pulled so far has been handed to a sink that
+    // still holds |delay| frames of it.
+    void Played(int64_t delay);
+
+    // Media time currently being heard. Returns false while there is no
+    // audio to follow: before the first sample, or after an underrun.
+    bool Clock(int64_t *time) const;
+    void SetPaused(bool pause);
+    // Volume from 0 to 1, applied by whatever mixes this stream.
+    void SetGain(float value) { gain = std::min(std::max(value, 0.0f), 1.0f); }
+    float Gain() const { return gain; }
+    size_t Bytes() const { return ring.Capacity() * sizeof(float); }
+};
+
+AudioStream::AudioStream(const AudioFormat &format)
+    : format(format),
+      ring(size_t(format.sample_rate / 2) * format.channels),
+      paused(false),
+      gain(1.0f),
+      rebase_pending(true),
+      rebase_discard(false),
+      mark_position(0),
+      mark_time(0),
+      mark_discard(false),
+      mark_serial(0),
+      seen_serial(0),
+      has_pending(false),
+      pending_position(0),
+      pending_time(0),
+      pending_discard(false),
+      base_position(0),
+      base_time(AV_NOPTS_VALUE),
+      live(false),
+      clock_time(0),
+      clock_updated_at(0),
+      clock_valid(false),
+      clock_paused(false)
+{
+}
+
+void AudioStream::Rebase(bool discard) {
+    rebase_pending = true;
+    rebase_discard = rebase_discard || discard;
+}
+
+int AudioStream::Write(const float *samples, int frames, int64_t time) {
+    if (rebase_pending) {
+        mark_time.store(time, std::memory_order_relaxed);
+        mark_discard.store(rebase_discard, std::memory_order_relaxed);
+        mark_position.store(ring.WritePosition(), std::memory_order_relaxed);
+        mark_serial.fetch_add(1, std::memory_order_release);
+        rebase_pending = false;
+        rebase_discard = false;
+    }
+    /* whole frames only, so the consumer never sees half of one */
+    size_t fit = std::min<size_t>(frames, ring.Space() / format.channels);
+    return ring.Write(samples, fit * format.channels) / format.channels;
+}
+
+void AudioStream::take_mark() {
+    uint32_t serial = mark_serial.load(std::memory_order_acquire);
+    if (serial == seen_serial)
+        return;
+    seen_serial = serial;
+    /* a newer mark replaces one not reached yet, but a seek still wins */
+    pending_discard = (has_pending && pending_discard) ||
+                      mark_discard.load(std::memory_order_relaxed);
+    pending_position = mark_position.load(std::memory_order_relaxed);
+    pending_time = mark_time.load(std::memory_order_relaxed);
+    has_pending = true;
+}
+
+void AudioStream::apply_mark() {
+    uint64_t position = ring.ReadPosition();
+    if (pending_discard && position < pending_position)
+        position += ring.Discard(pending_position - position);
+    if (position >= pending_position) {
+        base_position = pending_position;
+        base_time = pending_time;
+        has_pending = false;
+    }
+}
+
+int AudioStream::Pull(float *out, int frames) {
+    int done = 0;
+    if (!paused) {
+        take_mark();
+        while (done < frames) {
+            if (has_pending)
+                apply_mark();
+            size_t want = size_t(frames - done) * format.channels;
+            /* stop at the start of a new timeline so the clock can follow */
+            if (has_pending)
+                want = std::min<size_t>(want, pending_position - ring.ReadPosition());
+            size_t got = ring.Read(out + size_t(done) * format.channels, want);
+            done += got / format.channels;
+            if (got == 0 && !(has_pending && ring.ReadPosition() >= pending_position))
+                break;
+        }
+    }
+    memset(out + size_t(done) * format.channels, 0,
+           size_t(frames - done) * format.channels * sizeof(float));
+    live = done > 0;
+    return done;
+}
+
+void AudioStream::Played(int64_t delay) {
+    int64_t now = av_gettime_relative();
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    clock_paused = paused;
+    if (clock_paused) {
+        /* hold the clock where it stopped */
+        clock_updated_at = now;
+        return;
+    }
+    if (base_time == AV_NOPTS_VALUE || !live) {
+        clock_valid = false;
+        return;
+    }
+    int64_t frames = int64_t(ring.ReadPosition() - base_position) / format.channels - delay;
+    clock_time = base_time + frames * AV_TIME_BASE / format.sample_rate;
+    clock_updated_at = now;
+    clock_valid = true;
+}
+
+bool AudioStream::Clock(int64_t *time) const {
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    int64_t elapsed = av_gettime_relative() - clock_updated_at;
+    /* a sink that stopped asking for audio is no clock to follow */
+    if (!clock_valid || elapsed > AV_TIME_BASE / 5)
+        return false;
+    *time = clock_time + (clock_paused? 0:elapsed);
+    return true;
+}
+
+void AudioStream::SetPaused(bool pause) {
+    paused = pause;
+}
+
+#endif
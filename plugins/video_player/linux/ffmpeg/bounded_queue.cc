@@ -0,0 +1,141 @@
+#ifndef FFMPEG_BOUNDED_QUEUE
+#define FFMPEG_BOUNDED_QUEUE
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Occupancy and backpressure counters of a BoundedQueue.
+struct QueueStats
+{
+    size_t capacity = 0;
+    size_t size = 0;
+    size_t high_water = 0;
+    uint64_t pushed = 0;
+    // Times the producer had to wait because the queue was full.
+    uint64_t full_waits = 0;
+    // Times the consumer had to wait because the queue was empty.
+    uint64_t empty_waits = 0;
+};
+
+// A blocking FIFO with a fixed capacity, used to hand work between the
+// pipeline stages of a player. Closing the queue wakes every waiter.
+template <typename T>
+class BoundedQueue
+{
+private:
+    mutable std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<T> items;
+    QueueStats stats;
+    bool closed;
+
+public:
+    explicit BoundedQueue(size_t capacity);
+
+    // Blocks while the queue is full. Returns false if it was closed.
+    bool Push(T item);
+    // Blocks while the queue is empty. Returns false once it is closed.
+    bool Pop(T *item);
+
+    void Close();
+    void Reopen();
+    // Drops every queued item, handing it to |dispose| first.
+    template <typename F>
+    void Clear(F dispose);
+
+    void SetCapacity(size_t capacity);
+    size_t Capacity() const;
+    QueueStats Stats() const;
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) : closed(false)
+{
+    stats.capacity = std::max<size_t>(capacity, 1);
+}
+
+template <typename T>
+bool BoundedQueue<T>::Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!closed && items.size() >= stats.capacity) {
+        stats.full_waits++;
+        not_full.wait(lock, [this]() { return closed || items.size() < stats.capacity; });
+    }
+    if (closed)
+        return false;
+
+    items.push_back(std::move(item));
+    stats.pushed++;
+    stats.high_water = std::max(stats.high_water, items.size());
+    not_empty.notify_one();
+    return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::Pop(T *item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!closed && items.empty()) {
+        stats.empty_waits++;
+        not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+    }
+    if (closed)
+        return false;
+
+    *item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+}
+
+template <typename T>
+void BoundedQueue<T>::Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+}
+
+template <typename T>
+void BoundedQueue<T>::Reopen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = false;
+}
+
+template <typename T>
+template <typename F>
+void BoundedQueue<T>::Clear(F dispose) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &item : items) {
+        dispose(item);
+    }
+    items.clear();
+    not_full.notify_all();
+}
+
+template <typename T>
+void BoundedQueue<T>::SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.capacity = std::max<size_t>(capacity, 1);
+    not_full.notify_all();
+}
+
+template <typename T>
+size_t BoundedQueue<T>::Capacity() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats.capacity;
+}
+
+template <typename T>
+QueueStats BoundedQueue<T>::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    QueueStats current = stats;
+    current.size = items.size();
+    return current;
+}
+
+#endif
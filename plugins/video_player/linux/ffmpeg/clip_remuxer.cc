@@ -0,0 +1,306 @@
+#ifndef FFMPEG_CLIP_REMUXER
+#define FFMPEG_CLIP_REMUXER
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// How a trimmed clip starts, given that stream copy cannot start between
+// keyframes.
+enum class TrimMode
+{
+    // At the keyframe at or before the requested start, so the clip may
+    // begin a little early.
+    kKeyframe,
+    // At the requested start: the clip still holds the frames from the
+    // keyframe on, but an edit list hides them. MP4 and MOV only; other
+    // containers fall back to kKeyframe.
+    kExact,
+};
+
+struct TrimOptions
+{
+    int64_t start_us = 0;
+    int64_t end_us = INT64_MAX;
+    TrimMode mode = TrimMode::kKeyframe;
+    bool audio = true;
+};
+
+struct TrimResult
+{
+    // Where the clip actually starts and ends in the source.
+    int64_t start_us = 0;
+    int64_t end_us = 0;
+    int64_t packets = 0;
+    bool exact = false;
+};
+
+// Called with the share of the clip written so far, 0 to 1.
+typedef std::function<void(double progress)> ProgressCallback;
+
+// Copies the video and audio packets of [start_us, end_us) from |input| into
+// a new container at |output|, its format guessed from the extension,
+// without decoding anything. A cancelled or failed clip is deleted.
+class ClipRemuxer
+{
+private:
+    std::string input;
+    std::string output;
+    TrimOptions options;
+    AVFormatContext *in_ctx;
+    AVFormatContext *out_ctx;
+    /* per input stream, -1 where the stream is left out */
+    std::vector<int> mapping;
+    int reference;
+    int64_t origin_us;
+
+    int open_input();
+    int open_output();
+    int find_start(int64_t *start_us);
+    int64_t to_us(int64_t ts, int stream) const;
+    static bool has_edit_lists(const AVOutputFormat *format);
+
+public:
+    ClipRemuxer(const std::string &input, const std::string &output, const TrimOptions &options);
+    ~ClipRemuxer();
+
+    int Run(const std::atomic<bool> &cancelled, const ProgressCallback &progress, TrimResult *result);
+};
+
+ClipRemuxer::ClipRemuxer(const std::string &input, const std::string &output, const TrimOptions &options)
+    : input(input), output(output), options(options), in_ctx(NULL), out_ctx(NULL), reference(-1), origin_us(0)
+{
+}
+
+ClipRemuxer::~ClipRemuxer()
+{
+    avformat_close_input(&in_ctx);
+    if (out_ctx) {
+        if (!(out_ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out_ctx->pb);
+        avformat_free_context(out_ctx);
+    }
+}
+
+bool ClipRemuxer::has_edit_lists(const AVOutputFormat *format) {
+    /* the mov muxer family */
+    for (const char *name : { "mov", "mp4", "ipod", "ismv", "3gp", "3g2", "psp", "f4v" }) {
+        if (strcmp(format->name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int64_t ClipRemuxer::to_us(int64_t ts, int stream) const {
+    return av_rescale_q(ts, in_ctx->streams[stream]->time_base, AV_TIME_BASE_Q) - origin_us;
+}
+
+int ClipRemuxer::open_input() {
+    int ret = avformat_open_input(&in_ctx, input.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0)
+        return ret;
+    /* video sets the cut points; an audio-only file is cut on its audio */
+    reference = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (reference < 0)
+        reference = av_find_best_stream(in_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (reference < 0)
+        return reference;
+    AVStream *stream = in_ctx->streams[reference];
+    origin_us = (stream->start_time != AV_NOPTS_VALUE)?
+        av_rescale_q(stream->start_time, stream->time_base, AV_TIME_BASE_Q):0;
+    return 0;
+}
+
+int ClipRemuxer::open_output() {
+    int ret = avformat_alloc_output_context2(&out_ctx, NULL, NULL, output.c_str());
+    if (ret < 0 || !out_ctx)
+        return ret < 0? ret:AVERROR(EINVAL);
+
+    mapping.assign(in_ctx->nb_streams, -1);
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        AVStream *in = in_ctx->streams[i];
+        AVMediaType type = in->codecpar->codec_type;
+        if ((int)i != reference && !(options.audio && type == AVMEDIA_TYPE_AUDIO)) {
+            in->discard = AVDISCARD_ALL;
+            continue;
+        }
+        AVStream *out = avformat_new_stream(out_ctx, NULL);
+        if (!out)
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_parameters_copy(out->codecpar, in->codecpar)) < 0)
+            return ret;
+        /* the input container's tag may mean nothing in the output's */
+        out->codecpar->codec_tag = 0;
+        out->time_base = in->time_base;
+        /* keeps the rotation tag, among others */
+        av_dict_copy(&out->metadata, in->metadata, 0);
+        mapping[i] = out->index;
+    }
+    av_dict_copy(&out_ctx->metadata, in_ctx->metadata, 0);
+
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&out_ctx->pb, output.c_str(), AVIO_FLAG_WRITE)) < 0)
+        return ret;
+    return 0;
+}
+
+int ClipRemuxer::find_start(int64_t *start_us) {
+    /* the first packet of the reference stream after the seek is the
+     * keyframe the clip has to start from */
+    AVStream *stream = in_ctx->streams[reference];
+    int64_t target = av_rescale_q(origin_us + options.start_us, AV_TIME_BASE_Q, stream->time_base);
+    int ret = av_seek_frame(in_ctx, reference, target, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+        return ret;
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+        return AVERROR(ENOMEM);
+    *start_us = 0;
+    while ((ret = av_read_frame(in_ctx, packet)) >= 0) {
+        bool found = packet->stream_index == reference;
+        if (found)
+            *start_us = to_us((packet->pts != AV_NOPTS_VALUE)? packet->pts:packet->dts, reference);
+        av_packet_unref(packet);
+        if (found)
+            break;
+    }
+    av_packet_free(&packet);
+    if (ret < 0)
+        return ret;
+    /* and back again, so that the copy reads the same packets */
+    return av_seek_frame(in_ctx, reference, target, AVSEEK_FLAG_BACKWARD);
+}
+
+int ClipRemuxer::Run(const std::atomic<bool> &cancelled, const ProgressCallback &progress, TrimResult *result) {
+    AVPacket *packet = NULL;
+    std::vector<bool> finished;
+    int64_t keyframe_us, offset_us, span_us;
+    int remaining = 0;
+    int last_percent = -1;
+    bool header_written = false;
+    int ret;
+
+    /* cancelled as it started: not even an empty file is left behind */
+    if (cancelled)
+        return AVERROR_EXIT;
+    if ((ret = open_input()) < 0 || (ret = open_output()) < 0)
+        goto end;
+    if ((ret = find_start(&keyframe_us)) < 0)
+        goto end;
+    result->exact = options.mode == TrimMode::kExact && has_edit_lists(out_ctx->oformat) &&
+        keyframe_us < options.start_us;
+    /* timestamps in the clip count from here */
+    offset_us = result->exact? options.start_us:keyframe_us;
+    result->start_us = offset_us;
+    result->end_us = offset_us;
+    span_us = (in_ctx->duration > 0)? std::min(options.end_us, in_ctx->duration):options.end_us;
+    span_us = std::max<int64_t>(span_us - offset_us, 1);
+
+    if ((ret = avformat_write_header(out_ctx, NULL)) < 0)
+        goto end;
+    header_written = true;
+    if (!(packet = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    finished.assign(in_ctx->nb_streams, false);
+    for (int index : mapping) {
+        remaining += index >= 0;
+    }
+
+    while (remaining > 0) {
+        if (cancelled) {
+            ret = AVERROR_EXIT;
+            goto end;
+        }
+        ret = av_read_frame(in_ctx, packet);
+        if (ret == AVERROR_EOF)
+            break;
+        if (ret < 0)
+            goto end;
+        int index = packet->stream_index;
+        if (mapping[index] < 0 || finished[index]) {
+            av_packet_unref(packet);
+            continue;
+        }
+        int64_t pts_us = to_us((packet->pts != AV_NOPTS_VALUE)? packet->pts:packet->dts, index);
+        int64_t dts_us = (packet->dts != AV_NOPTS_VALUE)? to_us(packet->dts, index):pts_us;
+        if (index == reference) {
+            /* Cut video in decode order, so that no frame in the clip
+             * loses a reference frame; at most a few frames past the end
+             * come along. */
+            if (dts_us >= options.end_us) {
+                finished[index] = true;
+                remaining--;
+                av_packet_unref(packet);
+                continue;
+            }
+            result->end_us = std::max(result->end_us, pts_us);
+            int percent = std::min<int64_t>((pts_us - offset_us) * 100 / span_us, 100);
+            if (percent > last_percent && progress) {
+                last_percent = percent;
+                progress(percent / 100.0);
+            }
+        } else {
+            if (pts_us >= options.end_us) {
+                finished[index] = true;
+                remaining--;
+                av_packet_unref(packet);
+                continue;
+            }
+            /* audio needs no keyframe, so it starts exactly */
+            if (pts_us < offset_us) {
+                av_packet_unref(packet);
+                continue;
+            }
+        }
+
+        AVStream *in = in_ctx->streams[index];
+        AVStream *out = out_ctx->streams[mapping[index]];
+        int64_t shift = av_rescale_q(origin_us + offset_us, AV_TIME_BASE_Q, in->time_base);
+        if (packet->pts != AV_NOPTS_VALUE)
+            packet->pts -= shift;
+        if (packet->dts != AV_NOPTS_VALUE)
+            packet->dts -= shift;
+        av_packet_rescale_ts(packet, in->time_base, out->time_base);
+        packet->stream_index = out->index;
+        packet->pos = -1;
+        if ((ret = av_interleaved_write_frame(out_ctx, packet)) < 0)
+            goto end;
+        result->packets++;
+    }
+    ret = av_write_trailer(out_ctx);
+    header_written = false;
+    if (ret >= 0 && progress)
+        progress(1.0);
+
+end:
+    if (header_written)
+        av_write_trailer(out_ctx);
+    av_packet_free(&packet);
+    if (ret < 0) {
+        if (ret != AVERROR_EXIT)
+            av_log(NULL, AV_LOG_ERROR, "Cannot export %s to %s\n", input.c_str(), output.c_str());
+        if (out_ctx) {
+            if (!(out_ctx->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&out_ctx->pb);
+            unlink(output.c_str());
+        }
+    }
+    return ret < 0? ret:0;
+}
+
+#endif
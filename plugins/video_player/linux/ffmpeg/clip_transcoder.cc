@@ -0,0 +1,467 @@
+#ifndef FFMPEG_CLIP_TRANSCODER
+#define FFMPEG_CLIP_TRANSCODER
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+#include "bounded_queue.cc"
+#include "clip_remuxer.cc"
+#include "frame_converter.cc"
+
+struct TranscodeOptions
+{
+    // One of the encoders built into libavcodec, such as mpeg4 or mjpeg.
+    AVCodecID codec = AV_CODEC_ID_MPEG4;
+    // Zero keeps the source's; with only one given, the other follows the
+    // source's aspect ratio. Rounded down to even.
+    int width = 0;
+    int height = 0;
+    int64_t bit_rate = 4000000;
+    int64_t start_us = 0;
+    int64_t end_us = INT64_MAX;
+    // Copied as it is when the output container takes its codec, otherwise
+    // left out.
+    bool audio = true;
+};
+
+struct TranscodeResult
+{
+    int width = 0;
+    int height = 0;
+    int64_t frames = 0;
+    bool audio = false;
+    int64_t elapsed_us = 0;
+};
+
+// Re-encodes [start_us, end_us) of |input| into |output| as a pipeline of
+// three threads: demux and decode, scale, then encode and mux on the calling
+// thread. Decoder and encoder also run threads of their own. Cuts are frame
+// accurate, since every frame is encoded anew. A cancelled or failed clip is
+// deleted.
+class ClipTranscoder
+{
+private:
+    // A decoded or scaled frame, or an audio packet passing through. Both
+    // NULL marks the end of the stream.
+    struct Item
+    {
+        AVFrame *frame;
+        AVPacket *packet;
+    };
+
+    std::string input;
+    std::string output;
+    TranscodeOptions options;
+    AVFormatContext *in_ctx;
+    AVFormatContext *out_ctx;
+    AVCodecContext *dec_ctx;
+    AVCodecContext *enc_ctx;
+    int video_index;
+    int audio_index;
+    AVStream *video_out;
+    AVStream *audio_out;
+    int64_t origin_us;
+    std::atomic<bool> stopping;
+    std::atomic<int> stage_error;
+
+    BoundedQueue<Item> decoded;
+    BoundedQueue<Item> scaled;
+
+    static const size_t kQueueDepth = 8;
+
+    int open_input();
+    int open_output(TranscodeResult *result);
+    int64_t to_us(int64_t ts, int stream) const;
+    void decode_stage();
+    void scale_stage();
+    int write_packets(int64_t *frames);
+    static void dispose(Item &item);
+
+public:
+    ClipTranscoder(const std::string &input, const std::string &output, const TranscodeOptions &options);
+    ~ClipTranscoder();
+
+    int Run(const std::atomic<bool> &cancelled, const ProgressCallback &progress, TranscodeResult *result);
+};
+
+ClipTranscoder::ClipTranscoder(const std::string &input, const std::string &output,
+                               const TranscodeOptions &options)
+    : input(input), output(output), options(options),
+      in_ctx(NULL), out_ctx(NULL), dec_ctx(NULL), enc_ctx(NULL),
+      video_index(-1), audio_index(-1), video_out(NULL), audio_out(NULL), origin_us(0),
+      stopping(false), stage_error(0),
+      decoded(kQueueDepth), scaled(kQueueDepth)
+{
+}
+
+ClipTranscoder::~ClipTranscoder()
+{
+    avcodec_free_context(&dec_ctx);
+    avcodec_free_context(&enc_ctx);
+    avformat_close_input(&in_ctx);
+    if (out_ctx) {
+        if (!(out_ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out_ctx->pb);
+        avformat_free_context(out_ctx);
+    }
+}
+
+void ClipTranscoder::dispose(Item &item) {
+    av_frame_free(&item.frame);
+    av_packet_free(&item.packet);
+}
+
+int64_t ClipTranscoder::to_us(int64_t ts, int stream) const {
+    return av_rescale_q(ts, in_ctx->streams[stream]->time_base, AV_TIME_BASE_Q) - origin_us;
+}
+
+int ClipTranscoder::open_input() {
+    AVCodec *dec;
+    int ret = avformat_open_input(&in_ctx, input.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(in_ctx, NULL)) < 0)
+        return ret;
+    if ((ret = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0)) < 0)
+        return ret;
+    video_index = ret;
+    AVStream *video = in_ctx->streams[video_index];
+    origin_us = (video->start_time != AV_NOPTS_VALUE)?
+        av_rescale_q(video->start_time, video->time_base, AV_TIME_BASE_Q):0;
+
+    if (!(dec_ctx = avcodec_alloc_context3(dec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(dec_ctx, video->codecpar);
+    /* one per core; the job's niceness carries over to them */
+    dec_ctx->thread_count = 0;
+    dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    return avcodec_open2(dec_ctx, dec, NULL);
+}
+
+int ClipTranscoder::open_output(TranscodeResult *result) {
+    AVCodec *enc = avcodec_find_encoder(options.codec);
+    if (!enc || !enc->pix_fmts)
+        return AVERROR_ENCODER_NOT_FOUND;
+    int ret = avformat_alloc_output_context2(&out_ctx, NULL, NULL, output.c_str());
+    if (ret < 0 || !out_ctx)
+        return ret < 0? ret:AVERROR(EINVAL);
+
+    int width = options.width, height = options.height;
+    if (width <= 0 && height <= 0) {
+        width = dec_ctx->width;
+        height = dec_ctx->height;
+    } else if (width <= 0) {
+        width = av_rescale(height, dec_ctx->width, dec_ctx->height);
+    } else if (height <= 0) {
+        height = av_rescale(width, dec_ctx->height, dec_ctx->width);
+    }
+    result->width = width & ~1;
+    result->height = height & ~1;
+
+    /* mpeg4 takes no time base finer than 1/65535 */
+    AVStream *video = in_ctx->streams[video_index];
+    AVRational rate = av_guess_frame_rate(in_ctx, video, NULL);
+    if (rate.num <= 0 || rate.den <= 0)
+        rate = AVRational{30, 1};
+    if (rate.num > 65535)
+        rate = av_d2q(av_q2d(rate), 65535);
+
+    if (!(enc_ctx = avcodec_alloc_context3(enc)))
+        return AVERROR(ENOMEM);
+    enc_ctx->width = result->width;
+    enc_ctx->height = result->height;
+    enc_ctx->pix_fmt = enc->pix_fmts[0];
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    enc_ctx->time_base = av_inv_q(rate);
+    enc_ctx->framerate = rate;
+    enc_ctx->bit_rate = options.bit_rate;
+    enc_ctx->gop_size = 12;
+    enc_ctx->thread_count = 0;
+    enc_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (out_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((ret = avcodec_open2(enc_ctx, enc, NULL)) < 0)
+        return ret;
+
+    if (!(video_out = avformat_new_stream(out_ctx, NULL)))
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_from_context(video_out->codecpar, enc_ctx)) < 0)
+        return ret;
+    video_out->time_base = enc_ctx->time_base;
+    av_dict_copy(&video_out->metadata, video->metadata, 0);
+
+    if (options.audio) {
+        int best = av_find_best_stream(in_ctx, AVMEDIA_TYPE_AUDIO, -1, video_index, NULL, 0);
+        if (best >= 0 &&
+            avformat_query_codec(out_ctx->oformat, in_ctx->streams[best]->codecpar->codec_id,
+                                 FF_COMPLIANCE_NORMAL) == 1) {
+            if (!(audio_out = avformat_new_stream(out_ctx, NULL)))
+                return AVERROR(ENOMEM);
+            if ((ret = avcodec_parameters_copy(audio_out->codecpar, in_ctx->streams[best]->codecpar)) < 0)
+                return ret;
+            audio_out->codecpar->codec_tag = 0;
+            audio_out->time_base = in_ctx->streams[best]->time_base;
+            audio_index = best;
+            result->audio = true;
+        }
+    }
+    for (unsigned i = 0; i < in_ctx->nb_streams; i++) {
+        if ((int)i != video_index && (int)i != audio_index)
+            in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&out_ctx->pb, output.c_str(), AVIO_FLAG_WRITE)) < 0)
+        return ret;
+    return avformat_write_header(out_ctx, NULL);
+}
+
+void ClipTranscoder::decode_stage() {
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    bool draining = false, video_done = false, audio_done = audio_index < 0;
+    int ret = 0;
+
+    if (!packet || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (options.start_us > 0 &&
+        (ret = av_seek_frame(in_ctx, video_index,
+                             av_rescale_q(origin_us + options.start_us, AV_TIME_BASE_Q,
+                                          in_ctx->streams[video_index]->time_base),
+                             AVSEEK_FLAG_BACKWARD)) < 0)
+        goto end;
+
+    while (!stopping && !(video_done && audio_done)) {
+        if (!draining) {
+            ret = av_read_frame(in_ctx, packet);
+            if (ret == AVERROR_EOF) {
+                draining = true;
+                audio_done = true;
+                avcodec_send_packet(dec_ctx, NULL);
+            } else if (ret < 0) {
+                goto end;
+            } else if (packet->stream_index == audio_index && !audio_done) {
+                int64_t pts_us = to_us((packet->pts != AV_NOPTS_VALUE)? packet->pts:packet->dts, audio_index);
+                if (pts_us >= options.end_us) {
+                    audio_done = true;
+                } else if (pts_us >= options.start_us) {
+                    AVPacket *copy = av_packet_clone(packet);
+                    if (!copy || !decoded.Push(Item{ NULL, copy })) {
+                        av_packet_free(&copy);
+                        av_packet_unref(packet);
+                        goto end;
+                    }
+                }
+                av_packet_unref(packet);
+                continue;
+            } else {
+                if (packet->stream_index == video_index && !video_done)
+                    avcodec_send_packet(dec_ctx, packet);
+                av_packet_unref(packet);
+            }
+        }
+
+        while ((ret = avcodec_receive_frame(dec_ctx, frame)) >= 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            int64_t pts_us = (pts != AV_NOPTS_VALUE)? to_us(pts, video_index):options.start_us;
+            if (pts_us >= options.end_us) {
+                video_done = true;
+                av_frame_unref(frame);
+                break;
+            }
+            if (pts_us < options.start_us) {
+                av_frame_unref(frame);
+                continue;
+            }
+            /* microseconds into the clip from here on */
+            frame->pts = pts_us - options.start_us;
+            AVFrame *item = av_frame_alloc();
+            if (!item) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            av_frame_move_ref(item, frame);
+            if (!decoded.Push(Item{ item, NULL })) {
+                av_frame_free(&item);
+                goto end;
+            }
+        }
+        if (ret == AVERROR_EOF)
+            video_done = true;
+    }
+    ret = 0;
+
+end:
+    if (ret < 0 && ret != AVERROR_EOF)
+        stage_error = ret;
+    decoded.Push(Item{ NULL, NULL });
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+}
+
+void ClipTranscoder::scale_stage() {
+    FrameConverter converter;
+    bool initialized = false;
+    Item item;
+    while (decoded.Pop(&item)) {
+        if (item.frame) {
+            AVFrame *out = av_frame_alloc();
+            int ret = out? 0:AVERROR(ENOMEM);
+            /* the first frame tells the real input format */
+            if (ret >= 0 && !initialized) {
+                ret = converter.Init(item.frame->width, item.frame->height, AVPixelFormat(item.frame->format),
+                                     AV_TIME_BASE_Q, item.frame->sample_aspect_ratio,
+                                     enc_ctx->width, enc_ctx->height, enc_ctx->pix_fmt);
+                initialized = ret >= 0;
+            }
+            if (ret >= 0)
+                ret = converter.Convert(item.frame, out);
+            av_frame_free(&item.frame);
+            if (ret < 0) {
+                av_frame_free(&out);
+                stage_error = ret;
+                break;
+            }
+            item.frame = out;
+        }
+        bool end = !item.frame && !item.packet;
+        if (!scaled.Push(item)) {
+            dispose(item);
+            return;
+        }
+        if (end)
+            return;
+    }
+    scaled.Push(Item{ NULL, NULL });
+}
+
+int ClipTranscoder::write_packets(int64_t *frames) {
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+        return AVERROR(ENOMEM);
+    int ret;
+    while ((ret = avcodec_receive_packet(enc_ctx, packet)) >= 0) {
+        av_packet_rescale_ts(packet, enc_ctx->time_base, video_out->time_base);
+        packet->stream_index = video_out->index;
+        (*frames)++;
+        if ((ret = av_interleaved_write_frame(out_ctx, packet)) < 0)
+            break;
+    }
+    av_packet_free(&packet);
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)? 0:ret;
+}
+
+int ClipTranscoder::Run(const std::atomic<bool> &cancelled, const ProgressCallback &progress,
+                        TranscodeResult *result) {
+    int64_t started = av_gettime_relative();
+    std::thread decoder, scaler;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int64_t span_us;
+    int last_percent = -1;
+    bool header_written = false;
+    Item item;
+    int ret;
+
+    /* cancelled as it started: nothing is opened, nothing left behind */
+    if (cancelled)
+        return AVERROR_EXIT;
+    if ((ret = open_input()) < 0 || (ret = open_output(result)) < 0)
+        goto end;
+    header_written = true;
+    span_us = (in_ctx->duration > 0)? std::min(options.end_us, in_ctx->duration):options.end_us;
+    span_us = std::max<int64_t>(span_us - options.start_us, 1);
+
+    decoder = std::thread(&ClipTranscoder::decode_stage, this);
+    scaler = std::thread(&ClipTranscoder::scale_stage, this);
+    while (scaled.Pop(&item)) {
+        if (cancelled) {
+            dispose(item);
+            ret = AVERROR_EXIT;
+            goto end;
+        }
+        if (!item.frame && !item.packet)
+            break;
+        if (item.packet) {
+            AVStream *in = in_ctx->streams[audio_index];
+            int64_t shift = av_rescale_q(origin_us + options.start_us, AV_TIME_BASE_Q, in->time_base);
+            if (item.packet->pts != AV_NOPTS_VALUE)
+                item.packet->pts -= shift;
+            if (item.packet->dts != AV_NOPTS_VALUE)
+                item.packet->dts -= shift;
+            av_packet_rescale_ts(item.packet, in->time_base, audio_out->time_base);
+            item.packet->stream_index = audio_out->index;
+            item.packet->pos = -1;
+            ret = av_interleaved_write_frame(out_ctx, item.packet);
+            dispose(item);
+            if (ret < 0)
+                goto end;
+            continue;
+        }
+
+        int64_t pts_us = item.frame->pts;
+        item.frame->pts = av_rescale_q(pts_us, AV_TIME_BASE_Q, enc_ctx->time_base);
+        /* variable rate sources can round two frames onto one tick */
+        if (last_pts != AV_NOPTS_VALUE && item.frame->pts <= last_pts)
+            item.frame->pts = last_pts + 1;
+        last_pts = item.frame->pts;
+        item.frame->pict_type = AV_PICTURE_TYPE_NONE;
+        ret = avcodec_send_frame(enc_ctx, item.frame);
+        dispose(item);
+        if (ret < 0 || (ret = write_packets(&result->frames)) < 0)
+            goto end;
+
+        int percent = std::min<int64_t>(pts_us * 100 / span_us, 100);
+        if (percent > last_percent && progress) {
+            last_percent = percent;
+            progress(percent / 100.0);
+        }
+    }
+    if ((ret = stage_error) < 0)
+        goto end;
+    if ((ret = avcodec_send_frame(enc_ctx, NULL)) < 0 || (ret = write_packets(&result->frames)) < 0)
+        goto end;
+    ret = av_write_trailer(out_ctx);
+    header_written = false;
+    if (ret >= 0 && progress)
+        progress(1.0);
+
+end:
+    /* wake and drain both stages */
+    stopping = true;
+    decoded.Close();
+    scaled.Close();
+    if (decoder.joinable())
+        decoder.join();
+    if (scaler.joinable())
+        scaler.join();
+    decoded.Clear(dispose);
+    scaled.Clear(dispose);
+    if (header_written)
+        av_write_trailer(out_ctx);
+    result->elapsed_us = av_gettime_relative() - started;
+    if (ret < 0) {
+        if (ret != AVERROR_EXIT)
+            av_log(NULL, AV_LOG_ERROR, "Cannot transcode %s to %s\n", input.c_str(), output.c_str());
+        if (out_ctx) {
+            if (!(out_ctx->oformat->flags & AVFMT_NOFILE))
+                avio_closep(&out_ctx->pb);
+            unlink(output.c_str());
+        }
+    }
+    return ret < 0? ret:0;
+}
+
+#endif
@@ -4,26 +4,227 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswresample/swresample.h>
 }
 
+#include "audio_mixer.cc"
+#include "audio_stream.cc"
+#include "bounded_queue.cc"
+#include "frame_cache.cc"
+#include "frame_stamp.cc"
+#include "frame_tap.cc"
+#include "gop_cache.cc"
+#include "hdr_converter.cc"
+#include "image_sequence.cc"
+#include "memory_governor.cc"
+#include "scrub_proxy.cc"
+#include "shm_frame_ring.cc"
+
 #undef av_err2str
 #define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
 
 void NullFunc() {};
 
-class FFMPEGManager
+// Per-player settings supplied through the `create` call.
+struct FFMPEGOptions
+{
+    // Output size of the converted frames.
+    int width = 1280;
+    int height = 720;
+
+    // Demux the whole stream but only feed keyframes to the decoder. Meant for
+    // grids of muted preview tiles, which are presented at keyframe cadence.
+    bool keyframe_only = false;
+
+    // Depth of the queues between the demux, decode and convert stages.
+    int packet_queue_size = 64;
+    int frame_queue_size = 4;
+
+    // Decode the best audio stream, if there is one, and follow its clock.
+    // Keyframe-only previews never do.
+    bool audio = true;
+    int audio_queue_size = 256;
+
+    // A local capture pipe or socket rather than a file: open without
+    // probing, never buffer, and present every frame as soon as it is
+    // decoded. Live sources cannot seek or loop, and carry no audio.
+    bool live = false;
+
+    // Frames per second of an image sequence, which has no timing of its
+    // own.
+    double frame_rate = 30.0;
+
+    // Players with a lower priority are asked to give memory back first
+    // when the plugin-wide budget is exceeded.
+    int priority = 0;
+
+    // Where the frame shown before playback starts is taken from, for
+    // Preroll; negative, the default, shows nothing until then. A poster
+    // costs a preroll on the thread that initializes the player.
+    int64_t poster_us = -1;
+
+    // How 10-bit sources, HDR ones above all, are brought down to the
+    // output's 8 bits. kOff leaves them to the scale filter.
+    ToneMapOptions tone_map;
+
+    // Threads the filter graph may spread the filters that support it
+    // over, deinterlacers among them; 0 takes one per core. Keyframe-only
+    // previews always use one.
+    int filter_threads = 0;
+
+    bool operator==(const FFMPEGOptions &other) const {
+        return width == other.width && height == other.height && keyframe_only == other.keyframe_only &&
+            packet_queue_size == other.packet_queue_size && frame_queue_size == other.frame_queue_size &&
+            audio == other.audio && audio_queue_size == other.audio_queue_size && live == other.live &&
+            frame_rate == other.frame_rate && priority == other.priority && poster_us == other.poster_us &&
+            tone_map == other.tone_map && filter_threads == other.filter_threads;
+    }
+    bool operator!=(const FFMPEGOptions &other) const { return !(*this == other); }
+};
+
+// Work done by one pipeline stage, excluding time spent blocked on the
+// neighbouring queues.
+struct StageStats
+{
+    uint64_t items = 0;
+    int64_t busy_us = 0;
+};
+
+// Capture-to-present delay of live frames carrying a frame stamp.
+struct LatencyStats
+{
+    uint64_t samples = 0;
+    int64_t last_us = 0;
+    int64_t min_us = 0;
+    int64_t max_us = 0;
+    int64_t mean_us = 0;
+};
+
+struct PipelineStats
+{
+    StageStats demux;
+    StageStats decode;
+    StageStats convert;
+    StageStats audio;
+    QueueStats packets;
+    QueueStats frames;
+    QueueStats audio_packets;
+    LatencyStats latency;
+    // From the start of Init to the first frame on screen; 0 until then.
+    int64_t first_frame_us = 0;
+    // The playback rate asked for, negative in reverse, and the frames per
+    // second actually shown over the last second.
+    double speed = 1.0;
+    double output_fps = 0.0;
+};
+
+class StageMeter
+{
+private:
+    std::atomic<uint64_t> items{0};
+    std::atomic<int64_t> busy_us{0};
+public:
+    void Add(int64_t start_us) {
+        items++;
+        busy_us += av_gettime_relative() - start_us;
+    }
+    StageStats Stats() const { return StageStats{items.load(), busy_us.load()}; }
+};
+
+class LatencyMeter
 {
 private:
+    mutable std::mutex mutex;
+    LatencyStats stats;
+    int64_t total_us = 0;
+public:
+    void Add(int64_t latency_us) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.last_us = latency_us;
+        stats.min_us = stats.samples? std::min(stats.min_us, latency_us):latency_us;
+        stats.max_us = std::max(stats.max_us, latency_us);
+        total_us += latency_us;
+        stats.samples++;
+        stats.mean_us = total_us / int64_t(stats.samples);
+    }
+    LatencyStats Stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+};
+
+class RateMeter
+{
+private:
+    mutable std::mutex mutex;
+    std::deque<int64_t> times;
+public:
+    static constexpr int64_t kWindow = AV_TIME_BASE;
+
+    void Add() {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = av_gettime_relative();
+        times.push_back(now);
+        while (times.front() < now - kWindow)
+            times.pop_front();
+    }
+    // Events per second over the last kWindow.
+    double Rate() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t since = av_gettime_relative() - kWindow;
+        size_t count = times.end() - std::lower_bound(times.begin(), times.end(), since);
+        return count * double(AV_TIME_BASE) / kWindow;
+    }
+};
+
+// Items handed between the pipeline stages. The serial is the seek request
+// they were produced for; stages drop anything a newer seek has superseded.
+struct QueuedPacket
+{
+    AVPacket *packet;
+    uint32_t serial;
+};
+
+struct QueuedFrame
+{
+    AVFrame *frame;
+    uint32_t serial;
+    // Shown at once rather than paced, as the answer to a seek.
+    bool seek_result;
+};
+
+class FFMPEGManager : public MemoryClient
+{
+private:
+    FFMPEGOptions options;
+
     AVFormatContext *fmt_ctx;
     AVCodecContext *dec_ctx;
     AVFilterContext *buffersink_ctx;
@@ -33,48 +234,284 @@ private:
     AVFrame *frame;
     AVFrame *filt_frame;
 
+    /* what the filter graph is fed, from the decoder or a shm_ring */
+    int input_width, input_height;
+    AVPixelFormat input_format, output_format;
+    AVRational input_time_base, input_aspect;
+    /* raw frames from another process, in place of demuxing and decoding */
+    std::unique_ptr<ShmFrameRing> shm_ring;
+    /* a directory of images, decoded ahead in parallel */
+    std::unique_ptr<ImageSequence> sequence;
+
     int video_stream_index;
     int64_t last_pts;
+    /* when the frame at last_pts was due on screen */
+    int64_t last_pts_at;
+    AVRational output_time_base;
+    /* stream start, and how far off a cached frame may answer a seek */
+    int64_t start_time;
+    int64_t seek_tolerance;
 
     mutable std::shared_mutex buffer_mutex;
-    uint8_t *buffer;
+    VideoFramePtr buffer;
     double current_time;
-    int width, height;
-
-    bool running;  
-
+    std::atomic<int> width, height;
+    /* set by the memory governor, applied by the present stage */
+    std::atomic<bool> downshift_pending;
+    /* what SetFilter and SetRegion asked for, and what the graph runs;
+     * the present stage swaps the one for the other between frames */
+    mutable std::mutex filter_mutex;
+    std::string filters, pending_filters;
+    FrameRegion region, pending_region;
+    std::atomic<bool> filter_pending;
+    /* decoded frames cut down to the region, without a copy */
+    AVFrame *crop_frame;
+    /* the next frame is shown even while paused */
+    std::atomic<bool> poster_pending;
+    /* when Init started, and how long until the first frame was shown */
+    int64_t opened_at;
+    std::atomic<int64_t> first_frame_us;
+    /* native consumers of the published frames */
+    FrameTapSet taps;
+
+    std::atomic<bool> running, looping, paused, closing;
+    std::function<void()> frame_callback;
+    bool loop_active;
+    /* the last pass ran from the start to the end without a seek */
+    bool pass_complete;
+
+    /* identifies this source's frames in the shared FrameCache */
+    std::string source;
+    /* the file fmt_ctx was opened from, empty for other sources; steps and
+     * scrub proxies open it again on threads that fmt_ctx may not outlive */
+    std::string input_path;
+    /* pts of every frame presented during the last decoded pass */
+    std::vector<int64_t> pass_pts;
+
+    /* demux -> packet_queue -> decode -> frame_queue -> convert/present */
+    BoundedQueue<QueuedPacket> packet_queue;
+    BoundedQueue<QueuedFrame> frame_queue;
+    std::atomic<bool> stopping;
+    StageMeter demux_meter, decode_meter, convert_meter;
+    LatencyMeter latency_meter;
+    RateMeter output_meter;
+    /* the playback rate; negative plays the GOPs backwards from gop_cache */
+    std::atomic<double> speed;
+
+    /* demux -> audio_packet_queue -> decode/resample -> audio_stream, which
+     * audio_mixer mixes with every other player into one sink */
+    int audio_stream_index;
+    AVCodecContext *audio_dec_ctx;
+    SwrContext *swr_ctx;
+    AVFrame *audio_frame;
+    BoundedQueue<QueuedPacket> audio_packet_queue;
+    std::unique_ptr<AudioSink> audio_sink;
+    std::unique_ptr<AudioStream> audio_stream;
+    /* set while playing; owned_mixer is only used with a sink of our own */
+    AudioMixer *audio_mixer;
+    std::unique_ptr<AudioMixer> owned_mixer;
+    float volume;
+    uint32_t audio_serial;
+    StageMeter audio_meter;
+    /* holding the last frame at the end of the stream */
+    std::atomic<bool> at_end;
+
+    /* Only the latest seek request is ever served. Each request bumps
+     * seek_serial; the demuxer seeks when its serial falls behind, and
+     * the decoder flushes when the packets' serial changes. */
+    std::mutex seek_mutex;
+    std::condition_variable seek_cv;
+    std::atomic<uint32_t> seek_serial, demux_serial;
+    uint32_t decode_serial;
+    int64_t seek_target;
+    int64_t seek_requested_at;
+    /* set for seeks that only move the pipeline under a frame already
+     * shown, which must not be covered by the nearest keyframe */
+    bool seek_quiet;
+
+    /* a cheap, all-intra copy of the file that answers seeks while they
+     * are still being dragged around */
+    std::mutex scrub_mutex;
+    std::shared_ptr<ScrubProxyJob> scrub_job;
+    FrameConverter scrub_converter;
+    int scrub_width, scrub_height;
+
+    /* the GOPs around the last frame stepped to, converted for display */
+    std::mutex step_mutex;
+    std::shared_ptr<GopCache> gop_cache;
+    size_t gop_bytes();
+
+    /* 10-bit frames converted ahead of the filter graph, which then only
+     * scales them */
+    std::unique_ptr<HdrConverter> hdr_converter;
+    AVFrame *hdr_frame;
+
+    static int interrupt_callback(void *opaque);
     int init_fmt_context(const char *filename);
     int init_dec_context(AVPixelFormat pix_fmt);
     int open_input_file(const char *filename, AVPixelFormat pix_fmt);
+    int open_shm_ring(const char *name, AVPixelFormat pix_fmt);
+    int open_image_sequence(const char *directory, AVPixelFormat pix_fmt);
+    int init_audio_context();
+    void free_audio_context();
     int init_filters(const char *filters_descr);
+    int configure_filters();
+    int apply_filters();
+    std::string step_filters() const;
+    void account_memory();
 
-    int read_frame_to_packet(AVPacket* packet);
     int receive_frame();
     int get_filter_frame();
+    int demux_loop();
+    int decode_loop();
+    void audio_loop();
+    bool write_audio(const float *samples, int frames, int64_t time, uint32_t serial);
+    bool wait_for_settle(uint32_t serial);
+    bool wait_while_paused(uint32_t serial);
+    int present_frame(AVFrame *decoded, const std::function<void()> &callback);
+    int step_frame(int direction, VideoFramePtr *out);
+    int reverse_pass(uint32_t serial, const std::function<void()> &callback);
+    void measure_latency(const AVFrame *decoded);
+    int decode_pass(const std::function<void()> &callback, bool from_start);
+    bool replay_from_cache(const std::function<void()> &callback);
+    int rewind();
+    int shm_loop(const std::function<void()> &callback);
+    int sequence_pass(const std::function<void()> &callback, int first);
+    int sequence_loop(const std::function<void()> &callback);
     int loop_internal(std::function<void()> callback);
 
-    void frame_sleep(const AVFrame *frame, AVRational time_base);
+    std::shared_ptr<const ScrubProxy> scrub_proxy();
+    bool publish_scrub_frame(int64_t position_us);
+    void request_seek(int64_t position_us, bool quiet);
+    int64_t stream_time(int64_t pts, AVRational time_base) const;
+    void frame_sleep(int64_t pts, AVRational time_base);
     void save_frame(const AVFrame *frame, AVRational time_base);
+    void publish_frame(VideoFramePtr converted, bool paced = true);
 
     // For testing purposes
     void write_frame_to_file(const AVFrame *frame, AVRational time_base);
 
 public:
-    FFMPEGManager();
-    ~FFMPEGManager();
+    // Prefix of a filename naming a ShmFrameRing rather than a media file.
+    static constexpr const char *kShmScheme = "shm://";
+
+    // A seek is refined to the exact frame once no newer request has
+    // arrived for this long; until then the nearest keyframe is shown.
+    static constexpr int64_t kSeekSettleTime = 150000;
+    // Playback rates are clamped to this far either side of 1, either way.
+    static constexpr double kMinSpeed = 1.0 / 16;
+    static constexpr double kMaxSpeed = 16.0;
+    // From this fast, the decoder drops the frames no other frame refers
+    // to; from the second, everything but keyframes.
+    static constexpr double kSkipNonRefSpeed = 2.0;
+    static constexpr double kSkipNonKeySpeed = 8.0;
+
+    FFMPEGManager(const FFMPEGOptions &options = FFMPEGOptions());
+    virtual ~FFMPEGManager();
 
     int Init(const char* filename, AVPixelFormat pix_fmt, int mwidth, int mheight);
     void Free();
     int Close(int ret);
     int Loop(std::function<void()> callback);
+    // Ends a running Loop and waits for it to return.
+    void Stop();
+    bool IsRunning() const { return running; }
+    // True from a successful Init until Free.
+    bool IsOpen() const { return fmt_ctx || shm_ring || sequence; }
+    void SetLooping(bool loop);
+    void SetPaused(bool pause);
+    // Pauses, then has Loop show the frame at |position_us| and fill the
+    // pipeline behind it, so that unpausing presents without delay. Call
+    // before Loop.
+    void Preroll(int64_t position_us);
+    // Plays audio into |sink| alone rather than the shared mixer. Must be
+    // called before Loop.
+    void SetAudioSink(std::unique_ptr<AudioSink> sink) { audio_sink = std::move(sink); }
+    bool HasAudio() const { return audio_stream_index >= 0; }
+    void SetVolume(float value);
+    // Plays at |value| times the normal rate, backwards if negative. Audio
+    // is only heard at 1. Reverse is for files alone; AVERROR(ENOSYS)
+    // otherwise.
+    int SetSpeed(double value);
+    double Speed() const { return speed; }
+    // True while holding the last frame once the stream has ended.
+    bool AtEnd() const { return at_end; }
+    // Moves playback to |position_us| from the start of the stream. Cheap to
+    // call for every step of a drag: superseded requests are abandoned.
+    void Seek(int64_t position_us);
+    // Pauses and shows the frame just after (|direction| > 0) or just
+    // before the one on screen. Stepping back decodes the GOP around it
+    // once; further steps through it are served from memory. AVERROR_EOF
+    // past either end, AVERROR(ENOSYS) for sources other than files.
+    // Stepped frames are filtered one at a time, so filters that hold
+    // frames back, the deinterlacers among them, cannot be stepped through.
+    // Blocks while a GOP is decoded, so the plugin steps on PlayerPool.
+    int Step(int direction);
+    int64_t Position() const;
+    // Runs |description|, a filter graph description such as "yadif" or
+    // "crop=iw/2:ih/2,hflip", ahead of the scaling to the output size, or
+    // nothing if it is empty. The description is checked at once; the
+    // graph is rebuilt between two frames, without reopening the source.
+    int SetFilter(const std::string &description);
+    std::string Filter() const;
+    // Shows |region| of the picture alone, scaled to the output size.
+    // Decoded frames are cropped before they are converted, so the work
+    // done per frame follows the size of the region. Applied like a
+    // filter, between two frames.
+    int SetRegion(const FrameRegion &region);
+    FrameRegion Region() const;
+    // Starts building the scrub proxy on |queue|, or finds it in the cache;
+    // from then on seeks are shown from the proxy until they settle. Null
+    // for sources other than files.
+    std::shared_ptr<ScrubProxyJob> BuildScrubProxy(JobQueue &queue, int priority);
 
     int Data(uint8_t *out) const;
+    VideoFramePtr Frame() const;
+    // Lends every frame published from now on to |callback|, on a thread
+    // of the tap's own. Returns an id for RemoveFrameTap.
+    int64_t AddFrameTap(FrameTapCallback callback) { return taps.Add(std::move(callback)); }
+    bool RemoveFrameTap(int64_t id) { return taps.Remove(id); }
+    bool TapStats(int64_t id, FrameTapStats *stats) const { return taps.Stats(id, stats); }
     int Width() const { return width; }
     int Height() const { return height; }
+    const FFMPEGOptions &Options() const { return options; }
+    PipelineStats Stats() const;
+
+    virtual bool Relieve(MemoryRelief relief);
 };
 
-FFMPEGManager::FFMPEGManager()
+FFMPEGManager::FFMPEGManager(const FFMPEGOptions &options)
+    : options(options),
+      running(false),
+      looping(false),
+      paused(false),
+      closing(false),
+      frame_callback(NullFunc),
+      loop_active(false),
+      pass_complete(false),
+      packet_queue(options.live? 1:options.packet_queue_size),
+      frame_queue(options.live? 1:options.frame_queue_size),
+      stopping(false),
+      audio_packet_queue(options.audio_queue_size),
+      at_end(false),
+      seek_serial(0),
+      demux_serial(0),
+      decode_serial(0),
+      seek_target(0),
+      seek_requested_at(0),
+      seek_quiet(false),
+      scrub_width(0),
+      scrub_height(0)
 {
+    width = options.width;
+    height = options.height;
+    downshift_pending = false;
+    filter_pending = false;
+    poster_pending = false;
+    speed = 1.0;
+    opened_at = 0;
+    first_frame_us = 0;
+
     fmt_ctx = NULL;
     dec_ctx = NULL;
     buffersink_ctx = NULL;
@@ -83,21 +520,67 @@ FFMPEGManager::FFMPEGManager()
 
     frame = NULL;
     filt_frame = NULL;
+    hdr_frame = NULL;
+    crop_frame = NULL;
+
+    input_width = input_height = 0;
+    input_format = output_format = AV_PIX_FMT_NONE;
+    input_time_base = AVRational{1, AV_TIME_BASE};
+    input_aspect = AVRational{0, 1};
+
+    audio_stream_index = -1;
+    audio_dec_ctx = NULL;
+    swr_ctx = NULL;
+    audio_frame = NULL;
+    audio_serial = 0;
+    audio_mixer = NULL;
+    volume = 1.0f;
 
     video_stream_index = -1;
     last_pts = AV_NOPTS_VALUE;
+    last_pts_at = 0;
+    output_time_base = AVRational{1, AV_TIME_BASE};
+    start_time = 0;
+    seek_tolerance = 0;
 
-    running = false;
     current_time = 0.0;
 }
 
 FFMPEGManager::~FFMPEGManager()
 {
+    Stop();
+    {
+        std::lock_guard<std::mutex> lock(scrub_mutex);
+        if (scrub_job)
+            scrub_job->Cancel();
+    }
     Free();
 }
 
+int FFMPEGManager::interrupt_callback(void *opaque) {
+    FFMPEGManager *manager = (FFMPEGManager*)opaque;
+    /* a pipe or socket can block reads indefinitely */
+    return manager->closing;
+}
+
 int FFMPEGManager::init_fmt_context(const char *filename) {
-    int ret = avformat_open_input(&fmt_ctx, filename, NULL, NULL);
+    fmt_ctx = avformat_alloc_context();
+    if (!fmt_ctx)
+        return AVERROR(ENOMEM);
+    fmt_ctx->interrupt_callback.callback = interrupt_callback;
+    fmt_ctx->interrupt_callback.opaque = this;
+
+    AVDictionary *format_opts = NULL;
+    if (options.live) {
+        /* start on the first packets rather than seconds of probing, and
+         * hand every packet on as soon as it is read */
+        fmt_ctx->flags |= AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_FLUSH_PACKETS;
+        av_dict_set(&format_opts, "probesize", "32", 0);
+        av_dict_set(&format_opts, "analyzeduration", "0", 0);
+        av_dict_set(&format_opts, "fpsprobesize", "0", 0);
+    }
+    int ret = avformat_open_input(&fmt_ctx, filename, NULL, &format_opts);
+    av_dict_free(&format_opts);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot open input file\n");
         return ret;
@@ -127,6 +610,20 @@ int FFMPEGManager::init_dec_context(AVPixelFormat pix_fmt) {
         return AVERROR(ENOMEM);
     avcodec_parameters_to_context(dec_ctx, fmt_ctx->streams[video_stream_index]->codecpar);
 
+    if (options.keyframe_only) {
+        /* previews are decoded many at a time, so keep each one cheap and
+         * single-threaded rather than letting every tile spawn a pool */
+        dec_ctx->skip_frame = AVDISCARD_NONKEY;
+        dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+        dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+        dec_ctx->thread_count = 1;
+    }
+    if (options.live) {
+        /* frame threading holds back one frame per thread; slices do not */
+        dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        dec_ctx->thread_type = FF_THREAD_SLICE;
+    }
+
     /* init the video decoder */
     if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot open video decoder\n");
@@ -134,6 +631,11 @@ int FFMPEGManager::init_dec_context(AVPixelFormat pix_fmt) {
     }
 
     dec_ctx->pix_fmt = pix_fmt;
+    input_width = dec_ctx->width;
+    input_height = dec_ctx->height;
+    input_format = output_format = pix_fmt;
+    input_time_base = fmt_ctx->streams[video_stream_index]->time_base;
+    input_aspect = dec_ctx->sample_aspect_ratio;
     return 0;
 }
 
@@ -142,29 +644,139 @@ int FFMPEGManager::open_input_file(const char *filename, AVPixelFormat pix_fmt)
     return (ret < 0)? ret:init_dec_context(pix_fmt);
 }
 
+int FFMPEGManager::open_shm_ring(const char *name, AVPixelFormat pix_fmt) {
+    shm_ring.reset(new ShmFrameRing());
+    int ret = shm_ring->Open(name);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open shared memory ring %s\n", name);
+        shm_ring.reset();
+        return ret;
+    }
+
+    /* the producer sets the pace; there is nothing to buffer or cache */
+    options.live = true;
+    const ShmFrameRingHeader *header = shm_ring->Header();
+    input_width = header->width;
+    input_height = header->height;
+    input_format = (header->format == uint32_t(ShmPixelFormat::kNV12))?
+        AV_PIX_FMT_NV12:AV_PIX_FMT_RGBA;
+    output_format = pix_fmt;
+    input_time_base = AV_TIME_BASE_Q;
+    input_aspect = AVRational{1, 1};
+    return 0;
+}
+
+int FFMPEGManager::open_image_sequence(const char *directory, AVPixelFormat pix_fmt) {
+    sequence.reset(new ImageSequence());
+    int ret = sequence->Open(directory);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot list images in %s\n", directory);
+        return ret;
+    }
+
+    /* the first frame describes the rest; a change is handled when seen */
+    AVFrame *first = av_frame_alloc();
+    if (!first)
+        return AVERROR(ENOMEM);
+    if ((ret = sequence->Get(0, false, first)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot decode %s\n", sequence->File(0).c_str());
+        av_frame_free(&first);
+        return ret;
+    }
+    input_width = first->width;
+    input_height = first->height;
+    input_format = (AVPixelFormat)first->format;
+    output_format = pix_fmt;
+    input_time_base = av_inv_q(av_d2q(options.frame_rate > 0? options.frame_rate:30.0, 1001000));
+    input_aspect = first->sample_aspect_ratio.num? first->sample_aspect_ratio:AVRational{1, 1};
+    av_frame_free(&first);
+    return 0;
+}
+
+int FFMPEGManager::init_audio_context() {
+    AVCodec *dec;
+    /* the audio that belongs with the chosen video stream */
+    int ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, video_stream_index, &dec, 0);
+    if (ret < 0)
+        return ret;
+    audio_stream_index = ret;
+
+    audio_dec_ctx = avcodec_alloc_context3(dec);
+    if (!audio_dec_ctx)
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(audio_dec_ctx, fmt_ctx->streams[audio_stream_index]->codecpar);
+    if ((ret = avcodec_open2(audio_dec_ctx, dec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open audio decoder\n");
+        return ret;
+    }
+
+    /* resample whatever the stream has to the one format sinks take */
+    AudioFormat format;
+    int64_t layout = audio_dec_ctx->channel_layout?
+        audio_dec_ctx->channel_layout:av_get_default_channel_layout(audio_dec_ctx->channels);
+    swr_ctx = swr_alloc_set_opts(NULL, av_get_default_channel_layout(format.channels),
+                                 AV_SAMPLE_FMT_FLT, format.sample_rate,
+                                 layout, audio_dec_ctx->sample_fmt, audio_dec_ctx->sample_rate,
+                                 0, NULL);
+    if (!swr_ctx)
+        return AVERROR(ENOMEM);
+    if ((ret = swr_init(swr_ctx)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot initialize the audio resampler\n");
+        return ret;
+    }
+
+    audio_frame = av_frame_alloc();
+    if (!audio_frame)
+        return AVERROR(ENOMEM);
+    audio_stream.reset(new AudioStream(format));
+    audio_stream->SetGain(volume);
+    return 0;
+}
+
+void FFMPEGManager::free_audio_context() {
+    audio_stream_index = -1;
+    audio_stream.reset();
+    swr_free(&swr_ctx);
+    if (audio_dec_ctx) {
+        avcodec_free_context(&audio_dec_ctx);
+    }
+    if (audio_frame) {
+        av_frame_free(&audio_frame);
+    }
+}
+
 int FFMPEGManager::init_filters(const char *filters_descr)
 {
     char args[512];
     int ret = 0;
+    int crop_left, crop_top, crop_width, crop_height;
     const AVFilter *buffersrc  = avfilter_get_by_name("buffer");
     const AVFilter *buffersink = avfilter_get_by_name("buffersink");
     AVFilterInOut *outputs = avfilter_inout_alloc();
     AVFilterInOut *inputs  = avfilter_inout_alloc();
-    AVRational time_base = fmt_ctx->streams[video_stream_index]->time_base;
-    enum AVPixelFormat pix_fmts[] = { dec_ctx->pix_fmt, AV_PIX_FMT_NONE };
+    enum AVPixelFormat pix_fmts[] = { output_format, AV_PIX_FMT_NONE };
 
     filter_graph = avfilter_graph_alloc();
     if (!outputs || !inputs || !filter_graph) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
+    /* previews are many at a time, like their decoders */
+    filter_graph->nb_threads = options.keyframe_only? 1:options.filter_threads;
+
+    /* what is left of them once cropped to the region */
+    region.ToPixels(input_width, input_height, &crop_left, &crop_top, &crop_width, &crop_height);
+    if (region.IsFull()) {
+        crop_width = input_width;
+        crop_height = input_height;
+    }
 
     /* buffer video source: the decoded frames from the decoder will be inserted here. */
     snprintf(args, sizeof(args),
             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-            dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-            time_base.num, time_base.den,
-            dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den);
+            crop_width, crop_height, input_format,
+            input_time_base.num, input_time_base.den,
+            input_aspect.num, input_aspect.den);
 
     ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
                                        args, NULL, filter_graph);
@@ -231,37 +843,225 @@ end:
 
 int FFMPEGManager::Init(const char* filename, AVPixelFormat pix_fmt, int mwidth, int mheight) {
     int ret;
-
-    if ((ret = open_input_file(filename, pix_fmt)) >= 0) {
+    opened_at = av_gettime_relative();
+    first_frame_us = 0;
+
+    size_t scheme = strlen(kShmScheme);
+    struct stat st;
+    if (strncmp(filename, kShmScheme, scheme) == 0)
+        ret = open_shm_ring(filename + scheme, pix_fmt);
+    else if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode))
+        ret = open_image_sequence(filename, pix_fmt);
+    else
+        ret = open_input_file(filename, pix_fmt);
+    input_path = (ret >= 0 && fmt_ctx)? filename:"";
+    if (ret >= 0) {
         width = mwidth;
         height = mheight;
-        char filter_descr[16];
-        sprintf(filter_descr, "scale=%d:%d", mwidth, mheight);
-        ret = init_filters(filter_descr);
+        ret = configure_filters();
+        source = filename;
+        if (options.keyframe_only)
+            source += "#keyframes";
+
+        if (fmt_ctx) {
+            AVStream *stream = fmt_ctx->streams[video_stream_index];
+            start_time = (stream->start_time != AV_NOPTS_VALUE)?
+                av_rescale_q(stream->start_time, stream->time_base, AV_TIME_BASE_Q):0;
+            /* a frame and a half, so a seek between two frames finds the earlier */
+            double fps = av_q2d(stream->avg_frame_rate);
+            int64_t tolerance = (fps > 0)? int64_t(AV_TIME_BASE * 1.5 / fps):AV_TIME_BASE / 20;
+            seek_tolerance = av_rescale_q(tolerance, AV_TIME_BASE_Q, output_time_base);
+        } else if (sequence) {
+            /* pts count frames, so a frame and a half is simply that */
+            seek_tolerance = av_rescale_q(3, input_time_base, output_time_base) / 2;
+        }
         frame = av_frame_alloc();
         filt_frame = av_frame_alloc();
+
+        /* a video without playable audio still plays, on its own clock */
+        if (ret >= 0 && fmt_ctx && options.audio && !options.keyframe_only && !options.live &&
+            init_audio_context() < 0)
+            free_audio_context();
     }
     if (ret < 0)
         return Close(ret);
 
+    MemoryGovernor::Shared().Register(this, source, options.priority);
+    account_memory();
     return 0;
 }
 
+int FFMPEGManager::configure_filters() {
+    char scale[64];
+    snprintf(scale, sizeof(scale), "scale=%d:%d%s", width.load(), height.load(),
+             options.keyframe_only ? ":flags=fast_bilinear" : "");
+    std::string filter_descr = scale;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        if (!filters.empty())
+            filter_descr = filters + "," + scale;
+    }
+
+    /* the graph in use stays until its replacement is complete */
+    AVFilterGraph *previous_graph = filter_graph;
+    AVFilterContext *previous_src = buffersrc_ctx, *previous_sink = buffersink_ctx;
+    filter_graph = NULL;
+    int ret = init_filters(filter_descr.c_str());
+    if (ret < 0) {
+        avfilter_graph_free(&filter_graph);
+        filter_graph = previous_graph;
+        buffersrc_ctx = previous_src;
+        buffersink_ctx = previous_sink;
+        return ret;
+    }
+    avfilter_graph_free(&previous_graph);
+    output_time_base = buffersink_ctx->inputs[0]->time_base;
+    return ret;
+}
+
+int FFMPEGManager::apply_filters() {
+    std::string previous;
+    FrameRegion previous_region;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        previous = filters;
+        previous_region = region;
+        filters = pending_filters;
+        region = pending_region;
+    }
+    AVRational time_base = output_time_base;
+    int ret = configure_filters();
+    if (ret < 0) {
+        /* SetFilter checked the description, but not against these frames */
+        av_log(NULL, AV_LOG_ERROR, "Cannot apply filters: %s\n", av_err2str(ret));
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        filters = previous;
+        region = previous_region;
+        return ret;
+    }
+
+    /* a deinterlacer sending fields, say, ticks twice as fast */
+    if (av_cmp_q(time_base, output_time_base) != 0) {
+        seek_tolerance = av_rescale_q(seek_tolerance, time_base, output_time_base);
+        last_pts = AV_NOPTS_VALUE;
+    }
+    /* frames filtered the old way must not answer seeks or steps */
+    FrameCache::Shared().EvictSource(source);
+    {
+        std::lock_guard<std::mutex> lock(step_mutex);
+        gop_cache.reset();
+    }
+    account_memory();
+    return 0;
+}
+
+void FFMPEGManager::account_memory() {
+    MemoryGovernor &governor = MemoryGovernor::Shared();
+    size_t decoded = 0, packet = 0, output = 0;
+    int threads = 0;
+    if (shm_ring || sequence) {
+        /* the producer's frame, copied out of the ring, or the images
+         * decoded ahead of the playhead */
+        decoded = av_image_get_buffer_size(input_format, input_width, input_height, 1);
+        threads = sequence? sequence->ReadAhead():1;
+        output = size_t(width) * height * 4;
+    } else if (dec_ctx && fmt_ctx) {
+        AVStream *stream = fmt_ctx->streams[video_stream_index];
+        int size = av_image_get_buffer_size((AVPixelFormat)stream->codecpar->format,
+                                            dec_ctx->width, dec_ctx->height, 1);
+        decoded = (size > 0)? size:dec_ctx->width * dec_ctx->height * 3 / 2;
+        /* a rough average; the demuxer does not know packet sizes ahead */
+        double fps = av_q2d(stream->avg_frame_rate);
+        packet = (stream->codecpar->bit_rate > 0 && fps > 0)?
+            size_t(stream->codecpar->bit_rate / 8 / fps):(64 << 10);
+        threads = std::max(dec_ctx->thread_count, 1);
+        output = size_t(width) * height * 4;
+    }
+
+    /* reference frames plus one in flight per decoder thread */
+    governor.Reserve(this, "decoder", decoded * (threads + 6));
+    governor.Reserve(this, "filterGraph", output);
+    governor.Reserve(this, "packetQueue", packet * packet_queue.Capacity());
+    governor.Reserve(this, "frameQueue", decoded * frame_queue.Capacity());
+    governor.Reserve(this, "audio", audio_stream? audio_stream->Bytes():0);
+    /* Reserve may ask this player for relief, which takes the lock
+     * again: read under it, reserve after */
+    size_t shown = 0;
+    {
+        std::shared_lock lock(buffer_mutex);
+        shown = buffer? buffer->Bytes():0;
+    }
+    governor.Reserve(this, "output", shown);
+    governor.Reserve(this, "frameCache", FrameCache::Shared().SourceBytes(source));
+    governor.Reserve(this, "gopCache", gop_bytes());
+}
+
+size_t FFMPEGManager::gop_bytes() {
+    std::lock_guard<std::mutex> lock(step_mutex);
+    return gop_cache? gop_cache->Bytes():0;
+}
+
+bool FFMPEGManager::Relieve(MemoryRelief relief) {
+    switch (relief) {
+    case MemoryRelief::kShrinkQueues: {
+        size_t packets = packet_queue.Capacity(), frames = frame_queue.Capacity();
+        if (packets <= 8 && frames <= 1)
+            return false;
+        packet_queue.SetCapacity(std::max<size_t>(packets / 2, 8));
+        frame_queue.SetCapacity(std::max<size_t>(frames / 2, 1));
+        break;
+    }
+    case MemoryRelief::kEvictCache: {
+        std::unique_lock<std::mutex> lock(step_mutex);
+        size_t stepped = gop_cache? gop_cache->Bytes():0;
+        gop_cache.reset();
+        lock.unlock();
+        if (FrameCache::Shared().SourceBytes(source) == 0 && stepped == 0)
+            return false;
+        FrameCache::Shared().EvictSource(source);
+        break;
+    }
+    case MemoryRelief::kDownshift:
+        /* never below a thumbnail, and only one step per enforcement */
+        if (width / 2 < 160 || downshift_pending)
+            return false;
+        downshift_pending = true;
+        return true;
+    }
+    account_memory();
+    return true;
+}
+
 void FFMPEGManager::Free() {
+    /* other players' threads account and relieve this one through the
+     * governor; once unregistered, none of them still reads the contexts */
+    MemoryGovernor::Shared().Unregister(this);
     avfilter_graph_free(&filter_graph);
+    buffersink_ctx = NULL;
+    buffersrc_ctx = NULL;
     if (dec_ctx) {
         avcodec_free_context(&dec_ctx);
     }
+    free_audio_context();
     avformat_close_input(&fmt_ctx);
+    shm_ring.reset();
+    sequence.reset();
     if (frame) {
         av_frame_free(&frame);
     }
     if (filt_frame) {
         av_frame_free(&filt_frame);
     }
-    if (buffer) {
-        delete [] buffer;
-        buffer = NULL;
+    av_frame_free(&hdr_frame);
+    hdr_converter.reset();
+    av_frame_free(&crop_frame);
+    {
+        std::unique_lock lock(buffer_mutex);
+        buffer.reset();
+    }
+    {
+        std::lock_guard<std::mutex> lock(step_mutex);
+        gop_cache.reset();
     }
 }
 
@@ -273,11 +1073,6 @@ int FFMPEGManager::Close(int ret) {
     return 0;
 }
 
-int FFMPEGManager::read_frame_to_packet(AVPacket* packet) {
-    av_packet_unref(packet);
-    return av_read_frame(fmt_ctx, packet);
-}
-
 int FFMPEGManager::receive_frame() {
     av_frame_unref(frame);
     return avcodec_receive_frame(dec_ctx, frame);
@@ -288,102 +1083,1107 @@ int FFMPEGManager::get_filter_frame() {
     return av_buffersink_get_frame(buffersink_ctx, filt_frame);
 }
 
-int FFMPEGManager::loop_internal(std::function<void()> callback) {
-    AVPacket packet;
-    /* read all packets */
-    int ret = av_read_frame(fmt_ctx, &packet);
-    if (ret < 0) {
-        av_packet_unref(&packet);
+int FFMPEGManager::demux_loop() {
+    int ret = 0;
+    while (!stopping) {
+        if (seek_serial != demux_serial) {
+            int64_t target;
+            {
+                std::lock_guard<std::mutex> lock(seek_mutex);
+                target = seek_target + start_time;
+                demux_serial = seek_serial.load();
+            }
+            /* land on the keyframe at or before the target */
+            if (av_seek_frame(fmt_ctx, -1, target, AVSEEK_FLAG_BACKWARD) < 0)
+                av_log(NULL, AV_LOG_ERROR, "Cannot seek input\n");
+        }
+
+        int64_t start = av_gettime_relative();
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if ((ret = av_read_frame(fmt_ctx, packet)) < 0) {
+            av_packet_free(&packet);
+            break;
+        }
+        if (packet->stream_index == audio_stream_index) {
+            demux_meter.Add(start);
+            if (!audio_packet_queue.Push(QueuedPacket{packet, demux_serial})) {
+                av_packet_free(&packet);
+                break;
+            }
+            continue;
+        }
+        if (packet->stream_index != video_stream_index ||
+            (options.keyframe_only && !(packet->flags & AV_PKT_FLAG_KEY))) {
+            av_packet_free(&packet);
+            continue;
+        }
+        demux_meter.Add(start);
+        if (!packet_queue.Push(QueuedPacket{packet, demux_serial})) {
+            av_packet_free(&packet);
+            break;
+        }
     }
-    
-    for(; ret >= 0; ret = read_frame_to_packet(&packet)) {
-        if (packet.stream_index != video_stream_index) {
+
+    /* a null packet puts the decoders into draining mode */
+    packet_queue.Push(QueuedPacket{NULL, demux_serial});
+    if (audio_stream_index >= 0)
+        audio_packet_queue.Push(QueuedPacket{NULL, demux_serial});
+    return (ret == AVERROR_EOF)? 0:ret;
+}
+
+int FFMPEGManager::decode_loop() {
+    enum { kPlaying, kSeekKeyframe, kSeekExact } phase = kPlaying;
+    AVStream *stream = fmt_ctx->streams[video_stream_index];
+    AVRational time_base = stream->time_base;
+    int64_t target = 0;
+    bool quiet = false;
+    /* fast playback keeps a frame per interval of the source's own rate */
+    int64_t interval = (stream->avg_frame_rate.num > 0)?
+        av_rescale_q(1, av_inv_q(stream->avg_frame_rate), AV_TIME_BASE_Q):AV_TIME_BASE / 25;
+    int64_t kept = AV_NOPTS_VALUE;
+    QueuedPacket item;
+    int ret = 0;
+    while (packet_queue.Pop(&item)) {
+        if (item.serial != seek_serial) {
+            /* superseded by a newer seek; never decoded */
+            if (!item.packet)
+                break;
+            av_packet_free(&item.packet);
             continue;
         }
+        if (item.serial != decode_serial) {
+            avcodec_flush_buffers(dec_ctx);
+            decode_serial = item.serial;
+            std::lock_guard<std::mutex> lock(seek_mutex);
+            target = seek_target;
+            quiet = seek_quiet;
+            phase = kSeekKeyframe;
+            kept = AV_NOPTS_VALUE;
+        }
 
-        ret = avcodec_send_packet(dec_ctx, &packet);
+        /* fast rates drop frames before they are decoded, let alone
+         * converted; keyframe-only players drop them all already */
+        double rate = speed;
+        if (!options.keyframe_only) {
+            AVDiscard discard = (rate >= kSkipNonKeySpeed)? AVDISCARD_NONKEY:
+                (rate >= kSkipNonRefSpeed)? AVDISCARD_NONREF:AVDISCARD_DEFAULT;
+            dec_ctx->skip_frame = discard;
+        }
+
+        int64_t start = av_gettime_relative();
+        bool end_of_stream = !item.packet;
+        ret = avcodec_send_packet(dec_ctx, item.packet);
+        av_packet_free(&item.packet);
         if (ret < 0) {
             av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder\n");
             break;
         }
 
-        for(ret = avcodec_receive_frame(dec_ctx, frame); 
-            ret >= 0 && !(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF); 
-            ret = receive_frame()) {
-            if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
-                return ret;
+        while ((ret = receive_frame()) >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            int64_t time = stream_time(frame->pts, time_base);
+            if (phase == kSeekKeyframe && (quiet || scrub_proxy())) {
+                /* the proxy or a step already shows this position, so the
+                 * keyframe adds nothing; go straight for the exact frame
+                 * once the requests stop coming */
+                if (!wait_for_settle(item.serial)) {
+                    ret = AVERROR(EAGAIN);
+                    break;
+                }
+                phase = kSeekExact;
+            }
+            /* frames short of an exact seek target are never converted */
+            if (phase == kSeekExact && time < target)
+                continue;
+            /* nor those that would be shown faster than the source's rate */
+            if (phase == kPlaying && rate > 1.0 && kept != AV_NOPTS_VALUE && time >= kept &&
+                time - kept < (rate - 0.5) * interval)
+                continue;
+            kept = time;
+
+            AVFrame *decoded = av_frame_alloc();
+            if (!decoded) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            av_frame_move_ref(decoded, frame);
+            decode_meter.Add(start);
+            if (!frame_queue.Push(QueuedFrame{decoded, item.serial, phase != kPlaying})) {
+                av_frame_free(&decoded);
+                ret = AVERROR_EXIT;
+                break;
+            }
+            start = av_gettime_relative();
+
+            if (phase == kSeekExact) {
+                phase = kPlaying;
+            } else if (phase == kSeekKeyframe) {
+                /* the nearest keyframe is on screen; refine to the exact
+                 * frame only once the requests stop coming */
+                if (!wait_for_settle(item.serial)) {
+                    ret = AVERROR(EAGAIN);
+                    break;
+                }
+                phase = (time < target && !options.keyframe_only)? kSeekExact:kPlaying;
             }
+        }
+        if (ret == AVERROR(EAGAIN) && !end_of_stream) {
+            ret = 0;
+            continue;
+        }
+        if (ret != AVERROR_EOF && ret != AVERROR_EXIT && ret != AVERROR(EAGAIN)) {
+            av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder\n");
+        }
+        break;
+    }
 
-            frame->pts = frame->best_effort_timestamp;
+    /* a null frame marks the end of the pass for the present stage */
+    frame_queue.Push(QueuedFrame{NULL, decode_serial, false});
+    return (ret == AVERROR_EOF || ret == AVERROR_EXIT || ret == AVERROR(EAGAIN))? 0:ret;
+}
+
+void FFMPEGManager::audio_loop() {
+    AVRational time_base = fmt_ctx->streams[audio_stream_index]->time_base;
+    int channels = audio_stream->Format().channels;
+    int64_t target = AV_NOPTS_VALUE;
+    std::vector<float> samples;
+    QueuedPacket item;
+    while (audio_packet_queue.Pop(&item)) {
+        if (item.serial != seek_serial) {
+            if (!item.packet)
+                break;
+            av_packet_free(&item.packet);
+            continue;
+        }
+        if (item.serial != audio_serial) {
+            /* drop what the sink has not played yet, then stay quiet
+             * until the seek is no longer being dragged around */
+            avcodec_flush_buffers(audio_dec_ctx);
+            swr_init(swr_ctx);
+            audio_serial = item.serial;
+            audio_stream->Rebase(true);
+            if (!wait_for_settle(item.serial)) {
+                av_packet_free(&item.packet);
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(seek_mutex);
+            target = seek_target;
+        }
+        /* heard at the normal rate only; SetSpeed seeks to line it up again */
+        if (item.packet && speed != 1.0) {
+            av_packet_free(&item.packet);
+            continue;
+        }
 
-            /* push the decoded frame into the filtergraph */
-            if (av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        int64_t start = av_gettime_relative();
+        bool end_of_stream = !item.packet;
+        int ret = avcodec_send_packet(audio_dec_ctx, item.packet);
+        av_packet_free(&item.packet);
+        if (ret < 0) {
+            /* a damaged audio packet is no reason to stop the video */
+            av_log(NULL, AV_LOG_WARNING, "Error while sending a packet to the audio decoder\n");
+            if (end_of_stream)
                 break;
+            continue;
+        }
+
+        while ((ret = avcodec_receive_frame(audio_dec_ctx, audio_frame)) >= 0) {
+            int64_t pts = audio_frame->best_effort_timestamp;
+            if (target != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE) {
+                if (stream_time(pts, time_base) < target) {
+                    av_frame_unref(audio_frame);
+                    continue;
+                }
+                target = AV_NOPTS_VALUE;
             }
 
-            /* pull filtered frames from the filtergraph */
-            for(ret = av_buffersink_get_frame(buffersink_ctx, filt_frame); 
-                ret >= 0 && !(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF); 
-                ret = get_filter_frame()) {
-                if (ret < 0)
-                    return ret;
-                save_frame(filt_frame, buffersink_ctx->inputs[0]->time_base);
-                callback();
+            int count = swr_get_out_samples(swr_ctx, audio_frame->nb_samples);
+            samples.resize(size_t(count) * channels);
+            uint8_t *out = (uint8_t*)samples.data();
+            count = swr_convert(swr_ctx, &out, count,
+                                (const uint8_t**)audio_frame->extended_data, audio_frame->nb_samples);
+            av_frame_unref(audio_frame);
+            audio_meter.Add(start);
+            int64_t time = (pts == AV_NOPTS_VALUE)? AV_NOPTS_VALUE:av_rescale_q(pts, time_base, AV_TIME_BASE_Q);
+            if (count > 0 && !write_audio(samples.data(), count, time, item.serial)) {
+                ret = AVERROR_EXIT;
+                break;
             }
+            start = av_gettime_relative();
         }
+        if (ret == AVERROR_EOF || (ret == AVERROR_EXIT && stopping))
+            break;
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EXIT)
+            av_log(NULL, AV_LOG_WARNING, "Error while receiving a frame from the audio decoder\n");
+    }
+}
+
+bool FFMPEGManager::write_audio(const float *samples, int frames, int64_t time, uint32_t serial) {
+    const AudioFormat &format = audio_stream->Format();
+    while (frames > 0) {
+        int written = audio_stream->Write(samples, frames, time);
+        samples += size_t(written) * format.channels;
+        frames -= written;
+        if (time != AV_NOPTS_VALUE)
+            time += int64_t(written) * AV_TIME_BASE / format.sample_rate;
+        if (frames == 0)
+            break;
+        /* the ring is full; the renderer drains it at playback speed */
+        if (stopping || closing || serial != seek_serial)
+            return false;
+        usleep(int64_t(AudioMixer::kBlockFrames) * AV_TIME_BASE / format.sample_rate / 2);
+    }
+    return true;
+}
+
+bool FFMPEGManager::wait_for_settle(uint32_t serial) {
+    std::unique_lock<std::mutex> lock(seek_mutex);
+    while (!closing && !stopping && seek_serial == serial) {
+        int64_t remaining = seek_requested_at + kSeekSettleTime - av_gettime_relative();
+        if (remaining <= 0)
+            return true;
+        seek_cv.wait_for(lock, std::chrono::microseconds(remaining));
+    }
+    return false;
+}
+
+bool FFMPEGManager::wait_while_paused(uint32_t serial) {
+    if (!paused)
+        return true;
+    std::unique_lock<std::mutex> lock(seek_mutex);
+    seek_cv.wait(lock, [this, serial]() { return !paused || closing || seek_serial != serial; });
+    /* resume without trying to catch up on the time spent paused */
+    last_pts = AV_NOPTS_VALUE;
+    return !closing && seek_serial == serial;
+}
+
+int FFMPEGManager::present_frame(AVFrame *decoded, const std::function<void()> &callback) {
+    int64_t start = av_gettime_relative();
+    if (downshift_pending.exchange(false)) {
+        /* halve the output under memory pressure, keeping sizes even */
+        width = (width / 2) & ~1;
+        height = (height / 2) & ~1;
+        int ret = configure_filters();
+        account_memory();
+        if (ret < 0)
+            return ret;
+    }
+
+    if (filter_pending.exchange(false))
+        apply_filters();
+
+    AVFrame *input = decoded;
+    if (!region.IsFull()) {
+        /* cropping only moves the data pointers, so the conversion and the
+         * scale never touch what is outside the region */
+        int left, top, crop_width, crop_height;
+        region.ToPixels(decoded->width, decoded->height, &left, &top, &crop_width, &crop_height);
+        if (!crop_frame && !(crop_frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        av_frame_unref(crop_frame);
+        int ret = av_frame_ref(crop_frame, decoded);
+        if (ret < 0)
+            return ret;
+        crop_frame->crop_left = left;
+        crop_frame->crop_top = top;
+        crop_frame->crop_right = decoded->width - left - crop_width;
+        crop_frame->crop_bottom = decoded->height - top - crop_height;
+        /* hardware frames cannot be cropped this way; the scale copes */
+        if (av_frame_apply_cropping(crop_frame, AV_FRAME_CROP_UNALIGNED) >= 0)
+            input = crop_frame;
+    }
+    if (options.tone_map.curve != ToneMapCurve::kOff &&
+        HdrConverter::Supports((AVPixelFormat)input->format, output_format)) {
+        /* halving as it converts leaves the scale filter a quarter of the
+         * pixels whenever the output is that much smaller */
+        bool halve = width * 2 <= input->width && height * 2 <= input->height;
+        if (!hdr_converter)
+            hdr_converter.reset(new HdrConverter(options.tone_map));
+        if (!hdr_frame && !(hdr_frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        int ret = hdr_converter->Convert(input, hdr_frame, output_format, halve);
+        if (ret < 0)
+            return ret;
+        input = hdr_frame;
+    }
+
+    /* push the decoded frame into the filtergraph */
+    if (av_buffersrc_add_frame_flags(buffersrc_ctx, input, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph\n");
+        return 0;
+    }
+
+    /* pull filtered frames from the filtergraph */
+    int ret;
+    while ((ret = get_filter_frame()) >= 0) {
+        convert_meter.Add(start);
+        save_frame(filt_frame, output_time_base);
+        if (options.live && !shm_ring)
+            measure_latency(decoded);
+        callback();
+        start = av_gettime_relative();
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)? 0:ret;
+}
+
+void FFMPEGManager::measure_latency(const AVFrame *decoded) {
+    /* only 8-bit luma survives to here unchanged */
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)decoded->format);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->comp[0].plane != 0 ||
+        desc->comp[0].step != 1 || desc->comp[0].depth != 8)
+        return;
+
+    int64_t stamp;
+    if (ReadFrameStamp(decoded->data[0], decoded->width, &stamp)) {
+        int64_t latency = av_gettime_relative() - stamp;
+        /* anything else is a picture that merely looks like a stamp */
+        if (latency >= 0 && latency < 60 * AV_TIME_BASE)
+            latency_meter.Add(latency);
+    }
+}
+
+int FFMPEGManager::decode_pass(const std::function<void()> &callback, bool from_start) {
+    uint32_t serial = seek_serial;
+    from_start = from_start && serial == demux_serial;
+    pass_pts.clear();
+    pass_complete = false;
+    stopping = false;
+    packet_queue.Reopen();
+    frame_queue.Reopen();
+    audio_packet_queue.Reopen();
+    /* Stop() may have run between the caller's check and the reopen */
+    if (closing) {
+        packet_queue.Close();
+        frame_queue.Close();
+        audio_packet_queue.Close();
+        return 0;
+    }
+
+    int demux_ret = 0, decode_ret = 0;
+    std::thread demux_thread([this, &demux_ret]() { demux_ret = demux_loop(); });
+    std::thread decode_thread([this, &decode_ret]() { decode_ret = decode_loop(); });
+    std::thread audio_thread;
+    if (audio_stream_index >= 0)
+        audio_thread = std::thread(&FFMPEGManager::audio_loop, this);
+
+    int ret = 0;
+    bool ended = false;
+    QueuedFrame item;
+    while (frame_queue.Pop(&item)) {
+        if (!item.frame) {
+            ended = true;
+            break;
+        }
+        if (item.serial != seek_serial) {
+            /* decoded for a target that has since been superseded */
+            av_frame_free(&item.frame);
+            continue;
+        }
+        bool poster = poster_pending.exchange(false);
+        if (item.seek_result || poster) {
+            last_pts = AV_NOPTS_VALUE;
+        } else if (!wait_while_paused(item.serial)) {
+            av_frame_free(&item.frame);
+            continue;
+        } else if (speed < 0) {
+            /* the pipeline stays full behind this frame until playback
+             * turns forward again, which seeks it anyway */
+            av_frame_free(&item.frame);
+            if ((ret = reverse_pass(item.serial, callback)) < 0)
+                break;
+            continue;
+        }
+        ret = present_frame(item.frame, callback);
+        av_frame_free(&item.frame);
+        if (ret < 0)
+            break;
+    }
+
+    /* at the end of the stream, let the audio still queued play out */
+    if (ended && audio_thread.joinable())
+        audio_thread.join();
+
+    /* wake up the producers in case presentation stopped early */
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        stopping = true;
+    }
+    seek_cv.notify_all();
+    packet_queue.Close();
+    frame_queue.Close();
+    audio_packet_queue.Close();
+    demux_thread.join();
+    decode_thread.join();
+    if (audio_thread.joinable())
+        audio_thread.join();
+    packet_queue.Clear([](QueuedPacket &queued) { av_packet_free(&queued.packet); });
+    frame_queue.Clear([](QueuedFrame &queued) { av_frame_free(&queued.frame); });
+    audio_packet_queue.Clear([](QueuedPacket &queued) { av_packet_free(&queued.packet); });
+
+    if (ret >= 0)
+        ret = (decode_ret < 0)? decode_ret:demux_ret;
+    pass_complete = ret >= 0 && ended && from_start && serial == seek_serial;
+    return ret;
+}
+
+bool FFMPEGManager::replay_from_cache(const std::function<void()> &callback) {
+    std::vector<VideoFramePtr> frames;
+    /* the audio has to be decoded again anyway */
+    if (audio_stream_index >= 0)
+        return false;
+    if (!pass_complete || pass_pts.empty() ||
+        !FrameCache::Shared().FindAll(source, pass_pts, width, height, &frames))
+        return false;
+
+    /* the whole clip is resident, so this pass costs no decoding at all */
+    uint32_t serial = seek_serial;
+    for (auto &cached : frames) {
+        if (!wait_while_paused(serial))
+            break;
+        publish_frame(cached);
+        callback();
+    }
+    return true;
+}
+
+int FFMPEGManager::rewind() {
+    AVStream *stream = fmt_ctx->streams[video_stream_index];
+    int64_t start = (stream->start_time != AV_NOPTS_VALUE)? stream->start_time:0;
+    int ret = av_seek_frame(fmt_ctx, video_stream_index, start, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot rewind input\n");
+        return ret;
+    }
+    avcodec_flush_buffers(dec_ctx);
+    if (audio_stream_index >= 0) {
+        /* the new loop starts once the end of the last one has played */
+        avcodec_flush_buffers(audio_dec_ctx);
+        swr_init(swr_ctx);
+        audio_stream->Rebase(false);
     }
     return 0;
 }
 
+int FFMPEGManager::shm_loop(const std::function<void()> &callback) {
+    AVFrame *input = av_frame_alloc();
+    if (!input)
+        return AVERROR(ENOMEM);
+    input->format = input_format;
+    input->width = input_width;
+    input->height = input_height;
+    int ret = av_frame_get_buffer(input, 0);
+
+    while (ret >= 0 && !closing) {
+        if (!wait_while_paused(seek_serial))
+            continue;
+        /* wake now and then to notice a pause or a Stop */
+        int ready = shm_ring->Wait(AV_TIME_BASE / 10);
+        if (ready == AVERROR_EOF)
+            break;
+        if (ready <= 0)
+            continue;
+
+        int64_t start = av_gettime_relative();
+        /* the filter graph may still hold a reference to the last frame */
+        if ((ret = av_frame_make_writable(input)) < 0)
+            break;
+        int64_t pts;
+        if (!shm_ring->ReadLatest(input->data, input->linesize, &pts))
+            continue;
+        /* copying out of the ring stands in for decoding */
+        decode_meter.Add(start);
+        input->pts = pts;
+        if ((ret = present_frame(input, callback)) < 0)
+            break;
+        /* producer and player share the monotonic clock */
+        latency_meter.Add(av_gettime_relative() - pts);
+    }
+    av_frame_free(&input);
+    return ret;
+}
+
+int FFMPEGManager::sequence_pass(const std::function<void()> &callback, int first) {
+    uint32_t serial = seek_serial;
+    pass_pts.clear();
+    pass_complete = first == 0;
+    last_pts = AV_NOPTS_VALUE;
+
+    int ret = 0;
+    for (int index = first; index < sequence->Count(); index++) {
+        if (closing || seek_serial != serial ||
+            (!poster_pending.exchange(false) && !wait_while_paused(serial))) {
+            pass_complete = false;
+            break;
+        }
+        int64_t start = av_gettime_relative();
+        if ((ret = sequence->Get(index, looping, frame)) < 0) {
+            /* one unreadable image should not end the animation */
+            av_log(NULL, AV_LOG_WARNING, "Cannot decode %s\n", sequence->File(index).c_str());
+            ret = 0;
+            continue;
+        }
+        decode_meter.Add(start);
+
+        if (frame->width != input_width || frame->height != input_height ||
+            frame->format != input_format) {
+            /* an image of another size or format needs a new filter graph */
+            input_width = frame->width;
+            input_height = frame->height;
+            input_format = (AVPixelFormat)frame->format;
+            if ((ret = configure_filters()) < 0)
+                break;
+        }
+        frame->pts = index;
+        ret = present_frame(frame, callback);
+        av_frame_unref(frame);
+        if (ret < 0)
+            break;
+    }
+    return ret;
+}
+
+int FFMPEGManager::sequence_loop(const std::function<void()> &callback) {
+    int ret = sequence_pass(callback, 0);
+    while (ret >= 0 && !closing) {
+        if (seek_serial != demux_serial) {
+            int first;
+            {
+                std::lock_guard<std::mutex> lock(seek_mutex);
+                demux_serial = seek_serial.load();
+                first = av_rescale_q(seek_target, AV_TIME_BASE_Q, input_time_base);
+            }
+            ret = sequence_pass(callback, std::min(first, sequence->Count() - 1));
+        } else if (looping) {
+            if (!replay_from_cache(callback))
+                ret = sequence_pass(callback, 0);
+        } else {
+            /* hold the last frame at the end of the sequence until a seek */
+            std::unique_lock<std::mutex> lock(seek_mutex);
+            at_end = true;
+            seek_cv.wait(lock, [this]() {
+                return closing || looping || seek_serial != demux_serial;
+            });
+            at_end = false;
+        }
+    }
+    return ret;
+}
+
+int FFMPEGManager::loop_internal(std::function<void()> callback) {
+    if (sequence)
+        return sequence_loop(callback);
+    if (shm_ring) {
+        int ret = shm_loop(callback);
+        /* hold the last frame once the producer has gone */
+        std::unique_lock<std::mutex> lock(seek_mutex);
+        at_end = true;
+        seek_cv.wait(lock, [this]() { return closing.load(); });
+        at_end = false;
+        return ret;
+    }
+
+    int ret = decode_pass(callback, true);
+    while (ret >= 0 && !closing) {
+        if (seek_serial != demux_serial) {
+            ret = decode_pass(callback, false);
+        } else if (looping) {
+            last_pts = AV_NOPTS_VALUE;
+            if (replay_from_cache(callback))
+                continue;
+            if ((ret = rewind()) < 0)
+                break;
+            ret = decode_pass(callback, true);
+        } else if (speed < 0) {
+            ret = reverse_pass(seek_serial, callback);
+        } else {
+            /* hold the last frame at the end of the stream until a seek */
+            std::unique_lock<std::mutex> lock(seek_mutex);
+            at_end = true;
+            seek_cv.wait(lock, [this]() {
+                return closing || looping || seek_serial != demux_serial || speed < 0;
+            });
+            at_end = false;
+        }
+    }
+    return ret;
+}
+
 int FFMPEGManager::Loop(std::function<void()> callback = NullFunc) {
-    if (running) {
+    if (running.exchange(true)) {
         printf("Manager already looping.\n");
         return 0;
     }
-    running = true;
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        frame_callback = callback;
+        loop_active = true;
+    }
 
+    if (audio_stream) {
+        if (audio_sink) {
+            owned_mixer.reset(new AudioMixer(std::move(audio_sink)));
+            audio_mixer = owned_mixer.get();
+        } else {
+            audio_mixer = &AudioMixer::Shared();
+        }
+        if (audio_mixer->AddInput(audio_stream.get()) < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Cannot mix audio, playing without it\n");
+            audio_mixer = NULL;
+            free_audio_context();
+        }
+    }
     int ret = loop_internal(callback);
+    if (audio_mixer) {
+        audio_mixer->RemoveInput(audio_stream.get());
+        audio_mixer = NULL;
+    }
+    owned_mixer.reset();
+    ret = Close(ret);
+
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        loop_active = false;
+    }
+    seek_cv.notify_all();
+    return ret;
+}
+
+void FFMPEGManager::Stop() {
+    std::unique_lock<std::mutex> lock(seek_mutex);
+    closing = true;
+    seek_cv.notify_all();
+    packet_queue.Close();
+    frame_queue.Close();
+    audio_packet_queue.Close();
+    seek_cv.wait(lock, [this]() { return !loop_active; });
+}
+
+void FFMPEGManager::SetLooping(bool loop) {
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        looping = loop;
+    }
+    seek_cv.notify_all();
+}
+
+void FFMPEGManager::SetPaused(bool pause) {
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        paused = pause;
+    }
+    if (audio_stream)
+        audio_stream->SetPaused(pause);
+    seek_cv.notify_all();
+}
+
+void FFMPEGManager::Preroll(int64_t position_us) {
+    SetPaused(true);
+    /* a seek is shown whether paused or not; from the start, the first
+     * frame of the pass is let through instead */
+    if (position_us > 0 && fmt_ctx && !options.live)
+        Seek(position_us);
+    else
+        poster_pending = true;
+}
+
+int FFMPEGManager::SetSpeed(double value) {
+    if (value == 0.0 || isnan(value))
+        return AVERROR(EINVAL);
+    if (value < 0 && (input_path.empty() || options.live))
+        return AVERROR(ENOSYS);
+    double magnitude = std::min(std::max(fabs(value), kMinSpeed), kMaxSpeed);
+    value = (value < 0)? -magnitude:magnitude;
+    double previous;
+    {
+        /* a pass holding the first or last frame waits on this */
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        previous = speed.exchange(value);
+    }
+    seek_cv.notify_all();
+
+    /* Turning forward again, the pipeline has to catch up with the frame
+     * reverse left on screen; leaving or returning to the normal rate,
+     * the audio has to be lined up again. Both are quiet seeks. */
+    bool resync = previous < 0 && value > 0;
+    resync = resync || (audio_stream && previous > 0 && (previous == 1.0) != (value == 1.0));
+    if (resync && !input_path.empty() && !options.live)
+        request_seek(Position(), true);
+    return 0;
+}
+
+int FFMPEGManager::SetFilter(const std::string &description) {
+    /* parsing creates and initializes every filter, which catches unknown
+     * names and bad options; the sizes are only known to the real graph */
+    if (!description.empty()) {
+        AVFilterGraph *graph = avfilter_graph_alloc();
+        AVFilterInOut *inputs = NULL, *outputs = NULL;
+        int ret = graph? avfilter_graph_parse2(graph, description.c_str(), &inputs, &outputs):AVERROR(ENOMEM);
+        /* a chain, with one end for the source and one for the scale */
+        if (ret >= 0 && (!inputs || inputs->next || !outputs || outputs->next))
+            ret = AVERROR(EINVAL);
+        avfilter_inout_free(&inputs);
+        avfilter_inout_free(&outputs);
+        avfilter_graph_free(&graph);
+        if (ret < 0)
+            return ret;
+    }
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        pending_filters = description;
+    }
+    filter_pending = true;
+    /* the frame on screen is filtered again, quietly, when nothing else
+     * would replace it */
+    if (paused && fmt_ctx && !options.live)
+        request_seek(Position(), true);
+    return 0;
+}
+
+std::string FFMPEGManager::Filter() const {
+    std::lock_guard<std::mutex> lock(filter_mutex);
+    return pending_filters;
+}
+
+int FFMPEGManager::SetRegion(const FrameRegion &value) {
+    FrameRegion clamped = value;
+    if (!clamped.Clamp())
+        return AVERROR(EINVAL);
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex);
+        if (clamped == pending_region)
+            return 0;
+        pending_region = clamped;
+    }
+    filter_pending = true;
+    if (paused && fmt_ctx && !options.live)
+        request_seek(Position(), true);
+    return 0;
+}
+
+FrameRegion FFMPEGManager::Region() const {
+    std::lock_guard<std::mutex> lock(filter_mutex);
+    return pending_region;
+}
+
+std::string FFMPEGManager::step_filters() const {
+    /* steps are decoded afresh; a crop filter takes the same pixels out of
+     * them as cropping does here */
+    std::lock_guard<std::mutex> lock(filter_mutex);
+    if (pending_region.IsFull())
+        return pending_filters;
+    int left, top, crop_width, crop_height;
+    pending_region.ToPixels(dec_ctx->width, dec_ctx->height, &left, &top, &crop_width, &crop_height);
+    char crop[64];
+    snprintf(crop, sizeof(crop), "crop=%d:%d:%d:%d", crop_width, crop_height, left, top);
+    return pending_filters.empty()? crop:crop + ("," + pending_filters);
+}
+
+void FFMPEGManager::SetVolume(float value) {
+    volume = value;
+    if (audio_stream)
+        audio_stream->SetGain(value);
+}
+
+void FFMPEGManager::request_seek(int64_t position_us, bool quiet) {
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        seek_target = std::max<int64_t>(position_us, 0);
+        seek_requested_at = av_gettime_relative();
+        seek_quiet = quiet;
+        seek_serial++;
+    }
+    seek_cv.notify_all();
+}
+
+void FFMPEGManager::Seek(int64_t position_us) {
+    std::function<void()> callback;
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        callback = frame_callback;
+    }
+    request_seek(position_us, false);
+
+    /* a frame still in the cache answers the request without any decoding;
+     * the pipeline seeks regardless so that playback can continue from it */
+    int64_t pts = av_rescale_q(position_us + start_time, AV_TIME_BASE_Q, output_time_base);
+    VideoFramePtr cached = FrameCache::Shared().FindNearest(
+        FrameKey{source, pts, width, height}, seek_tolerance);
+    if (cached) {
+        publish_frame(cached, false);
+        callback();
+    } else if (publish_scrub_frame(position_us)) {
+        callback();
+    }
+}
+
+int FFMPEGManager::step_frame(int direction, VideoFramePtr *out) {
+    VideoFramePtr current = Frame();
+    if (!current)
+        return AVERROR(EAGAIN);
+    std::shared_ptr<GopCache> cache;
+    int ret;
+    {
+        /* steps are served one at a time, in the order they arrive */
+        std::lock_guard<std::mutex> lock(step_mutex);
+        std::string stepped_filters = step_filters();
+        if (!gop_cache || gop_cache->Width() != width || gop_cache->Height() != height ||
+            gop_cache->Filters() != stepped_filters)
+            gop_cache = std::make_shared<GopCache>(input_path, width, height, output_format, output_time_base,
+                                                   options.tone_map, stepped_filters, Region());
+        cache = gop_cache;
+        ret = cache->Step(current->pts, direction, out);
+    }
+    /* the next GOP along is decoded while this one is shown */
+    if (ret >= 0)
+        cache->Prefetch(ThreadPool::Shared(), (*out)->pts, direction);
+    return ret;
+}
 
-    return Close(ret);
+int FFMPEGManager::reverse_pass(uint32_t serial, const std::function<void()> &callback) {
+    last_pts = AV_NOPTS_VALUE;
+    size_t accounted = SIZE_MAX;
+    while (!closing && speed < 0 && seek_serial == serial) {
+        if (!wait_while_paused(serial))
+            break;
+        VideoFramePtr stepped;
+        int ret = step_frame(-1, &stepped);
+        if (ret == AVERROR_EOF) {
+            /* hold the first frame until told otherwise */
+            std::unique_lock<std::mutex> lock(seek_mutex);
+            seek_cv.wait(lock, [this, serial]() {
+                return closing || speed >= 0 || seek_serial != serial;
+            });
+            break;
+        } else if (ret < 0) {
+            return ret;
+        }
+        publish_frame(stepped);
+        callback();
+        /* only a GOP decoded or dropped changes what the pass holds */
+        size_t bytes = gop_bytes();
+        if (bytes != accounted) {
+            accounted = bytes;
+            account_memory();
+        }
+    }
+    last_pts = AV_NOPTS_VALUE;
+    return 0;
+}
+
+int FFMPEGManager::Step(int direction) {
+    if (input_path.empty() || options.live)
+        return AVERROR(ENOSYS);
+    SetPaused(true);
+    VideoFramePtr stepped;
+    int ret = step_frame(direction, &stepped);
+    if (ret < 0)
+        return ret;
+
+    std::function<void()> callback;
+    {
+        std::lock_guard<std::mutex> lock(seek_mutex);
+        callback = frame_callback;
+    }
+    publish_frame(stepped, false);
+    callback();
+    /* playback resumes from the frame stepped to; the pipeline is moved
+     * there without showing anything on the way */
+    request_seek(av_rescale_q(stepped->pts, output_time_base, AV_TIME_BASE_Q) - start_time, true);
+    account_memory();
+    return 0;
+}
+
+std::shared_ptr<ScrubProxyJob> FFMPEGManager::BuildScrubProxy(JobQueue &queue, int priority) {
+    /* keyframe-only players are cheap to scrub already */
+    if (input_path.empty() || options.live || options.keyframe_only)
+        return nullptr;
+    std::shared_ptr<ScrubProxyJob> job;
+    {
+        std::lock_guard<std::mutex> lock(scrub_mutex);
+        /* a failed or cancelled build is tried again */
+        ScrubProxyJob::State state = scrub_job? scrub_job->GetState():ScrubProxyJob::State::kFailed;
+        if (state == ScrubProxyJob::State::kFailed || state == ScrubProxyJob::State::kCancelled)
+            scrub_job = std::make_shared<ScrubProxyJob>(input_path);
+        job = scrub_job;
+    }
+    job->Start(queue, priority);
+    return job;
+}
+
+std::shared_ptr<const ScrubProxy> FFMPEGManager::scrub_proxy() {
+    /* the proxy has a picture of its own size, which a crop or a rotation
+     * would make jump about */
+    if (!Filter().empty() || !Region().IsFull())
+        return nullptr;
+    std::lock_guard<std::mutex> lock(scrub_mutex);
+    return scrub_job? scrub_job->Proxy():nullptr;
+}
+
+bool FFMPEGManager::publish_scrub_frame(int64_t position_us) {
+    std::shared_ptr<const ScrubProxy> proxy = scrub_proxy();
+    if (!proxy)
+        return false;
+    int index = proxy->Find(position_us);
+    AVFrame *in = av_frame_alloc();
+    AVFrame *out = av_frame_alloc();
+    int ret = (in && out)? 0:AVERROR(ENOMEM);
+    if (ret >= 0) {
+        proxy->Wrap(index, in);
+        /* Seek may come from several threads; one converter serves them */
+        std::lock_guard<std::mutex> lock(scrub_mutex);
+        if (scrub_width != width || scrub_height != height) {
+            ret = scrub_converter.Init(proxy->Width(), proxy->Height(), ScrubProxy::kFormat,
+                                       AV_TIME_BASE_Q, AVRational{1, 1}, width, height, output_format);
+            scrub_width = (ret >= 0)? width.load():0;
+            scrub_height = (ret >= 0)? height.load():0;
+        }
+        if (ret >= 0)
+            ret = scrub_converter.Convert(in, out);
+    }
+    if (ret >= 0) {
+        /* packed like save_frame's, but never cached: it is not the real frame */
+        auto converted = std::make_shared<VideoFrame>();
+        converted->width = out->width;
+        converted->height = out->height;
+        converted->linesize = av_image_get_linesize((AVPixelFormat)out->format, out->width, 0);
+        converted->pts = av_rescale_q(proxy->Time(index) + start_time, AV_TIME_BASE_Q, output_time_base);
+        converted->time = converted->pts * av_q2d(output_time_base);
+        converted->data.resize(size_t(converted->linesize) * out->height);
+        for (int y = 0; y < out->height; y++) {
+            memcpy(&converted->data[size_t(y) * converted->linesize],
+                   out->data[0] + size_t(y) * out->linesize[0], converted->linesize);
+        }
+        publish_frame(converted, false);
+    }
+    av_frame_free(&in);
+    av_frame_free(&out);
+    return ret >= 0;
+}
+
+int64_t FFMPEGManager::Position() const {
+    std::shared_lock lock(buffer_mutex);
+    return std::max<int64_t>(int64_t(current_time * AV_TIME_BASE) - start_time, 0);
+}
+
+int64_t FFMPEGManager::stream_time(int64_t pts, AVRational time_base) const {
+    if (pts == AV_NOPTS_VALUE)
+        return 0;
+    return av_rescale_q(pts, time_base, AV_TIME_BASE_Q) - start_time;
 }
 
-void FFMPEGManager::frame_sleep(const AVFrame *frame, AVRational time_base) {
-    if (frame->pts != AV_NOPTS_VALUE) {
+void FFMPEGManager::frame_sleep(int64_t pts, AVRational time_base) {
+    if (options.live) {
+        /* the source sets the pace; waiting only adds latency */
+        last_pts = pts;
+        return;
+    }
+    int64_t audio_time;
+    double rate = speed;
+    if (pts != AV_NOPTS_VALUE && rate == 1.0 && audio_stream && audio_stream->Clock(&audio_time)) {
+        /* audio is the master clock: wait for it to reach this frame */
+        int64_t delay = av_rescale_q(pts, time_base, AV_TIME_BASE_Q) - audio_time;
+        if (delay > 0 && delay < AV_TIME_BASE)
+            usleep(delay);
+        last_pts = pts;
+        return;
+    }
+    if (pts != AV_NOPTS_VALUE) {
+        int64_t now = av_gettime_relative();
         if (last_pts != AV_NOPTS_VALUE) {
-            /* sleep roughly the right amount of time;
-             * usleep is in microseconds, just like AV_TIME_BASE. */
-            int64_t delay = av_rescale_q(frame->pts - last_pts,
-                                 time_base, AV_TIME_BASE_Q);
-            if (delay > 0 && delay < 1000000)
-                usleep(delay);
+            /* sleep until the frame is due, less the time already spent
+             * producing it; usleep is in microseconds, just like AV_TIME_BASE.
+             * Other rates scale the wait, and reverse comes with falling pts. */
+            int64_t delay = av_rescale_q(pts - last_pts,
+                                 time_base, AV_TIME_BASE_Q) / rate;
+            /* keyframes can legitimately be several seconds apart */
+            int64_t max_delay = (options.keyframe_only ? 10000000 : 1000000) / fabs(rate);
+            if (delay > 0 && delay < max_delay && last_pts_at + delay > now) {
+                usleep(last_pts_at + delay - now);
+                now = last_pts_at + delay;
+            }
         }
-        last_pts = frame->pts;
+        /* a late frame moves the schedule rather than hurrying the next */
+        last_pts = pts;
+        last_pts_at = now;
     }
 }
 
 void FFMPEGManager::save_frame(const AVFrame *frame, AVRational time_base) {
-    frame_sleep(frame, time_base);
-    int size = frame->linesize[0] * frame->height;
+    auto converted = std::make_shared<VideoFrame>();
+    converted->width = frame->width;
+    converted->height = frame->height;
+    converted->linesize = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, 0);
+    converted->pts = frame->pts;
+    converted->time = (frame->pts == AV_NOPTS_VALUE)? current_time:frame->pts * av_q2d(time_base);
+    converted->region = region;
+
+    /* store rows tightly packed, whatever padding the filter added */
+    converted->data.resize(size_t(converted->linesize) * frame->height);
+    for (int y = 0; y < frame->height; y++) {
+        memcpy(&converted->data[size_t(y) * converted->linesize],
+               frame->data[0] + size_t(y) * frame->linesize[0], converted->linesize);
+    }
+
+    /* live frames are never seen twice */
+    if (frame->pts != AV_NOPTS_VALUE && !options.live) {
+        FrameCache::Shared().Insert(FrameKey{source, frame->pts, width, height}, converted);
+        pass_pts.push_back(frame->pts);
+    }
+    MemoryGovernor::Shared().Reserve(this, "output", converted->Bytes());
+    MemoryGovernor::Shared().Reserve(this, "frameCache", FrameCache::Shared().SourceBytes(source));
+    publish_frame(converted);
+}
+
+void FFMPEGManager::publish_frame(VideoFramePtr converted, bool paced) {
+    if (paced)
+        frame_sleep(converted->pts, output_time_base);
+    /* the taps share the frame being shown; nothing is copied */
+    taps.Offer(converted);
+    output_meter.Add();
+    int64_t unset = 0;
+    first_frame_us.compare_exchange_strong(unset, std::max<int64_t>(av_gettime_relative() - opened_at, 1));
 
     std::unique_lock lock(buffer_mutex);
-    current_time = double(time_base.num) / double(time_base.den) * double(last_pts);
-    free(buffer);
-    buffer = (uint8_t*)malloc(size);
-    memcpy(buffer, std::move(frame->data[0]), size);
+    current_time = converted->time;
+    buffer = std::move(converted);
+}
+
+PipelineStats FFMPEGManager::Stats() const {
+    PipelineStats stats;
+    stats.demux = demux_meter.Stats();
+    stats.decode = decode_meter.Stats();
+    stats.convert = convert_meter.Stats();
+    stats.audio = audio_meter.Stats();
+    stats.packets = packet_queue.Stats();
+    stats.frames = frame_queue.Stats();
+    stats.audio_packets = audio_packet_queue.Stats();
+    stats.latency = latency_meter.Stats();
+    stats.first_frame_us = first_frame_us;
+    stats.speed = speed;
+    stats.output_fps = output_meter.Rate();
+    return stats;
+}
+
+VideoFramePtr FFMPEGManager::Frame() const {
+    std::shared_lock lock(buffer_mutex);
+    return buffer;
 }
 
 int FFMPEGManager::Data(uint8_t *out) const {
-    int size = frame->linesize[0] * frame->height;
     std::shared_lock lock(buffer_mutex);
-    memcpy(out, buffer, size);
-    return size;
+    if (!buffer)
+        return 0;
+    memcpy(out, buffer->data.data(), buffer->Bytes());
+    return buffer->Bytes();
 }
 
 void FFMPEGManager::write_frame_to_file(const AVFrame *frame, AVRational time_base)
 {
-    frame_sleep(frame, time_base);
+    frame_sleep(frame->pts, time_base);
 
     /* Trivial ASCII grayscale display. */
     FILE *f;
@@ -393,5 +2193,13 @@ void FFMPEGManager::write_frame_to_file(const AVFrame *frame, AVRational time_ba
     fclose(f);
 }
 
+// Where the plugin runs players' blocking calls, steps among them, and
+// deletes players. One worker, so the calls run in the order they were
+// handed over and a player is never deleted under one queued before.
+ThreadPool &PlayerPool() {
+    static ThreadPool pool(1);
+    return pool;
+}
+
 #endif
 
@@ -1,6 +1,11 @@
 #ifndef FFMPEG_TEXTURE
 #define FFMPEG_TEXTURE
 
+#include <string.h>
+
+#include <mutex>
+#include <vector>
+
 #include <flutter/texture_registrar.h>
 #include "ffmpeg_manager.cc"
 
@@ -10,33 +15,91 @@ class FFMPEGTexture : public Texture
 {
 private:
     FFMPEGManager* source;
+    // Keeps the frame handed to the engine alive until the next copy.
+    VideoFramePtr current;
+    // The part of the picture shown here. Players shared by several
+    // textures crop to all of their regions at once, and each texture
+    // copies its own out of that.
+    std::mutex region_mutex;
+    FrameRegion region;
+    // Its pixels, and the frame they were copied from.
+    std::vector<uint8_t> cropped;
+    int cropped_width, cropped_height;
+    VideoFramePtr cropped_from;
+    FrameRegion cropped_region;
 public:
     FFMPEGTexture(FFMPEGManager* man);
     virtual ~FFMPEGTexture();
 
     virtual const PixelBuffer* CopyPixelBuffer(size_t width, size_t height);
+    // Called from the platform thread; frames copied from then on show
+    // |value|.
+    void SetRegion(const FrameRegion& value);
+    FrameRegion Region();
 };
 
 FFMPEGTexture::FFMPEGTexture(FFMPEGManager* man)
+    : cropped_width(0), cropped_height(0)
 {
     source = man;
 }
 
 FFMPEGTexture::~FFMPEGTexture()
 {
-    delete source;
+    /* the plugin owns the manager, which may outlive its textures in the
+     * session pool */
     source = NULL;
 }
 
 const PixelBuffer* FFMPEGTexture::CopyPixelBuffer(size_t width, size_t height) {
+    current = source->Frame();
+    if (!current) {
+        return NULL;
+    }
+
+    /* the output size can change under memory pressure, so describe the
+     * frame itself rather than the manager's current settings */
     PixelBuffer* pb = new PixelBuffer();
-    pb->width = source->Width();
-    pb->height = source->Height();
+    FrameRegion shown = Region();
+    if (shown == current->region) {
+        pb->width = current->width;
+        pb->height = current->height;
+        pb->buffer = current->data.data();
+        return pb;
+    }
 
-    uint8_t buf[source->Width() * source->Height() * 4];
-    source->Data(buf);
-    pb->buffer = buf;
+    /* Only the rows and columns of this texture's region are copied. A
+     * frame from before the player took up a new region may not hold all
+     * of it; what it has is shown until the next frame. */
+    if (current != cropped_from || shown != cropped_region) {
+        FrameRegion within = shown.Within(current->region);
+        within.Clamp();
+        int left, top, width, height;
+        within.ToPixels(current->width, current->height, &left, &top, &width, &height);
+        size_t row = size_t(width) * 4;
+        cropped.resize(row * height);
+        for (int y = 0; y < height; y++) {
+            memcpy(&cropped[row * y], &current->data[size_t(top + y) * current->linesize + size_t(left) * 4], row);
+        }
+        cropped_width = width;
+        cropped_height = height;
+        cropped_from = current;
+        cropped_region = shown;
+    }
+    pb->width = cropped_width;
+    pb->height = cropped_height;
+    pb->buffer = cropped.data();
     return pb;
 }
 
+void FFMPEGTexture::SetRegion(const FrameRegion& value) {
+    std::lock_guard<std::mutex> lock(region_mutex);
+    region = value;
+}
+
+FrameRegion FFMPEGTexture::Region() {
+    std::lock_guard<std::mutex> lock(region_mutex);
+    return region;
+}
+
 #endif
\ No newline at end of file
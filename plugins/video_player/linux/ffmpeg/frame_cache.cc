@@ -0,0 +1,259 @@
+#ifndef FFMPEG_FRAME_CACHE
+#define FFMPEG_FRAME_CACHE
+
+#include <stdint.h>
+
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "frame_region.cc"
+
+// A frame after conversion to the output format. Frames are immutable once
+// published, so the presenting player, the cache and any reader can share
+// one copy.
+struct VideoFrame
+{
+    std::vector<uint8_t> data;
+    int width = 0;
+    int height = 0;
+    int linesize = 0;
+    // Presentation time in the time base of the output, and in seconds.
+    int64_t pts = 0;
+    double time = 0.0;
+    // The part of the source picture it shows.
+    FrameRegion region;
+
+    size_t Bytes() const { return data.size(); }
+};
+
+typedef std::shared_ptr<const VideoFrame> VideoFramePtr;
+
+struct FrameKey
+{
+    std::string source;
+    int64_t pts;
+    int width;
+    int height;
+
+    bool operator==(const FrameKey &other) const {
+        return pts == other.pts && width == other.width &&
+               height == other.height && source == other.source;
+    }
+};
+
+struct FrameKeyHash
+{
+    size_t operator()(const FrameKey &key) const {
+        size_t hash = std::hash<std::string>()(key.source);
+        hash ^= std::hash<int64_t>()(key.pts) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        hash ^= std::hash<int64_t>()((int64_t(key.width) << 32) | uint32_t(key.height)) +
+                0x9e3779b9 + (hash << 6) + (hash >> 2);
+        return hash;
+    }
+};
+
+struct FrameCacheStats
+{
+    size_t limit_bytes = 0;
+    size_t used_bytes = 0;
+    size_t frames = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Memory-bounded LRU of converted frames, shared by every player in the
+// plugin so that players of the same source reuse each other's work.
+class FrameCache
+{
+private:
+    typedef std::pair<FrameKey, VideoFramePtr> Entry;
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<FrameKey, std::list<Entry>::iterator, FrameKeyHash> index;
+    std::unordered_map<std::string, size_t> bytes_by_source;
+    /* resident pts per source and size, for nearest-frame lookups */
+    std::map<std::tuple<std::string, int, int>, std::set<int64_t>> pts_by_stream;
+    FrameCacheStats stats;
+
+    void evict_to(size_t bytes);
+    void remove(std::list<Entry>::iterator entry);
+
+public:
+    static constexpr size_t kDefaultLimit = 256 << 20;
+
+    explicit FrameCache(size_t limit_bytes = kDefaultLimit);
+
+    static FrameCache &Shared();
+
+    void SetLimit(size_t bytes);
+    // Evicts least recently used frames until at most |bytes| are held.
+    void Trim(size_t bytes);
+    void Insert(const FrameKey &key, VideoFramePtr frame);
+    VideoFramePtr Find(const FrameKey &key);
+    // Returns the resident frame with the largest pts not after |key.pts|,
+    // provided it is at most |max_distance| earlier.
+    VideoFramePtr FindNearest(const FrameKey &key, int64_t max_distance);
+    // Drops every frame of |source|, whatever its size.
+    void EvictSource(const std::string &source);
+    size_t SourceBytes(const std::string &source) const;
+    // Looks up every pts of |source| at once. Returns false, and leaves
+    // |frames| empty, unless all of them are resident.
+    bool FindAll(const std::string &source, const std::vector<int64_t> &pts,
+                 int width, int height, std::vector<VideoFramePtr> *frames);
+    FrameCacheStats Stats() const;
+};
+
+FrameCache::FrameCache(size_t limit_bytes)
+{
+    stats.limit_bytes = limit_bytes;
+}
+
+FrameCache &FrameCache::Shared() {
+    static FrameCache cache;
+    return cache;
+}
+
+void FrameCache::remove(std::list<Entry>::iterator entry) {
+    size_t bytes = entry->second->Bytes();
+    stats.used_bytes -= bytes;
+    auto source = bytes_by_source.find(entry->first.source);
+    if ((source->second -= bytes) == 0)
+        bytes_by_source.erase(source);
+    auto stream = pts_by_stream.find(
+        std::make_tuple(entry->first.source, entry->first.width, entry->first.height));
+    stream->second.erase(entry->first.pts);
+    if (stream->second.empty())
+        pts_by_stream.erase(stream);
+    index.erase(entry->first);
+    lru.erase(entry);
+}
+
+void FrameCache::evict_to(size_t bytes) {
+    while (stats.used_bytes > bytes && !lru.empty()) {
+        stats.evictions++;
+        remove(std::prev(lru.end()));
+    }
+}
+
+void FrameCache::SetLimit(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.limit_bytes = bytes;
+    evict_to(bytes);
+}
+
+void FrameCache::Trim(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    evict_to(bytes);
+}
+
+void FrameCache::Insert(const FrameKey &key, VideoFramePtr frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!frame || frame->Bytes() > stats.limit_bytes)
+        return;
+
+    auto it = index.find(key);
+    if (it != index.end())
+        remove(it->second);
+    lru.emplace_front(key, frame);
+    index[key] = lru.begin();
+    stats.used_bytes += frame->Bytes();
+    bytes_by_source[key.source] += frame->Bytes();
+    pts_by_stream[std::make_tuple(key.source, key.width, key.height)].insert(key.pts);
+    evict_to(stats.limit_bytes);
+}
+
+VideoFramePtr FrameCache::Find(const FrameKey &key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        stats.misses++;
+        return NULL;
+    }
+    stats.hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+VideoFramePtr FrameCache::FindNearest(const FrameKey &key, int64_t max_distance) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto stream = pts_by_stream.find(std::make_tuple(key.source, key.width, key.height));
+    if (stream == pts_by_stream.end()) {
+        stats.misses++;
+        return NULL;
+    }
+    auto after = stream->second.upper_bound(key.pts);
+    if (after == stream->second.begin() || key.pts - *std::prev(after) > max_distance) {
+        stats.misses++;
+        return NULL;
+    }
+
+    FrameKey found{key.source, *std::prev(after), key.width, key.height};
+    auto it = index.find(found);
+    stats.hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void FrameCache::EvictSource(const std::string &source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = lru.begin(); it != lru.end();) {
+        auto next = std::next(it);
+        if (it->first.source == source) {
+            stats.evictions++;
+            remove(it);
+        }
+        it = next;
+    }
+}
+
+size_t FrameCache::SourceBytes(const std::string &source) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = bytes_by_source.find(source);
+    return (it == bytes_by_source.end())? 0:it->second;
+}
+
+bool FrameCache::FindAll(const std::string &source, const std::vector<int64_t> &pts,
+                         int width, int height, std::vector<VideoFramePtr> *frames) {
+    std::lock_guard<std::mutex> lock(mutex);
+    frames->clear();
+    std::vector<std::list<Entry>::iterator> found;
+    found.reserve(pts.size());
+    FrameKey key{source, 0, width, height};
+    for (int64_t p : pts) {
+        key.pts = p;
+        auto it = index.find(key);
+        if (it == index.end()) {
+            stats.misses++;
+            return false;
+        }
+        found.push_back(it->second);
+    }
+
+    stats.hits += found.size();
+    frames->reserve(found.size());
+    for (auto &entry : found) {
+        lru.splice(lru.begin(), lru, entry);
+        frames->push_back(entry->second);
+    }
+    return true;
+}
+
+FrameCacheStats FrameCache::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    FrameCacheStats current = stats;
+    current.frames = lru.size();
+    return current;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef FFMPEG_FRAME_CONVERTER
+#define FFMPEG_FRAME_CONVERTER
+
+#include <stdio.h>
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+}
+
+#include <memory>
+#include <string>
+
+#include "hdr_converter.cc"
+
+// Scales and converts frames one at a time through a private filter graph,
+// for work outside a player's own graph. Single-threaded, since callers run
+// one converter per worker.
+class FrameConverter
+{
+private:
+    AVFilterGraph *graph;
+    AVFilterContext *source;
+    AVFilterContext *sink;
+    /* 10-bit frames go through here first, on the calling thread */
+    std::unique_ptr<HdrConverter> hdr;
+    AVPixelFormat hdr_format;
+    bool halve;
+    AVFrame *staged;
+
+public:
+    FrameConverter() : graph(NULL), source(NULL), sink(NULL), hdr_format(AV_PIX_FMT_NONE), halve(false),
+                       staged(NULL) {}
+    ~FrameConverter() { avfilter_graph_free(&graph); av_frame_free(&staged); }
+
+    // Frames come in as |width|x|height| |format| and go out as
+    // |out_width|x|out_height| |out_format|. A size of zero or a format of
+    // AV_PIX_FMT_NONE keeps the input's. 10-bit frames are tone mapped as
+    // |tone_map| says. |filters|, a filter graph description, run ahead of
+    // the scaling; they must give a frame back for every frame in.
+    int Init(int width, int height, AVPixelFormat format, AVRational time_base,
+             AVRational aspect, int out_width, int out_height, AVPixelFormat out_format,
+             const ToneMapOptions &tone_map = ToneMapOptions(),
+             const std::string &filters = std::string());
+    // Replaces |out| with the converted |in|, which is left untouched.
+    int Convert(AVFrame *in, AVFrame *out);
+};
+
+int FrameConverter::Init(int width, int height, AVPixelFormat format, AVRational time_base,
+                         AVRational aspect, int out_width, int out_height,
+                         AVPixelFormat out_format, const ToneMapOptions &tone_map,
+                         const std::string &filters) {
+    char args[256], scale[64];
+    std::string description;
+    enum AVPixelFormat pix_fmts[] = { out_format, AV_PIX_FMT_NONE };
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    int ret;
+
+    hdr.reset();
+    if (tone_map.curve != ToneMapCurve::kOff && HdrConverter::Supports(format, out_format)) {
+        /* the graph is left to scale what the converter makes */
+        hdr.reset(new HdrConverter(tone_map, NULL));
+        halve = out_width > 0 && out_height > 0 && out_width * 2 <= width && out_height * 2 <= height;
+        if (halve) {
+            width /= 2;
+            height /= 2;
+        }
+        format = hdr_format = out_format;
+        if (!staged && !(staged = av_frame_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+
+    avfilter_graph_free(&graph);
+    graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !graph) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    graph->nb_threads = 1;
+
+    snprintf(args, sizeof(args),
+             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             width, height, format, time_base.num, time_base.den,
+             aspect.num? aspect.num:1, aspect.den? aspect.den:1);
+    if ((ret = avfilter_graph_create_filter(&source, avfilter_get_by_name("buffer"), "in",
+                                            args, NULL, graph)) < 0)
+        goto end;
+    if ((ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out",
+                                            NULL, NULL, graph)) < 0)
+        goto end;
+    if (out_format != AV_PIX_FMT_NONE &&
+        (ret = av_opt_set_int_list(sink, "pix_fmts", pix_fmts,
+                                   AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
+        goto end;
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = source;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = sink;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    snprintf(scale, sizeof(scale), "scale=%d:%d",
+             out_width > 0? out_width:width, out_height > 0? out_height:height);
+    description = filters.empty()? scale:filters + "," + scale;
+    if ((ret = avfilter_graph_parse_ptr(graph, description.c_str(), &inputs, &outputs, NULL)) < 0)
+        goto end;
+    ret = avfilter_graph_config(graph, NULL);
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+int FrameConverter::Convert(AVFrame *in, AVFrame *out) {
+    av_frame_unref(out);
+    int ret;
+    if (hdr) {
+        if ((ret = hdr->Convert(in, staged, hdr_format, halve)) < 0)
+            return ret;
+        in = staged;
+    }
+    ret = av_buffersrc_add_frame_flags(source, in, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (ret < 0)
+        return ret;
+    /* scaling is one frame in, one frame out */
+    return av_buffersink_get_frame(sink, out);
+}
+
+#endif
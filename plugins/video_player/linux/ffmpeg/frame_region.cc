@@ -0,0 +1,79 @@
+#ifndef FFMPEG_FRAME_REGION
+#define FFMPEG_FRAME_REGION
+
+#include <math.h>
+
+#include <algorithm>
+
+// A part of the picture, in fractions of its width and height.
+struct FrameRegion
+{
+    double x = 0, y = 0;
+    double width = 1, height = 1;
+
+    bool IsFull() const { return x <= 0 && y <= 0 && x + width >= 1 && y + height >= 1; }
+    bool operator==(const FrameRegion &other) const {
+        return x == other.x && y == other.y && width == other.width && height == other.height;
+    }
+    bool operator!=(const FrameRegion &other) const { return !(*this == other); }
+    // Cut down to the picture; false if nothing of it is left.
+    bool Clamp();
+    // The smallest region holding both.
+    FrameRegion Union(const FrameRegion &other) const;
+    // This region as a part of |outer|, which holds it.
+    FrameRegion Within(const FrameRegion &outer) const;
+    // In pixels of a |frame_width|x|frame_height| picture, at least 2x2 and
+    // on even coordinates, so that subsampled chroma stays lined up.
+    void ToPixels(int frame_width, int frame_height, int *left, int *top, int *pixel_width,
+                  int *pixel_height) const;
+};
+
+bool FrameRegion::Clamp() {
+    /* a NaN or an infinity would reach the pixel conversion intact */
+    if (!isfinite(x) || !isfinite(y) || !isfinite(width) || !isfinite(height))
+        return false;
+    /* a region inside the picture is left exactly as it is */
+    if (x < 0) {
+        width += x;
+        x = 0;
+    }
+    if (y < 0) {
+        height += y;
+        y = 0;
+    }
+    if (x + width > 1)
+        width = 1 - x;
+    if (y + height > 1)
+        height = 1 - y;
+    return width > 0 && height > 0;
+}
+
+FrameRegion FrameRegion::Union(const FrameRegion &other) const {
+    FrameRegion out;
+    out.x = std::min(x, other.x);
+    out.y = std::min(y, other.y);
+    out.width = std::max(x + width, other.x + other.width) - out.x;
+    out.height = std::max(y + height, other.y + other.height) - out.y;
+    return out;
+}
+
+FrameRegion FrameRegion::Within(const FrameRegion &outer) const {
+    FrameRegion out;
+    out.x = (x - outer.x) / outer.width;
+    out.y = (y - outer.y) / outer.height;
+    out.width = width / outer.width;
+    out.height = height / outer.height;
+    return out;
+}
+
+void FrameRegion::ToPixels(int frame_width, int frame_height, int *left, int *top, int *pixel_width,
+                           int *pixel_height) const {
+    *left = std::min(int(x * frame_width), frame_width - 2) & ~1;
+    *top = std::min(int(y * frame_height), frame_height - 2) & ~1;
+    int right = std::min(int(ceil((x + width) * frame_width)), frame_width);
+    int bottom = std::min(int(ceil((y + height) * frame_height)), frame_height);
+    *pixel_width = std::max(std::min((right - *left + 1) & ~1, frame_width - *left), 2);
+    *pixel_height = std::max(std::min((bottom - *top + 1) & ~1, frame_height - *top), 2);
+}
+
+#endif
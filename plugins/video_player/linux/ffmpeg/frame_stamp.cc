@@ -0,0 +1,36 @@
+#ifndef FFMPEG_FRAME_STAMP
+#define FFMPEG_FRAME_STAMP
+
+#include <stdint.h>
+
+// A capture timestamp carried in the picture itself, so that latency can be
+// measured end to end through any container and pipe. The first 64 luma
+// samples of the top row hold the monotonic clock in microseconds, most
+// significant bit first; a bright sample is a one and a dark one a zero.
+static const int kFrameStampBits = 64;
+static const uint8_t kFrameStampDark = 16;
+static const uint8_t kFrameStampBright = 235;
+
+void WriteFrameStamp(uint8_t *luma, int64_t stamp) {
+    for (int bit = 0; bit < kFrameStampBits; bit++) {
+        bool set = (uint64_t(stamp) >> (kFrameStampBits - 1 - bit)) & 1;
+        luma[bit] = set? kFrameStampBright:kFrameStampDark;
+    }
+}
+
+// Returns false unless every sample is clearly dark or bright, which
+// ordinary pictures almost never are.
+bool ReadFrameStamp(const uint8_t *luma, int width, int64_t *stamp) {
+    if (width < kFrameStampBits)
+        return false;
+    uint64_t value = 0;
+    for (int bit = 0; bit < kFrameStampBits; bit++) {
+        if (luma[bit] > 64 && luma[bit] < 192)
+            return false;
+        value = (value << 1) | (luma[bit] >= 192);
+    }
+    *stamp = int64_t(value);
+    return true;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef FFMPEG_FRAME_TAP
+#define FFMPEG_FRAME_TAP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "frame_cache.cc"
+
+struct FrameTapStats
+{
+    uint64_t delivered = 0;
+    // Frames replaced by a newer one before the tap got to them.
+    uint64_t dropped = 0;
+};
+
+typedef std::function<void(const VideoFramePtr &frame)> FrameTapCallback;
+
+// Lends published frames to one consumer on a thread of its own. The frame
+// is the player's own immutable VideoFrame, shared rather than copied. At
+// most one frame waits for the consumer: a newer one takes its place, so a
+// slow tap sees fewer frames but never holds up presentation.
+class FrameTap
+{
+private:
+    FrameTapCallback callback;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    VideoFramePtr pending;
+    bool closing;
+    FrameTapStats stats;
+    std::thread thread;
+
+    void run();
+
+public:
+    explicit FrameTap(FrameTapCallback callback);
+    // Waits for a callback in progress to return.
+    ~FrameTap();
+
+    // Never blocks on the consumer.
+    void Offer(const VideoFramePtr &frame);
+    FrameTapStats Stats() const;
+};
+
+FrameTap::FrameTap(FrameTapCallback callback)
+    : callback(std::move(callback)), closing(false)
+{
+    thread = std::thread(&FrameTap::run, this);
+}
+
+FrameTap::~FrameTap()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void FrameTap::Offer(const VideoFramePtr &frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending)
+            stats.dropped++;
+        pending = frame;
+    }
+    cv.notify_one();
+}
+
+FrameTapStats FrameTap::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void FrameTap::run() {
+    while (true) {
+        VideoFramePtr frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return closing || pending; });
+            if (closing)
+                return;
+            frame = std::move(pending);
+            pending.reset();
+            stats.delivered++;
+        }
+        callback(frame);
+    }
+}
+
+// The frame taps of one player.
+class FrameTapSet
+{
+private:
+    mutable std::mutex mutex;
+    std::map<int64_t, std::unique_ptr<FrameTap>> taps;
+    /* lets a player without taps skip the lock */
+    std::atomic<size_t> count;
+
+public:
+    FrameTapSet() : count(0) {}
+
+    // Returns an id, unique across every player, for Remove.
+    int64_t Add(FrameTapCallback callback);
+    // Waits for the tap's callback to return, so must not be called from
+    // that callback.
+    bool Remove(int64_t id);
+    void Offer(const VideoFramePtr &frame);
+    bool Stats(int64_t id, FrameTapStats *stats) const;
+};
+
+int64_t FrameTapSet::Add(FrameTapCallback callback) {
+    static std::atomic<int64_t> next_id(1);
+    int64_t id = next_id++;
+    std::lock_guard<std::mutex> lock(mutex);
+    taps[id].reset(new FrameTap(std::move(callback)));
+    count = taps.size();
+    return id;
+}
+
+bool FrameTapSet::Remove(int64_t id) {
+    std::unique_ptr<FrameTap> removed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = taps.find(id);
+        if (it == taps.end())
+            return false;
+        removed = std::move(it->second);
+        taps.erase(it);
+        count = taps.size();
+    }
+    /* joined outside the lock, so presentation carries on meanwhile */
+    removed.reset();
+    return true;
+}
+
+void FrameTapSet::Offer(const VideoFramePtr &frame) {
+    if (count == 0)
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : taps) {
+        entry.second->Offer(frame);
+    }
+}
+
+bool FrameTapSet::Stats(int64_t id, FrameTapStats *stats) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = taps.find(id);
+    if (it == taps.end())
+        return false;
+    *stats = it->second->Stats();
+    return true;
+}
+
+#endif
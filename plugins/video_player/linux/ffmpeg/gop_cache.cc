@@ -0,0 +1,368 @@
+#ifndef FFMPEG_GOP_CACHE
+#define FFMPEG_GOP_CACHE
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "frame_cache.cc"
+#include "frame_converter.cc"
+#include "thread_pool.cc"
+
+// Whole GOPs of a file, decoded and converted for display, for stepping one
+// frame at a time in either direction. A step within a GOP already decoded
+// costs a lookup; a step across its edge decodes the neighbouring GOP once,
+// from its keyframe, with a demuxer and decoder of the cache's own, unless a
+// prefetch got there first, as it does in reverse playback. GOPs far from
+// the last step are dropped once they hold more than |limit_bytes|.
+class GopCache : public std::enable_shared_from_this<GopCache>
+{
+private:
+    struct Gop
+    {
+        /* the next GOP's keyframe, or INT64_MAX for the last */
+        int64_t end_pts;
+        /* in presentation order, the keyframe first; |pts| in the stream's
+         * time base, the frames' own in the output's */
+        std::vector<int64_t> pts;
+        std::vector<VideoFramePtr> frames;
+        size_t bytes;
+    };
+
+    std::string path;
+    int width, height;
+    AVPixelFormat format;
+    /* the time base of the pts going in and out */
+    AVRational out_time_base;
+    ToneMapOptions tone_map;
+    std::string filters;
+    FrameRegion region;
+    size_t limit_bytes;
+
+    /* the demuxer and decoder serve one load at a time */
+    std::mutex decode_mutex;
+    AVFormatContext *fmt;
+    AVCodecContext *dec;
+    AVPacket *packet;
+    AVFrame *decoded;
+    AVFrame *converted;
+    int stream;
+    AVRational time_base;
+    FrameConverter converter;
+    /* whatever open() returned; the decoder is never used after a failure */
+    int open_ret;
+
+    /* by the pts of their keyframes, in the stream's time base */
+    mutable std::mutex mutex;
+    std::map<int64_t, Gop> gops;
+    size_t bytes;
+    std::atomic<bool> prefetching;
+
+    int open();
+    bool contains(int64_t pts);
+    std::map<int64_t, Gop>::iterator find(int64_t pts);
+    bool insert(int64_t key_pts, Gop &gop, int64_t pts);
+    int load(int64_t pts);
+    VideoFramePtr pack(const AVFrame *frame, int64_t pts) const;
+    void trim(int64_t pts);
+    void prefetch(int64_t pts, int direction);
+
+public:
+    static const size_t kDefaultBytes = 192 << 20;
+
+    // Frames go through |filters| ahead of the scaling, which leave
+    // |region| of the picture.
+    GopCache(const std::string &path, int width, int height, AVPixelFormat format,
+             AVRational out_time_base, const ToneMapOptions &tone_map = ToneMapOptions(),
+             const std::string &filters = std::string(), const FrameRegion &region = FrameRegion(),
+             size_t limit_bytes = kDefaultBytes);
+    ~GopCache();
+
+    // The frame just after (|direction| > 0) or just before the one at
+    // |pts|. AVERROR_EOF past either end of the stream. One thread at a
+    // time.
+    int Step(int64_t pts, int direction, VideoFramePtr *out);
+    // Decodes the GOP next to the one holding |pts| in |direction| on
+    // |pool|, so that stepping across the edge costs nothing. Does nothing
+    // while an earlier prefetch is still under way.
+    void Prefetch(ThreadPool &pool, int64_t pts, int direction);
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+    const std::string &Filters() const { return filters; }
+    size_t Bytes() const;
+};
+
+GopCache::GopCache(const std::string &path, int width, int height, AVPixelFormat format,
+                   AVRational out_time_base, const ToneMapOptions &tone_map, const std::string &filters,
+                   const FrameRegion &region, size_t limit_bytes)
+    : path(path), width(width), height(height), format(format), out_time_base(out_time_base),
+      tone_map(tone_map), filters(filters), region(region), limit_bytes(limit_bytes), fmt(NULL), dec(NULL), packet(NULL), decoded(NULL), converted(NULL),
+      stream(-1), time_base(AVRational{1, AV_TIME_BASE}), bytes(0), prefetching(false)
+{
+    open_ret = open();
+}
+
+GopCache::~GopCache()
+{
+    av_frame_free(&converted);
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+}
+
+int GopCache::open() {
+    AVCodec *codec;
+    int ret = avformat_open_input(&fmt, path.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(fmt, NULL)) < 0)
+        return ret;
+    if ((stream = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+        return stream;
+    for (unsigned i = 0; i < fmt->nb_streams; i++) {
+        if (int(i) != stream)
+            fmt->streams[i]->discard = AVDISCARD_ALL;
+    }
+    time_base = fmt->streams[stream]->time_base;
+    if (!(dec = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(dec, fmt->streams[stream]->codecpar);
+    /* a GOP is decoded while the user waits */
+    dec->thread_count = 0;
+    if ((ret = avcodec_open2(dec, codec, NULL)) < 0)
+        return ret;
+    if (!(packet = av_packet_alloc()) || !(decoded = av_frame_alloc()) || !(converted = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    return converter.Init(dec->width, dec->height, dec->pix_fmt, time_base, dec->sample_aspect_ratio,
+                          width, height, format, tone_map, filters);
+}
+
+bool GopCache::contains(int64_t pts) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return find(pts) != gops.end();
+}
+
+std::map<int64_t, GopCache::Gop>::iterator GopCache::find(int64_t pts) {
+    auto it = gops.upper_bound(pts);
+    if (it == gops.begin())
+        return gops.end();
+    --it;
+    return (pts < it->second.end_pts)? it:gops.end();
+}
+
+VideoFramePtr GopCache::pack(const AVFrame *frame, int64_t pts) const {
+    /* packed like the player's own frames */
+    auto packed = std::make_shared<VideoFrame>();
+    packed->width = frame->width;
+    packed->height = frame->height;
+    packed->linesize = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, 0);
+    packed->pts = av_rescale_q(pts, time_base, out_time_base);
+    packed->time = pts * av_q2d(time_base);
+    packed->region = region;
+    packed->data.resize(size_t(packed->linesize) * frame->height);
+    for (int y = 0; y < frame->height; y++) {
+        memcpy(&packed->data[size_t(y) * packed->linesize],
+               frame->data[0] + size_t(y) * frame->linesize[0], packed->linesize);
+    }
+    return packed;
+}
+
+bool GopCache::insert(int64_t key_pts, Gop &gop, int64_t pts) {
+    std::lock_guard<std::mutex> lock(mutex);
+    /* one decoded already, by a step or a prefetch, is kept as it is */
+    if (gops.find(key_pts) == gops.end()) {
+        bytes += gop.bytes;
+        gops.emplace(key_pts, std::move(gop));
+    }
+    gop = Gop{ INT64_MAX, {}, {}, 0 };
+    return find(pts) != gops.end();
+}
+
+int GopCache::load(int64_t pts) {
+    std::lock_guard<std::mutex> decode_lock(decode_mutex);
+    /* loaded while waiting for the decoder */
+    if (contains(pts))
+        return 0;
+    int ret = open_ret;
+    if (ret < 0)
+        return ret;
+    if ((ret = av_seek_frame(fmt, stream, pts, AVSEEK_FLAG_BACKWARD)) < 0)
+        return ret;
+    avcodec_flush_buffers(dec);
+
+    /* The seek lands on the keyframe that starts the GOP holding |pts|, or
+     * on one before it; every GOP decoded on the way is kept, since the
+     * next steps back will want them. */
+    Gop gop = { INT64_MAX, {}, {}, 0 };
+    int64_t key_pts = AV_NOPTS_VALUE;
+    bool started = false, draining = false, found = false;
+    while (!found) {
+        if (!draining) {
+            ret = av_read_frame(fmt, packet);
+            if (ret == AVERROR_EOF) {
+                draining = true;
+                avcodec_send_packet(dec, NULL);
+            } else if (ret < 0) {
+                return ret;
+            } else {
+                if (packet->stream_index == stream)
+                    avcodec_send_packet(dec, packet);
+                av_packet_unref(packet);
+            }
+        }
+
+        while ((ret = avcodec_receive_frame(dec, decoded)) >= 0) {
+            int64_t frame_pts = decoded->best_effort_timestamp;
+            bool key = decoded->key_frame && frame_pts != AV_NOPTS_VALUE;
+            /* a frame without a timestamp of its own cannot be stepped to,
+             * and the leading frames of an open GOP belong to the one before */
+            if (frame_pts == AV_NOPTS_VALUE || (key_pts == AV_NOPTS_VALUE && !key) ||
+                (!gop.pts.empty() && frame_pts <= gop.pts.back())) {
+                av_frame_unref(decoded);
+                continue;
+            }
+            if (key && key_pts != AV_NOPTS_VALUE) {
+                /* the GOP before this keyframe is complete */
+                gop.end_pts = frame_pts;
+                found = insert(key_pts, gop, pts);
+                key_pts = AV_NOPTS_VALUE;
+                if (found) {
+                    av_frame_unref(decoded);
+                    break;
+                }
+            }
+            if (key_pts == AV_NOPTS_VALUE) {
+                /* nothing in the stream comes at or before |pts| */
+                if (!started && frame_pts > pts) {
+                    av_frame_unref(decoded);
+                    return AVERROR_EOF;
+                }
+                started = true;
+                key_pts = frame_pts;
+            }
+            ret = converter.Convert(decoded, converted);
+            av_frame_unref(decoded);
+            if (ret < 0)
+                return ret;
+            VideoFramePtr packed = pack(converted, frame_pts);
+            av_frame_unref(converted);
+            gop.bytes += packed->Bytes();
+            gop.pts.push_back(frame_pts);
+            gop.frames.push_back(packed);
+        }
+        if (ret == AVERROR_EOF && !found) {
+            /* the last GOP runs to the end of the stream */
+            if (key_pts == AV_NOPTS_VALUE || !insert(key_pts, gop, pts))
+                return AVERROR_EOF;
+            found = true;
+        } else if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void GopCache::trim(int64_t pts) {
+    /* the farthest first, never the GOP being stepped through */
+    while (bytes > limit_bytes && gops.size() > 1) {
+        auto first = gops.begin(), last = std::prev(gops.end());
+        bool drop_first = pts - first->first > last->first - pts;
+        auto victim = drop_first? first:last;
+        if (pts >= victim->first && pts < victim->second.end_pts)
+            break;
+        bytes -= victim->second.bytes;
+        gops.erase(victim);
+    }
+}
+
+int GopCache::Step(int64_t out_pts, int direction, VideoFramePtr *out) {
+    if (open_ret < 0)
+        return open_ret;
+    /* the decoder is left alone while the GOP is at hand, even if a
+     * prefetch has it busy */
+    int64_t pts = av_rescale_q(out_pts, out_time_base, time_base);
+    int ret;
+    if (!contains(pts) && (ret = load(pts)) < 0)
+        return ret;
+
+    int64_t edge;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = find(pts);
+        if (it == gops.end())
+            return AVERROR(EAGAIN);
+        /* |pts| may fall between two frames; it then counts as the one before */
+        const std::vector<int64_t> &times = it->second.pts;
+        size_t index = std::upper_bound(times.begin(), times.end(), pts) - times.begin();
+        index = (index > 0)? index - 1:0;
+        if (direction > 0 && index + 1 < times.size()) {
+            *out = it->second.frames[index + 1];
+            trim(times[index + 1]);
+            return 0;
+        } else if (direction <= 0 && index > 0) {
+            *out = it->second.frames[index - 1];
+            trim(times[index - 1]);
+            return 0;
+        }
+        if (direction > 0 && it->second.end_pts == INT64_MAX)
+            return AVERROR_EOF;
+        edge = (direction > 0)? it->second.end_pts:it->first - 1;
+    }
+
+    /* across the edge of the GOP; AVERROR_EOF from the first keyframe */
+    if (!contains(edge) && (ret = load(edge)) < 0)
+        return ret;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = find(edge);
+    if (it == gops.end())
+        return AVERROR(EAGAIN);
+    int64_t next_pts = (direction > 0)? it->second.pts.front():it->second.pts.back();
+    *out = (direction > 0)? it->second.frames.front():it->second.frames.back();
+    trim(next_pts);
+    return 0;
+}
+
+void GopCache::Prefetch(ThreadPool &pool, int64_t pts, int direction) {
+    if (open_ret < 0 || prefetching.exchange(true))
+        return;
+    /* the cache lives until the prefetch is done with it */
+    std::shared_ptr<GopCache> self = shared_from_this();
+    pool.Submit([self, pts, direction]() {
+        self->prefetch(pts, direction);
+        self->prefetching = false;
+    });
+}
+
+void GopCache::prefetch(int64_t out_pts, int direction) {
+    int64_t pts = av_rescale_q(out_pts, out_time_base, time_base), edge;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = find(pts);
+        if (it == gops.end() || (direction > 0 && it->second.end_pts == INT64_MAX))
+            return;
+        edge = (direction > 0)? it->second.end_pts:it->first - 1;
+    }
+    load(edge);
+}
+
+size_t GopCache::Bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
+
+#endif
@@ -0,0 +1,603 @@
+#ifndef FFMPEG_HDR_CONVERTER
+#define FFMPEG_HDR_CONVERTER
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+/* vsqrtq_f32 is AArch64's; 32-bit ARM takes the plain loops */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/mastering_display_metadata.h>
+}
+
+#include "thread_pool.cc"
+
+enum class ToneMapCurve
+{
+    // No path of its own: 10-bit sources go through the scale filter.
+    kOff,
+    // Whatever is brighter than the output's white is cut off.
+    kClip,
+    kReinhard,
+    kHable,
+};
+
+struct ToneMapOptions
+{
+    ToneMapCurve curve = ToneMapCurve::kHable;
+    // How bright the source gets, in nits. 0 takes the content light level
+    // or mastering display the stream carries, or else kDefaultPeak.
+    double peak_nits = 0;
+    // What the output's white stands for, in nits.
+    double white_nits = 100;
+
+    bool operator==(const ToneMapOptions &other) const {
+        return curve == other.curve && peak_nits == other.peak_nits && white_nits == other.white_nits;
+    }
+    bool operator!=(const ToneMapOptions &other) const { return !(*this == other); }
+};
+
+// Everything a row needs to go from 10-bit Y'CbCr to 8-bit RGB, built once
+// per source from its colour properties and peak.
+struct ToneMapTables
+{
+    static const int kSize = 4096;
+
+    /* Y'CbCr to R'G'B', on samples in 10-bit code values */
+    float y_offset, y_scale, c_offset, c_scale;
+    float cr_r, cb_g, cr_g, cb_b;
+    /* linear source primaries to BT.709, row major */
+    float gamut[9];
+    /* R'G'B' to linear light, 1 being the output's white */
+    float eotf[kSize];
+    /* output over input for the brightest channel, indexed by it times
+     * tone_scale */
+    float tone[kSize];
+    float tone_scale;
+    /* linear to 8 bits, indexed by the square root of the linear value so
+     * that the shadows get most of the entries */
+    uint8_t oetf[kSize];
+    /* SDR in BT.709 primaries skips the linear stages altogether */
+    bool direct;
+    uint8_t direct_out[kSize];
+};
+
+// A row of 10-bit 4:2:0 samples, as P010 or YUV420P10 lay them out, and
+// how many output pixels to make of it.
+struct HdrRowSource
+{
+    const uint16_t *y0;
+    // The luma row below, averaged in when halving.
+    const uint16_t *y1;
+    const uint16_t *u, *v;
+    // Between neighbouring chroma samples: 2 when interleaved.
+    int chroma_step;
+    // P010 keeps its 10 bits at the top.
+    int shift;
+    int width;
+    bool halve;
+};
+
+static double pq_to_nits(double e) {
+    const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+    const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+    double p = pow(e, 1 / m2);
+    return 10000 * pow(std::max(p - c1, 0.0) / (c2 - c3 * p), 1 / m1);
+}
+
+static double hlg_to_scene(double e) {
+    const double a = 0.17883277, b = 1 - 4 * a, c = 0.5 - a * log(4 * a);
+    return (e <= 0.5)? e * e / 3:(exp((e - c) / a) + b) / 12;
+}
+
+static double hable(double x) {
+    const double a = 0.15, b = 0.50, c = 0.10, d = 0.20, e = 0.02, f = 0.30;
+    return (x * (a * x + c * b) + d * e) / (x * (a * x + b) + d * f) - e / f;
+}
+
+// Fills |t| for frames like |frame|, whose brightest is |peak_nits|.
+void BuildToneMapTables(const AVFrame *frame, const ToneMapOptions &options, double peak_nits,
+                        ToneMapTables *t) {
+    const int last = ToneMapTables::kSize - 1;
+    bool pq = frame->color_trc == AVCOL_TRC_SMPTE2084;
+    bool hlg = frame->color_trc == AVCOL_TRC_ARIB_STD_B67;
+    /* HDR with its primaries unstated is BT.2020 in practice */
+    bool wide = frame->color_primaries == AVCOL_PRI_BT2020 ||
+        (frame->color_primaries == AVCOL_PRI_UNSPECIFIED && (pq || hlg));
+
+    if (frame->color_range == AVCOL_RANGE_JPEG) {
+        t->y_offset = 0;
+        t->y_scale = 1.0f / 1023;
+        t->c_scale = 1.0f / 1023;
+    } else {
+        t->y_offset = 64;
+        t->y_scale = 1.0f / 876;
+        t->c_scale = 1.0f / 896;
+    }
+    t->c_offset = 512;
+    double kr = 0.2126, kb = 0.0722;
+    if (frame->colorspace == AVCOL_SPC_BT2020_NCL || frame->colorspace == AVCOL_SPC_BT2020_CL ||
+        (frame->colorspace == AVCOL_SPC_UNSPECIFIED && wide)) {
+        kr = 0.2627;
+        kb = 0.0593;
+    } else if (frame->colorspace == AVCOL_SPC_BT470BG || frame->colorspace == AVCOL_SPC_SMPTE170M) {
+        kr = 0.299;
+        kb = 0.114;
+    }
+    double kg = 1 - kr - kb;
+    t->cr_r = 2 * (1 - kr);
+    t->cb_b = 2 * (1 - kb);
+    t->cb_g = -2 * kb * (1 - kb) / kg;
+    t->cr_g = -2 * kr * (1 - kr) / kg;
+
+    static const float bt2020_to_bt709[9] = {
+        1.6605f, -0.5876f, -0.0728f,
+        -0.1246f, 1.1329f, -0.0083f,
+        -0.0182f, -0.1006f, 1.1187f,
+    };
+    static const float identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    memcpy(t->gamut, wide? bt2020_to_bt709:identity, sizeof(t->gamut));
+
+    /* HLG is scene-referred; its nominal display peak stands in for one */
+    double white = options.white_nits;
+    if (hlg && options.peak_nits <= 0)
+        peak_nits = 1000;
+    double w = (pq || hlg)? std::max(peak_nits / white, 1.0):1.0;
+    for (int i = 0; i <= last; i++) {
+        double e = double(i) / last;
+        if (pq)
+            t->eotf[i] = pq_to_nits(e) / white;
+        else if (hlg)
+            /* the system gamma per channel rather than on luminance */
+            t->eotf[i] = 1000 * pow(hlg_to_scene(e), 1.2) / white;
+        else
+            t->eotf[i] = pow(e, 2.4);
+    }
+
+    ToneMapCurve curve = (w > 1)? options.curve:ToneMapCurve::kClip;
+    for (int i = 0; i <= last; i++) {
+        double m = std::max(double(i) / last * w, 1e-4), out;
+        switch (curve) {
+        case ToneMapCurve::kReinhard:
+            /* extended, so that |w| lands on white exactly */
+            out = m * (1 + m / (w * w)) / (1 + m);
+            break;
+        case ToneMapCurve::kHable:
+            out = hable(m) / hable(w);
+            break;
+        default:
+            out = std::min(m, 1.0);
+            break;
+        }
+        t->tone[i] = out / m;
+    }
+    t->tone_scale = last / w;
+
+    for (int i = 0; i <= last; i++) {
+        t->oetf[i] = uint8_t(lrint(255 * pow(double(i) / last, 2 / 2.4)));
+        t->direct_out[i] = uint8_t(lrint(255.0 * i / last));
+    }
+    t->direct = !pq && !hlg && !wide;
+}
+
+// |count| samples from pixel |x| on, which is even; the arrays have room for
+// an even number.
+static void load_samples(const HdrRowSource &row, int x, int count, float *y, float *u, float *v) {
+    int shift = row.shift;
+    if (row.halve) {
+        const uint16_t *y0 = row.y0 + 2 * x, *y1 = row.y1 + 2 * x;
+        const uint16_t *cu = row.u + x * row.chroma_step, *cv = row.v + x * row.chroma_step;
+        for (int i = 0; i < count; i++) {
+            int sum = (y0[2 * i] >> shift) + (y0[2 * i + 1] >> shift) +
+                (y1[2 * i] >> shift) + (y1[2 * i + 1] >> shift);
+            y[i] = sum * 0.25f;
+            u[i] = cu[i * row.chroma_step] >> shift;
+            v[i] = cv[i * row.chroma_step] >> shift;
+        }
+    } else {
+        /* chunks start on even pixels, so chroma goes out in pairs */
+        const uint16_t *y0 = row.y0 + x;
+        const uint16_t *cu = row.u + (x >> 1) * row.chroma_step, *cv = row.v + (x >> 1) * row.chroma_step;
+        for (int i = 0; i < count; i++) {
+            y[i] = y0[i] >> shift;
+        }
+        for (int i = 0; i < count; i += 2) {
+            u[i] = u[i + 1] = cu[(i >> 1) * row.chroma_step] >> shift;
+            v[i] = v[i + 1] = cv[(i >> 1) * row.chroma_step] >> shift;
+        }
+    }
+}
+
+// R'G'B' as indices into the tables.
+static void to_rgb_index(const ToneMapTables &t, const float *y, const float *u, const float *v,
+                         int count, int32_t *r, int32_t *g, int32_t *b) {
+    const float last = ToneMapTables::kSize - 1;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 yo = _mm_set1_ps(t.y_offset), ys = _mm_set1_ps(t.y_scale);
+    __m128 co = _mm_set1_ps(t.c_offset), cs = _mm_set1_ps(t.c_scale);
+    __m128 cr_r = _mm_set1_ps(t.cr_r), cb_g = _mm_set1_ps(t.cb_g);
+    __m128 cr_g = _mm_set1_ps(t.cr_g), cb_b = _mm_set1_ps(t.cb_b);
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 scale = _mm_set1_ps(last), half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 Y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(y + i), yo), ys);
+        __m128 U = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(u + i), co), cs);
+        __m128 V = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), co), cs);
+        __m128 R = _mm_add_ps(Y, _mm_mul_ps(V, cr_r));
+        __m128 G = _mm_add_ps(Y, _mm_add_ps(_mm_mul_ps(U, cb_g), _mm_mul_ps(V, cr_g)));
+        __m128 B = _mm_add_ps(Y, _mm_mul_ps(U, cb_b));
+        R = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(R, zero), one), scale), half);
+        G = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(G, zero), one), scale), half);
+        B = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(B, zero), one), scale), half);
+        _mm_storeu_si128((__m128i*)(r + i), _mm_cvttps_epi32(R));
+        _mm_storeu_si128((__m128i*)(g + i), _mm_cvttps_epi32(G));
+        _mm_storeu_si128((__m128i*)(b + i), _mm_cvttps_epi32(B));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t yo = vdupq_n_f32(t.y_offset), ys = vdupq_n_f32(t.y_scale);
+    float32x4_t co = vdupq_n_f32(t.c_offset), cs = vdupq_n_f32(t.c_scale);
+    float32x4_t zero = vdupq_n_f32(0.0f), one = vdupq_n_f32(1.0f);
+    float32x4_t scale = vdupq_n_f32(last), half = vdupq_n_f32(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t Y = vmulq_f32(vsubq_f32(vld1q_f32(y + i), yo), ys);
+        float32x4_t U = vmulq_f32(vsubq_f32(vld1q_f32(u + i), co), cs);
+        float32x4_t V = vmulq_f32(vsubq_f32(vld1q_f32(v + i), co), cs);
+        float32x4_t R = vaddq_f32(Y, vmulq_n_f32(V, t.cr_r));
+        float32x4_t G = vaddq_f32(Y, vaddq_f32(vmulq_n_f32(U, t.cb_g), vmulq_n_f32(V, t.cr_g)));
+        float32x4_t B = vaddq_f32(Y, vmulq_n_f32(U, t.cb_b));
+        R = vaddq_f32(vmulq_f32(vminq_f32(vmaxq_f32(R, zero), one), scale), half);
+        G = vaddq_f32(vmulq_f32(vminq_f32(vmaxq_f32(G, zero), one), scale), half);
+        B = vaddq_f32(vmulq_f32(vminq_f32(vmaxq_f32(B, zero), one), scale), half);
+        vst1q_s32(r + i, vcvtq_s32_f32(R));
+        vst1q_s32(g + i, vcvtq_s32_f32(G));
+        vst1q_s32(b + i, vcvtq_s32_f32(B));
+    }
+#endif
+    for (; i < count; i++) {
+        float Y = (y[i] - t.y_offset) * t.y_scale;
+        float U = (u[i] - t.c_offset) * t.c_scale;
+        float V = (v[i] - t.c_offset) * t.c_scale;
+        float R = Y + V * t.cr_r, G = Y + (U * t.cb_g + V * t.cr_g), B = Y + U * t.cb_b;
+        r[i] = int32_t(std::min(std::max(R, 0.0f), 1.0f) * last + 0.5f);
+        g[i] = int32_t(std::min(std::max(G, 0.0f), 1.0f) * last + 0.5f);
+        b[i] = int32_t(std::min(std::max(B, 0.0f), 1.0f) * last + 0.5f);
+    }
+}
+
+// Into the output's primaries, in place, and the index of the brightest
+// channel into the tone table.
+static void to_output_gamut(const ToneMapTables &t, float *r, float *g, float *b, int count, int32_t *m) {
+    const float *k = t.gamut;
+    const float last = ToneMapTables::kSize - 1;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(last);
+    __m128 scale = _mm_set1_ps(t.tone_scale), half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 R = _mm_loadu_ps(r + i), G = _mm_loadu_ps(g + i), B = _mm_loadu_ps(b + i);
+        __m128 R2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(R, _mm_set1_ps(k[0])), _mm_mul_ps(G, _mm_set1_ps(k[1]))),
+                               _mm_mul_ps(B, _mm_set1_ps(k[2])));
+        __m128 G2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(R, _mm_set1_ps(k[3])), _mm_mul_ps(G, _mm_set1_ps(k[4]))),
+                               _mm_mul_ps(B, _mm_set1_ps(k[5])));
+        __m128 B2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(R, _mm_set1_ps(k[6])), _mm_mul_ps(G, _mm_set1_ps(k[7]))),
+                               _mm_mul_ps(B, _mm_set1_ps(k[8])));
+        R2 = _mm_max_ps(R2, zero);
+        G2 = _mm_max_ps(G2, zero);
+        B2 = _mm_max_ps(B2, zero);
+        _mm_storeu_ps(r + i, R2);
+        _mm_storeu_ps(g + i, G2);
+        _mm_storeu_ps(b + i, B2);
+        __m128 M = _mm_max_ps(R2, _mm_max_ps(G2, B2));
+        M = _mm_add_ps(_mm_min_ps(_mm_mul_ps(M, scale), top), half);
+        _mm_storeu_si128((__m128i*)(m + i), _mm_cvttps_epi32(M));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t zero = vdupq_n_f32(0.0f), top = vdupq_n_f32(last), half = vdupq_n_f32(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t R = vld1q_f32(r + i), G = vld1q_f32(g + i), B = vld1q_f32(b + i);
+        float32x4_t R2 = vaddq_f32(vaddq_f32(vmulq_n_f32(R, k[0]), vmulq_n_f32(G, k[1])), vmulq_n_f32(B, k[2]));
+        float32x4_t G2 = vaddq_f32(vaddq_f32(vmulq_n_f32(R, k[3]), vmulq_n_f32(G, k[4])), vmulq_n_f32(B, k[5]));
+        float32x4_t B2 = vaddq_f32(vaddq_f32(vmulq_n_f32(R, k[6]), vmulq_n_f32(G, k[7])), vmulq_n_f32(B, k[8]));
+        R2 = vmaxq_f32(R2, zero);
+        G2 = vmaxq_f32(G2, zero);
+        B2 = vmaxq_f32(B2, zero);
+        vst1q_f32(r + i, R2);
+        vst1q_f32(g + i, G2);
+        vst1q_f32(b + i, B2);
+        float32x4_t M = vmaxq_f32(R2, vmaxq_f32(G2, B2));
+        M = vaddq_f32(vminq_f32(vmulq_n_f32(M, t.tone_scale), top), half);
+        vst1q_s32(m + i, vcvtq_s32_f32(M));
+    }
+#endif
+    for (; i < count; i++) {
+        float R = std::max((r[i] * k[0] + g[i] * k[1]) + b[i] * k[2], 0.0f);
+        float G = std::max((r[i] * k[3] + g[i] * k[4]) + b[i] * k[5], 0.0f);
+        float B = std::max((r[i] * k[6] + g[i] * k[7]) + b[i] * k[8], 0.0f);
+        r[i] = R;
+        g[i] = G;
+        b[i] = B;
+        m[i] = int32_t(std::min(std::max(R, std::max(G, B)) * t.tone_scale, last) + 0.5f);
+    }
+}
+
+// Tone mapped linear light as indices into the output table.
+static void to_output_index(const float *r, const float *g, const float *b, const float *ratio, int count,
+                            int32_t *ri, int32_t *gi, int32_t *bi) {
+    const float last = ToneMapTables::kSize - 1;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(last), half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 k = _mm_loadu_ps(ratio + i);
+        __m128 R = _mm_sqrt_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(r + i), k), one));
+        __m128 G = _mm_sqrt_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(g + i), k), one));
+        __m128 B = _mm_sqrt_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(b + i), k), one));
+        _mm_storeu_si128((__m128i*)(ri + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(R, scale), half)));
+        _mm_storeu_si128((__m128i*)(gi + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(G, scale), half)));
+        _mm_storeu_si128((__m128i*)(bi + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(B, scale), half)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t one = vdupq_n_f32(1.0f), scale = vdupq_n_f32(last), half = vdupq_n_f32(0.5f);
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t k = vld1q_f32(ratio + i);
+        float32x4_t R = vsqrtq_f32(vminq_f32(vmulq_f32(vld1q_f32(r + i), k), one));
+        float32x4_t G = vsqrtq_f32(vminq_f32(vmulq_f32(vld1q_f32(g + i), k), one));
+        float32x4_t B = vsqrtq_f32(vminq_f32(vmulq_f32(vld1q_f32(b + i), k), one));
+        vst1q_s32(ri + i, vcvtq_s32_f32(vaddq_f32(vmulq_f32(R, scale), half)));
+        vst1q_s32(gi + i, vcvtq_s32_f32(vaddq_f32(vmulq_f32(G, scale), half)));
+        vst1q_s32(bi + i, vcvtq_s32_f32(vaddq_f32(vmulq_f32(B, scale), half)));
+    }
+#endif
+    for (; i < count; i++) {
+        ri[i] = int32_t(sqrtf(std::min(r[i] * ratio[i], 1.0f)) * last + 0.5f);
+        gi[i] = int32_t(sqrtf(std::min(g[i] * ratio[i], 1.0f)) * last + 0.5f);
+        bi[i] = int32_t(sqrtf(std::min(b[i] * ratio[i], 1.0f)) * last + 0.5f);
+    }
+}
+
+// Converts one row into |out|, four bytes a pixel with the alpha opaque.
+// The vector stages run over chunks small enough to stay in L1, with the
+// table lookups between them.
+void ToneMapRow(const ToneMapTables &t, const HdrRowSource &row, uint8_t *out, bool bgra) {
+    const int kChunk = 256;
+    float y[kChunk], u[kChunk], v[kChunk], ratio[kChunk];
+    int32_t ri[kChunk], gi[kChunk], bi[kChunk], mi[kChunk];
+    int ro = bgra? 2:0, bo = bgra? 0:2;
+    for (int x = 0; x < row.width; x += kChunk) {
+        int count = std::min(kChunk, row.width - x);
+        uint8_t *dst = out + 4 * size_t(x);
+        load_samples(row, x, count, y, u, v);
+        to_rgb_index(t, y, u, v, count, ri, gi, bi);
+        if (t.direct) {
+            for (int i = 0; i < count; i++) {
+                dst[4 * i + ro] = t.direct_out[ri[i]];
+                dst[4 * i + 1] = t.direct_out[gi[i]];
+                dst[4 * i + bo] = t.direct_out[bi[i]];
+                dst[4 * i + 3] = 255;
+            }
+            continue;
+        }
+
+        /* the linear values take over the sample arrays */
+        float *r = y, *g = u, *b = v;
+        for (int i = 0; i < count; i++) {
+            r[i] = t.eotf[ri[i]];
+            g[i] = t.eotf[gi[i]];
+            b[i] = t.eotf[bi[i]];
+        }
+        to_output_gamut(t, r, g, b, count, mi);
+        for (int i = 0; i < count; i++) {
+            ratio[i] = t.tone[mi[i]];
+        }
+        to_output_index(r, g, b, ratio, count, ri, gi, bi);
+        for (int i = 0; i < count; i++) {
+            dst[4 * i + ro] = t.oetf[ri[i]];
+            dst[4 * i + 1] = t.oetf[gi[i]];
+            dst[4 * i + bo] = t.oetf[bi[i]];
+            dst[4 * i + 3] = 255;
+        }
+    }
+}
+
+// The plain per-pixel loop ToneMapRow replaces; kept as the benchmark's
+// baseline and the test's reference.
+void ToneMapRowScalar(const ToneMapTables &t, const HdrRowSource &row, uint8_t *out, bool bgra) {
+    const float last = ToneMapTables::kSize - 1;
+    int ro = bgra? 2:0, bo = bgra? 0:2;
+    for (int x = 0; x < row.width; x++) {
+        float y, u, v;
+        int c = (row.halve? x:x >> 1) * row.chroma_step;
+        if (row.halve) {
+            y = ((row.y0[2 * x] >> row.shift) + (row.y0[2 * x + 1] >> row.shift) +
+                 (row.y1[2 * x] >> row.shift) + (row.y1[2 * x + 1] >> row.shift)) * 0.25f;
+        } else {
+            y = row.y0[x] >> row.shift;
+        }
+        u = row.u[c] >> row.shift;
+        v = row.v[c] >> row.shift;
+        float Y = (y - t.y_offset) * t.y_scale;
+        float U = (u - t.c_offset) * t.c_scale;
+        float V = (v - t.c_offset) * t.c_scale;
+        float rgb[3] = { Y + V * t.cr_r, Y + (U * t.cb_g + V * t.cr_g), Y + U * t.cb_b };
+        int index[3];
+        for (int c = 0; c < 3; c++) {
+            index[c] = int(std::min(std::max(rgb[c], 0.0f), 1.0f) * last + 0.5f);
+        }
+        uint8_t *dst = out + 4 * size_t(x);
+        dst[3] = 255;
+        if (t.direct) {
+            dst[ro] = t.direct_out[index[0]];
+            dst[1] = t.direct_out[index[1]];
+            dst[bo] = t.direct_out[index[2]];
+            continue;
+        }
+        float lin[3], mapped[3];
+        for (int c = 0; c < 3; c++) {
+            lin[c] = t.eotf[index[c]];
+        }
+        for (int c = 0; c < 3; c++) {
+            const float *k = t.gamut + 3 * c;
+            mapped[c] = std::max((lin[0] * k[0] + lin[1] * k[1]) + lin[2] * k[2], 0.0f);
+        }
+        float m = std::max(mapped[0], std::max(mapped[1], mapped[2]));
+        float ratio = t.tone[int(std::min(m * t.tone_scale, last) + 0.5f)];
+        for (int c = 0; c < 3; c++) {
+            index[c] = int(sqrtf(std::min(mapped[c] * ratio, 1.0f)) * last + 0.5f);
+        }
+        dst[ro] = t.oetf[index[0]];
+        dst[1] = t.oetf[index[1]];
+        dst[bo] = t.oetf[index[2]];
+    }
+}
+
+// Brings 10-bit 4:2:0 frames, HDR or not, down to 8-bit RGBA or BGRA in one
+// pass, tone mapping and converting primaries where the source calls for
+// it. The scale filter does the same work a pixel at a time and without any
+// tone mapping, which leaves HDR washed out. Rows are split into tiles
+// spread over a ThreadPool.
+class HdrConverter
+{
+private:
+    ToneMapOptions options;
+    ThreadPool *pool;
+    std::unique_ptr<ToneMapTables> tables;
+    /* what the tables were built for */
+    int trc, primaries, space, range;
+    double peak;
+
+    double source_peak(const AVFrame *in) const;
+
+public:
+    static const int kTileRows = 16;
+    static constexpr double kDefaultPeak = 1000.0;
+
+    // Whether frames in |in| have a path of their own to |out|.
+    static bool Supports(AVPixelFormat in, AVPixelFormat out);
+    // Row of |frame| in |format| behind output row |y|.
+    static HdrRowSource RowSource(const AVFrame *frame, int y, bool halve);
+
+    // Tiles go to |pool|, and the calling thread takes its share; without
+    // a pool, it does them all.
+    explicit HdrConverter(const ToneMapOptions &options = ToneMapOptions(),
+                          ThreadPool *pool = &ThreadPool::Shared());
+
+    // Replaces |out| with |in| as |format|, half its size if |halve|, each
+    // output pixel then averaging four. |out|'s buffer is reused when it is
+    // the right size and no one else holds it.
+    int Convert(const AVFrame *in, AVFrame *out, AVPixelFormat format, bool halve);
+    // Built by Convert for the last frame; null before.
+    const ToneMapTables *Tables() const { return tables.get(); }
+    const ToneMapOptions &Options() const { return options; }
+};
+
+HdrConverter::HdrConverter(const ToneMapOptions &options, ThreadPool *pool)
+    : options(options), pool(pool), trc(-1), primaries(-1), space(-1), range(-1), peak(0)
+{
+}
+
+bool HdrConverter::Supports(AVPixelFormat in, AVPixelFormat out) {
+    return (in == AV_PIX_FMT_P010LE || in == AV_PIX_FMT_YUV420P10LE) &&
+        (out == AV_PIX_FMT_RGBA || out == AV_PIX_FMT_BGRA);
+}
+
+HdrRowSource HdrConverter::RowSource(const AVFrame *frame, int y, bool halve) {
+    HdrRowSource row;
+    int luma = halve? 2 * y:y, chroma = halve? y:y / 2;
+    row.y0 = (const uint16_t*)(frame->data[0] + size_t(luma) * frame->linesize[0]);
+    row.y1 = halve? (const uint16_t*)(frame->data[0] + size_t(luma + 1) * frame->linesize[0]):row.y0;
+    row.u = (const uint16_t*)(frame->data[1] + size_t(chroma) * frame->linesize[1]);
+    if (frame->format == AV_PIX_FMT_P010LE) {
+        row.v = row.u + 1;
+        row.chroma_step = 2;
+        row.shift = 6;
+    } else {
+        row.v = (const uint16_t*)(frame->data[2] + size_t(chroma) * frame->linesize[2]);
+        row.chroma_step = 1;
+        row.shift = 0;
+    }
+    row.width = halve? frame->width / 2:frame->width;
+    row.halve = halve;
+    return row;
+}
+
+double HdrConverter::source_peak(const AVFrame *in) const {
+    if (options.peak_nits > 0)
+        return options.peak_nits;
+    AVFrameSideData *data = av_frame_get_side_data(in, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+    if (data && ((const AVContentLightMetadata*)data->data)->MaxCLL > 0)
+        return ((const AVContentLightMetadata*)data->data)->MaxCLL;
+    data = av_frame_get_side_data(in, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+    if (data && ((const AVMasteringDisplayMetadata*)data->data)->has_luminance)
+        return av_q2d(((const AVMasteringDisplayMetadata*)data->data)->max_luminance);
+    /* often only keyframes carry it */
+    return tables? peak:kDefaultPeak;
+}
+
+int HdrConverter::Convert(const AVFrame *in, AVFrame *out, AVPixelFormat format, bool halve) {
+    if (!Supports((AVPixelFormat)in->format, format))
+        return AVERROR(EINVAL);
+    int width = halve? in->width / 2:in->width, height = halve? in->height / 2:in->height;
+    if (width <= 0 || height <= 0)
+        return AVERROR(EINVAL);
+
+    double source = source_peak(in);
+    if (!tables || in->color_trc != trc || in->color_primaries != primaries ||
+        in->colorspace != space || in->color_range != range || source != peak) {
+        if (!tables)
+            tables.reset(new ToneMapTables());
+        BuildToneMapTables(in, options, source, tables.get());
+        trc = in->color_trc;
+        primaries = in->color_primaries;
+        space = in->colorspace;
+        range = in->color_range;
+        peak = source;
+    }
+
+    int ret;
+    if (out->format != format || out->width != width || out->height != height || !av_frame_is_writable(out)) {
+        av_frame_unref(out);
+        out->format = format;
+        out->width = width;
+        out->height = height;
+        if ((ret = av_frame_get_buffer(out, 0)) < 0)
+            return ret;
+    }
+    if ((ret = av_frame_copy_props(out, in)) < 0)
+        return ret;
+    out->color_trc = AVCOL_TRC_BT709;
+    out->color_primaries = AVCOL_PRI_BT709;
+    out->colorspace = AVCOL_SPC_RGB;
+    out->color_range = AVCOL_RANGE_JPEG;
+
+    const ToneMapTables &t = *tables;
+    bool bgra = format == AV_PIX_FMT_BGRA;
+    int tiles = (height + kTileRows - 1) / kTileRows;
+    std::function<void(int)> tile = [&](int index) {
+        int end = std::min(height, (index + 1) * kTileRows);
+        for (int y = index * kTileRows; y < end; y++) {
+            ToneMapRow(t, RowSource(in, y, halve), out->data[0] + size_t(y) * out->linesize[0], bgra);
+        }
+    };
+    if (pool) {
+        pool->ParallelFor(tiles, tile);
+    } else {
+        for (int i = 0; i < tiles; i++) {
+            tile(i);
+        }
+    }
+    return 0;
+}
+
+#endif
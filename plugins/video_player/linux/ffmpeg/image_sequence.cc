@@ -0,0 +1,269 @@
+#ifndef FFMPEG_IMAGE_SEQUENCE
+#define FFMPEG_IMAGE_SEQUENCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/error.h>
+}
+
+#include "thread_pool.cc"
+
+// Decodes the one picture in |path| into |out| on the calling thread. The
+// decoder is single-threaded: the parallelism is across files.
+int DecodeImageFile(const std::string &path, AVFrame *out) {
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVCodec *codec;
+    int ret;
+
+    if (!packet)
+        return AVERROR(ENOMEM);
+    if ((ret = avformat_open_input(&fmt, path.c_str(), NULL, NULL)) < 0)
+        goto end;
+    if (fmt->nb_streams < 1 ||
+        !(codec = avcodec_find_decoder(fmt->streams[0]->codecpar->codec_id))) {
+        ret = AVERROR_DECODER_NOT_FOUND;
+        goto end;
+    }
+    if (!(dec = avcodec_alloc_context3(codec))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    avcodec_parameters_to_context(dec, fmt->streams[0]->codecpar);
+    dec->thread_count = 1;
+    if ((ret = avcodec_open2(dec, codec, NULL)) < 0)
+        goto end;
+
+    while ((ret = avcodec_receive_frame(dec, out)) == AVERROR(EAGAIN)) {
+        ret = av_read_frame(fmt, packet);
+        if (ret == AVERROR_EOF) {
+            /* a decoder that holds the picture back gives it up on flush */
+            avcodec_send_packet(dec, NULL);
+            continue;
+        }
+        if (ret < 0)
+            break;
+        ret = avcodec_send_packet(dec, packet);
+        av_packet_unref(packet);
+        if (ret < 0)
+            break;
+    }
+
+end:
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    return ret;
+}
+
+// The frames of a rendered animation: every image file in one directory,
+// in natural order so that frame_9 comes before frame_10. Frames are
+// independent, so the ones after the playhead are decoded ahead of time
+// on a ThreadPool, as many at once as it has workers.
+class ImageSequence
+{
+private:
+    struct Slot
+    {
+        AVFrame *frame = NULL;
+        int ret = 0;
+        bool done = false;
+        // Outside the read-ahead window since a seek; not worth decoding.
+        bool abandoned = false;
+
+        ~Slot() { av_frame_free(&frame); }
+    };
+
+    ThreadPool &pool;
+    std::vector<std::string> files;
+    int ahead;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<int, std::shared_ptr<Slot>> slots;
+    int in_flight;
+
+    void schedule(int index);
+    void decode_slot(int index, std::shared_ptr<Slot> slot);
+
+public:
+    // Enough to keep every worker busy without holding many large frames.
+    static constexpr int kMaxReadAhead = 16;
+
+    explicit ImageSequence(ThreadPool &pool = ThreadPool::Shared());
+    // Waits for decodes already running; queued ones are skipped.
+    ~ImageSequence();
+
+    static bool IsImageFile(const std::string &name);
+    static bool NaturalLess(const std::string &a, const std::string &b);
+
+    int Open(const std::string &directory);
+    int Count() const { return files.size(); }
+    int ReadAhead() const { return ahead; }
+    const std::string &File(int index) const { return files[index]; }
+
+    // Moves frame |index| into |out|, waiting for it if the read-ahead has
+    // not got there yet, and queues the frames after it. With |wrap| the
+    // read-ahead continues from the first frame past the last.
+    int Get(int index, bool wrap, AVFrame *out);
+};
+
+ImageSequence::ImageSequence(ThreadPool &pool)
+    : pool(pool), ahead(std::min<int>(pool.Size() + 2, kMaxReadAhead)), in_flight(0)
+{
+}
+
+ImageSequence::~ImageSequence()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto &entry : slots) {
+        entry.second->abandoned = true;
+    }
+    cv.wait(lock, [this]() { return in_flight == 0; });
+}
+
+bool ImageSequence::IsImageFile(const std::string &name) {
+    static const char *kExtensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff" };
+    for (const char *extension : kExtensions) {
+        size_t length = strlen(extension);
+        if (name.size() > length &&
+            strcasecmp(name.c_str() + name.size() - length, extension) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool ImageSequence::NaturalLess(const std::string &a, const std::string &b) {
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+            /* compare runs of digits as numbers, ignoring leading zeros */
+            size_t start_a = i, start_b = j;
+            while (i < a.size() && isdigit((unsigned char)a[i]))
+                i++;
+            while (j < b.size() && isdigit((unsigned char)b[j]))
+                j++;
+            size_t zeros_a = start_a, zeros_b = start_b;
+            while (zeros_a + 1 < i && a[zeros_a] == '0')
+                zeros_a++;
+            while (zeros_b + 1 < j && b[zeros_b] == '0')
+                zeros_b++;
+            if (i - zeros_a != j - zeros_b)
+                return i - zeros_a < j - zeros_b;
+            int order = a.compare(zeros_a, i - zeros_a, b, zeros_b, j - zeros_b);
+            if (order != 0)
+                return order < 0;
+            continue;
+        }
+        if (a[i] != b[j])
+            return a[i] < b[j];
+        i++;
+        j++;
+    }
+    return a.size() - i < b.size() - j;
+}
+
+int ImageSequence::Open(const std::string &directory) {
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+        return AVERROR(errno);
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.' && IsImageFile(entry->d_name))
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    if (names.empty())
+        return AVERROR_INVALIDDATA;
+
+    std::sort(names.begin(), names.end(), NaturalLess);
+    files.clear();
+    for (auto &name : names) {
+        files.push_back(directory + "/" + name);
+    }
+    return 0;
+}
+
+void ImageSequence::schedule(int index) {
+    auto slot = std::make_shared<Slot>();
+    slots[index] = slot;
+    in_flight++;
+    pool.Submit([this, index, slot]() { decode_slot(index, slot); });
+}
+
+void ImageSequence::decode_slot(int index, std::shared_ptr<Slot> slot) {
+    bool abandoned;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        abandoned = slot->abandoned;
+    }
+    AVFrame *decoded = NULL;
+    int ret = AVERROR_EXIT;
+    if (!abandoned) {
+        decoded = av_frame_alloc();
+        ret = decoded? DecodeImageFile(files[index], decoded):AVERROR(ENOMEM);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    slot->frame = decoded;
+    slot->ret = ret;
+    slot->done = true;
+    in_flight--;
+    cv.notify_all();
+}
+
+int ImageSequence::Get(int index, bool wrap, AVFrame *out) {
+    int count = files.size();
+    if (index < 0 || index >= count)
+        return AVERROR(EINVAL);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    /* forget read-ahead that a seek has left behind */
+    for (auto it = slots.begin(); it != slots.end();) {
+        int distance = it->first - index;
+        if (wrap && distance < 0)
+            distance += count;
+        if (distance < 0 || distance > ahead) {
+            it->second->abandoned = true;
+            it = slots.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    /* the wanted frame first, then the ones after it */
+    for (int k = 0; k <= ahead && k < count; k++) {
+        int next = index + k;
+        if (next >= count) {
+            if (!wrap)
+                break;
+            next -= count;
+        }
+        if (slots.find(next) == slots.end())
+            schedule(next);
+    }
+
+    std::shared_ptr<Slot> slot = slots[index];
+    cv.wait(lock, [&slot]() { return slot->done; });
+    slots.erase(index);
+    if (slot->ret >= 0)
+        av_frame_move_ref(out, slot->frame);
+    return slot->ret;
+}
+
+#endif
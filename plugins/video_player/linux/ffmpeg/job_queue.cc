@@ -0,0 +1,165 @@
+#ifndef FFMPEG_JOB_QUEUE
+#define FFMPEG_JOB_QUEUE
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Long-running file jobs, such as exports, on a few workers of their own.
+// Higher priorities start first, equal ones in the order submitted. The
+// workers run niced, and so do any codec threads they start, so that jobs
+// only ever take cores playback leaves idle.
+class JobQueue
+{
+public:
+    // Tasks poll |cancelled| and return early once it is set.
+    typedef std::function<void(const std::atomic<bool> &cancelled)> Task;
+    // Reports that a job was cancelled before it started.
+    typedef std::function<void()> Dropped;
+
+private:
+    struct Job
+    {
+        Task task;
+        Dropped dropped;
+        std::atomic<bool> cancelled;
+        Job(Task task, Dropped dropped) : task(std::move(task)), dropped(std::move(dropped)), cancelled(false) {}
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    /* keyed by (-priority, id), so the first entry runs next */
+    std::map<std::pair<int, int64_t>, std::shared_ptr<Job>> queued;
+    std::map<int64_t, std::shared_ptr<Job>> running;
+    std::vector<std::thread> workers;
+    int64_t next_id;
+    int nice_value;
+    bool closing;
+
+    void worker_loop();
+
+public:
+    JobQueue(size_t workers, int nice_value);
+    // Cancels every job, running or queued, and joins the workers.
+    ~JobQueue();
+
+    // Shared by the export and transcode jobs of every player.
+    static JobQueue &Exports();
+
+    // |dropped| runs instead of |task| if the job is cancelled before it
+    // starts, so that it still reports how it ended.
+    int64_t Submit(int priority, Task task, Dropped dropped = nullptr);
+    // A job that has not started is dropped at once, on this thread, without
+    // running its task. Returns false if the job is unknown or already
+    // finished.
+    bool Cancel(int64_t id);
+    size_t Queued();
+};
+
+JobQueue::JobQueue(size_t threads, int nice_value) : next_id(1), nice_value(nice_value), closing(false)
+{
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&JobQueue::worker_loop, this);
+    }
+}
+
+JobQueue::~JobQueue()
+{
+    std::map<std::pair<int, int64_t>, std::shared_ptr<Job>> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+        dropped.swap(queued);
+        for (auto &entry : running) {
+            entry.second->cancelled = true;
+        }
+    }
+    cv.notify_all();
+    for (auto &entry : dropped) {
+        if (entry.second->dropped)
+            entry.second->dropped();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+JobQueue &JobQueue::Exports() {
+    /* two, so that a quick stream copy need not wait out a long transcode */
+    static JobQueue queue(2, 10);
+    return queue;
+}
+
+int64_t JobQueue::Submit(int priority, Task task, Dropped dropped) {
+    int64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = next_id++;
+        queued[std::make_pair(-priority, id)] = std::make_shared<Job>(std::move(task), std::move(dropped));
+    }
+    cv.notify_one();
+    return id;
+}
+
+bool JobQueue::Cancel(int64_t id) {
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = running.find(id);
+        if (it != running.end()) {
+            it->second->cancelled = true;
+            return true;
+        }
+        for (auto entry = queued.begin(); entry != queued.end(); entry++) {
+            if (entry->first.second == id) {
+                job = entry->second;
+                queued.erase(entry);
+                break;
+            }
+        }
+    }
+    if (!job)
+        return false;
+    if (job->dropped)
+        job->dropped();
+    return true;
+}
+
+size_t JobQueue::Queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued.size();
+}
+
+void JobQueue::worker_loop() {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice_value);
+    while (true) {
+        std::shared_ptr<Job> job;
+        int64_t id;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return closing || !queued.empty(); });
+            if (queued.empty())
+                return;
+            id = queued.begin()->first.second;
+            job = queued.begin()->second;
+            queued.erase(queued.begin());
+            running[id] = job;
+        }
+        job->task(job->cancelled);
+        std::lock_guard<std::mutex> lock(mutex);
+        running.erase(id);
+    }
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef FFMPEG_MEDIA_CACHE
+#define FFMPEG_MEDIA_CACHE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+// Data derived from media files (scene indexes, waveforms, probes) kept on
+// disk between runs. Entries are keyed by the file's path and are only
+// trusted while the file keeps the size and mtime recorded with them.
+
+// What identifies a file as unchanged since an entry was written.
+struct FileIdentity
+{
+    int64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const FileIdentity &other) const {
+        return size == other.size && mtime_ns == other.mtime_ns;
+    }
+    bool operator!=(const FileIdentity &other) const { return !(*this == other); }
+};
+
+bool GetFileIdentity(const std::string &path, FileIdentity *identity) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+    identity->size = st.st_size;
+    identity->mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool make_directory(const std::string &path) {
+    /* every missing parent too, like mkdir -p */
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0700) < 0 && errno != EEXIST)
+            return false;
+        if (slash == std::string::npos)
+            return true;
+    }
+}
+
+// $XDG_CACHE_HOME/video_player/<kind>, falling back to ~/.cache, created
+// on first use. Empty if there is nowhere to write.
+std::string MediaCacheDirectory(const std::string &kind) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    std::string directory;
+    if (base && base[0] == '/') {
+        directory = base;
+    } else {
+        const char *home = getenv("HOME");
+        if (!home || home[0] != '/')
+            return "";
+        directory = std::string(home) + "/.cache";
+    }
+    directory += "/video_player/" + kind;
+    return make_directory(directory)? directory:"";
+}
+
+// The entry for |path| in the |kind| cache, named by a hash of the path.
+std::string MediaCachePath(const std::string &kind, const std::string &path,
+                           const char *extension) {
+    std::string directory = MediaCacheDirectory(kind);
+    if (directory.empty())
+        return "";
+    /* FNV-1a; collisions are caught by the path stored in each entry */
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : path) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)hash);
+    return directory + name + extension;
+}
+
+// A name beside |path| to write an entry under before renaming it into
+// place. Two writers of one entry, in this process or another, never share
+// it; the last rename wins.
+std::string TemporaryPath(const std::string &path) {
+    static std::atomic<int> next_write(0);
+    return path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(next_write++);
+}
+
+// Writes |bytes| to |path| through a temporary file, so that a reader never
+// sees half an entry.
+int ReplaceFile(const std::string &path, const std::vector<uint8_t> &bytes) {
+    std::string temporary = TemporaryPath(path);
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return AVERROR(errno);
+    bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (fclose(file) != 0 || !written || rename(temporary.c_str(), path.c_str()) < 0) {
+        int ret = AVERROR(errno? errno:EIO);
+        unlink(temporary.c_str());
+        return ret;
+    }
+    return 0;
+}
+
+int ReadWholeFile(const std::string &path, std::vector<uint8_t> *bytes) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return AVERROR(errno);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    bytes->resize(size > 0? size:0);
+    bool read = fread(bytes->data(), 1, bytes->size(), file) == bytes->size();
+    fclose(file);
+    return read? 0:AVERROR(EIO);
+}
+
+// Little helpers for the fixed-layout binary entries.
+class CacheWriter
+{
+private:
+    std::vector<uint8_t> bytes;
+
+public:
+    template <typename T>
+    void Put(const T &value) {
+        const uint8_t *raw = (const uint8_t*)&value;
+        bytes.insert(bytes.end(), raw, raw + sizeof(T));
+    }
+    void PutBytes(const uint8_t *data, size_t size) { bytes.insert(bytes.end(), data, data + size); }
+    void PutString(const std::string &value) {
+        Put(uint32_t(value.size()));
+        PutBytes((const uint8_t*)value.data(), value.size());
+    }
+    const std::vector<uint8_t> &Bytes() const { return bytes; }
+};
+
+class CacheReader
+{
+private:
+    const std::vector<uint8_t> &bytes;
+    size_t offset;
+    bool failed;
+
+public:
+    explicit CacheReader(const std::vector<uint8_t> &bytes) : bytes(bytes), offset(0), failed(false) {}
+
+    template <typename T>
+    T Get() {
+        T value = T();
+        GetBytes((uint8_t*)&value, sizeof(T));
+        return value;
+    }
+    void GetBytes(uint8_t *out, size_t size) {
+        if (failed || bytes.size() - offset < size) {
+            failed = true;
+            memset(out, 0, size);
+            return;
+        }
+        memcpy(out, &bytes[offset], size);
+        offset += size;
+    }
+    std::string GetString() {
+        uint32_t size = Get<uint32_t>();
+        if (failed || bytes.size() - offset < size) {
+            failed = true;
+            return "";
+        }
+        std::string value((const char*)&bytes[offset], size);
+        offset += size;
+        return value;
+    }
+    // False once a read ran past the end.
+    bool Ok() const { return !failed; }
+    // What is left to read.
+    size_t Remaining() const { return failed? 0:bytes.size() - offset; }
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef FFMPEG_MEDIA_PROBE
+#define FFMPEG_MEDIA_PROBE
+
+#include <math.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/display.h>
+}
+
+#include "media_cache.cc"
+#include "thread_pool.cc"
+
+// What a library screen shows about a file, read from its container alone.
+struct MediaInfo
+{
+    // 0 once probed; otherwise why the file could not be read.
+    int error = 0;
+    int64_t duration_us = 0;
+    int64_t bit_rate = 0;
+    std::string format;
+
+    bool has_video = false;
+    int width = 0;
+    int height = 0;
+    // Clockwise degrees the picture is to be turned for display: 0, 90,
+    // 180 or 270.
+    int rotation = 0;
+    double frame_rate = 0;
+    std::string video_codec;
+
+    bool has_audio = false;
+    int sample_rate = 0;
+    int channels = 0;
+    std::string audio_codec;
+
+    static const uint32_t kMagic = 0x494d5056; /* "VPMI" */
+    static const uint32_t kVersion = 1;
+
+    std::vector<uint8_t> Serialize(const std::string &path, const FileIdentity &identity) const;
+    bool Deserialize(const std::vector<uint8_t> &bytes, const std::string &path,
+                     const FileIdentity &identity);
+};
+
+std::vector<uint8_t> MediaInfo::Serialize(const std::string &path, const FileIdentity &identity) const {
+    CacheWriter writer;
+    writer.Put(uint32_t(kMagic));
+    writer.Put(uint32_t(kVersion));
+    writer.PutString(path);
+    writer.Put(identity.size);
+    writer.Put(identity.mtime_ns);
+    writer.Put(duration_us);
+    writer.Put(bit_rate);
+    writer.PutString(format);
+    writer.Put(uint8_t(has_video));
+    writer.Put(int32_t(width));
+    writer.Put(int32_t(height));
+    writer.Put(int32_t(rotation));
+    writer.Put(frame_rate);
+    writer.PutString(video_codec);
+    writer.Put(uint8_t(has_audio));
+    writer.Put(int32_t(sample_rate));
+    writer.Put(int32_t(channels));
+    writer.PutString(audio_codec);
+    return writer.Bytes();
+}
+
+bool MediaInfo::Deserialize(const std::vector<uint8_t> &bytes, const std::string &path,
+                            const FileIdentity &identity) {
+    CacheReader reader(bytes);
+    if (reader.Get<uint32_t>() != kMagic || reader.Get<uint32_t>() != kVersion ||
+        reader.GetString() != path)
+        return false;
+    FileIdentity stored;
+    stored.size = reader.Get<int64_t>();
+    stored.mtime_ns = reader.Get<int64_t>();
+    if (!reader.Ok() || stored != identity)
+        return false;
+    duration_us = reader.Get<int64_t>();
+    bit_rate = reader.Get<int64_t>();
+    format = reader.GetString();
+    has_video = reader.Get<uint8_t>() != 0;
+    width = reader.Get<int32_t>();
+    height = reader.Get<int32_t>();
+    rotation = reader.Get<int32_t>();
+    frame_rate = reader.Get<double>();
+    video_codec = reader.GetString();
+    has_audio = reader.Get<uint8_t>() != 0;
+    sample_rate = reader.Get<int32_t>();
+    channels = reader.Get<int32_t>();
+    audio_codec = reader.GetString();
+    error = 0;
+    return reader.Ok();
+}
+
+static int stream_rotation(AVStream *stream) {
+    double degrees = 0;
+    const int32_t *matrix = (const int32_t*)av_stream_get_side_data(stream, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+    AVDictionaryEntry *tag = av_dict_get(stream->metadata, "rotate", NULL, 0);
+    if (matrix) {
+        /* the matrix turns counter-clockwise */
+        degrees = -av_display_rotation_get(matrix);
+    } else if (tag) {
+        degrees = atof(tag->value);
+    }
+    if (isnan(degrees))
+        return 0;
+    int quarter = int(lround(degrees / 90)) % 4;
+    return (quarter < 0? quarter + 4:quarter) * 90;
+}
+
+// Reads |path|'s MediaInfo without opening a decoder. The stream parameters
+// of most containers are in their headers; the others are probed as briefly
+// as the demuxer allows.
+int ProbeMediaUncached(const std::string &path, MediaInfo *info) {
+    AVFormatContext *fmt = NULL;
+    int video, audio;
+    int ret = avformat_open_input(&fmt, path.c_str(), NULL, NULL);
+    if (ret < 0)
+        goto end;
+    video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    audio = av_find_best_stream(fmt, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (fmt->duration == AV_NOPTS_VALUE || fmt->nb_streams == 0 ||
+        (video >= 0 && fmt->streams[video]->codecpar->width <= 0) ||
+        (audio >= 0 && fmt->streams[audio]->codecpar->sample_rate <= 0)) {
+        if ((ret = avformat_find_stream_info(fmt, NULL)) < 0)
+            goto end;
+        video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        audio = av_find_best_stream(fmt, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    }
+
+    info->duration_us = (fmt->duration != AV_NOPTS_VALUE)? fmt->duration:0;
+    info->bit_rate = fmt->bit_rate;
+    info->format = fmt->iformat->name;
+    if (video >= 0) {
+        AVStream *stream = fmt->streams[video];
+        info->has_video = true;
+        info->width = stream->codecpar->width;
+        info->height = stream->codecpar->height;
+        info->rotation = stream_rotation(stream);
+        AVRational rate = stream->avg_frame_rate.num > 0? stream->avg_frame_rate:stream->r_frame_rate;
+        info->frame_rate = rate.den > 0? av_q2d(rate):0;
+        info->video_codec = avcodec_get_name(stream->codecpar->codec_id);
+    }
+    if (audio >= 0) {
+        AVCodecParameters *par = fmt->streams[audio]->codecpar;
+        info->has_audio = true;
+        info->sample_rate = par->sample_rate;
+        info->channels = par->channels;
+        info->audio_codec = avcodec_get_name(par->codec_id);
+    }
+    ret = 0;
+
+end:
+    avformat_close_input(&fmt);
+    info->error = ret;
+    return ret;
+}
+
+// The MediaInfo of |path| from the "probes" media cache, probed and stored
+// there if the file changed since or was never probed. Failures are not
+// cached, so a file still being copied in is read again next time.
+int ProbeMedia(const std::string &path, MediaInfo *info) {
+    FileIdentity identity;
+    bool cacheable = GetFileIdentity(path, &identity);
+    std::string cache_path = cacheable? MediaCachePath("probes", path, ".info"):"";
+    std::vector<uint8_t> bytes;
+    if (!cache_path.empty() && ReadWholeFile(cache_path, &bytes) == 0 &&
+        info->Deserialize(bytes, path, identity))
+        return 0;
+
+    /* nothing of a damaged entry is kept */
+    *info = MediaInfo();
+    int ret = ProbeMediaUncached(path, info);
+    if (ret >= 0 && !cache_path.empty())
+        ReplaceFile(cache_path, info->Serialize(path, identity));
+    return ret;
+}
+
+// Probing waits on the disk more than on the cores, and must not hold up
+// the shared pool image sequences decode on.
+ThreadPool &ProbePool() {
+    static ThreadPool pool(4);
+    return pool;
+}
+
+// Probes every one of |paths| on |pool|, then hands the results, in the
+// same order, to |done| on whichever worker finished last.
+void ProbeMediaBatch(ThreadPool &pool, const std::vector<std::string> &paths,
+                     std::function<void(std::vector<MediaInfo> &infos)> done) {
+    struct Batch
+    {
+        std::vector<std::string> paths;
+        std::vector<MediaInfo> infos;
+        std::atomic<size_t> remaining;
+        std::function<void(std::vector<MediaInfo> &infos)> done;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->paths = paths;
+    batch->infos.resize(paths.size());
+    batch->remaining = paths.size();
+    batch->done = std::move(done);
+    if (paths.empty()) {
+        batch->done(batch->infos);
+        return;
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        pool.Submit([batch, i]() {
+            ProbeMedia(batch->paths[i], &batch->infos[i]);
+            if (--batch->remaining == 0)
+                batch->done(batch->infos);
+        });
+    }
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef FFMPEG_MEMORY_GOVERNOR
+#define FFMPEG_MEMORY_GOVERNOR
+
+#include <unistd.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Ways a player can give memory back, in the order the governor asks for
+// them: the cheapest, least visible relief first.
+enum class MemoryRelief
+{
+    kShrinkQueues,
+    kEvictCache,
+    kDownshift,
+};
+
+// Implemented by anything that registers reservations with the governor.
+class MemoryClient
+{
+public:
+    virtual ~MemoryClient() {}
+    // Releases what it can through |relief|. Returns false if that kind of
+    // relief is exhausted for this client.
+    virtual bool Relieve(MemoryRelief relief) = 0;
+};
+
+struct MemoryUsage
+{
+    std::string name;
+    int priority = 0;
+    size_t total = 0;
+    std::map<std::string, size_t> reservations;
+};
+
+struct MemoryReport
+{
+    size_t budget = 0;
+    size_t total = 0;
+    uint64_t reliefs = 0;
+    std::vector<MemoryUsage> clients;
+};
+
+// Plugin-wide accounting of decoded-media memory. Players record what they
+// hold per category; when the total exceeds the budget, the lowest-priority
+// players are asked for relief until it fits again.
+class MemoryGovernor
+{
+private:
+    struct Client
+    {
+        MemoryUsage usage;
+        uint64_t order;
+    };
+
+    mutable std::mutex mutex;
+    std::mutex enforce_mutex;
+    std::map<MemoryClient*, Client> clients;
+    size_t budget;
+    size_t total;
+    uint64_t registrations;
+    uint64_t reliefs;
+
+    void enforce();
+    void relieve_over_budget();
+
+public:
+    MemoryGovernor();
+
+    static MemoryGovernor &Shared();
+    // Half of physical memory, which leaves room for the rest of the app.
+    static size_t DefaultBudget();
+
+    void SetBudget(size_t bytes);
+    void Register(MemoryClient *client, const std::string &name, int priority);
+    void Unregister(MemoryClient *client);
+    // Replaces what |client| holds for |category|, then enforces the budget.
+    void Reserve(MemoryClient *client, const std::string &category, size_t bytes);
+    size_t Total() const;
+    // What |client| holds in all categories together.
+    size_t Usage(MemoryClient *client) const;
+    MemoryReport Report() const;
+};
+
+MemoryGovernor::MemoryGovernor()
+    : budget(DefaultBudget()), total(0), registrations(0), reliefs(0)
+{
+}
+
+MemoryGovernor &MemoryGovernor::Shared() {
+    static MemoryGovernor governor;
+    return governor;
+}
+
+size_t MemoryGovernor::DefaultBudget() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0)
+        return SIZE_MAX;
+    return size_t(pages) * size_t(page_size) / 2;
+}
+
+void MemoryGovernor::SetBudget(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+    }
+    enforce();
+}
+
+void MemoryGovernor::Register(MemoryClient *client, const std::string &name, int priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Client &entry = clients[client];
+    entry.usage.name = name;
+    entry.usage.priority = priority;
+    entry.order = registrations++;
+}
+
+void MemoryGovernor::Unregister(MemoryClient *client) {
+    /* wait out any enforcement pass that might be relieving |client| */
+    std::lock_guard<std::mutex> guard(enforce_mutex);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = clients.find(client);
+    if (it == clients.end())
+        return;
+    total -= it->second.usage.total;
+    clients.erase(it);
+}
+
+void MemoryGovernor::Reserve(MemoryClient *client, const std::string &category, size_t bytes) {
+    bool over;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = clients.find(client);
+        if (it == clients.end())
+            return;
+        MemoryUsage &usage = it->second.usage;
+        size_t &reserved = usage.reservations[category];
+        usage.total = usage.total - reserved + bytes;
+        total = total - reserved + bytes;
+        reserved = bytes;
+        over = total > budget;
+    }
+    if (over)
+        enforce();
+}
+
+void MemoryGovernor::enforce() {
+    /* relief calls back into Reserve on the thread running the pass, which
+     * must not start another; one pass at a time is enough, and the thread
+     * already running it will see the new totals */
+    static thread_local bool enforcing = false;
+    if (enforcing)
+        return;
+    std::unique_lock<std::mutex> guard(enforce_mutex, std::try_to_lock);
+    if (!guard.owns_lock())
+        return;
+    enforcing = true;
+    relieve_over_budget();
+    enforcing = false;
+}
+
+void MemoryGovernor::relieve_over_budget() {
+    std::vector<std::pair<int, std::pair<uint64_t, MemoryClient*>>> order;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total <= budget)
+            return;
+        for (auto &entry : clients) {
+            /* lowest priority first; among equals, the most recently created */
+            order.push_back({entry.second.usage.priority,
+                             {UINT64_MAX - entry.second.order, entry.first}});
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    const MemoryRelief steps[] = {
+        MemoryRelief::kShrinkQueues, MemoryRelief::kEvictCache, MemoryRelief::kDownshift,
+    };
+    for (MemoryRelief relief : steps) {
+        for (auto &entry : order) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (total <= budget)
+                    return;
+                /* the client may have gone away since the list was taken */
+                if (clients.find(entry.second.second) == clients.end())
+                    continue;
+            }
+            if (entry.second.second->Relieve(relief)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                reliefs++;
+            }
+        }
+    }
+}
+
+size_t MemoryGovernor::Total() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+size_t MemoryGovernor::Usage(MemoryClient *client) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = clients.find(client);
+    return (it != clients.end())? it->second.usage.total:0;
+}
+
+MemoryReport MemoryGovernor::Report() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryReport report;
+    report.budget = budget;
+    report.total = total;
+    report.reliefs = reliefs;
+    for (auto &entry : clients) {
+        report.clients.push_back(entry.second.usage);
+    }
+    return report;
+}
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef FFMPEG_OFFLINE_DECODER
+#define FFMPEG_OFFLINE_DECODER
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+}
+
+#include "bounded_queue.cc"
+#include "frame_converter.cc"
+#include "thread_pool.cc"
+
+// Settings of an OfflineDecoder run.
+struct OfflineOptions
+{
+    // Size and format frames are delivered in. Zero sizes and
+    // AV_PIX_FMT_NONE keep the decoder's.
+    int width = 0;
+    int height = 0;
+    AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+
+    // Segments decoded at once; 0 means one per core.
+    int threads = 0;
+    // Shorter stretches are not worth a decoder of their own.
+    int64_t min_segment_us = 2 * AV_TIME_BASE;
+    // Decoded frames held ahead of the consumer, across all segments.
+    size_t buffer_bytes = 256 << 20;
+    // Run the decoders at the lowest scheduling priority, for jobs that
+    // must not take cores from playback.
+    bool background = false;
+};
+
+struct OfflineStats
+{
+    uint64_t frames = 0;
+    int segments = 0;
+    int threads = 0;
+    int64_t elapsed_us = 0;
+};
+
+// Every frame of a file, in order and as fast as the cores allow, for
+// analysis rather than playback. The file is cut at keyframes into segments
+// that are decoded in parallel, each by its own demuxer and decoder, while
+// the consumer takes them in turn.
+class OfflineDecoder
+{
+public:
+    // Called on the thread running Run, with frames in presentation order.
+    // |time_us| is measured from the start of the stream. Returning false
+    // ends the run early.
+    typedef std::function<bool(const AVFrame *frame, int64_t time_us)> Consumer;
+
+private:
+    std::string path;
+    OfflineOptions options;
+    std::atomic<bool> cancelled;
+
+    AVRational time_base;
+    int64_t start_pts;
+    int source_width, source_height;
+    AVPixelFormat source_format;
+    AVRational source_aspect;
+    int64_t duration_us;
+
+    /* segment i holds the frames with pts in [boundaries[i], boundaries[i + 1]) */
+    std::vector<int64_t> boundaries;
+    int decoder_threads;
+    OfflineStats stats;
+
+    static int open_video(const std::string &path, int threads, AVFormatContext **fmt,
+                          AVCodecContext **dec, int *stream);
+    int find_boundaries(AVFormatContext *fmt, int stream);
+    int decode_segment(int index, BoundedQueue<AVFrame*> *out);
+
+public:
+    OfflineDecoder();
+
+    int Open(const std::string &path, const OfflineOptions &options = OfflineOptions());
+    // Decodes the whole file into |consumer|. Returns AVERROR_EXIT if the
+    // run was cancelled or the consumer stopped it.
+    int Run(const Consumer &consumer);
+    // Ends a Run from any thread.
+    void Cancel() { cancelled = true; }
+
+    int Width() const { return options.width > 0? options.width:source_width; }
+    int Height() const { return options.height > 0? options.height:source_height; }
+    AVPixelFormat Format() const {
+        return options.pix_fmt != AV_PIX_FMT_NONE? options.pix_fmt:source_format;
+    }
+    int64_t Duration() const { return duration_us; }
+    int Segments() const { return boundaries.size() - 1; }
+    const OfflineStats &Stats() const { return stats; }
+};
+
+OfflineDecoder::OfflineDecoder()
+    : cancelled(false),
+      time_base(AVRational{1, AV_TIME_BASE}),
+      start_pts(0),
+      source_width(0),
+      source_height(0),
+      source_format(AV_PIX_FMT_NONE),
+      source_aspect(AVRational{1, 1}),
+      duration_us(0),
+      decoder_threads(1)
+{
+}
+
+int OfflineDecoder::open_video(const std::string &path, int threads, AVFormatContext **fmt,
+                               AVCodecContext **dec, int *stream) {
+    AVCodec *codec;
+    int ret = avformat_open_input(fmt, path.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(*fmt, NULL)) < 0)
+        return ret;
+    if ((ret = av_find_best_stream(*fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+        return ret;
+    *stream = ret;
+
+    /* only the video is of interest */
+    for (unsigned i = 0; i < (*fmt)->nb_streams; i++) {
+        if (int(i) != *stream)
+            (*fmt)->streams[i]->discard = AVDISCARD_ALL;
+    }
+    if (!(*dec = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(*dec, (*fmt)->streams[*stream]->codecpar);
+    (*dec)->thread_count = threads;
+    return avcodec_open2(*dec, codec, NULL);
+}
+
+int OfflineDecoder::Open(const std::string &filename, const OfflineOptions &opts) {
+    path = filename;
+    options = opts;
+    cancelled = false;
+    if (options.threads <= 0)
+        options.threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    int stream;
+    int ret = open_video(path, 1, &fmt, &dec, &stream);
+    if (ret >= 0) {
+        AVStream *video = fmt->streams[stream];
+        time_base = video->time_base;
+        start_pts = (video->start_time != AV_NOPTS_VALUE)? video->start_time:0;
+        source_width = dec->width;
+        source_height = dec->height;
+        source_format = dec->pix_fmt;
+        source_aspect = dec->sample_aspect_ratio;
+        duration_us = (video->duration != AV_NOPTS_VALUE)?
+            av_rescale_q(video->duration, time_base, AV_TIME_BASE_Q):
+            std::max<int64_t>(fmt->duration, 0);
+        ret = find_boundaries(fmt, stream);
+    }
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Cannot prepare %s for analysis\n", path.c_str());
+    return ret;
+}
+
+int OfflineDecoder::find_boundaries(AVFormatContext *fmt, int stream) {
+    boundaries.assign(1, INT64_MIN);
+    int segments = std::min<int64_t>(options.threads * 4,
+                                     duration_us / std::max<int64_t>(options.min_segment_us, 1));
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+        return AVERROR(ENOMEM);
+
+    /* Seek to evenly spaced times and take the keyframe each one lands on.
+     * Nearby targets can land on the same keyframe, so keep them unique. */
+    int64_t first_key = AV_NOPTS_VALUE;
+    for (int i = 0; i < segments; i++) {
+        int64_t target = start_pts + av_rescale_q(duration_us * i / segments,
+                                                  AV_TIME_BASE_Q, time_base);
+        if (av_seek_frame(fmt, stream, target, AVSEEK_FLAG_BACKWARD) < 0)
+            break;
+        int64_t key = AV_NOPTS_VALUE;
+        while (av_read_frame(fmt, packet) >= 0) {
+            bool found = packet->stream_index == stream && (packet->flags & AV_PKT_FLAG_KEY);
+            if (found)
+                key = (packet->pts != AV_NOPTS_VALUE)? packet->pts:packet->dts;
+            av_packet_unref(packet);
+            if (found)
+                break;
+        }
+        if (i == 0)
+            first_key = key;
+        else if (key != AV_NOPTS_VALUE && first_key != AV_NOPTS_VALUE && key > first_key)
+            boundaries.push_back(key);
+    }
+    av_packet_free(&packet);
+
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    boundaries.push_back(INT64_MAX);
+    /* a short file is one segment, which may as well use every core */
+    decoder_threads = std::max<int>(options.threads / Segments(), 1);
+    return 0;
+}
+
+int OfflineDecoder::decode_segment(int index, BoundedQueue<AVFrame*> *out) {
+    if (cancelled)
+        return AVERROR_EXIT;
+    if (options.background) {
+        /* the pool is private, so the niceness dies with it */
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+    int64_t begin = boundaries[index], end = boundaries[index + 1];
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *decoded = av_frame_alloc();
+    FrameConverter converter;
+    bool convert = options.width > 0 || options.height > 0 || options.pix_fmt != AV_PIX_FMT_NONE;
+    bool done = false, draining = false;
+    int stream;
+    int ret;
+
+    if (!packet || !decoded) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_video(path, decoder_threads, &fmt, &dec, &stream)) < 0)
+        goto end;
+    /* lands on the keyframe that starts the segment */
+    if (index > 0 && (ret = av_seek_frame(fmt, stream, begin, AVSEEK_FLAG_BACKWARD)) < 0)
+        goto end;
+    if (convert &&
+        (ret = converter.Init(dec->width, dec->height, dec->pix_fmt, time_base, dec->sample_aspect_ratio,
+                              options.width, options.height, options.pix_fmt)) < 0)
+        goto end;
+
+    while (!done && !cancelled) {
+        if (!draining) {
+            ret = av_read_frame(fmt, packet);
+            if (ret == AVERROR_EOF) {
+                draining = true;
+                avcodec_send_packet(dec, NULL);
+            } else if (ret < 0) {
+                goto end;
+            } else {
+                if (packet->stream_index == stream) {
+                    /* a damaged packet costs a frame, not the analysis */
+                    avcodec_send_packet(dec, packet);
+                }
+                av_packet_unref(packet);
+            }
+        }
+
+        while ((ret = avcodec_receive_frame(dec, decoded)) >= 0) {
+            int64_t pts = decoded->best_effort_timestamp;
+            /* Frames come out in presentation order, so the first one past
+             * the end means the rest of this segment has been delivered;
+             * the leading frames of an open GOP are the previous segment's. */
+            if (pts != AV_NOPTS_VALUE && pts >= end) {
+                done = true;
+                av_frame_unref(decoded);
+                break;
+            }
+            if (pts != AV_NOPTS_VALUE && pts < begin) {
+                av_frame_unref(decoded);
+                continue;
+            }
+            decoded->pts = pts;
+            AVFrame *delivered = av_frame_alloc();
+            if (!delivered) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            if (convert)
+                ret = converter.Convert(decoded, delivered);
+            else
+                av_frame_move_ref(delivered, decoded);
+            av_frame_unref(decoded);
+            if (ret < 0) {
+                av_frame_free(&delivered);
+                goto end;
+            }
+            if (!out->Push(delivered)) {
+                /* cancelled */
+                av_frame_free(&delivered);
+                done = true;
+                break;
+            }
+        }
+        if (ret == AVERROR_EOF)
+            done = true;
+    }
+    ret = 0;
+
+end:
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    return ret;
+}
+
+int OfflineDecoder::Run(const Consumer &consumer) {
+    int64_t started = av_gettime_relative();
+    int segments = Segments();
+    int threads = std::min(options.threads, segments);
+    stats = OfflineStats();
+    stats.segments = segments;
+    stats.threads = threads;
+
+    /* split the buffer budget between the segments decoding at once */
+    int frame_bytes = av_image_get_buffer_size(Format(), Width(), Height(), 1);
+    size_t depth = options.buffer_bytes / threads / std::max(frame_bytes, 1);
+    std::vector<std::unique_ptr<BoundedQueue<AVFrame*>>> queues;
+    std::vector<int> results(segments, 0);
+    for (int i = 0; i < segments; i++) {
+        queues.emplace_back(new BoundedQueue<AVFrame*>(std::max<size_t>(depth, 2)));
+    }
+
+    /* Segments queue up on a pool of their own, since a worker whose queue
+     * is full blocks until the consumer reaches it. Segment i + threads
+     * starts once an earlier one has been consumed. */
+    std::unique_ptr<ThreadPool> pool(new ThreadPool(threads));
+    for (int i = 0; i < segments; i++) {
+        pool->Submit([this, i, &queues, &results]() {
+            results[i] = decode_segment(i, queues[i].get());
+            /* NULL marks the end of the segment */
+            queues[i]->Push(NULL);
+        });
+    }
+
+    int ret = 0;
+    for (int i = 0; i < segments && ret >= 0; i++) {
+        AVFrame *item;
+        while (queues[i]->Pop(&item) && item) {
+            int64_t time = av_rescale_q(item->pts - start_pts, time_base, AV_TIME_BASE_Q);
+            if (!cancelled && !consumer(item, time))
+                cancelled = true;
+            stats.frames++;
+            av_frame_free(&item);
+            if (cancelled)
+                break;
+        }
+        if (cancelled)
+            ret = AVERROR_EXIT;
+        else if (results[i] < 0)
+            ret = results[i];
+    }
+
+    /* wake and drain every worker still running */
+    cancelled = true;
+    for (auto &queue : queues) {
+        queue->Close();
+    }
+    pool.reset();
+    for (auto &queue : queues) {
+        queue->Clear([](AVFrame *&item) { av_frame_free(&item); });
+    }
+    stats.elapsed_us = av_gettime_relative() - started;
+    if (ret < 0 && ret != AVERROR_EXIT)
+        av_log(NULL, AV_LOG_ERROR, "Analysis of %s failed\n", path.c_str());
+    return ret;
+}
+
+#endif
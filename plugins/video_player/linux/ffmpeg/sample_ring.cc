@@ -0,0 +1,92 @@
+#ifndef FFMPEG_SAMPLE_RING
+#define FFMPEG_SAMPLE_RING
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Single-producer, single-consumer ring of float samples. Neither side ever
+// blocks or takes a lock, so the consumer can run on an audio thread.
+class SampleRing
+{
+private:
+    std::vector<float> buffer;
+    size_t mask;
+    /* running totals of samples written and read; they only ever grow */
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+
+public:
+    // |capacity| is rounded up to a power of two.
+    explicit SampleRing(size_t capacity);
+
+    // Producer side. Writes as many of |count| samples as fit.
+    size_t Write(const float *samples, size_t count);
+    size_t Space() const;
+    uint64_t WritePosition() const { return head.load(std::memory_order_relaxed); }
+
+    // Consumer side. Reads up to |count| samples.
+    size_t Read(float *out, size_t count);
+    size_t Discard(size_t count);
+    size_t Available() const;
+    uint64_t ReadPosition() const { return tail.load(std::memory_order_relaxed); }
+
+    size_t Capacity() const { return buffer.size(); }
+};
+
+SampleRing::SampleRing(size_t capacity) : head(0), tail(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    buffer.resize(size);
+    mask = size - 1;
+}
+
+size_t SampleRing::Write(const float *samples, size_t count) {
+    uint64_t write = head.load(std::memory_order_relaxed);
+    uint64_t read = tail.load(std::memory_order_acquire);
+    count = std::min<size_t>(count, buffer.size() - (write - read));
+
+    /* copy in at most two pieces, around the end of the buffer */
+    size_t offset = write & mask;
+    size_t first = std::min(count, buffer.size() - offset);
+    memcpy(&buffer[offset], samples, first * sizeof(float));
+    memcpy(&buffer[0], samples + first, (count - first) * sizeof(float));
+    head.store(write + count, std::memory_order_release);
+    return count;
+}
+
+size_t SampleRing::Space() const {
+    return buffer.size() - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+}
+
+size_t SampleRing::Read(float *out, size_t count) {
+    uint64_t read = tail.load(std::memory_order_relaxed);
+    uint64_t write = head.load(std::memory_order_acquire);
+    count = std::min<size_t>(count, write - read);
+
+    size_t offset = read & mask;
+    size_t first = std::min(count, buffer.size() - offset);
+    memcpy(out, &buffer[offset], first * sizeof(float));
+    memcpy(out + first, &buffer[0], (count - first) * sizeof(float));
+    tail.store(read + count, std::memory_order_release);
+    return count;
+}
+
+size_t SampleRing::Discard(size_t count) {
+    uint64_t read = tail.load(std::memory_order_relaxed);
+    uint64_t write = head.load(std::memory_order_acquire);
+    count = std::min<size_t>(count, write - read);
+    tail.store(read + count, std::memory_order_release);
+    return count;
+}
+
+size_t SampleRing::Available() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+}
+
+#endif
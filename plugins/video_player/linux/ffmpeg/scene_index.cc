@@ -0,0 +1,351 @@
+#ifndef FFMPEG_SCENE_INDEX
+#define FFMPEG_SCENE_INDEX
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "media_cache.cc"
+#include "offline_decoder.cc"
+
+// Sum of |a[i] - b[i]| over |count| bytes.
+uint64_t FrameSad(const uint8_t *a, const uint8_t *b, size_t count) {
+    uint64_t sum = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i total = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        /* two 64-bit lanes of eight byte differences each */
+        total = _mm_add_epi64(total, _mm_sad_epu8(x, y));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, total);
+    sum = lanes[0] + lanes[1];
+#elif defined(__ARM_NEON)
+    uint64x2_t total = vdupq_n_u64(0);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        total = vpadalq_u32(total, vpaddlq_u16(vpaddlq_u8(d)));
+    }
+    sum = vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+#endif
+    for (; i < count; i++) {
+        sum += abs(int(a[i]) - int(b[i]));
+    }
+    return sum;
+}
+
+// The plain loop FrameSad replaces; kept as the test's reference.
+uint64_t FrameSadScalar(const uint8_t *a, const uint8_t *b, size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += abs(int(a[i]) - int(b[i]));
+    }
+    return sum;
+}
+
+struct SceneCut
+{
+    // From the start of the stream.
+    int64_t time_us;
+    // Mean difference from the previous frame per byte, 0 to 255.
+    float score;
+    // The scene's first frame, packed RGBA at the index's thumbnail size.
+    std::vector<uint8_t> thumbnail;
+};
+
+// Where the scenes of a file start. The first cut is always at the first
+// frame, so the thumbnails make a complete strip.
+struct SceneIndex
+{
+    int thumbnail_width = 0;
+    int thumbnail_height = 0;
+    std::vector<SceneCut> cuts;
+
+    static const uint32_t kMagic = 0x49535056; /* "VPSI" */
+    static const uint32_t kVersion = 1;
+
+    // The start of the scene nearest |time_us| if within |window_us|,
+    // otherwise |time_us| itself.
+    int64_t Snap(int64_t time_us, int64_t window_us) const;
+
+    std::vector<uint8_t> Serialize(const std::string &path, const FileIdentity &identity) const;
+    // Fails unless |bytes| were written for this |path| and |identity|.
+    bool Deserialize(const std::vector<uint8_t> &bytes, const std::string &path,
+                     const FileIdentity &identity);
+};
+
+int64_t SceneIndex::Snap(int64_t time_us, int64_t window_us) const {
+    int64_t best = time_us;
+    int64_t best_distance = window_us + 1;
+    auto it = std::lower_bound(cuts.begin(), cuts.end(), time_us,
+                               [](const SceneCut &cut, int64_t t) { return cut.time_us < t; });
+    /* only the cuts either side can be nearest */
+    for (auto candidate : { it, it == cuts.begin()? cuts.end():it - 1 }) {
+        if (candidate == cuts.end())
+            continue;
+        int64_t distance = std::abs(candidate->time_us - time_us);
+        if (distance < best_distance) {
+            best = candidate->time_us;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+std::vector<uint8_t> SceneIndex::Serialize(const std::string &path, const FileIdentity &identity) const {
+    CacheWriter writer;
+    writer.Put(uint32_t(kMagic));
+    writer.Put(uint32_t(kVersion));
+    writer.PutString(path);
+    writer.Put(identity.size);
+    writer.Put(identity.mtime_ns);
+    writer.Put(uint32_t(thumbnail_width));
+    writer.Put(uint32_t(thumbnail_height));
+    writer.Put(uint32_t(cuts.size()));
+    for (const SceneCut &cut : cuts) {
+        writer.Put(cut.time_us);
+        writer.Put(cut.score);
+        writer.PutBytes(cut.thumbnail.data(), cut.thumbnail.size());
+    }
+    return writer.Bytes();
+}
+
+bool SceneIndex::Deserialize(const std::vector<uint8_t> &bytes, const std::string &path,
+                             const FileIdentity &identity) {
+    CacheReader reader(bytes);
+    if (reader.Get<uint32_t>() != kMagic || reader.Get<uint32_t>() != kVersion ||
+        reader.GetString() != path)
+        return false;
+    FileIdentity stored;
+    stored.size = reader.Get<int64_t>();
+    stored.mtime_ns = reader.Get<int64_t>();
+    if (!reader.Ok() || stored != identity)
+        return false;
+    thumbnail_width = reader.Get<uint32_t>();
+    thumbnail_height = reader.Get<uint32_t>();
+    uint32_t count = reader.Get<uint32_t>();
+    size_t thumbnail_bytes = size_t(thumbnail_width) * thumbnail_height * 4;
+    /* every cut takes its time and score, thumbnail or not */
+    size_t cut_bytes = sizeof(int64_t) + sizeof(float) + thumbnail_bytes;
+    if (!reader.Ok() || thumbnail_bytes > (1 << 20) || count > reader.Remaining() / cut_bytes)
+        return false;
+    cuts.resize(count);
+    for (SceneCut &cut : cuts) {
+        cut.time_us = reader.Get<int64_t>();
+        cut.score = reader.Get<float>();
+        cut.thumbnail.resize(thumbnail_bytes);
+        reader.GetBytes(cut.thumbnail.data(), thumbnail_bytes);
+    }
+    return reader.Ok();
+}
+
+// Builds the SceneIndex of one file in the background: the file is decoded
+// by an OfflineDecoder straight to thumbnail size at the lowest priority,
+// and each frame is compared to the one before. A difference well above the
+// recent average starts a new scene. Finished indexes are kept in the
+// "scenes" media cache, so a file is only ever scanned once.
+class SceneIndexer
+{
+public:
+    enum class State { kIdle, kBuilding, kReady, kFailed, kCancelled };
+
+    static const int kThumbnailWidth = 128;
+    static const int kThumbnailHeight = 72;
+    // Below this a difference is motion, however calm the scene was.
+    static constexpr float kMinScore = 20.0f;
+    // How far above the running average a cut must stand.
+    static constexpr float kScoreRatio = 3.0f;
+    // Flashes and fades are not scenes of their own.
+    static const int64_t kMinSceneUs = AV_TIME_BASE / 2;
+
+private:
+    std::string path;
+    std::string cache_path;
+    FileIdentity identity;
+    OfflineDecoder decoder;
+    std::thread worker;
+    std::atomic<bool> cancelled;
+    std::atomic<int64_t> position_us;
+    std::atomic<int64_t> duration_us;
+
+    std::mutex mutex;
+    State state;
+    int error;
+    std::shared_ptr<const SceneIndex> index;
+
+    void finish(State final_state, int ret, std::shared_ptr<const SceneIndex> result);
+    void run();
+
+public:
+    explicit SceneIndexer(const std::string &path);
+    ~SceneIndexer();
+
+    // Loads the cached index if the file is unchanged, otherwise starts
+    // building it on a thread of its own.
+    void Start();
+    // Ends a build from any thread; the index stays unbuilt.
+    void Cancel();
+
+    State GetState();
+    // The error that failed the build.
+    int Error();
+    // How much of the file has been scanned, 0 to 1.
+    double Progress();
+    // Null until the state is kReady.
+    std::shared_ptr<const SceneIndex> Index();
+};
+
+SceneIndexer::SceneIndexer(const std::string &path)
+    : path(path), cancelled(false), position_us(0), duration_us(0), state(State::kIdle), error(0)
+{
+}
+
+SceneIndexer::~SceneIndexer()
+{
+    Cancel();
+    if (worker.joinable())
+        worker.join();
+}
+
+void SceneIndexer::Start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state != State::kIdle)
+        return;
+    if (!GetFileIdentity(path, &identity)) {
+        state = State::kFailed;
+        error = AVERROR(ENOENT);
+        return;
+    }
+    cache_path = MediaCachePath("scenes", path, ".idx");
+    std::vector<uint8_t> bytes;
+    auto cached = std::make_shared<SceneIndex>();
+    if (!cache_path.empty() && ReadWholeFile(cache_path, &bytes) == 0 &&
+        cached->Deserialize(bytes, path, identity)) {
+        index = cached;
+        state = State::kReady;
+        return;
+    }
+    state = State::kBuilding;
+    worker = std::thread(&SceneIndexer::run, this);
+}
+
+void SceneIndexer::Cancel() {
+    cancelled = true;
+    decoder.Cancel();
+}
+
+void SceneIndexer::finish(State final_state, int ret, std::shared_ptr<const SceneIndex> result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    state = final_state;
+    error = ret;
+    index = result;
+}
+
+void SceneIndexer::run() {
+    /* this thread consumes the frames; the decoders lower their own */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    OfflineOptions options;
+    options.width = kThumbnailWidth;
+    options.height = kThumbnailHeight;
+    options.pix_fmt = AV_PIX_FMT_RGBA;
+    options.threads = std::max(1, int(std::thread::hardware_concurrency()) / 4);
+    options.buffer_bytes = 16 << 20;
+    options.background = true;
+    int ret = decoder.Open(path, options);
+    if (ret < 0) {
+        finish(State::kFailed, ret, NULL);
+        return;
+    }
+    duration_us = decoder.Duration();
+    if (cancelled) {
+        /* Open clears a Cancel that raced it */
+        finish(State::kCancelled, AVERROR_EXIT, NULL);
+        return;
+    }
+
+    auto result = std::make_shared<SceneIndex>();
+    result->thumbnail_width = kThumbnailWidth;
+    result->thumbnail_height = kThumbnailHeight;
+    const size_t row_bytes = kThumbnailWidth * 4;
+    const size_t frame_bytes = row_bytes * kThumbnailHeight;
+    std::vector<uint8_t> previous, current(frame_bytes);
+    float average = 0;
+
+    ret = decoder.Run([&](const AVFrame *frame, int64_t time_us) {
+        position_us = time_us;
+        /* packed, so that the whole frame is one run for FrameSad */
+        for (int y = 0; y < kThumbnailHeight; y++) {
+            memcpy(&current[y * row_bytes], frame->data[0] + y * frame->linesize[0], row_bytes);
+        }
+        bool cut = previous.empty();
+        float score = 0;
+        if (!cut) {
+            score = float(FrameSad(current.data(), previous.data(), frame_bytes)) / frame_bytes;
+            cut = score >= kMinScore && score >= kScoreRatio * average &&
+                time_us - result->cuts.back().time_us >= kMinSceneUs;
+            /* a cut would hide the next one if it went into the average whole */
+            average += (std::min(score, kScoreRatio * average + 1) - average) * 0.1f;
+        }
+        if (cut)
+            result->cuts.push_back(SceneCut{ time_us, score, current });
+        previous.swap(current);
+        /* the first swap leaves an empty buffer behind */
+        current.resize(frame_bytes);
+        return true;
+    });
+    if (ret < 0) {
+        finish(ret == AVERROR_EXIT? State::kCancelled:State::kFailed, ret, NULL);
+        return;
+    }
+
+    if (!cache_path.empty())
+        ReplaceFile(cache_path, result->Serialize(path, identity));
+    position_us = duration_us.load();
+    finish(State::kReady, 0, result);
+}
+
+SceneIndexer::State SceneIndexer::GetState() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state;
+}
+
+int SceneIndexer::Error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+}
+
+double SceneIndexer::Progress() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state == State::kReady)
+        return 1.0;
+    int64_t duration = duration_us;
+    return duration > 0? std::min(1.0, double(position_us) / duration):0.0;
+}
+
+std::shared_ptr<const SceneIndex> SceneIndexer::Index() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return index;
+}
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef FFMPEG_SCRUB_PROXY
+#define FFMPEG_SCRUB_PROXY
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+#include "job_queue.cc"
+#include "media_cache.cc"
+#include "offline_decoder.cc"
+
+// A low-resolution, all-intra stand-in for a file, so that any position can
+// be shown during a drag without decoding from the previous keyframe. The
+// frames are raw YUV420P in a memory-mapped file of the "proxies" media
+// cache: a ScrubProxyHeader and the source path in the first kDataOffset
+// bytes, then the frames back to back, then their times.
+struct ScrubProxyHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t source_size;
+    int64_t source_mtime_ns;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frame_count;
+    uint32_t path_length;
+    uint64_t frame_bytes;
+};
+
+class ScrubProxy
+{
+private:
+    uint8_t *base;
+    size_t size;
+    const ScrubProxyHeader *header;
+    const int64_t *times;
+
+public:
+    static const uint32_t kMagic = 0x50535056; /* "VPSP" */
+    static const uint32_t kVersion = 1;
+    static const size_t kDataOffset = 4096;
+    static const AVPixelFormat kFormat = AV_PIX_FMT_YUV420P;
+
+    ScrubProxy() : base(NULL), size(0), header(NULL), times(NULL) {}
+    ~ScrubProxy() {
+        if (base)
+            munmap(base, size);
+    }
+
+    // The cache file of |source|, wherever it is to be written.
+    static std::string CachePath(const std::string &source) {
+        return MediaCachePath("proxies", source, ".proxy");
+    }
+
+    // Maps the proxy of |source| if one was built from the file as it is now.
+    int Open(const std::string &source);
+
+    int Width() const { return header->width; }
+    int Height() const { return header->height; }
+    int Count() const { return header->frame_count; }
+    // From the start of the stream.
+    int64_t Time(int index) const { return times[index]; }
+    // The frame nearest |time_us|.
+    int Find(int64_t time_us) const;
+    // Points |frame|'s planes into the mapping; it must not outlive the proxy.
+    void Wrap(int index, AVFrame *frame) const;
+};
+
+int ScrubProxy::Open(const std::string &source) {
+    FileIdentity identity;
+    if (!GetFileIdentity(source, &identity))
+        return AVERROR(ENOENT);
+    std::string path = CachePath(source);
+    int fd = path.empty()? -1:open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return AVERROR(ENOENT);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= kDataOffset) {
+        size = st.st_size;
+        base = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            base = NULL;
+    }
+    close(fd);
+    if (!base)
+        return AVERROR(EIO);
+
+    header = (const ScrubProxyHeader*)base;
+    int frame_bytes = av_image_get_buffer_size(kFormat, header->width, header->height, 1);
+    if (header->magic != kMagic || header->version != kVersion ||
+        header->source_size != identity.size || header->source_mtime_ns != identity.mtime_ns ||
+        header->frame_count == 0 || frame_bytes <= 0 || header->frame_bytes != uint64_t(frame_bytes) ||
+        header->path_length > kDataOffset - sizeof(ScrubProxyHeader) ||
+        source.compare(0, std::string::npos, (const char*)(header + 1), header->path_length) != 0 ||
+        /* both factors are bounded by the file before they are multiplied */
+        header->frame_count > (size - kDataOffset) / (header->frame_bytes + sizeof(int64_t)))
+        return AVERROR_INVALIDDATA;
+    times = (const int64_t*)(base + kDataOffset + header->frame_bytes * header->frame_count);
+    return 0;
+}
+
+int ScrubProxy::Find(int64_t time_us) const {
+    const int64_t *end = times + header->frame_count;
+    const int64_t *it = std::lower_bound(times, end, time_us);
+    if (it == end)
+        return header->frame_count - 1;
+    if (it != times && time_us - it[-1] < *it - time_us)
+        it--;
+    return it - times;
+}
+
+void ScrubProxy::Wrap(int index, AVFrame *frame) const {
+    const uint8_t *pixels = base + kDataOffset + header->frame_bytes * index;
+    frame->width = header->width;
+    frame->height = header->height;
+    frame->format = kFormat;
+    av_image_fill_arrays(frame->data, frame->linesize, pixels, kFormat, header->width, header->height, 1);
+}
+
+// Builds a ScrubProxy on a JobQueue, or finds it already in the cache.
+class ScrubProxyJob : public std::enable_shared_from_this<ScrubProxyJob>
+{
+public:
+    enum class State { kIdle, kBuilding, kReady, kFailed, kCancelled };
+
+    static const int kWidth = 256;
+    // The whole file is covered by at most this many frames; a short one
+    // keeps every frame.
+    static const int kMaxFrames = 3600;
+
+private:
+    std::string source;
+    JobQueue *queue;
+    int64_t job_id;
+    std::atomic<int64_t> position_us;
+    std::atomic<int64_t> duration_us;
+
+    std::mutex mutex;
+    State state;
+    std::shared_ptr<const ScrubProxy> proxy;
+
+    int build(const std::atomic<bool> &cancelled);
+    void finish(State final_state);
+
+public:
+    explicit ScrubProxyJob(const std::string &source);
+
+    void Start(JobQueue &queue, int priority);
+    void Cancel();
+
+    State GetState();
+    double Progress();
+    // Null until the state is kReady.
+    std::shared_ptr<const ScrubProxy> Proxy();
+};
+
+ScrubProxyJob::ScrubProxyJob(const std::string &source)
+    : source(source), queue(NULL), job_id(-1), position_us(0), duration_us(0), state(State::kIdle)
+{
+}
+
+void ScrubProxyJob::Start(JobQueue &jobs, int priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state != State::kIdle)
+        return;
+    auto cached = std::make_shared<ScrubProxy>();
+    if (cached->Open(source) >= 0) {
+        proxy = cached;
+        state = State::kReady;
+        return;
+    }
+    state = State::kBuilding;
+    queue = &jobs;
+    /* the job holds on to this object, not to the player that asked */
+    auto self = shared_from_this();
+    job_id = jobs.Submit(priority, [self](const std::atomic<bool> &cancelled) {
+        int ret = self->build(cancelled);
+        if (ret == AVERROR_EXIT) {
+            self->finish(State::kCancelled);
+            return;
+        }
+        auto built = std::make_shared<ScrubProxy>();
+        if (ret < 0 || built->Open(self->source) < 0) {
+            self->finish(State::kFailed);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->proxy = built;
+        self->state = State::kReady;
+    }, [self]() {
+        self->finish(State::kCancelled);
+    });
+}
+
+void ScrubProxyJob::Cancel() {
+    int64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = job_id;
+    }
+    if (id >= 0)
+        queue->Cancel(id);
+}
+
+void ScrubProxyJob::finish(State final_state) {
+    std::lock_guard<std::mutex> lock(mutex);
+    state = final_state;
+}
+
+int ScrubProxyJob::build(const std::atomic<bool> &cancelled) {
+    FileIdentity identity;
+    std::string path = ScrubProxy::CachePath(source);
+    if (cancelled)
+        return AVERROR_EXIT;
+    if (path.empty() || !GetFileIdentity(source, &identity))
+        return AVERROR(ENOENT);
+    /* Open checks the whole path against the one stored in the header, so
+     * a proxy of a longer one would never be taken */
+    if (source.size() > ScrubProxy::kDataOffset - sizeof(ScrubProxyHeader))
+        return AVERROR(ENAMETOOLONG);
+
+    /* the first open only learns the source's shape */
+    OfflineDecoder decoder;
+    int ret = decoder.Open(source);
+    if (ret < 0)
+        return ret;
+    OfflineOptions options;
+    options.width = kWidth;
+    options.height = std::max(2, int(int64_t(kWidth) * decoder.Height() / std::max(decoder.Width(), 1)) & ~1);
+    options.pix_fmt = ScrubProxy::kFormat;
+    options.threads = std::max(1, int(std::thread::hardware_concurrency()) / 4);
+    options.buffer_bytes = 16 << 20;
+    options.background = true;
+    if ((ret = decoder.Open(source, options)) < 0)
+        return ret;
+    duration_us = decoder.Duration();
+    int64_t interval = decoder.Duration() / kMaxFrames;
+
+    ScrubProxyHeader header = {};
+    header.magic = ScrubProxy::kMagic;
+    header.version = ScrubProxy::kVersion;
+    header.source_size = identity.size;
+    header.source_mtime_ns = identity.mtime_ns;
+    header.width = options.width;
+    header.height = options.height;
+    header.path_length = source.size();
+    header.frame_bytes = av_image_get_buffer_size(options.pix_fmt, options.width, options.height, 1);
+
+    /* written aside and renamed into place, like every cache entry; two
+     * players of one file may be building at once */
+    std::string temporary = TemporaryPath(path);
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return AVERROR(errno);
+    std::vector<uint8_t> block(std::max<size_t>(ScrubProxy::kDataOffset, header.frame_bytes));
+    std::vector<int64_t> times;
+    bool written = fwrite(block.data(), 1, ScrubProxy::kDataOffset, file) == ScrubProxy::kDataOffset;
+    int64_t next_time = INT64_MIN;
+
+    ret = decoder.Run([&](const AVFrame *frame, int64_t time_us) {
+        position_us = time_us;
+        if (cancelled)
+            return false;
+        if (time_us < next_time)
+            return true;
+        next_time = time_us + interval;
+        av_image_copy_to_buffer(block.data(), header.frame_bytes, frame->data, frame->linesize,
+                                options.pix_fmt, options.width, options.height, 1);
+        written = written && fwrite(block.data(), 1, header.frame_bytes, file) == header.frame_bytes;
+        times.push_back(time_us);
+        return written;
+    });
+    /* a failed write stops the run too, but is no cancellation */
+    if ((ret >= 0 || (ret == AVERROR_EXIT && !cancelled)) && (!written || times.empty()))
+        ret = AVERROR(EIO);
+
+    if (ret >= 0) {
+        header.frame_count = times.size();
+        written = fwrite(times.data(), sizeof(int64_t), times.size(), file) == times.size() &&
+            fseek(file, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(source.data(), 1, header.path_length, file) == header.path_length;
+    }
+    if (fclose(file) != 0 || !written)
+        ret = (ret < 0)? ret:AVERROR(EIO);
+    if (ret >= 0 && rename(temporary.c_str(), path.c_str()) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(temporary.c_str());
+    return ret;
+}
+
+ScrubProxyJob::State ScrubProxyJob::GetState() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state;
+}
+
+double ScrubProxyJob::Progress() {
+    if (GetState() == State::kReady)
+        return 1.0;
+    int64_t duration = duration_us;
+    return duration > 0? std::min(1.0, double(position_us) / duration):0.0;
+}
+
+std::shared_ptr<const ScrubProxy> ScrubProxyJob::Proxy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return proxy;
+}
+
+#endif
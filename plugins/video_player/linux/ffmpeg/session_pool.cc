@@ -0,0 +1,128 @@
+#ifndef FFMPEG_SESSION_POOL
+#define FFMPEG_SESSION_POOL
+
+#include <stddef.h>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ffmpeg_manager.cc"
+#include "memory_governor.cc"
+
+// Players whose last texture was disposed, kept open and paused in case the
+// same source is shown again soon, as tiles of a scrolling feed are. Taking
+// one back skips opening, probing and decoder setup, and its last frame is
+// ready to show at once. The least recently parked go first once there are
+// more than |max_sessions| or they hold more than |max_bytes| between them.
+class SessionPool
+{
+private:
+    struct Entry
+    {
+        std::string key;
+        FFMPEGManager *manager;
+        size_t bytes;
+    };
+
+    mutable std::mutex mutex;
+    /* most recently parked first */
+    std::list<Entry> entries;
+    size_t max_sessions;
+    size_t max_bytes;
+
+    std::vector<FFMPEGManager*> trim();
+
+public:
+    static const size_t kDefaultSessions = 4;
+    static const size_t kDefaultBytes = 128 << 20;
+
+    SessionPool(size_t max_sessions = kDefaultSessions, size_t max_bytes = kDefaultBytes);
+
+    // Parks |manager| under |key|. Returns the players that no longer fit,
+    // for the caller to delete once it has forgotten them; |manager| itself
+    // is among them if it alone is over the limits.
+    std::vector<FFMPEGManager*> Put(const std::string &key, FFMPEGManager *manager);
+    // The player parked under |key|, now the caller's again, or null.
+    FFMPEGManager *Take(const std::string &key);
+    // Returns the evicted players, as Put does.
+    std::vector<FFMPEGManager*> SetLimits(size_t sessions, size_t bytes);
+    // Empties the pool, returning every player in it.
+    std::vector<FFMPEGManager*> Clear();
+
+    size_t Size() const;
+    size_t Bytes() const;
+};
+
+SessionPool::SessionPool(size_t max_sessions, size_t max_bytes)
+    : max_sessions(max_sessions), max_bytes(max_bytes)
+{
+}
+
+std::vector<FFMPEGManager*> SessionPool::Put(const std::string &key, FFMPEGManager *manager) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.push_front(Entry{key, manager, 0});
+    return trim();
+}
+
+FFMPEGManager *SessionPool::Take(const std::string &key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+        if (it->key == key) {
+            FFMPEGManager *manager = it->manager;
+            entries.erase(it);
+            return manager;
+        }
+    }
+    return NULL;
+}
+
+std::vector<FFMPEGManager*> SessionPool::SetLimits(size_t sessions, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    max_sessions = sessions;
+    max_bytes = bytes;
+    return trim();
+}
+
+std::vector<FFMPEGManager*> SessionPool::Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<FFMPEGManager*> evicted;
+    for (Entry &entry : entries) {
+        evicted.push_back(entry.manager);
+    }
+    entries.clear();
+    return evicted;
+}
+
+std::vector<FFMPEGManager*> SessionPool::trim() {
+    /* what each player holds is whatever it last reported to the governor */
+    size_t bytes = 0;
+    for (Entry &entry : entries) {
+        entry.bytes = MemoryGovernor::Shared().Usage(entry.manager);
+        bytes += entry.bytes;
+    }
+    std::vector<FFMPEGManager*> evicted;
+    while (!entries.empty() && (entries.size() > max_sessions || bytes > max_bytes)) {
+        bytes -= entries.back().bytes;
+        evicted.push_back(entries.back().manager);
+        entries.pop_back();
+    }
+    return evicted;
+}
+
+size_t SessionPool::Size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t SessionPool::Bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t bytes = 0;
+    for (const Entry &entry : entries) {
+        bytes += MemoryGovernor::Shared().Usage(entry.manager);
+    }
+    return bytes;
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef FFMPEG_SHM_FRAME_RING
+#define FFMPEG_SHM_FRAME_RING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+// Raw frames handed over in POSIX shared memory, for producers that already
+// have pixels and should not have to encode them.
+//
+// The object is a ShmFrameRingHeader followed by slot_count slots, each a
+// ShmFrameSlot and then the pixels of one frame. The producer writes frame n
+// into slot n % slot_count under a seqlock, bumps |published| and wakes the
+// futex word. Consumers only ever read the newest frame, so a slow consumer
+// skips frames rather than falling behind.
+enum class ShmPixelFormat : uint32_t
+{
+    kRGBA = 1,
+    // Luma plane, then interleaved chroma at half height, both |stride|
+    // wide. Width and height must be even.
+    kNV12 = 2,
+};
+
+struct ShmFrameRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    // Bytes per row of every plane.
+    uint32_t stride;
+    uint32_t slot_count;
+    uint32_t reserved;
+    // Bytes from one slot to the next, a multiple of 64.
+    uint64_t slot_size;
+    // Bumped, and woken, on every publish and on close.
+    alignas(64) std::atomic<uint32_t> futex;
+    std::atomic<uint32_t> closed;
+    std::atomic<uint64_t> published;
+};
+
+struct ShmFrameSlot
+{
+    // Odd while the producer is writing the slot.
+    std::atomic<uint64_t> sequence;
+    // Capture time on the monotonic clock, in microseconds.
+    int64_t pts_us;
+    uint8_t padding[48];
+};
+
+class ShmFrameRing
+{
+private:
+    std::string name;
+    bool owner;
+    int fd;
+    uint8_t *base;
+    size_t size;
+    ShmFrameRingHeader *header;
+    uint64_t consumed;
+
+    ShmFrameSlot *slot(uint64_t index) const;
+    int map(int prot);
+
+public:
+    static const uint32_t kMagic = 0x48535056; /* "VPSH" */
+    static const uint32_t kVersion = 1;
+    static const size_t kHeaderSize = 128;
+
+    ShmFrameRing();
+    ~ShmFrameRing();
+
+    static size_t FrameBytes(ShmPixelFormat format, uint32_t stride, uint32_t height);
+
+    // Producer side: creates |name| (without the leading slash).
+    int Create(const std::string &name, ShmPixelFormat format, uint32_t width,
+               uint32_t height, uint32_t slot_count);
+    void Publish(const uint8_t *pixels, int64_t pts_us);
+    void Close();
+
+    // Consumer side.
+    int Open(const std::string &name);
+    // Waits up to |timeout_us| for a frame newer than the last one read.
+    // Returns 1 if there is one, 0 on timeout and AVERROR_EOF once closed.
+    int Wait(int64_t timeout_us);
+    // Copies the newest frame into |planes|. Returns false if the producer
+    // overwrote it meanwhile; the next Wait returns at once to retry.
+    bool ReadLatest(uint8_t *const planes[], const int linesizes[], int64_t *pts_us);
+
+    const ShmFrameRingHeader *Header() const { return header; }
+};
+
+ShmFrameRing::ShmFrameRing()
+    : owner(false), fd(-1), base(NULL), size(0), header(NULL), consumed(0)
+{
+}
+
+ShmFrameRing::~ShmFrameRing()
+{
+    if (base)
+        munmap(base, size);
+    if (fd >= 0)
+        close(fd);
+    if (owner)
+        shm_unlink(("/" + name).c_str());
+}
+
+size_t ShmFrameRing::FrameBytes(ShmPixelFormat format, uint32_t stride, uint32_t height) {
+    return (format == ShmPixelFormat::kNV12)? size_t(stride) * height * 3 / 2:size_t(stride) * height;
+}
+
+ShmFrameSlot *ShmFrameRing::slot(uint64_t index) const {
+    return (ShmFrameSlot*)(base + kHeaderSize + (index % header->slot_count) * header->slot_size);
+}
+
+int ShmFrameRing::map(int prot) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    size = st.st_size;
+    base = (uint8_t*)mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        return -errno;
+    }
+    header = (ShmFrameRingHeader*)base;
+    return 0;
+}
+
+int ShmFrameRing::Create(const std::string &ring_name, ShmPixelFormat format, uint32_t width,
+                         uint32_t height, uint32_t slot_count) {
+    static_assert(sizeof(ShmFrameRingHeader) <= kHeaderSize, "header outgrew its space");
+    static_assert(sizeof(ShmFrameSlot) == 64, "pixels must start 64-byte aligned");
+    if (format == ShmPixelFormat::kNV12 && ((width | height) & 1))
+        return -EINVAL;
+    name = ring_name;
+    fd = shm_open(("/" + name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -errno;
+    owner = true;
+
+    uint32_t stride = (format == ShmPixelFormat::kRGBA)? width * 4:width;
+    uint64_t slot_size = (sizeof(ShmFrameSlot) + FrameBytes(format, stride, height) + 63) & ~uint64_t(63);
+    if (ftruncate(fd, kHeaderSize + slot_size * slot_count) < 0)
+        return -errno;
+    int ret = map(PROT_READ | PROT_WRITE);
+    if (ret < 0)
+        return ret;
+
+    header->version = kVersion;
+    header->format = uint32_t(format);
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    /* consumers check the magic last */
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = kMagic;
+    return 0;
+}
+
+void ShmFrameRing::Publish(const uint8_t *pixels, int64_t pts_us) {
+    uint64_t n = header->published.load(std::memory_order_relaxed);
+    ShmFrameSlot *target = slot(n);
+    target->sequence.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    target->pts_us = pts_us;
+    memcpy((uint8_t*)(target + 1), pixels,
+           FrameBytes(ShmPixelFormat(header->format), header->stride, header->height));
+    target->sequence.store(2 * n + 2, std::memory_order_release);
+    header->published.store(n + 1, std::memory_order_release);
+    header->futex.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+void ShmFrameRing::Close() {
+    header->closed.store(1, std::memory_order_release);
+    header->futex.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+int ShmFrameRing::Open(const std::string &ring_name) {
+    name = ring_name;
+    fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return -errno;
+    int ret = map(PROT_READ);
+    if (ret < 0)
+        return ret;
+    if (size < kHeaderSize || header->magic != kMagic || header->version != kVersion ||
+        (header->format != uint32_t(ShmPixelFormat::kRGBA) &&
+         header->format != uint32_t(ShmPixelFormat::kNV12)) ||
+        header->slot_count == 0 || size < kHeaderSize + header->slot_size * header->slot_count ||
+        header->slot_size < sizeof(ShmFrameSlot) +
+            FrameBytes(ShmPixelFormat(header->format), header->stride, header->height))
+        return -EINVAL;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    /* only frames published from now on */
+    consumed = header->published.load(std::memory_order_acquire);
+    return 0;
+}
+
+int ShmFrameRing::Wait(int64_t timeout_us) {
+    uint32_t seen = header->futex.load(std::memory_order_acquire);
+    if (header->published.load(std::memory_order_acquire) > consumed)
+        return 1;
+    if (header->closed.load(std::memory_order_acquire))
+        return AVERROR_EOF;
+
+    struct timespec timeout;
+    timeout.tv_sec = timeout_us / 1000000;
+    timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+    /* the word is shared with another process, so no FUTEX_PRIVATE_FLAG */
+    syscall(SYS_futex, &header->futex, FUTEX_WAIT, seen, &timeout, NULL, 0);
+
+    if (header->published.load(std::memory_order_acquire) > consumed)
+        return 1;
+    return header->closed.load(std::memory_order_acquire)? AVERROR_EOF:0;
+}
+
+bool ShmFrameRing::ReadLatest(uint8_t *const planes[], const int linesizes[], int64_t *pts_us) {
+    uint64_t n = header->published.load(std::memory_order_acquire);
+    if (n == 0)
+        return false;
+    consumed = n;
+    ShmFrameSlot *source = slot(n - 1);
+    uint64_t sequence = source->sequence.load(std::memory_order_acquire);
+    if (sequence != 2 * (n - 1) + 2)
+        return false;
+
+    const uint8_t *pixels = (const uint8_t*)(source + 1);
+    int rows = header->height;
+    int plane_count = (header->format == uint32_t(ShmPixelFormat::kNV12))? 2:1;
+    size_t row_bytes = (header->format == uint32_t(ShmPixelFormat::kRGBA))?
+        size_t(header->width) * 4:header->width;
+    for (int plane = 0; plane < plane_count; plane++) {
+        if (plane == 1)
+            rows = header->height / 2;
+        for (int y = 0; y < rows; y++) {
+            memcpy(planes[plane] + size_t(y) * linesizes[plane], pixels + size_t(y) * header->stride,
+                   row_bytes);
+        }
+        pixels += size_t(header->stride) * header->height;
+    }
+    *pts_us = source->pts_us;
+
+    /* a changed sequence means the producer lapped us mid-copy */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return source->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+#endif
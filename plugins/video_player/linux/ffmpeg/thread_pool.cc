@@ -0,0 +1,126 @@
+#ifndef FFMPEG_THREAD_POOL
+#define FFMPEG_THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads running tasks in the order submitted. For
+// work that splits into independent pieces, such as the frames of an image
+// sequence; players share one pool so that they share the cores too.
+class ThreadPool
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool closing;
+
+    void worker_loop();
+
+public:
+    // One worker per core unless told otherwise.
+    explicit ThreadPool(size_t threads = 0);
+    // Runs whatever is still queued, then joins the workers.
+    ~ThreadPool();
+
+    static ThreadPool &Shared();
+
+    void Submit(std::function<void()> task);
+    // Runs work(0) to work(count - 1) on the workers and the calling thread,
+    // returning once all are done. Safe to call from a worker: the caller
+    // takes its share rather than waiting for a free one.
+    void ParallelFor(int count, const std::function<void(int)> &work);
+    size_t Size() const { return workers.size(); }
+};
+
+ThreadPool::ThreadPool(size_t threads) : closing(false)
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+ThreadPool &ThreadPool::Shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)> &work) {
+    struct Job
+    {
+        std::atomic<int> next{0};
+        int done = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    /* helpers that only get going once everything is done find nothing
+     * left, and never touch |work| */
+    auto job = std::make_shared<Job>();
+    auto run = [job, count, &work]() {
+        int index, finished = 0;
+        while ((index = job->next++) < count) {
+            work(index);
+            finished++;
+        }
+        if (finished > 0) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->done += finished;
+            if (job->done == count)
+                job->cv.notify_all();
+        }
+    };
+    size_t helpers = std::min<size_t>(workers.size(), std::max(count - 1, 0));
+    for (size_t i = 0; i < helpers; i++) {
+        Submit(run);
+    }
+    run();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&job, count]() { return job->done >= count; });
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return closing || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+#endif
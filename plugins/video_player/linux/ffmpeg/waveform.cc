@@ -0,0 +1,397 @@
+#ifndef FFMPEG_WAVEFORM
+#define FFMPEG_WAVEFORM
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#include "media_cache.cc"
+#include "thread_pool.cc"
+
+// Folds |count| samples into a bucket's running minimum, maximum and sum of
+// squares.
+void ReduceSamples(const float *samples, size_t count, float *min, float *max, double *sum_squares) {
+    size_t i = 0;
+    float low = *min, high = *max, squares = 0;
+#if defined(__SSE__)
+    if (count >= 4) {
+        __m128 l = _mm_set1_ps(low), h = _mm_set1_ps(high), s = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            __m128 x = _mm_loadu_ps(samples + i);
+            l = _mm_min_ps(l, x);
+            h = _mm_max_ps(h, x);
+            s = _mm_add_ps(s, _mm_mul_ps(x, x));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, l);
+        low = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, h);
+        high = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, s);
+        squares = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+#elif defined(__ARM_NEON)
+    if (count >= 4) {
+        float32x4_t l = vdupq_n_f32(low), h = vdupq_n_f32(high), s = vdupq_n_f32(0);
+        for (; i + 4 <= count; i += 4) {
+            float32x4_t x = vld1q_f32(samples + i);
+            l = vminq_f32(l, x);
+            h = vmaxq_f32(h, x);
+            s = vmlaq_f32(s, x, x);
+        }
+        float lanes[4];
+        vst1q_f32(lanes, l);
+        low = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        vst1q_f32(lanes, h);
+        high = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+        vst1q_f32(lanes, s);
+        squares = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+#endif
+    for (; i < count; i++) {
+        low = std::min(low, samples[i]);
+        high = std::max(high, samples[i]);
+        squares += samples[i] * samples[i];
+    }
+    *min = low;
+    *max = high;
+    /* one frame's worth in float, the whole bucket in double */
+    *sum_squares += squares;
+}
+
+// The plain loop ReduceSamples replaces; kept as the test's reference.
+void ReduceSamplesScalar(const float *samples, size_t count, float *min, float *max, double *sum_squares) {
+    for (size_t i = 0; i < count; i++) {
+        *min = std::min(*min, samples[i]);
+        *max = std::max(*max, samples[i]);
+        *sum_squares += double(samples[i]) * samples[i];
+    }
+}
+
+// The overview of a file's audio for a timeline: the extremes and loudness
+// of the channels mixed to mono, in |buckets| equal stretches of time.
+struct Waveform
+{
+    int64_t duration_us = 0;
+    int sample_rate = 0;
+    int channels = 0;
+    std::vector<float> min;
+    std::vector<float> max;
+    std::vector<float> rms;
+
+    static const uint32_t kMagic = 0x57535056; /* "VPSW" */
+    static const uint32_t kVersion = 1;
+
+    int Buckets() const { return min.size(); }
+
+    std::vector<uint8_t> Serialize(const std::string &key, const FileIdentity &identity) const;
+    bool Deserialize(const std::vector<uint8_t> &bytes, const std::string &key,
+                     const FileIdentity &identity);
+};
+
+std::vector<uint8_t> Waveform::Serialize(const std::string &key, const FileIdentity &identity) const {
+    CacheWriter writer;
+    writer.Put(uint32_t(kMagic));
+    writer.Put(uint32_t(kVersion));
+    writer.PutString(key);
+    writer.Put(identity.size);
+    writer.Put(identity.mtime_ns);
+    writer.Put(duration_us);
+    writer.Put(int32_t(sample_rate));
+    writer.Put(int32_t(channels));
+    writer.Put(uint32_t(Buckets()));
+    for (const std::vector<float> *values : { &min, &max, &rms }) {
+        writer.PutBytes((const uint8_t*)values->data(), values->size() * sizeof(float));
+    }
+    return writer.Bytes();
+}
+
+bool Waveform::Deserialize(const std::vector<uint8_t> &bytes, const std::string &key,
+                           const FileIdentity &identity) {
+    CacheReader reader(bytes);
+    if (reader.Get<uint32_t>() != kMagic || reader.Get<uint32_t>() != kVersion ||
+        reader.GetString() != key)
+        return false;
+    FileIdentity stored;
+    stored.size = reader.Get<int64_t>();
+    stored.mtime_ns = reader.Get<int64_t>();
+    if (!reader.Ok() || stored != identity)
+        return false;
+    duration_us = reader.Get<int64_t>();
+    sample_rate = reader.Get<int32_t>();
+    channels = reader.Get<int32_t>();
+    uint32_t buckets = reader.Get<uint32_t>();
+    if (!reader.Ok() || size_t(buckets) * 3 * sizeof(float) > bytes.size())
+        return false;
+    for (std::vector<float> *values : { &min, &max, &rms }) {
+        values->resize(buckets);
+        reader.GetBytes((uint8_t*)values->data(), buckets * sizeof(float));
+    }
+    return reader.Ok();
+}
+
+// Computes a Waveform by decoding the audio stream alone, every other stream
+// discarded by the demuxer. The buckets are split into runs of equal time
+// that are decoded in parallel, each by its own demuxer and decoder from the
+// packet a seek lands on; runs own disjoint buckets, so nothing is merged.
+class WaveformBuilder
+{
+private:
+    std::string path;
+    int buckets;
+    AVRational time_base;
+    int64_t start_pts;
+    int64_t total_samples;
+
+    /* per bucket, written by the one run that owns it */
+    std::vector<float> min, max;
+    std::vector<double> sum_squares;
+    std::vector<int64_t> counts;
+
+    static int open_audio(const std::string &path, AVFormatContext **fmt, AVCodecContext **dec,
+                          int *stream);
+    int64_t first_sample(int bucket) const {
+        return (bucket * total_samples + buckets - 1) / buckets;
+    }
+    int decode_run(int first_bucket, int end_bucket);
+
+public:
+    // Below this a run is not worth a decoder of its own.
+    static const int64_t kMinRunUs = 10 * AV_TIME_BASE;
+
+    int Build(const std::string &path, int buckets, Waveform *out, int threads = 0);
+};
+
+int WaveformBuilder::open_audio(const std::string &path, AVFormatContext **fmt, AVCodecContext **dec,
+                                int *stream) {
+    AVCodec *codec;
+    int ret = avformat_open_input(fmt, path.c_str(), NULL, NULL);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(*fmt, NULL)) < 0)
+        return ret;
+    if ((ret = av_find_best_stream(*fmt, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0)) < 0)
+        return ret;
+    *stream = ret;
+    for (unsigned i = 0; i < (*fmt)->nb_streams; i++) {
+        if ((int)i != *stream)
+            (*fmt)->streams[i]->discard = AVDISCARD_ALL;
+    }
+    if (!(*dec = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(*dec, (*fmt)->streams[*stream]->codecpar);
+    (*dec)->thread_count = 1;
+    return avcodec_open2(*dec, codec, NULL);
+}
+
+int WaveformBuilder::decode_run(int first_bucket, int end_bucket) {
+    int64_t begin = first_sample(first_bucket), end = first_sample(end_bucket);
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    SwrContext *swr = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    std::vector<float> mono;
+    bool done = false, draining = false;
+    int64_t position = AV_NOPTS_VALUE;
+    int64_t layout;
+    int stream;
+    int ret;
+
+    if (!packet || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_audio(path, &fmt, &dec, &stream)) < 0)
+        goto end;
+    /* lands on the packet at or before the run, whose extra samples are skipped */
+    if (first_bucket > 0 &&
+        (ret = av_seek_frame(fmt, stream,
+                             start_pts + av_rescale_q(begin, AVRational{1, dec->sample_rate}, time_base),
+                             AVSEEK_FLAG_BACKWARD)) < 0)
+        goto end;
+
+    /* mono at the source rate, so that a sample is a sample of the file */
+    layout = dec->channel_layout? dec->channel_layout:av_get_default_channel_layout(dec->channels);
+    swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLT, dec->sample_rate,
+                             layout, dec->sample_fmt, dec->sample_rate, 0, NULL);
+    if (!swr) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = swr_init(swr)) < 0)
+        goto end;
+
+    while (!done) {
+        if (!draining) {
+            ret = av_read_frame(fmt, packet);
+            if (ret == AVERROR_EOF) {
+                draining = true;
+                avcodec_send_packet(dec, NULL);
+            } else if (ret < 0) {
+                goto end;
+            } else {
+                if (packet->stream_index == stream) {
+                    /* a damaged packet costs a gap, not the waveform */
+                    avcodec_send_packet(dec, packet);
+                }
+                av_packet_unref(packet);
+            }
+        }
+
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE)
+                position = av_rescale_q(pts - start_pts, time_base, AVRational{1, dec->sample_rate});
+            else if (position == AV_NOPTS_VALUE)
+                position = begin;
+            mono.resize(frame->nb_samples);
+            uint8_t *out = (uint8_t*)mono.data();
+            int count = swr_convert(swr, &out, frame->nb_samples,
+                                    (const uint8_t**)frame->extended_data, frame->nb_samples);
+            av_frame_unref(frame);
+            if (count < 0)
+                continue;
+
+            /* the samples of the frame inside the run, bucket by bucket */
+            int64_t i = std::max<int64_t>(begin - position, 0);
+            while (i < count && position + i < end) {
+                int64_t sample = position + i;
+                int bucket = std::min<int64_t>(sample * buckets / total_samples, buckets - 1);
+                int64_t run = std::min<int64_t>(count - i, std::min(first_sample(bucket + 1), end) - sample);
+                run = std::max<int64_t>(run, 1);
+                ReduceSamples(&mono[i], run, &min[bucket], &max[bucket], &sum_squares[bucket]);
+                counts[bucket] += run;
+                i += run;
+            }
+            position += count;
+            if (position >= end) {
+                done = true;
+                break;
+            }
+        }
+        if (ret == AVERROR_EOF)
+            done = true;
+    }
+    ret = 0;
+
+end:
+    swr_free(&swr);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    return ret;
+}
+
+int WaveformBuilder::Build(const std::string &filename, int bucket_count, Waveform *out, int threads) {
+    path = filename;
+    buckets = bucket_count;
+    if (buckets <= 0)
+        return AVERROR(EINVAL);
+    if (threads <= 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    AVFormatContext *fmt = NULL;
+    AVCodecContext *dec = NULL;
+    int stream;
+    int ret = open_audio(path, &fmt, &dec, &stream);
+    if (ret >= 0) {
+        AVStream *audio = fmt->streams[stream];
+        time_base = audio->time_base;
+        start_pts = (audio->start_time != AV_NOPTS_VALUE)? audio->start_time:0;
+        out->duration_us = (audio->duration != AV_NOPTS_VALUE)?
+            av_rescale_q(audio->duration, time_base, AV_TIME_BASE_Q):
+            std::max<int64_t>(fmt->duration, 0);
+        out->sample_rate = dec->sample_rate;
+        out->channels = dec->channels;
+        total_samples = av_rescale(out->duration_us, dec->sample_rate, AV_TIME_BASE);
+        if (total_samples <= 0 || dec->sample_rate <= 0)
+            ret = AVERROR_INVALIDDATA;
+    }
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot read the audio of %s\n", path.c_str());
+        return ret;
+    }
+
+    min.assign(buckets, INFINITY);
+    max.assign(buckets, -INFINITY);
+    sum_squares.assign(buckets, 0);
+    counts.assign(buckets, 0);
+
+    int runs = std::max<int64_t>(std::min<int64_t>({ int64_t(threads), int64_t(buckets),
+                                                     out->duration_us / kMinRunUs }), 1);
+    std::vector<int> results(runs, 0);
+    {
+        ThreadPool pool(runs);
+        for (int i = 0; i < runs; i++) {
+            pool.Submit([this, i, runs, &results]() {
+                results[i] = decode_run(int64_t(buckets) * i / runs, int64_t(buckets) * (i + 1) / runs);
+            });
+        }
+    }
+    for (int result : results) {
+        if (result < 0)
+            return result;
+    }
+
+    /* buckets no sample fell into, as in gaps, read as silence */
+    out->min.resize(buckets);
+    out->max.resize(buckets);
+    out->rms.resize(buckets);
+    for (int i = 0; i < buckets; i++) {
+        bool empty = counts[i] == 0;
+        out->min[i] = empty? 0:min[i];
+        out->max[i] = empty? 0:max[i];
+        out->rms[i] = empty? 0:sqrt(sum_squares[i] / counts[i]);
+    }
+    return 0;
+}
+
+// Where files are summarized off the platform thread. Build spreads each
+// one over threads of its own, so one at a time is enough.
+ThreadPool &WaveformPool() {
+    static ThreadPool pool(1);
+    return pool;
+}
+
+// The Waveform of |path| from the "waveforms" media cache, computed and
+// stored there if the file changed since or was never summarized.
+int GetWaveform(const std::string &path, int buckets, Waveform *out) {
+    FileIdentity identity;
+    bool cacheable = GetFileIdentity(path, &identity);
+    std::string key = path + "#" + std::to_string(buckets);
+    std::string cache_path = cacheable? MediaCachePath("waveforms", key, ".peaks"):"";
+    std::vector<uint8_t> bytes;
+    if (!cache_path.empty() && ReadWholeFile(cache_path, &bytes) == 0 &&
+        out->Deserialize(bytes, key, identity))
+        return 0;
+
+    WaveformBuilder builder;
+    int ret = builder.Build(path, buckets, out);
+    if (ret >= 0 && !cache_path.empty())
+        ReplaceFile(cache_path, out->Serialize(key, identity));
+    return ret;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "../ffmpeg/offline_decoder.cc"
+
+// Runs a luma analysis over a file twice, on one segment and then split at
+// keyframes across every core, and checks that both see the same frames in
+// the same order.
+//
+//   ./analysis_bench SampleVideo_1280x720_1mb.mp4
+
+struct LumaRun
+{
+    int result = 0;
+    std::vector<int64_t> times;
+    double mean_luma = 0;
+    OfflineStats stats;
+};
+
+static LumaRun analyze(const char *path, int threads) {
+    LumaRun run;
+    OfflineOptions options;
+    options.width = 320;
+    options.height = 180;
+    options.pix_fmt = AV_PIX_FMT_GRAY8;
+    options.threads = threads;
+    /* a single segment is the sequential baseline */
+    if (threads == 1)
+        options.min_segment_us = INT64_MAX;
+
+    OfflineDecoder decoder;
+    if ((run.result = decoder.Open(path, options)) < 0)
+        return run;
+    double total = 0;
+    run.result = decoder.Run([&run, &total](const AVFrame *frame, int64_t time_us) {
+        uint64_t sum = 0;
+        for (int y = 0; y < frame->height; y++) {
+            const uint8_t *row = frame->data[0] + y * frame->linesize[0];
+            for (int x = 0; x < frame->width; x++) {
+                sum += row[x];
+            }
+        }
+        total += double(sum) / (frame->width * frame->height);
+        run.times.push_back(time_us);
+        return true;
+    });
+    run.mean_luma = run.times.empty()? 0:total / run.times.size();
+    run.stats = decoder.Stats();
+    return run;
+}
+
+int main(int argc, char **argv) {
+    const char *path = (argc > 1)? argv[1]:"SampleVideo_1280x720_1mb.mp4";
+
+    LumaRun sequential = analyze(path, 1);
+    LumaRun parallel = analyze(path, 0);
+    if (sequential.result < 0 || parallel.result < 0) {
+        fprintf(stderr, "Analysis failed\n");
+        return 1;
+    }
+
+    printf("sequential: %zu frames in %.1f ms, mean luma %.2f\n", sequential.times.size(),
+           sequential.stats.elapsed_us / 1000.0, sequential.mean_luma);
+    printf("parallel:   %zu frames in %.1f ms on %d segments, %d at a time, mean luma %.2f\n",
+           parallel.times.size(), parallel.stats.elapsed_us / 1000.0, parallel.stats.segments,
+           parallel.stats.threads, parallel.mean_luma);
+    printf("speedup %.2fx\n", double(sequential.stats.elapsed_us) / parallel.stats.elapsed_us);
+
+    if (parallel.times != sequential.times) {
+        fprintf(stderr, "Parallel run delivered different frames\n");
+        return 1;
+    }
+    for (size_t i = 1; i < parallel.times.size(); i++) {
+        if (parallel.times[i] <= parallel.times[i - 1]) {
+            fprintf(stderr, "Frames out of order at %zu\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
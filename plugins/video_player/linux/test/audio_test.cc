@@ -0,0 +1,42 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a file headless twice: once recording its audio to a WAV file in
+// real time, then again into an unpaced null sink to time the decode side.
+// The video follows the audio clock in both runs.
+
+static int64_t play(const char *filename, std::unique_ptr<AudioSink> sink, int *frames) {
+    FFMPEGManager *fm = new FFMPEGManager();
+    if (fm->Init(filename, AV_PIX_FMT_RGBA, 640, 360) < 0 || !fm->HasAudio()) {
+        fprintf(stderr, "%s has no playable audio\n", filename);
+        delete fm;
+        return -1;
+    }
+    fm->SetAudioSink(std::move(sink));
+
+    *frames = 0;
+    int64_t start = av_gettime_relative();
+    std::thread loop([fm, frames]() { fm->Loop([frames]() { (*frames)++; }); });
+    while (!fm->AtEnd())
+        usleep(10000);
+    int64_t elapsed = av_gettime_relative() - start;
+    fm->Stop();
+    loop.join();
+    delete fm;
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    const char *filename = (argc > 1)? argv[1]:"SampleVideo_1280x720_1mb.mp4";
+    const char *wav = (argc > 2)? argv[2]:"audio_test.wav";
+    int frames;
+
+    int64_t elapsed = play(filename, std::unique_ptr<AudioSink>(new WavFileAudioSink(wav, true)), &frames);
+    if (elapsed < 0)
+        return 1;
+    printf("realtime: %d frames in %.2f s, audio written to %s\n", frames, elapsed / 1e6, wav);
+
+    elapsed = play(filename, std::unique_ptr<AudioSink>(new NullAudioSink(false)), &frames);
+    printf("unpaced:  %d frames in %.2f s (%.1f fps)\n", frames, elapsed / 1e6,
+           frames * 1e6 / std::max<int64_t>(elapsed, 1));
+    return 0;
+}
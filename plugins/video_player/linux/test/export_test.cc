@@ -0,0 +1,101 @@
+#include "../ffmpeg/clip_remuxer.cc"
+#include "../ffmpeg/job_queue.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Checks the job queue's ordering and cancellation, then cuts a clip out of
+// a file in both trim modes and reads it back.
+//
+//   ./export_test SampleVideo_1280x720_1mb.mp4 1500 4000
+
+static bool check_queue() {
+    JobQueue queue(1, 0);
+    std::mutex mutex;
+    std::vector<std::string> order;
+    auto record = [&](const std::string &name) {
+        return [&, name](const std::atomic<bool> &cancelled) {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(cancelled? name + " cancelled":name);
+        };
+    };
+    /* holds the one worker while the rest queue up */
+    std::atomic<bool> release(false);
+    queue.Submit(0, [&](const std::atomic<bool> &) {
+        while (!release)
+            usleep(1000);
+    });
+    usleep(10000);
+    queue.Submit(0, record("low"));
+    int64_t dropped = queue.Submit(5, record("dropped"), [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back("dropped cancelled");
+    });
+    queue.Submit(5, record("high"));
+    queue.Cancel(dropped);
+    release = true;
+    while (queue.Queued() > 0)
+        usleep(1000);
+    usleep(10000);
+
+    std::vector<std::string> expected = { "dropped cancelled", "high", "low" };
+    if (order != expected) {
+        fprintf(stderr, "jobs ran out of order:");
+        for (auto &name : order) {
+            fprintf(stderr, " [%s]", name.c_str());
+        }
+        fprintf(stderr, "\n");
+        return false;
+    }
+    return true;
+}
+
+static bool check_clip(const char *input, TrimMode mode, int64_t start_us, int64_t end_us) {
+    const char *output = "/tmp/export_test.mp4";
+    TrimOptions options;
+    options.start_us = start_us;
+    options.end_us = end_us;
+    options.mode = mode;
+    TrimResult result;
+    std::atomic<bool> cancelled(false);
+    int updates = 0;
+    int64_t start = av_gettime_relative();
+    ClipRemuxer remuxer(input, output, options);
+    int ret = remuxer.Run(cancelled, [&updates](double) { updates++; }, &result);
+    int64_t elapsed = av_gettime_relative() - start;
+    if (ret < 0) {
+        fprintf(stderr, "export failed: %d\n", ret);
+        return false;
+    }
+
+    AVFormatContext *fmt = NULL;
+    if (avformat_open_input(&fmt, output, NULL, NULL) < 0 || avformat_find_stream_info(fmt, NULL) < 0) {
+        fprintf(stderr, "the clip does not open\n");
+        return false;
+    }
+    double duration = fmt->duration / 1e6;
+    avformat_close_input(&fmt);
+    printf("%s: %.3f s to %.3f s, %lld packets, %s, %.3f s long, %d progress updates, %.1f ms\n",
+           mode == TrimMode::kExact? "exact":"keyframe", result.start_us / 1e6, result.end_us / 1e6,
+           (long long)result.packets, result.exact? "edit list":"from the keyframe", duration,
+           updates, elapsed / 1000.0);
+    /* the clip covers what was asked for, give or take a GOP at the start */
+    return result.start_us <= start_us && result.end_us < end_us &&
+        duration >= (end_us - start_us) / 1e6 * 0.9;
+}
+
+int main(int argc, char **argv) {
+    if (!check_queue())
+        return 1;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [start ms] [end ms]\n", argv[0]);
+        return 1;
+    }
+    int64_t start_us = ((argc > 2)? atoll(argv[2]):1500) * 1000;
+    int64_t end_us = ((argc > 3)? atoll(argv[3]):4000) * 1000;
+    if (!check_clip(argv[1], TrimMode::kKeyframe, start_us, end_us) ||
+        !check_clip(argv[1], TrimMode::kExact, start_us, end_us))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "paused_player.cc"
+
+// Swaps filters under a playing file: bad descriptions are refused up
+// front, a mirror applied while paused refilters the frame on screen, and
+// a threaded deinterlacer swapped in and out while playing never stops
+// the frames.
+//
+//   ./filter_test SampleVideo_1280x720_1mb.mp4
+
+// Mean difference between |a| and |b| mirrored, per channel.
+static double mirror_difference(const VideoFramePtr &a, const VideoFramePtr &b) {
+    int64_t total = 0;
+    for (int y = 0; y < a->height; y++) {
+        const uint8_t *p = a->data.data() + y * a->linesize;
+        const uint8_t *q = b->data.data() + y * b->linesize;
+        for (int x = 0; x < a->width; x++) {
+            for (int c = 0; c < 3; c++) {
+                total += abs(p[4 * x + c] - q[4 * (a->width - 1 - x) + c]);
+            }
+        }
+    }
+    return double(total) / (int64_t(a->width) * a->height * 3);
+}
+
+static bool plays(FFMPEGManager *fm, const char *what) {
+    usleep(FFMPEGManager::kSeekSettleTime * 3);
+    double fps = fm->Stats().output_fps;
+    printf("%s: %.1f fps\n", what, fps);
+    if (fps <= 0)
+        fprintf(stderr, "nothing shown with %s\n", what);
+    return fps > 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    FFMPEGOptions options;
+    options.filter_threads = 0;
+    PausedPlayer player(argv[1], AV_TIME_BASE, options);
+    if (!player.IsOpen())
+        return 1;
+    FFMPEGManager &fm = player.fm;
+
+    bool ok = true;
+    if (fm.SetFilter("nosuchfilter") >= 0 || fm.SetFilter("split[a][b]") >= 0 ||
+        fm.SetFilter("hflip=nosuchoption=1") >= 0) {
+        fprintf(stderr, "a bad description was taken\n");
+        ok = false;
+    }
+
+    /* the poster, then the same frame mirrored */
+    VideoFramePtr poster = player.WaitForPoster();
+    if (!poster) {
+        ok = false;
+    } else if (fm.SetFilter("hflip") < 0) {
+        fprintf(stderr, "hflip was refused\n");
+        ok = false;
+    } else {
+        VideoFramePtr mirrored = wait_for_frame(&fm, poster, FFMPEGManager::kSeekSettleTime * 4);
+        double difference = mirrored? mirror_difference(poster, mirrored):0;
+        if (mirrored)
+            printf("mirrored %.3f s as %.3f s, %.2f off per channel\n", poster->time, mirrored->time,
+                   difference);
+        if (!mirrored || mirrored->pts != poster->pts || difference > 4) {
+            fprintf(stderr, "the paused frame was not mirrored\n");
+            ok = false;
+        }
+    }
+
+    fm.SetPaused(false);
+    ok = ok && plays(&fm, "hflip");
+    ok = ok && fm.SetFilter("yadif=deint=all") >= 0 && plays(&fm, "yadif");
+    ok = ok && fm.SetFilter("") >= 0 && plays(&fm, "no filter");
+    if (ok && !fm.IsOpen()) {
+        fprintf(stderr, "the file was closed\n");
+        ok = false;
+    }
+    return ok? 0:1;
+}
@@ -0,0 +1,62 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a file with two frame taps: a histogram that keeps up, and one that
+// takes far longer than a frame. The slow tap must drop frames without
+// slowing presentation, and neither may see a copy of the frame.
+
+int main(int argc, char **argv) {
+    const char *path = (argc > 1)? argv[1]:"SampleVideo_1280x720_1mb.mp4";
+    int seconds = (argc > 2)? atoi(argv[2]):5;
+
+    FFMPEGOptions options;
+    options.audio = false;
+    FFMPEGManager *fm = new FFMPEGManager(options);
+    if (fm->Init(path, AV_PIX_FMT_RGBA, 640, 360) < 0)
+        return 1;
+    fm->SetLooping(true);
+
+    std::atomic<uint64_t> shared(0);
+    uint64_t histogram[256] = {0};
+    int64_t fast = fm->AddFrameTap([fm, &shared, &histogram](const VideoFramePtr &frame) {
+        for (size_t i = 0; i < frame->data.size(); i += 4) {
+            histogram[frame->data[i + 1]]++;
+        }
+        /* the tap holds the player's own frame, not a copy of it */
+        if (frame == fm->Frame())
+            shared++;
+    });
+    int64_t slow = fm->AddFrameTap([](const VideoFramePtr &frame) {
+        usleep(200000);
+    });
+
+    std::atomic<int64_t> presented(0);
+    std::thread loop([fm, &presented]() {
+        fm->Loop([&presented]() { presented++; });
+    });
+    sleep(seconds);
+    FrameTapStats slow_stats;
+    fm->TapStats(slow, &slow_stats);
+    fm->RemoveFrameTap(slow);
+    fm->Stop();
+    loop.join();
+
+    FrameTapStats fast_stats;
+    fm->TapStats(fast, &fast_stats);
+    fm->RemoveFrameTap(fast);
+    delete fm;
+
+    uint64_t peak = 0;
+    for (int i = 1; i < 256; i++) {
+        if (histogram[i] > histogram[peak])
+            peak = i;
+    }
+    printf("%lld frames presented in %d s\n", (long long)presented.load(), seconds);
+    printf("fast tap: %llu delivered, %llu dropped, %llu shared with the player, green peaks at %llu\n",
+           (unsigned long long)fast_stats.delivered, (unsigned long long)fast_stats.dropped,
+           (unsigned long long)shared.load(), (unsigned long long)peak);
+    printf("slow tap: %llu delivered, %llu dropped\n",
+           (unsigned long long)slow_stats.delivered, (unsigned long long)slow_stats.dropped);
+    /* 30 fps content, so a blocking slow tap would have held this to 5 fps */
+    bool ok = presented > seconds * 20 && slow_stats.dropped > 0 && shared > 0 && fast_stats.dropped == 0;
+    return ok? 0:1;
+}
@@ -0,0 +1,108 @@
+#include "../ffmpeg/hdr_converter.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Converts a synthetic 4K PQ frame, as P010 and as YUV420P10, to RGBA with
+// the vectorized kernel spread over the shared pool and with the plain loop
+// it replaces on one thread, at full size and halved. The budget is a frame
+// interval at 30 fps; both kernels must agree to within a step.
+
+static const int kWidth = 3840, kHeight = 2160;
+
+static AVFrame *make_frame(AVPixelFormat format) {
+    AVFrame *frame = av_frame_alloc();
+    frame->format = format;
+    frame->width = kWidth;
+    frame->height = kHeight;
+    frame->color_trc = AVCOL_TRC_SMPTE2084;
+    frame->color_primaries = AVCOL_PRI_BT2020;
+    frame->colorspace = AVCOL_SPC_BT2020_NCL;
+    frame->color_range = AVCOL_RANGE_MPEG;
+    av_frame_get_buffer(frame, 0);
+    int shift = (format == AV_PIX_FMT_P010LE)? 6:0;
+    /* a luma ramp across the whole code range, chroma turning slowly */
+    for (int y = 0; y < kHeight; y++) {
+        uint16_t *row = (uint16_t*)(frame->data[0] + size_t(y) * frame->linesize[0]);
+        for (int x = 0; x < kWidth; x++) {
+            row[x] = (64 + (x + y) * 876 / (kWidth + kHeight)) << shift;
+        }
+    }
+    for (int y = 0; y < kHeight / 2; y++) {
+        uint16_t *u = (uint16_t*)(frame->data[1] + size_t(y) * frame->linesize[1]);
+        uint16_t *v = (format == AV_PIX_FMT_P010LE)? u + 1:
+            (uint16_t*)(frame->data[2] + size_t(y) * frame->linesize[2]);
+        int step = (format == AV_PIX_FMT_P010LE)? 2:1;
+        for (int x = 0; x < kWidth / 2; x++) {
+            u[x * step] = (64 + (x * 7 + y * 3) % 897) << shift;
+            v[x * step] = (64 + (x * 3 + y * 7) % 897) << shift;
+        }
+    }
+    return frame;
+}
+
+static double bench_converter(HdrConverter *converter, const AVFrame *in, AVFrame *out, bool halve) {
+    const int kIterations = 20;
+    converter->Convert(in, out, AV_PIX_FMT_RGBA, halve);
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < kIterations; i++) {
+        converter->Convert(in, out, AV_PIX_FMT_RGBA, halve);
+    }
+    return (av_gettime_relative() - start) / 1000.0 / kIterations;
+}
+
+static double bench_scalar(const ToneMapTables &t, const AVFrame *in, AVFrame *out, bool halve) {
+    const int kIterations = 3;
+    int height = halve? kHeight / 2:kHeight;
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < kIterations; i++) {
+        for (int y = 0; y < height; y++) {
+            ToneMapRowScalar(t, HdrConverter::RowSource(in, y, halve), out->data[0] + size_t(y) * out->linesize[0],
+                             false);
+        }
+    }
+    return (av_gettime_relative() - start) / 1000.0 / kIterations;
+}
+
+static int max_difference(const AVFrame *a, const AVFrame *b) {
+    int most = 0;
+    for (int y = 0; y < a->height; y++) {
+        const uint8_t *p = a->data[0] + size_t(y) * a->linesize[0];
+        const uint8_t *q = b->data[0] + size_t(y) * b->linesize[0];
+        for (int x = 0; x < a->width * 4; x++) {
+            most = std::max(most, abs(p[x] - q[x]));
+        }
+    }
+    return most;
+}
+
+int main() {
+    const double budget = 1000.0 / 30;
+    bool ok = true;
+    printf("%dx%d PQ, %d pool threads, %.1f ms budget\n", kWidth, kHeight, int(ThreadPool::Shared().Size()), budget);
+    printf("format     size   simd ms  scalar ms  simd %% of budget  max diff\n");
+    AVPixelFormat formats[] = { AV_PIX_FMT_P010LE, AV_PIX_FMT_YUV420P10LE };
+    for (AVPixelFormat format : formats) {
+        AVFrame *in = make_frame(format);
+        for (int halve = 0; halve < 2; halve++) {
+            HdrConverter converter;
+            AVFrame *simd = av_frame_alloc(), *scalar = av_frame_alloc();
+            double simd_ms = bench_converter(&converter, in, simd, halve);
+            scalar->format = AV_PIX_FMT_RGBA;
+            scalar->width = simd->width;
+            scalar->height = simd->height;
+            av_frame_get_buffer(scalar, 0);
+            double scalar_ms = bench_scalar(*converter.Tables(), in, scalar, halve);
+            int difference = max_difference(simd, scalar);
+            printf("%-9s  %-5s  %7.2f  %9.2f  %15.1f%%  %8d\n",
+                   (format == AV_PIX_FMT_P010LE)? "p010":"yuv420p10", halve? "half":"full", simd_ms,
+                   scalar_ms, 100 * simd_ms / budget, difference);
+            ok = ok && difference <= 1;
+            av_frame_free(&simd);
+            av_frame_free(&scalar);
+        }
+        av_frame_free(&in);
+    }
+    return ok? 0:1;
+}
@@ -0,0 +1,76 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "../ffmpeg/frame_stamp.cc"
+
+// Stands in for a local capture process: writes an uncompressed y4m stream
+// to a FIFO (or stdout), each frame stamped with the moment it was made.
+//
+//   mkfifo /tmp/live.y4m
+//   ./live_producer /tmp/live.y4m 30 &
+//   ./live_test /tmp/live.y4m
+
+static int64_t monotonic_us() {
+    /* the clock av_gettime_relative() reads on Linux */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *path = (argc > 1)? argv[1]:"-";
+    int fps = (argc > 2)? atoi(argv[2]):30;
+    const int width = 640, height = 360;
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = (strcmp(path, "-") == 0)? STDOUT_FILENO:open(path, O_WRONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+
+    char header[128];
+    int length = snprintf(header, sizeof(header),
+                          "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+    if (!write_all(fd, header, length))
+        return 1;
+
+    std::vector<uint8_t> picture(width * height * 3 / 2, 128);
+    int64_t start = monotonic_us();
+    for (int64_t n = 0;; n++) {
+        /* a moving bar, so the picture visibly changes */
+        uint8_t *luma = picture.data();
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                luma[y * width + x] = ((x + n * 4) % width < 32)? 200:60;
+            }
+        }
+        WriteFrameStamp(luma, monotonic_us());
+        if (!write_all(fd, "FRAME\n", 6) || !write_all(fd, picture.data(), picture.size()))
+            break;
+
+        int64_t delay = start + (n + 1) * 1000000 / fps - monotonic_us();
+        if (delay > 0)
+            usleep(delay);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a live source for a while and reports the capture-to-present
+// latency of the frames stamped by live_producer.
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <fifo or unix:socket> [seconds]\n", argv[0]);
+        return 1;
+    }
+    int seconds = (argc > 2)? atoi(argv[2]):10;
+
+    FFMPEGOptions options;
+    options.live = true;
+    FFMPEGManager *fm = new FFMPEGManager(options);
+    if (fm->Init(argv[1], AV_PIX_FMT_RGBA, 640, 360) < 0)
+        return 1;
+
+    int64_t opened = av_gettime_relative();
+    std::atomic<int64_t> first_frame(AV_NOPTS_VALUE);
+    std::thread loop([fm, &first_frame]() {
+        fm->Loop([&first_frame]() {
+            if (first_frame == AV_NOPTS_VALUE)
+                first_frame = av_gettime_relative();
+        });
+    });
+    sleep(seconds);
+    LatencyStats latency = fm->Stats().latency;
+    fm->Stop();
+    loop.join();
+    delete fm;
+
+    if (first_frame != AV_NOPTS_VALUE)
+        printf("first frame %.1f ms after open\n", (first_frame.load() - opened) / 1000.0);
+    printf("%llu stamped frames: latency last %.2f ms, mean %.2f ms, min %.2f ms, max %.2f ms\n",
+           (unsigned long long)latency.samples, latency.last_us / 1000.0, latency.mean_us / 1000.0,
+           latency.min_us / 1000.0, latency.max_us / 1000.0);
+    return latency.samples? 0:1;
+}
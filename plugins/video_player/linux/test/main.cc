@@ -3,6 +3,11 @@
 int main() {
     FFMPEGManager* fm = new FFMPEGManager();
     fm->Init("SampleVideo_1280x720_1mb.mp4", AV_PIX_FMT_RGB24, 1280, 720);
-    fm->Loop();
+    std::thread loop([fm]() { fm->Loop(); });
+    /* playback holds the last frame at the end until told otherwise */
+    while (!fm->AtEnd())
+        usleep(100000);
+    fm->Stop();
+    loop.join();
     return 0;
-}
\ No newline at end of file
+}
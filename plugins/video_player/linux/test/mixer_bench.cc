@@ -0,0 +1,52 @@
+#include "../ffmpeg/audio_mixer.cc"
+
+// Times one mixer block for 1 to 32 inputs, each pulled from its own ring
+// and mixed with a gain ramp, using the vectorized kernel and the plain
+// loop it replaces. The budget is the block's playback time.
+
+typedef void (*MixFunction)(float*, const float*, size_t, float, float);
+
+static double bench(int inputs, MixFunction mix) {
+    const int kIterations = 20000;
+    AudioFormat format;
+    size_t count = size_t(AudioMixer::kBlockFrames) * format.channels;
+    std::vector<std::unique_ptr<AudioStream>> streams;
+    std::vector<float> source(count), scratch(count), out(count);
+    for (size_t i = 0; i < count; i++) {
+        source[i] = (i % 97) / 97.0f - 0.5f;
+    }
+    for (int i = 0; i < inputs; i++) {
+        streams.emplace_back(new AudioStream(format));
+    }
+
+    int64_t busy = 0;
+    for (int iteration = 0; iteration < kIterations; iteration++) {
+        for (auto &stream : streams) {
+            stream->Write(source.data(), AudioMixer::kBlockFrames, 0);
+        }
+        int64_t start = av_gettime_relative();
+        memset(out.data(), 0, count * sizeof(float));
+        for (int i = 0; i < inputs; i++) {
+            streams[i]->Pull(scratch.data(), AudioMixer::kBlockFrames);
+            /* a ramp on every block is the worst case */
+            float gain = (iteration & 1)? 0.5f:1.0f;
+            mix(out.data(), scratch.data(), count, gain, (1.5f - 2 * gain) / count);
+        }
+        ClampSamples(out.data(), count);
+        busy += av_gettime_relative() - start;
+    }
+    return double(busy) / kIterations;
+}
+
+int main() {
+    AudioFormat format;
+    double budget = double(AudioMixer::kBlockFrames) * AV_TIME_BASE / format.sample_rate;
+    printf("block: %d frames, %.0f us\n", AudioMixer::kBlockFrames, budget);
+    printf("inputs  simd us  scalar us  simd %% of budget\n");
+    for (int inputs = 1; inputs <= 32; inputs *= 2) {
+        double simd = bench(inputs, MixInto);
+        double scalar = bench(inputs, MixIntoScalar);
+        printf("%6d  %7.2f  %9.2f  %6.2f%%\n", inputs, simd, scalar, 100 * simd / budget);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef TEST_PAUSED_PLAYER
+#define TEST_PAUSED_PLAYER
+
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Shared by the tests that start from a paused player with a poster frame.
+
+// The first frame published after |previous|, or null after |timeout_us|.
+static VideoFramePtr wait_for_frame(FFMPEGManager *fm, const VideoFramePtr &previous, int64_t timeout_us) {
+    int64_t deadline = av_gettime_relative() + timeout_us;
+    while (av_gettime_relative() < deadline) {
+        VideoFramePtr frame = fm->Frame();
+        if (frame && frame != previous)
+            return frame;
+        usleep(1000);
+    }
+    return nullptr;
+}
+
+// A player of a file at 640x360, without audio, prerolled to |poster_us|
+// and looping on a thread of its own until it is destroyed.
+class PausedPlayer
+{
+private:
+    int64_t poster_us;
+    std::thread loop;
+
+    static FFMPEGOptions silent(FFMPEGOptions options) {
+        options.audio = false;
+        return options;
+    }
+
+public:
+    FFMPEGManager fm;
+
+    PausedPlayer(const char *path, int64_t poster_us, const FFMPEGOptions &options = FFMPEGOptions())
+        : poster_us(poster_us), fm(silent(options))
+    {
+        fm.Init(path, AV_PIX_FMT_RGBA, 640, 360);
+        if (!fm.IsOpen()) {
+            fprintf(stderr, "%s does not open\n", path);
+            return;
+        }
+        fm.Preroll(poster_us);
+        loop = std::thread([this]() { fm.Loop(); });
+    }
+
+    ~PausedPlayer()
+    {
+        if (loop.joinable()) {
+            fm.Stop();
+            loop.join();
+        }
+    }
+
+    bool IsOpen() const { return fm.IsOpen(); }
+
+    // The poster frame, or null if none came. The poster of an offset is
+    // the exact frame shown once the seek settles, not the keyframe shown
+    // on the way there.
+    VideoFramePtr WaitForPoster() {
+        VideoFramePtr poster = wait_for_frame(&fm, nullptr, 2 * AV_TIME_BASE);
+        if (poster && poster_us > 0) {
+            VideoFramePtr exact = wait_for_frame(&fm, poster, FFMPEGManager::kSeekSettleTime * 2);
+            if (exact)
+                poster = exact;
+        }
+        if (!poster)
+            fprintf(stderr, "no poster frame\n");
+        return poster;
+    }
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "paused_player.cc"
+
+// Prerolls a file from the start and from an offset. The poster frame must
+// show while paused and stay put, and unpausing must present the next frame
+// without waiting for the pipeline to fill.
+//
+//   ./poster_test SampleVideo_1280x720_1mb.mp4 2000
+
+static bool check(const char *path, int64_t poster_us) {
+    PausedPlayer player(path, poster_us);
+    if (!player.IsOpen())
+        return false;
+    FFMPEGManager &fm = player.fm;
+
+    bool ok = true;
+    VideoFramePtr poster = player.WaitForPoster();
+    if (!poster) {
+        ok = false;
+    } else {
+        double error_ms = (poster->time * AV_TIME_BASE - poster_us) / 1000.0;
+        usleep(300000);
+        bool held = fm.Frame() == poster;
+        int64_t start = av_gettime_relative();
+        fm.SetPaused(false);
+        VideoFramePtr next = wait_for_frame(&fm, poster, AV_TIME_BASE);
+        int64_t resumed_us = av_gettime_relative() - start;
+        printf("poster at %.3f s (%.1f ms off) after %.1f ms, %s while paused, next frame %.1f ms after play\n",
+               poster->time, error_ms, fm.Stats().first_frame_us / 1000.0, held? "held":"replaced",
+               resumed_us / 1000.0);
+        /* a frame interval or two at most, nothing like a preroll */
+        ok = held && next && resumed_us < 100000 && fabs(error_ms) < 100;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [poster ms]\n", argv[0]);
+        return 1;
+    }
+    int64_t poster_us = ((argc > 2)? atoll(argv[2]):2000) * 1000;
+    if (!check(argv[1], 0) || !check(argv[1], poster_us))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <condition_variable>
+#include <mutex>
+
+#include "../ffmpeg/media_probe.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Probes a batch of files twice, the second time from the cache, and checks
+// that both agree and that a missing file only fails its own entry.
+//
+//   ./probe_test SampleVideo_1280x720_1mb.mp4 [more files...]
+
+static double probe(const std::vector<std::string> &paths, std::vector<MediaInfo> *out) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    int64_t start = av_gettime_relative();
+    ProbeMediaBatch(ProbePool(), paths, [&](std::vector<MediaInfo> &infos) {
+        std::lock_guard<std::mutex> lock(mutex);
+        *out = infos;
+        finished = true;
+        cv.notify_all();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return finished; });
+    return (av_gettime_relative() - start) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [more files...]\n", argv[0]);
+        return 1;
+    }
+    std::vector<std::string> paths(argv + 1, argv + argc);
+    for (const std::string &path : paths) {
+        std::string cache_path = MediaCachePath("probes", path, ".info");
+        unlink(cache_path.c_str());
+    }
+    paths.push_back("/nonexistent/probe_test.mp4");
+
+    std::vector<MediaInfo> first, second;
+    double probed_ms = probe(paths, &first);
+    double cached_ms = probe(paths, &second);
+    printf("%zu files probed in %.1f ms, then %.1f ms from the cache\n", paths.size(), probed_ms, cached_ms);
+
+    for (size_t i = 0; i + 1 < paths.size(); i++) {
+        const MediaInfo &a = first[i], &b = second[i];
+        printf("%s: %s, %.3f s, %dx%d %s rotated %d, %.2f fps, %d Hz x%d %s\n", paths[i].c_str(),
+               a.format.c_str(), a.duration_us / 1e6, a.width, a.height, a.video_codec.c_str(),
+               a.rotation, a.frame_rate, a.sample_rate, a.channels, a.audio_codec.c_str());
+        if (a.error < 0 || b.error < 0 || a.duration_us != b.duration_us || a.width != b.width ||
+            a.height != b.height || a.rotation != b.rotation || a.video_codec != b.video_codec ||
+            a.audio_codec != b.audio_codec) {
+            fprintf(stderr, "%s: the cached probe differs\n", paths[i].c_str());
+            return 1;
+        }
+    }
+    if (first.back().error >= 0 || second.back().error >= 0) {
+        fprintf(stderr, "a missing file was probed\n");
+        return 1;
+    }
+    return 0;
+}
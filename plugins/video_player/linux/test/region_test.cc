@@ -0,0 +1,78 @@
+#include "paused_player.cc"
+
+// Zooms a paused file into its bottom right quarter. The frame on screen
+// must be redone from that quarter alone and match the full frame there;
+// zooming out again restores the whole picture. What each cost to convert
+// is printed.
+//
+//   ./region_test SampleVideo_1280x720_1mb.mp4
+
+// Mean difference per channel between |zoomed| and the part of |full| that
+// |region| covers, sampled at |zoomed|'s pixels.
+static double zoom_difference(const VideoFramePtr &full, const VideoFramePtr &zoomed, const FrameRegion &region) {
+    int64_t total = 0;
+    for (int y = 0; y < zoomed->height; y++) {
+        int fy = int((region.y + region.height * (y + 0.5) / zoomed->height) * full->height);
+        const uint8_t *p = zoomed->data.data() + y * zoomed->linesize;
+        const uint8_t *q = full->data.data() + fy * full->linesize;
+        for (int x = 0; x < zoomed->width; x++) {
+            int fx = int((region.x + region.width * (x + 0.5) / zoomed->width) * full->width);
+            for (int c = 0; c < 3; c++) {
+                total += abs(p[4 * x + c] - q[4 * fx + c]);
+            }
+        }
+    }
+    return double(total) / (int64_t(zoomed->width) * zoomed->height * 3);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    PausedPlayer player(argv[1], AV_TIME_BASE);
+    if (!player.IsOpen())
+        return 1;
+    FFMPEGManager &fm = player.fm;
+
+    FrameRegion quarter;
+    quarter.x = quarter.y = 0.5;
+    quarter.width = quarter.height = 0.5;
+    FrameRegion outside = quarter;
+    outside.x = 1.5;
+    FrameRegion broken = quarter;
+    broken.y = NAN;
+    bool ok = fm.SetRegion(outside) < 0 && fm.SetRegion(broken) < 0;
+    if (!ok)
+        fprintf(stderr, "a region outside the picture was taken\n");
+
+    VideoFramePtr full = player.WaitForPoster();
+    if (!full)
+        ok = false;
+
+    PipelineStats before = fm.Stats();
+    VideoFramePtr zoomed = ok && fm.SetRegion(quarter) >= 0?
+        wait_for_frame(&fm, full, FFMPEGManager::kSeekSettleTime * 4):nullptr;
+    if (!zoomed || zoomed->pts != full->pts || zoomed->region != quarter) {
+        fprintf(stderr, "the paused frame was not redone for the region\n");
+        ok = false;
+    } else {
+        PipelineStats after = fm.Stats();
+        double difference = zoom_difference(full, zoomed, quarter);
+        uint64_t items = after.convert.items - before.convert.items;
+        double zoomed_ms = items? (after.convert.busy_us - before.convert.busy_us) / 1000.0 / items:0;
+        double full_ms = before.convert.items? before.convert.busy_us / 1000.0 / before.convert.items:0;
+        printf("zoomed %.3f s to %dx%d, %.2f off per channel, converted in %.2f ms rather than %.2f ms\n",
+               zoomed->time, zoomed->width, zoomed->height, difference, zoomed_ms, full_ms);
+        /* the full frame was scaled down first, so only roughly */
+        ok = difference < 16;
+    }
+
+    VideoFramePtr restored = ok && fm.SetRegion(FrameRegion()) >= 0?
+        wait_for_frame(&fm, zoomed, FFMPEGManager::kSeekSettleTime * 4):nullptr;
+    if (ok && (!restored || !restored->region.IsFull() || restored->pts != full->pts)) {
+        fprintf(stderr, "the whole picture did not come back\n");
+        ok = false;
+    }
+    return ok? 0:1;
+}
@@ -0,0 +1,81 @@
+#include "../ffmpeg/scene_index.cc"
+
+// Checks the vectorized difference against the plain loop, then indexes a
+// file and prints its scenes. A second run must come from the cache.
+//
+//   ./scene_index_test SampleVideo_1280x720_1mb.mp4
+
+static bool check_sad() {
+    std::vector<uint8_t> a(4099), b(4099);
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] = (i * 37) & 0xff;
+        b[i] = (i * 91 + 13) & 0xff;
+    }
+    /* odd lengths and offsets exercise the scalar tail and unaligned loads */
+    for (size_t offset : { 0, 1, 7 }) {
+        for (size_t count : { 0, 15, 16, 17, 4096 }) {
+            uint64_t fast = FrameSad(&a[offset], &b[offset], count);
+            uint64_t slow = FrameSadScalar(&a[offset], &b[offset], count);
+            if (fast != slow) {
+                fprintf(stderr, "FrameSad(%zu, %zu) = %llu, expected %llu\n", offset, count,
+                        (unsigned long long)fast, (unsigned long long)slow);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool wait(SceneIndexer *indexer) {
+    while (indexer->GetState() == SceneIndexer::State::kBuilding) {
+        printf("\r%3.0f%%", indexer->Progress() * 100);
+        fflush(stdout);
+        usleep(100000);
+    }
+    printf("\r");
+    return indexer->GetState() == SceneIndexer::State::kReady;
+}
+
+int main(int argc, char **argv) {
+    if (!check_sad())
+        return 1;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+
+    /* a private cache, so that the first run always scans */
+    char directory[] = "/tmp/scene_index_testXXXXXX";
+    if (!mkdtemp(directory))
+        return 1;
+    setenv("XDG_CACHE_HOME", directory, 1);
+
+    int64_t start = av_gettime_relative();
+    SceneIndexer first(argv[1]);
+    first.Start();
+    if (!wait(&first)) {
+        fprintf(stderr, "indexing failed: %d\n", first.Error());
+        return 1;
+    }
+    int64_t scanned = av_gettime_relative() - start;
+    std::shared_ptr<const SceneIndex> index = first.Index();
+    for (const SceneCut &cut : index->cuts) {
+        printf("%8.3f s  score %5.1f\n", cut.time_us / 1e6, cut.score);
+    }
+
+    start = av_gettime_relative();
+    SceneIndexer second(argv[1]);
+    second.Start();
+    int64_t loaded = av_gettime_relative() - start;
+    if (second.GetState() != SceneIndexer::State::kReady ||
+        second.Index()->cuts.size() != index->cuts.size()) {
+        fprintf(stderr, "the index was not cached\n");
+        return 1;
+    }
+    printf("%zu scenes, scanned in %.1f ms, loaded from the cache in %.2f ms\n",
+           index->cuts.size(), scanned / 1000.0, loaded / 1000.0);
+
+    int64_t middle = index->cuts.back().time_us / 2;
+    printf("%.3f s snaps to %.3f s\n", middle / 1e6, index->Snap(middle, 10 * AV_TIME_BASE) / 1e6);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "../ffmpeg/scrub_proxy.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Builds the scrub proxy of a file, checks that its frames are where their
+// times say, then opens it again and checks that it came from the cache.
+//
+//   ./scrub_proxy_test SampleVideo_1280x720_1mb.mp4
+
+static std::shared_ptr<const ScrubProxy> build(JobQueue &queue, const char *path, int64_t *elapsed_us) {
+    int64_t start = av_gettime_relative();
+    auto job = std::make_shared<ScrubProxyJob>(path);
+    job->Start(queue, 0);
+    while (job->GetState() == ScrubProxyJob::State::kBuilding)
+        usleep(10000);
+    *elapsed_us = av_gettime_relative() - start;
+    return job->Proxy();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    std::string cache_path = ScrubProxy::CachePath(argv[1]);
+    unlink(cache_path.c_str());
+
+    JobQueue queue(1, 0);
+    int64_t built_us, cached_us;
+    std::shared_ptr<const ScrubProxy> proxy = build(queue, argv[1], &built_us);
+    if (!proxy) {
+        fprintf(stderr, "no proxy was built\n");
+        return 1;
+    }
+    printf("built %dx%d, %d frames in %.1f ms\n", proxy->Width(), proxy->Height(), proxy->Count(),
+           built_us / 1000.0);
+
+    /* times rise, and every time finds its own frame */
+    for (int i = 0; i < proxy->Count(); i++) {
+        if ((i > 0 && proxy->Time(i) <= proxy->Time(i - 1)) || proxy->Find(proxy->Time(i)) != i) {
+            fprintf(stderr, "frame %d at %lld is out of place\n", i, (long long)proxy->Time(i));
+            return 1;
+        }
+    }
+    if (proxy->Find(INT64_MIN) != 0 || proxy->Find(INT64_MAX) != proxy->Count() - 1) {
+        fprintf(stderr, "times outside the file are not clamped\n");
+        return 1;
+    }
+    AVFrame *frame = av_frame_alloc();
+    proxy->Wrap(proxy->Count() - 1, frame);
+    bool wrapped = frame->width == proxy->Width() && frame->data[2] != NULL;
+    av_frame_free(&frame);
+    if (!wrapped) {
+        fprintf(stderr, "the last frame does not wrap\n");
+        return 1;
+    }
+
+    std::shared_ptr<const ScrubProxy> cached = build(queue, argv[1], &cached_us);
+    printf("opened again in %.1f ms\n", cached_us / 1000.0);
+    if (!cached || cached->Count() != proxy->Count() || cached_us > built_us / 2) {
+        fprintf(stderr, "the second open did not come from the cache\n");
+        return 1;
+    }
+    return 0;
+}
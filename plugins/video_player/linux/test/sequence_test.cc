@@ -0,0 +1,46 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a directory of numbered images at the requested rate and reports
+// the rate actually presented, to check that the read-ahead keeps up.
+//
+//   ffmpeg -i SampleVideo_1280x720_1mb.mp4 -vf scale=1920:1080 /tmp/frames/%04d.png
+//   ./sequence_test /tmp/frames 60
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <directory> [fps] [seconds]\n", argv[0]);
+        return 1;
+    }
+    FFMPEGOptions options;
+    options.frame_rate = (argc > 2)? atof(argv[2]):60.0;
+    int seconds = (argc > 3)? atoi(argv[3]):10;
+
+    FFMPEGManager *fm = new FFMPEGManager(options);
+    if (fm->Init(argv[1], AV_PIX_FMT_RGBA, 1920, 1080) < 0)
+        return 1;
+    fm->SetLooping(true);
+
+    std::atomic<int64_t> frames(0), first_frame(AV_NOPTS_VALUE);
+    std::thread loop([fm, &frames, &first_frame]() {
+        fm->Loop([&frames, &first_frame]() {
+            if (first_frame == AV_NOPTS_VALUE)
+                first_frame = av_gettime_relative();
+            frames++;
+        });
+    });
+    sleep(seconds);
+    int64_t elapsed = av_gettime_relative() - first_frame;
+    int64_t presented = frames;
+    PipelineStats stats = fm->Stats();
+    fm->Stop();
+    loop.join();
+    delete fm;
+
+    double fps = (presented > 1)? (presented - 1) * 1e6 / elapsed:0;
+    printf("%lld frames, %.1f fps presented of %.1f requested\n",
+           (long long)presented, fps, options.frame_rate);
+    printf("waited %.2f ms per image for the read-ahead, convert %.2f ms per frame\n",
+           stats.decode.items? stats.decode.busy_us / 1000.0 / stats.decode.items:0.0,
+           stats.convert.items? stats.convert.busy_us / 1000.0 / stats.convert.items:0.0);
+    return fps >= options.frame_rate * 0.95? 0:1;
+}
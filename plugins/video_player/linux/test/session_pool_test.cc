@@ -0,0 +1,92 @@
+#include "../ffmpeg/session_pool.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Parks open players in a session pool and checks that the least recently
+// parked are evicted first, by count and then by memory, and that taking a
+// player back costs nothing next to opening it and finds it at the normal
+// rate however fast it was left playing.
+//
+//   ./session_pool_test SampleVideo_1280x720_1mb.mp4
+
+static FFMPEGManager *open_player(const char *path, int64_t *elapsed_us) {
+    FFMPEGOptions options;
+    options.audio = false;
+    int64_t start = av_gettime_relative();
+    FFMPEGManager *fm = new FFMPEGManager(options);
+    fm->Init(path, AV_PIX_FMT_RGBA, 640, 360);
+    *elapsed_us = av_gettime_relative() - start;
+    return fm;
+}
+
+// Parks |fm| under |key| the way the plugin does once its last texture is
+// disposed.
+static std::vector<FFMPEGManager*> park(SessionPool *pool, const std::string &key, FFMPEGManager *fm) {
+    fm->SetPaused(true);
+    fm->SetFilter("");
+    fm->SetRegion(FrameRegion());
+    fm->SetSpeed(1.0);
+    return pool->Put(key, fm);
+}
+
+static bool expect(const std::vector<FFMPEGManager*> &evicted, const std::vector<FFMPEGManager*> &expected,
+                   const char *what) {
+    if (evicted != expected) {
+        fprintf(stderr, "%s: %zu evicted, %zu expected\n", what, evicted.size(), expected.size());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    int64_t opened_us = 0;
+    std::vector<FFMPEGManager*> players;
+    for (int i = 0; i < 3; i++) {
+        players.push_back(open_player(argv[1], &opened_us));
+        if (!players.back()->IsOpen()) {
+            fprintf(stderr, "%s does not open\n", argv[1]);
+            return 1;
+        }
+    }
+
+    SessionPool pool(2, SIZE_MAX);
+    /* disposed while fast forwarding */
+    players[1]->SetSpeed(8.0);
+    bool ok = expect(park(&pool, "a", players[0]), {}, "first") &&
+        expect(park(&pool, "b", players[1]), {}, "second") &&
+        /* over the count: the first parked goes */
+        expect(park(&pool, "c", players[2]), { players[0] }, "third");
+    if (!ok)
+        return 1;
+    delete players[0];
+
+    int64_t start = av_gettime_relative();
+    FFMPEGManager *taken = pool.Take("b");
+    int64_t taken_us = av_gettime_relative() - start;
+    printf("opened in %.2f ms, taken back in %.3f ms\n", opened_us / 1000.0, taken_us / 1000.0);
+    if (taken != players[1] || !taken->IsOpen() || pool.Take("a") || pool.Size() != 1) {
+        fprintf(stderr, "the pool gave back the wrong player\n");
+        return 1;
+    }
+    if (taken->Speed() != 1.0) {
+        fprintf(stderr, "taken back at %.2fx\n", taken->Speed());
+        return 1;
+    }
+
+    /* over the memory: room for one player only, the one parked last */
+    park(&pool, "b", taken);
+    size_t one = MemoryGovernor::Shared().Usage(players[2]);
+    if (one == 0 || !expect(pool.SetLimits(2, one + 1), { players[2] }, "memory"))
+        return 1;
+    delete players[2];
+    for (FFMPEGManager *fm : pool.Clear()) {
+        delete fm;
+    }
+    return pool.Size() == 0? 0:1;
+}
@@ -0,0 +1,67 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "../ffmpeg/shm_frame_ring.cc"
+
+// Stands in for a local renderer or capture process that already has raw
+// pixels: publishes RGBA frames into a shared-memory ring until interrupted.
+//
+//   ./shm_producer video_player_test 60 &
+//   ./shm_test shm://video_player_test
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int) {
+    interrupted = 1;
+}
+
+static int64_t monotonic_us() {
+    /* the clock av_gettime_relative() reads on Linux */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv) {
+    const char *name = (argc > 1)? argv[1]:"video_player_test";
+    int fps = (argc > 2)? atoi(argv[2]):60;
+    const int width = 640, height = 360;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    ShmFrameRing ring;
+    int ret = ring.Create(name, ShmPixelFormat::kRGBA, width, height, 4);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot create ring %s: %s\n", name, strerror(-ret));
+        return 1;
+    }
+
+    std::vector<uint8_t> picture(size_t(width) * height * 4);
+    int64_t start = monotonic_us();
+    for (int64_t n = 0; !interrupted; n++) {
+        /* a moving bar, so the picture visibly changes */
+        for (int y = 0; y < height; y++) {
+            uint8_t *row = &picture[size_t(y) * width * 4];
+            for (int x = 0; x < width; x++) {
+                uint8_t level = ((x + n * 4) % width < 32)? 220:40;
+                row[x * 4 + 0] = level;
+                row[x * 4 + 1] = uint8_t(y * 255 / height);
+                row[x * 4 + 2] = level;
+                row[x * 4 + 3] = 255;
+            }
+        }
+        ring.Publish(picture.data(), monotonic_us());
+
+        int64_t delay = start + (n + 1) * 1000000 / fps - monotonic_us();
+        if (delay > 0)
+            usleep(delay);
+    }
+    /* lets players hold the last frame instead of waiting for more */
+    ring.Close();
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a shared-memory ring for a while and reports how many frames made
+// it through and how long each took from publish to present.
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s shm://<name> [seconds]\n", argv[0]);
+        return 1;
+    }
+    int seconds = (argc > 2)? atoi(argv[2]):10;
+
+    FFMPEGManager *fm = new FFMPEGManager();
+    if (fm->Init(argv[1], AV_PIX_FMT_RGBA, 640, 360) < 0)
+        return 1;
+
+    std::atomic<int64_t> frames(0);
+    std::thread loop([fm, &frames]() {
+        fm->Loop([&frames]() { frames++; });
+    });
+    sleep(seconds);
+    LatencyStats latency = fm->Stats().latency;
+    fm->Stop();
+    loop.join();
+    delete fm;
+
+    printf("%lld frames in %d s: latency last %.2f ms, mean %.2f ms, min %.2f ms, max %.2f ms\n",
+           (long long)frames.load(), seconds, latency.last_us / 1000.0, latency.mean_us / 1000.0,
+           latency.min_us / 1000.0, latency.max_us / 1000.0);
+    return frames? 0:1;
+}
@@ -0,0 +1,64 @@
+#include "../ffmpeg/ffmpeg_manager.cc"
+
+// Plays a file at several rates, forwards and backwards, and checks that
+// the position moves at the rate asked for while the output stays close to
+// the source's frame rate, with the decoder rather than the converter
+// dropping what fast rates leave out.
+//
+//   ./speed_test SampleVideo_1280x720_1mb.mp4
+
+static const int64_t kRun = 1500000;
+
+static bool run(FFMPEGManager *fm, double speed, int64_t from_us) {
+    /* a seek of its own, if turning forward, is overridden */
+    fm->SetSpeed(speed);
+    fm->Seek(from_us);
+    /* the seek settles, then the pipeline fills */
+    usleep(FFMPEGManager::kSeekSettleTime * 3);
+    PipelineStats before = fm->Stats();
+    int64_t start = fm->Position();
+    usleep(kRun);
+    PipelineStats after = fm->Stats();
+    int64_t moved = fm->Position() - start;
+
+    double expected = speed * kRun;
+    double converted = (after.convert.items - before.convert.items) / (kRun / 1e6);
+    printf("%5.2fx: moved %.3f s in %.3f s, %.1f fps shown, %.1f fps converted\n", speed,
+           moved / 1e6, kRun / 1e6, after.output_fps, converted);
+    /* within a GOP's worth of slack either way */
+    if (fabs(moved - expected) > fabs(expected) * 0.3 + 300000) {
+        fprintf(stderr, "%.2fx moved %.3f s rather than %.3f s\n", speed, moved / 1e6, expected / 1e6);
+        return false;
+    }
+    if (after.output_fps <= 0) {
+        fprintf(stderr, "%.2fx showed nothing\n", speed);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    FFMPEGOptions options;
+    options.audio = false;
+    FFMPEGManager fm(options);
+    fm.Init(argv[1], AV_PIX_FMT_RGBA, 640, 360);
+    if (!fm.IsOpen()) {
+        fprintf(stderr, "%s does not open\n", argv[1]);
+        return 1;
+    }
+    std::thread loop([&fm]() { fm.Loop(); });
+
+    bool ok = run(&fm, 1.0, 0) && run(&fm, 0.5, 0) && run(&fm, 2.0, 0) && run(&fm, 4.0, 0) &&
+        run(&fm, -1.0, 4 * AV_TIME_BASE) && run(&fm, -2.0, 4 * AV_TIME_BASE) && run(&fm, 1.0, 0);
+    if (ok && fm.SetSpeed(0) >= 0) {
+        fprintf(stderr, "a speed of 0 was taken\n");
+        ok = false;
+    }
+    fm.Stop();
+    loop.join();
+    return ok? 0:1;
+}
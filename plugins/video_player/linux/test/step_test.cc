@@ -0,0 +1,87 @@
+#include "paused_player.cc"
+
+// Seeks into a file, steps back a few frames and then forward again. Every
+// step back must land on an earlier frame, only the first into a GOP may
+// decode, so no more than one later step, into the GOP before, may cost
+// anywhere near the first, and stepping forward must retrace the same
+// frames.
+//
+//   ./step_test SampleVideo_1280x720_1mb.mp4 2000
+
+static const int kSteps = 8;
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [position ms]\n", argv[0]);
+        return 1;
+    }
+    int64_t position_us = ((argc > 2)? atoll(argv[2]):2000) * 1000;
+    PausedPlayer player(argv[1], position_us);
+    if (!player.IsOpen())
+        return 1;
+    FFMPEGManager &fm = player.fm;
+
+    VideoFramePtr start = player.WaitForPoster();
+    bool ok = start != nullptr;
+
+    std::vector<VideoFramePtr> back;
+    double first_ms = 0, slowest_ms = 0;
+    int decoded = 0;
+    for (int i = 0; ok && i < kSteps; i++) {
+        int64_t before = av_gettime_relative();
+        int ret = fm.Step(-1);
+        double elapsed_ms = (av_gettime_relative() - before) / 1000.0;
+        VideoFramePtr frame = fm.Frame();
+        VideoFramePtr previous = back.empty()? start:back.back();
+        if (ret < 0 || !frame || frame->pts >= previous->pts) {
+            fprintf(stderr, "step back %d: %d, %.3f s after %.3f s\n", i, ret, frame? frame->time:-1.0,
+                    previous->time);
+            ok = false;
+            break;
+        }
+        if (i == 0) {
+            first_ms = elapsed_ms;
+        } else {
+            slowest_ms = std::max(slowest_ms, elapsed_ms);
+            /* the rest of a GOP comes from the cache */
+            if (elapsed_ms > std::max(first_ms / 4, 1.0))
+                decoded++;
+        }
+        back.push_back(frame);
+    }
+    if (ok) {
+        printf("stepped back from %.3f s to %.3f s: first step %.2f ms, slowest after it %.3f ms\n",
+               start->time, back.back()->time, first_ms, slowest_ms);
+        if (decoded > 1) {
+            fprintf(stderr, "%d steps after the first decoded\n", decoded);
+            ok = false;
+        }
+    }
+
+    /* forward again through the frames just seen, newest last */
+    if (ok) {
+        back.pop_back();
+        std::reverse(back.begin(), back.end());
+        back.push_back(start);
+    }
+    for (size_t i = 0; ok && i < back.size(); i++) {
+        int ret = fm.Step(1);
+        VideoFramePtr frame = fm.Frame();
+        if (ret < 0 || !frame || frame->pts != back[i]->pts || frame->data != back[i]->data) {
+            fprintf(stderr, "step forward %zu: %d, %.3f s rather than %.3f s\n", i, ret,
+                    frame? frame->time:-1.0, back[i]->time);
+            ok = false;
+        }
+    }
+
+    /* left alone, the pipeline settles on the frame stepped to */
+    if (ok) {
+        VideoFramePtr shown = fm.Frame();
+        usleep(FFMPEGManager::kSeekSettleTime * 3);
+        if (fm.Frame()->pts != shown->pts) {
+            fprintf(stderr, "the pipeline moved off the stepped frame\n");
+            ok = false;
+        }
+    }
+    return ok? 0:1;
+}
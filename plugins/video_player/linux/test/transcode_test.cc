@@ -0,0 +1,58 @@
+#include "../ffmpeg/clip_transcoder.cc"
+
+// Transcodes a file with both built-in encoders and reads the results back,
+// then cancels a third run halfway and checks that nothing is left behind.
+//
+//   ./transcode_test SampleVideo_1280x720_1mb.mp4
+
+static bool transcode(const char *input, const char *output, AVCodecID codec, bool cancel_halfway) {
+    TranscodeOptions options;
+    options.codec = codec;
+    options.width = 640;
+    options.bit_rate = 1500000;
+    TranscodeResult result;
+    std::atomic<bool> cancelled(false);
+    double reached = 0;
+    ClipTranscoder transcoder(input, output, options);
+    int ret = transcoder.Run(cancelled, [&](double progress) {
+        reached = progress;
+        if (cancel_halfway && progress >= 0.5)
+            cancelled = true;
+    }, &result);
+
+    if (cancel_halfway) {
+        bool removed = access(output, F_OK) != 0;
+        printf("cancelled at %.0f%%: %s, %s\n", reached * 100,
+               ret == AVERROR_EXIT? "stopped":"ran on", removed? "output removed":"output left behind");
+        return ret == AVERROR_EXIT && removed;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s failed: %d\n", output, ret);
+        return false;
+    }
+
+    AVFormatContext *fmt = NULL;
+    if (avformat_open_input(&fmt, output, NULL, NULL) < 0 || avformat_find_stream_info(fmt, NULL) < 0) {
+        fprintf(stderr, "%s does not open\n", output);
+        return false;
+    }
+    int video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    bool sized = video >= 0 && fmt->streams[video]->codecpar->width == result.width &&
+        fmt->streams[video]->codecpar->height == result.height;
+    avformat_close_input(&fmt);
+    printf("%s: %dx%d, %lld frames, %s, %.1f ms\n", output, result.width, result.height,
+           (long long)result.frames, result.audio? "audio copied":"no audio", result.elapsed_us / 1000.0);
+    return sized && result.frames > 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    if (!transcode(argv[1], "/tmp/transcode_test.mp4", AV_CODEC_ID_MPEG4, false) ||
+        !transcode(argv[1], "/tmp/transcode_test.avi", AV_CODEC_ID_MJPEG, false) ||
+        !transcode(argv[1], "/tmp/transcode_cancel.mp4", AV_CODEC_ID_MPEG4, true))
+        return 1;
+    return 0;
+}
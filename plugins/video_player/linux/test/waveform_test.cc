@@ -0,0 +1,68 @@
+#include "../ffmpeg/waveform.cc"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// Checks the vectorized reduction against the plain loop, then summarizes a
+// file's audio on one thread and on every core and compares the two.
+//
+//   ./waveform_test SampleVideo_1280x720_1mb.mp4 2000
+
+static bool check_reduce() {
+    std::vector<float> samples(1027);
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = sinf(i * 0.05f) * ((i % 7) / 7.0f);
+    }
+    for (size_t count : { 0, 3, 4, 5, 1027 }) {
+        float fast_min = INFINITY, fast_max = -INFINITY, slow_min = INFINITY, slow_max = -INFINITY;
+        double fast_squares = 0, slow_squares = 0;
+        ReduceSamples(samples.data(), count, &fast_min, &fast_max, &fast_squares);
+        ReduceSamplesScalar(samples.data(), count, &slow_min, &slow_max, &slow_squares);
+        if (fast_min != slow_min || fast_max != slow_max ||
+            fabs(fast_squares - slow_squares) > 1e-4 * (slow_squares + 1)) {
+            fprintf(stderr, "ReduceSamples(%zu) disagrees with the plain loop\n", count);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double build(const char *path, int buckets, int threads, Waveform *out) {
+    int64_t start = av_gettime_relative();
+    WaveformBuilder builder;
+    if (builder.Build(path, buckets, out, threads) < 0)
+        return -1;
+    return (av_gettime_relative() - start) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    if (!check_reduce())
+        return 1;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [buckets]\n", argv[0]);
+        return 1;
+    }
+    int buckets = (argc > 2)? atoi(argv[2]):2000;
+
+    Waveform sequential, parallel;
+    double sequential_ms = build(argv[1], buckets, 1, &sequential);
+    double parallel_ms = build(argv[1], buckets, 0, &parallel);
+    if (sequential_ms < 0 || parallel_ms < 0) {
+        fprintf(stderr, "cannot summarize %s\n", argv[1]);
+        return 1;
+    }
+
+    /* a run decoded from a seek may differ slightly at its first packet */
+    int differing = 0;
+    for (int i = 0; i < buckets; i++) {
+        if (fabsf(sequential.max[i] - parallel.max[i]) > 0.05f ||
+            fabsf(sequential.rms[i] - parallel.rms[i]) > 0.05f)
+            differing++;
+    }
+    float peak = *std::max_element(parallel.max.begin(), parallel.max.end());
+    printf("%d buckets over %.1f s, peak %.3f\n", buckets, parallel.duration_us / 1e6, peak);
+    printf("1 thread %.1f ms, all cores %.1f ms (%.1fx), %d buckets differ\n",
+           sequential_ms, parallel_ms, sequential_ms / parallel_ms, differing);
+    return differing <= buckets / 100? 0:1;
+}
@@ -14,10 +14,12 @@
 #include "plugins/video_player/linux/video_player_plugin.h"
 
 #include <gtk/gtk.h>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <map>
+#include <mutex>
 #include <thread>
 
 using std::string;
@@ -32,8 +34,17 @@ using std::endl;
 
 #include <flutter_messenger.h>
 
+#include "ffmpeg/alsa_audio_sink.cc"
+#include "ffmpeg/clip_remuxer.cc"
+#include "ffmpeg/clip_transcoder.cc"
 #include "ffmpeg/ffmpeg_manager.cc"
 #include "ffmpeg/ffmpeg_texture.cc"
+#include "ffmpeg/job_queue.cc"
+#include "ffmpeg/media_probe.cc"
+#include "ffmpeg/offline_decoder.cc"
+#include "ffmpeg/scene_index.cc"
+#include "ffmpeg/session_pool.cc"
+#include "ffmpeg/waveform.cc"
 
 namespace plugins_video_player {
 
@@ -41,14 +52,45 @@ namespace {
 // See video_player.dart for documentation.
 const char kChannelName[] = "flutter.io/videoPlayer";
 const char kTextureIdFormat[] = "%s/videoEvents%ld";
+const char kAnalysisIdFormat[] = "%s/analysisEvents%ld";
+const char kExportIdFormat[] = "%s/exportEvents%ld";
 const char kInitMethod[] = "init";
 const char kCreateMethod[] = "create";
 const char kPlayMethod[] = "play";
 const char kSetLoopingMethod[] = "setLooping";
 const char kSetVolumeMethod[] = "setVolume";
+const char kSetPlaybackSpeedMethod[] = "setPlaybackSpeed";
+const char kSetFilterMethod[] = "setFilter";
+const char kSetRegionMethod[] = "setRegion";
 const char kPauseMethod[] = "pause";
 const char kPositionMethod[] = "position";
+const char kSeekToMethod[] = "seekTo";
+const char kStepForwardMethod[] = "stepForward";
+const char kStepBackwardMethod[] = "stepBackward";
 const char kDisposeMethod[] = "dispose";
+const char kStatsMethod[] = "stats";
+const char kSetFrameCacheLimitMethod[] = "setFrameCacheLimit";
+const char kSetMemoryBudgetMethod[] = "setMemoryBudget";
+const char kMemoryStatsMethod[] = "memoryStats";
+const char kAnalyzeFramesMethod[] = "analyzeFrames";
+const char kBuildSceneIndexMethod[] = "buildSceneIndex";
+const char kSceneIndexMethod[] = "sceneIndex";
+const char kCancelSceneIndexMethod[] = "cancelSceneIndex";
+const char kSnapToSceneMethod[] = "snapToScene";
+const char kGetWaveformMethod[] = "getWaveform";
+const char kExportClipMethod[] = "exportClip";
+const char kTranscodeClipMethod[] = "transcodeClip";
+const char kBuildScrubProxyMethod[] = "buildScrubProxy";
+const char kProbeMethod[] = "probe";
+const char kSetSessionPoolLimitsMethod[] = "setSessionPoolLimits";
+
+// Scrub proxies queue behind the exports a user asked for.
+const int kScrubProxyPriority = -10;
+
+// Appended to the URI key of keyframe-only preview managers.
+const char kKeyframeOnlySuffix[] = "#keyframes";
+// Appended to the URI key of live-source managers.
+const char kLiveSuffix[] = "#live";
 }
 
 using flutter::EncodableMap;
@@ -58,20 +100,61 @@ typedef flutter::MethodResult<EncodableValue> FlutterResponderEV;
 typedef flutter::MethodChannel<EncodableValue> FlutterMethdodChannelEV;
 typedef flutter::MethodCall<EncodableValue> FlutterMethdodCallEV;
 
+// The work of an export job, sending its events to |channel_name|.
+typedef std::function<void(const std::atomic<bool>& cancelled, const string& channel_name)> ExportTask;
+
+// An export waiting for Dart to listen, then for its turn on the job queue.
+struct PendingExport {
+  int priority;
+  JobQueue::Task task;
+  // Reports a job cancelled before it started.
+  JobQueue::Dropped dropped;
+  // -1 until submitted.
+  int64_t job_id;
+};
+
 class VideoPlayerPlugin : public flutter::Plugin {
  public:
   static void RegisterWithRegistrar(flutter::PluginRegistrar *registrar);
 
   virtual ~VideoPlayerPlugin();
 
+  // Frame taps, for the C API in video_player_plugin.h.
+  static int64_t AddFrameTap(int64_t texture_id, FrameTapCallback callback);
+  static void RemoveFrameTap(int64_t tap_id);
+  static bool GetFrameTapStats(int64_t tap_id, FrameTapStats* stats);
+
   string GetAssetURIFromArgs(const EncodableValue& arguments) const;
+  FFMPEGOptions GetOptionsFromArgs(const EncodableValue& arguments) const;
 
  protected:
   void Create(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
   void Play(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
   void Pause(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetLooping(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetVolume(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetPlaybackSpeed(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetFilter(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetRegion(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
   void Position(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SeekTo(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void Step(const EncodableValue& arguments, int direction, std::unique_ptr<FlutterResponderEV> result);
   void Dispose(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void Stats(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetFrameCacheLimit(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetMemoryBudget(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void MemoryStats(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void AnalyzeFrames(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void BuildSceneIndex(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SceneIndexOf(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void CancelSceneIndex(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SnapToScene(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void GetWaveformOf(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void ExportClip(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void TranscodeClip(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void BuildScrubProxy(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void Probe(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
+  void SetSessionPoolLimits(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result);
 
  private:
   // Creates a plugin that communicates on the given channel.
@@ -84,27 +167,74 @@ class VideoPlayerPlugin : public flutter::Plugin {
   void HandleListener(
     const FlutterMethdodCallEV &method_call, std::unique_ptr<FlutterResponderEV> result, 
     const string& channel_name, const string& uri);
+  void HandleAnalysisListener(
+    const FlutterMethdodCallEV &method_call, std::unique_ptr<FlutterResponderEV> result,
+    const string& channel_name, int64_t analysis_id, int chunk_frames);
+  // Runs an analysis to its end, sending its frames to Dart in chunks.
+  void HandleExportListener(
+      const FlutterMethdodCallEV &method_call,
+      std::unique_ptr<FlutterResponderEV> result,
+      int64_t export_id);
+  void StartExport(int priority, ExportTask task, std::unique_ptr<FlutterResponderEV> result);
+  // Crops the player to all that its textures show.
+  int UpdateRegion(FFMPEGManager* fman);
+  static void SendProgress(const string& channel_name, double progress);
+  void FinishExport(int64_t export_id);
+  void RunAnalysis(const string& channel_name, int64_t analysis_id, int chunk_frames);
+  static void SendEvent(const string& channel_name, const EncodableValue& value);
+  // Runs |task| on the platform thread, the only one that may reply to a
+  // method call.
+  static void RunOnPlatformThread(std::function<void()> task);
+  void StartLoop(FFMPEGManager* fman);
+  // Forgets and deletes players evicted from the session pool.
+  void DeleteManagers(const std::vector<FFMPEGManager*>& managers);
   // The MethodChannel used for communication with the Flutter engine.
   std::unique_ptr<FlutterMethdodChannelEV> channel_;
 
   static flutter::TextureRegistrar* texture_registrar;
   static flutter::BinaryMessenger* messenger;
   static flutter::FlutterEngine* engine;
+  static VideoPlayerPlugin* instance;
 
   std::unordered_map<int64_t, FFMPEGManager*>* managers_by_texture_id;
+  std::unordered_map<int64_t, FFMPEGTexture*>* textures_by_id;
   std::unordered_map<FFMPEGManager*, std::vector<int64_t>*>* texture_ownership;
+  // Guards the texture lists in texture_ownership, which each player's loop
+  // thread reads. Only the platform thread changes them.
+  std::mutex texture_ids_mutex;
   std::unordered_map<string, FFMPEGManager*>* managers_by_uri;
+  // Players without a texture, by the same keys, until they are shown again
+  // or evicted.
+  SessionPool* session_pool;
+  // The player each frame tap was added to. The mutex also covers writes to
+  // managers_by_texture_id, which AddFrameTap reads from other threads.
+  std::mutex taps_mutex;
+  std::unordered_map<int64_t, FFMPEGManager*>* managers_by_tap_id;
+  // Offline analyses from analyzeFrames until they finish.
+  std::mutex analyses_mutex;
+  std::unordered_map<int64_t, std::shared_ptr<OfflineDecoder>>* analyses;
+  int64_t next_analysis_id;
+  // Scene indexes by file, built or building.
+  std::mutex scene_indexers_mutex;
+  std::unordered_map<string, std::shared_ptr<SceneIndexer>>* scene_indexers;
+  // Exports from their export call until their job ends.
+  std::mutex exports_mutex;
+  std::unordered_map<int64_t, PendingExport>* exports;
+  int64_t next_export_id;
   // Private implementation.
 };
 
 flutter::TextureRegistrar* VideoPlayerPlugin::texture_registrar = NULL;
 flutter::BinaryMessenger* VideoPlayerPlugin::messenger = NULL;
+VideoPlayerPlugin* VideoPlayerPlugin::instance = NULL;
 
 // static
 void VideoPlayerPlugin::RegisterWithRegistrar(
     flutter::PluginRegistrar *registrar) {
   messenger = registrar->messenger();
   texture_registrar = registrar->textures();
+  // Every player is mixed into this one output.
+  AudioMixer::Shared().SetSink(std::unique_ptr<AudioSink>(new AlsaAudioSink()));
   auto channel = std::make_unique<FlutterMethdodChannelEV>(
       messenger, kChannelName,
       &flutter::StandardMethodCodec::GetInstance());
@@ -119,6 +249,7 @@ void VideoPlayerPlugin::RegisterWithRegistrar(
         plugin_pointer->HandleMethodCall(call, std::move(result));
       });
 
+  instance = plugin.get();
   registrar->AddPlugin(std::move(plugin));
 }
 
@@ -126,8 +257,16 @@ VideoPlayerPlugin::VideoPlayerPlugin(
     std::unique_ptr<FlutterMethdodChannelEV> channel)
     : channel_(std::move(channel)) {
   managers_by_texture_id = new std::unordered_map<int64_t, FFMPEGManager*>();
+  textures_by_id = new std::unordered_map<int64_t, FFMPEGTexture*>();
   texture_ownership = new std::unordered_map<FFMPEGManager*, std::vector<int64_t>*>();
   managers_by_uri = new std::unordered_map<string, FFMPEGManager*>();
+  session_pool = new SessionPool();
+  managers_by_tap_id = new std::unordered_map<int64_t, FFMPEGManager*>();
+  analyses = new std::unordered_map<int64_t, std::shared_ptr<OfflineDecoder>>();
+  next_analysis_id = 1;
+  scene_indexers = new std::unordered_map<string, std::shared_ptr<SceneIndexer>>();
+  exports = new std::unordered_map<int64_t, PendingExport>();
+  next_export_id = 1;
 }
 
 VideoPlayerPlugin::~VideoPlayerPlugin() {
@@ -138,6 +277,49 @@ VideoPlayerPlugin::~VideoPlayerPlugin() {
     }
 }
 
+// static
+int64_t VideoPlayerPlugin::AddFrameTap(int64_t texture_id, FrameTapCallback callback) {
+  if (!instance) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(instance->taps_mutex);
+  auto it = instance->managers_by_texture_id->find(texture_id);
+  if (it == instance->managers_by_texture_id->end()) {
+    return -1;
+  }
+  int64_t tap_id = it->second->AddFrameTap(std::move(callback));
+  instance->managers_by_tap_id->insert({tap_id, it->second});
+  return tap_id;
+}
+
+// static
+void VideoPlayerPlugin::RemoveFrameTap(int64_t tap_id) {
+  if (!instance) {
+    return;
+  }
+  FFMPEGManager *fman;
+  {
+    std::lock_guard<std::mutex> lock(instance->taps_mutex);
+    auto it = instance->managers_by_tap_id->find(tap_id);
+    if (it == instance->managers_by_tap_id->end()) {
+      return;
+    }
+    fman = it->second;
+    instance->managers_by_tap_id->erase(it);
+  }
+  fman->RemoveFrameTap(tap_id);
+}
+
+// static
+bool VideoPlayerPlugin::GetFrameTapStats(int64_t tap_id, FrameTapStats* stats) {
+  if (!instance) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(instance->taps_mutex);
+  auto it = instance->managers_by_tap_id->find(tap_id);
+  return it != instance->managers_by_tap_id->end() && it->second->TapStats(tap_id, stats);
+}
+
 EncodableValue GrabEncodableValueFromArgs(const EncodableValue& arguments, const char* key) {
   EncodableMap arg_map = arguments.MapValue();
   auto it = arg_map.find(EncodableValue(key));
@@ -159,6 +341,83 @@ string VideoPlayerPlugin::GetAssetURIFromArgs(const EncodableValue& arguments) c
   return uri.StringValue();
 }
 
+bool GrabIntFromArgs(const EncodableValue& arguments, const char* key, int* out) {
+  EncodableValue value = GrabEncodableValueFromArgs(arguments, key);
+  if (value.IsInt()) {
+    *out = value.IntValue();
+  } else if (value.IsLong()) {
+    *out = static_cast<int>(value.LongValue());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool GrabBoolFromArgs(const EncodableValue& arguments, const char* key) {
+  EncodableValue value = GrabEncodableValueFromArgs(arguments, key);
+  return value.IsBool() && value.BoolValue();
+}
+
+// Strips the suffixes Create adds to keep differently configured managers of
+// the same file apart.
+string FilenameFromUriKey(string uri) {
+  for (const char* suffix : {kLiveSuffix, kKeyframeOnlySuffix}) {
+    size_t length = strlen(suffix);
+    if (uri.size() >= length && uri.compare(uri.size() - length, length, suffix) == 0) {
+      uri.resize(uri.size() - length);
+    }
+  }
+  return uri;
+}
+
+FFMPEGOptions VideoPlayerPlugin::GetOptionsFromArgs(const EncodableValue& arguments) const {
+  FFMPEGOptions options;
+  int size;
+  if (GrabIntFromArgs(arguments, "width", &size) && size > 0) {
+    options.width = size;
+  }
+  if (GrabIntFromArgs(arguments, "height", &size) && size > 0) {
+    options.height = size;
+  }
+  options.keyframe_only = GrabBoolFromArgs(arguments, "keyframeOnly");
+  options.live = GrabBoolFromArgs(arguments, "live");
+  GrabIntFromArgs(arguments, "priority", &options.priority);
+  int poster_ms;
+  if (GrabIntFromArgs(arguments, "posterPosition", &poster_ms)) {
+    options.poster_us = static_cast<int64_t>(poster_ms) * 1000;
+  }
+  EncodableValue frame_rate = GrabEncodableValueFromArgs(arguments, "frameRate");
+  if (frame_rate.IsDouble() && frame_rate.DoubleValue() > 0) {
+    options.frame_rate = frame_rate.DoubleValue();
+  }
+  int filter_threads;
+  if (GrabIntFromArgs(arguments, "filterThreads", &filter_threads) && filter_threads >= 0) {
+    options.filter_threads = filter_threads;
+  }
+  EncodableValue tone_mapping = GrabEncodableValueFromArgs(arguments, "toneMapping");
+  if (tone_mapping.IsString()) {
+    const string& curve = tone_mapping.StringValue();
+    if (curve == "none") {
+      options.tone_map.curve = ToneMapCurve::kOff;
+    } else if (curve == "clip") {
+      options.tone_map.curve = ToneMapCurve::kClip;
+    } else if (curve == "reinhard") {
+      options.tone_map.curve = ToneMapCurve::kReinhard;
+    } else if (curve == "hable") {
+      options.tone_map.curve = ToneMapCurve::kHable;
+    }
+  }
+  EncodableValue peak_nits = GrabEncodableValueFromArgs(arguments, "peakNits");
+  if (peak_nits.IsDouble() && peak_nits.DoubleValue() > 0) {
+    options.tone_map.peak_nits = peak_nits.DoubleValue();
+  }
+  EncodableValue white_nits = GrabEncodableValueFromArgs(arguments, "whiteNits");
+  if (white_nits.IsDouble() && white_nits.DoubleValue() > 0) {
+    options.tone_map.white_nits = white_nits.DoubleValue();
+  }
+  return options;
+}
+
 void VideoPlayerPlugin::Create(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
   string uri_val = GetAssetURIFromArgs(arguments);
   if (uri_val == "") {
@@ -166,24 +425,61 @@ void VideoPlayerPlugin::Create(const EncodableValue& arguments, std::unique_ptr<
     return;
   }
 
-  FFMPEGManager *fman;
+  FFMPEGOptions options = GetOptionsFromArgs(arguments);
+  // Keyframe-only previews decode differently, so they never share a manager
+  // with a full player for the same file.
+  if (options.keyframe_only) {
+    uri_val += kKeyframeOnlySuffix;
+  }
+  if (options.live) {
+    uri_val += kLiveSuffix;
+  }
+
+  FFMPEGManager *fman = NULL;
+  bool warm = false;
   auto it = managers_by_uri->find(uri_val);
   if (it == managers_by_uri->end()) {
-    fman = new FFMPEGManager();
+    fman = session_pool->Take(uri_val);
+    // A parked player was opened at its own size, tone mapping and the
+    // rest, so it only stands in for one created with the same options.
+    if (fman != NULL && fman->Options() != options) {
+      DeleteManagers({fman});
+      fman = NULL;
+    }
+  }
+  if (it != managers_by_uri->end()) {
+    fman = it->second;
+  } else if (fman != NULL) {
+    // Still open and paused where it was left; its ownership entry was
+    // kept while it was parked.
+    managers_by_uri->insert({uri_val, fman});
+    warm = true;
+  } else {
+    fman = new FFMPEGManager(options);
     managers_by_uri->insert({uri_val, fman});
 
     std::vector<int64_t> *list = new std::vector<int64_t>();
     texture_ownership->insert({fman, std::move(list)});
   }
-  else {
-    fman = it->second;
-  }
 
-  Texture* texture = new FFMPEGTexture(fman);
-  int64_t texture_id = texture_registrar->RegisterTexture(std::move(texture));
-  managers_by_texture_id->insert({texture_id, fman});
+  FFMPEGTexture* texture = new FFMPEGTexture(fman);
+  int64_t texture_id = texture_registrar->RegisterTexture(texture);
+  {
+    std::lock_guard<std::mutex> lock(taps_mutex);
+    managers_by_texture_id->insert({texture_id, fman});
+  }
+  textures_by_id->insert({texture_id, texture});
   auto owner = texture_ownership->find(fman);
-  owner->second->push_back(texture_id);
+  {
+    std::lock_guard<std::mutex> lock(texture_ids_mutex);
+    owner->second->push_back(texture_id);
+  }
+  // The new texture shows the whole picture.
+  UpdateRegion(fman);
+  // A player taken back from the pool shows its last frame at once.
+  if (fman->Frame()) {
+    texture_registrar->MarkTextureFrameAvailable(texture_id);
+  }
 
   char channel_name[256];
   sprintf(channel_name, kTextureIdFormat, kChannelName, texture_id);
@@ -194,6 +490,7 @@ void VideoPlayerPlugin::Create(const EncodableValue& arguments, std::unique_ptr<
 
   EncodableMap encodables = {
     {EncodableValue("textureId"), EncodableValue(texture_id)},
+    {EncodableValue("warm"), EncodableValue(warm)},
   };
   EncodableValue value(encodables);
 
@@ -208,10 +505,25 @@ void VideoPlayerPlugin::Create(const EncodableValue& arguments, std::unique_ptr<
 void VideoPlayerPlugin::Play(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
   int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
   FFMPEGManager *fman = managers_by_texture_id->find(texture_id)->second;
-  std::vector<int64_t> *texture_ids = texture_ownership->find(fman)->second;
+  fman->SetPaused(false);
+  if (!fman->IsRunning()) {
+    StartLoop(fman);
+  }
+  result->Success();
+}
 
-  std::thread t(&FFMPEGManager::Loop, fman, [texture_ids]() {
-    for (auto &&id : *texture_ids)
+// Runs |fman| on a thread of its own, telling every texture it feeds about
+// each new frame.
+void VideoPlayerPlugin::StartLoop(FFMPEGManager* fman) {
+  std::vector<int64_t> *texture_ids = texture_ownership->find(fman)->second;
+  std::thread t(&FFMPEGManager::Loop, fman, [this, texture_ids]() {
+    // Textures come and go on the platform thread meanwhile.
+    std::vector<int64_t> ids;
+    {
+      std::lock_guard<std::mutex> lock(texture_ids_mutex);
+      ids = *texture_ids;
+    }
+    for (auto &&id : ids)
     {
       char channel_name[256];
       sprintf(channel_name, kTextureIdFormat, kChannelName, id);
@@ -224,24 +536,1016 @@ void VideoPlayerPlugin::Play(const EncodableValue& arguments, std::unique_ptr<Fl
       // messenger->Send(channel_name, std::move(&(*message)[0]), message->size());
     }
   });
-  
   t.detach();
-  result->Success();
 }
 
 void VideoPlayerPlugin::Pause(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  it->second->SetPaused(true);
   result->Success();
 }
 
+void VideoPlayerPlugin::SetLooping(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  it->second->SetLooping(GrabBoolFromArgs(arguments, "looping"));
+  result->Success();
+}
+
+void VideoPlayerPlugin::SetVolume(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  EncodableValue volume = GrabEncodableValueFromArgs(arguments, "volume");
+  if (!volume.IsDouble()) {
+    result->Error("Missing volume");
+    return;
+  }
+  it->second->SetVolume(static_cast<float>(volume.DoubleValue()));
+  result->Success();
+}
+
+// Negative speeds play backwards. The manager clamps the rate; audio is
+// muted at any rate but 1.
+void VideoPlayerPlugin::SetPlaybackSpeed(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  EncodableValue speed = GrabEncodableValueFromArgs(arguments, "speed");
+  if (!speed.IsDouble()) {
+    result->Error("Missing speed");
+    return;
+  }
+  int ret = it->second->SetSpeed(speed.DoubleValue());
+  if (ret == AVERROR(ENOSYS)) {
+    result->Error("Only files play in reverse");
+    return;
+  } else if (ret < 0) {
+    result->Error("Invalid speed");
+    return;
+  }
+  result->Success();
+}
+
+// Crops, rotations, deinterlacing and the like, as an ffmpeg filter graph
+// description run ahead of the scaling; an empty one removes them.
+void VideoPlayerPlugin::SetFilter(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  EncodableValue description = GrabEncodableValueFromArgs(arguments, "description");
+  if (!description.IsString()) {
+    result->Error("Missing description");
+    return;
+  }
+  if (it->second->SetFilter(description.StringValue()) < 0) {
+    result->Error("Invalid filter description");
+    return;
+  }
+  result->Success();
+}
+
+// A zoomed view shows part of the picture, given in fractions of its width
+// and height; no region shows all of it. The player decodes and converts
+// only what its textures show between them.
+void VideoPlayerPlugin::SetRegion(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  FrameRegion region;
+  EncodableValue x = GrabEncodableValueFromArgs(arguments, "x");
+  EncodableValue y = GrabEncodableValueFromArgs(arguments, "y");
+  EncodableValue width = GrabEncodableValueFromArgs(arguments, "width");
+  EncodableValue height = GrabEncodableValueFromArgs(arguments, "height");
+  if (x.IsDouble() && y.IsDouble() && width.IsDouble() && height.IsDouble()) {
+    region.x = x.DoubleValue();
+    region.y = y.DoubleValue();
+    region.width = width.DoubleValue();
+    region.height = height.DoubleValue();
+  } else if (!x.IsNull() || !y.IsNull() || !width.IsNull() || !height.IsNull()) {
+    result->Error("Incomplete region");
+    return;
+  }
+  if (!region.Clamp()) {
+    result->Error("Region outside the picture");
+    return;
+  }
+  textures_by_id->find(texture_id)->second->SetRegion(region);
+  if (UpdateRegion(it->second) < 0) {
+    result->Error("Region outside the picture");
+    return;
+  }
+  result->Success();
+}
+
+int VideoPlayerPlugin::UpdateRegion(FFMPEGManager* fman) {
+  std::vector<int64_t> *texture_ids = texture_ownership->find(fman)->second;
+  FrameRegion shown;
+  for (size_t i = 0; i < texture_ids->size(); i++) {
+    FrameRegion region = textures_by_id->find((*texture_ids)[i])->second->Region();
+    // The first one exactly, so that a texture alone gets its frames as
+    // they are.
+    shown = (i == 0)? region:shown.Union(region);
+  }
+  return fman->SetRegion(shown);
+}
+
 void VideoPlayerPlugin::Position(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
-  EncodableValue value(0);
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  EncodableValue value(it->second->Position() / 1000);
   result->Success(&value);
 }
 
+// Called for every step of a scrubber drag. The manager keeps only the
+// latest request, so there is nothing to throttle here.
+void VideoPlayerPlugin::SeekTo(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  EncodableValue location = GrabEncodableValueFromArgs(arguments, "location");
+  if (!location.IsInt() && !location.IsLong()) {
+    result->Error("Missing location");
+    return;
+  }
+  int64_t location_ms = location.IsInt()? location.IntValue():location.LongValue();
+  it->second->Seek(location_ms * 1000);
+  result->Success();
+}
+
+// Pauses and shows the next or previous frame, replying with its position.
+// The first step back into a GOP decodes it, which takes a moment; the
+// steps after it are served from memory. Steps run on PlayerPool and reply
+// from the platform thread once done.
+void VideoPlayerPlugin::Step(const EncodableValue& arguments, int direction, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  FFMPEGManager *fman = it->second;
+  std::shared_ptr<FlutterResponderEV> responder(std::move(result));
+  PlayerPool().Submit([fman, direction, responder]() {
+    int ret = fman->Step(direction);
+    int64_t position_ms = fman->Position() / 1000;
+    RunOnPlatformThread([ret, direction, position_ms, responder]() {
+      if (ret == AVERROR_EOF) {
+        responder->Error(direction > 0? "At the last frame":"At the first frame");
+        return;
+      } else if (ret == AVERROR(ENOSYS)) {
+        responder->Error("Only files can be stepped through");
+        return;
+      } else if (ret < 0) {
+        responder->Error("Step failed");
+        return;
+      }
+      EncodableMap encodables = {
+        {EncodableValue("position"), EncodableValue(position_ms)},
+      };
+      EncodableValue value(encodables);
+      responder->Success(&value);
+    });
+  });
+}
+
+// Releases the texture. A player left without textures is paused and parked
+// in the session pool rather than closed, unless it plays a live source.
 void VideoPlayerPlugin::Dispose(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  FFMPEGManager *fman = it->second;
+  {
+    std::lock_guard<std::mutex> lock(taps_mutex);
+    managers_by_texture_id->erase(it);
+  }
+  textures_by_id->erase(texture_id);
+  texture_registrar->UnregisterTexture(texture_id);
+  std::vector<int64_t> *texture_ids = texture_ownership->find(fman)->second;
+  {
+    std::lock_guard<std::mutex> lock(texture_ids_mutex);
+    texture_ids->erase(std::remove(texture_ids->begin(), texture_ids->end(), texture_id), texture_ids->end());
+  }
+  if (!texture_ids->empty()) {
+    // What is left to show may be less.
+    UpdateRegion(fman);
+    result->Success();
+    return;
+  }
+
+  string uri_val;
+  for (auto entry = managers_by_uri->begin(); entry != managers_by_uri->end(); entry++) {
+    if (entry->second == fman) {
+      uri_val = entry->first;
+      managers_by_uri->erase(entry);
+      break;
+    }
+  }
+  if (fman->Options().live || !fman->IsOpen()) {
+    DeleteManagers({fman});
+  } else {
+    fman->SetPaused(true);
+    // The next player of this file starts out unfiltered, at the normal rate.
+    fman->SetFilter("");
+    fman->SetRegion(FrameRegion());
+    fman->SetSpeed(1.0);
+    DeleteManagers(session_pool->Put(uri_val, fman));
+  }
+  result->Success();
+}
+
+void VideoPlayerPlugin::DeleteManagers(const std::vector<FFMPEGManager*>& managers) {
+  for (FFMPEGManager *fman : managers) {
+    {
+      std::lock_guard<std::mutex> lock(taps_mutex);
+      for (auto it = managers_by_tap_id->begin(); it != managers_by_tap_id->end();) {
+        it = (it->second == fman) ? managers_by_tap_id->erase(it) : std::next(it);
+      }
+    }
+    // The playback thread reads the texture list until the manager stops,
+    // which the platform thread does not wait for.
+    auto owner = texture_ownership->find(fman);
+    std::vector<int64_t> *texture_ids = owner->second;
+    texture_ownership->erase(owner);
+    PlayerPool().Submit([fman, texture_ids]() {
+      delete fman;
+      delete texture_ids;
+    });
+  }
+}
+
+EncodableValue EncodeStageStats(const StageStats& stats) {
+  EncodableMap encodables = {
+    {EncodableValue("items"), EncodableValue(static_cast<int64_t>(stats.items))},
+    {EncodableValue("busyMicros"), EncodableValue(stats.busy_us)},
+  };
+  return EncodableValue(encodables);
+}
+
+EncodableValue EncodeFrameCacheStats(const FrameCacheStats& stats) {
+  EncodableMap encodables = {
+    {EncodableValue("limitBytes"), EncodableValue(static_cast<int64_t>(stats.limit_bytes))},
+    {EncodableValue("usedBytes"), EncodableValue(static_cast<int64_t>(stats.used_bytes))},
+    {EncodableValue("frames"), EncodableValue(static_cast<int64_t>(stats.frames))},
+    {EncodableValue("hits"), EncodableValue(static_cast<int64_t>(stats.hits))},
+    {EncodableValue("misses"), EncodableValue(static_cast<int64_t>(stats.misses))},
+    {EncodableValue("evictions"), EncodableValue(static_cast<int64_t>(stats.evictions))},
+  };
+  return EncodableValue(encodables);
+}
+
+EncodableValue EncodeQueueStats(const QueueStats& stats) {
+  EncodableMap encodables = {
+    {EncodableValue("size"), EncodableValue(static_cast<int64_t>(stats.size))},
+    {EncodableValue("capacity"), EncodableValue(static_cast<int64_t>(stats.capacity))},
+    {EncodableValue("highWater"), EncodableValue(static_cast<int64_t>(stats.high_water))},
+    {EncodableValue("fullWaits"), EncodableValue(static_cast<int64_t>(stats.full_waits))},
+    {EncodableValue("emptyWaits"), EncodableValue(static_cast<int64_t>(stats.empty_waits))},
+  };
+  return EncodableValue(encodables);
+}
+
+EncodableValue EncodeLatencyStats(const LatencyStats& stats) {
+  EncodableMap encodables = {
+    {EncodableValue("samples"), EncodableValue(static_cast<int64_t>(stats.samples))},
+    {EncodableValue("lastMicros"), EncodableValue(stats.last_us)},
+    {EncodableValue("minMicros"), EncodableValue(stats.min_us)},
+    {EncodableValue("maxMicros"), EncodableValue(stats.max_us)},
+    {EncodableValue("meanMicros"), EncodableValue(stats.mean_us)},
+  };
+  return EncodableValue(encodables);
+}
+
+void VideoPlayerPlugin::Stats(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+
+  PipelineStats stats = it->second->Stats();
+  EncodableMap encodables = {
+    {EncodableValue("demux"), EncodeStageStats(stats.demux)},
+    {EncodableValue("decode"), EncodeStageStats(stats.decode)},
+    {EncodableValue("convert"), EncodeStageStats(stats.convert)},
+    {EncodableValue("audio"), EncodeStageStats(stats.audio)},
+    {EncodableValue("packetQueue"), EncodeQueueStats(stats.packets)},
+    {EncodableValue("frameQueue"), EncodeQueueStats(stats.frames)},
+    {EncodableValue("audioPacketQueue"), EncodeQueueStats(stats.audio_packets)},
+    {EncodableValue("latency"), EncodeLatencyStats(stats.latency)},
+    {EncodableValue("frameCache"), EncodeFrameCacheStats(FrameCache::Shared().Stats())},
+    {EncodableValue("firstFrameMicros"), EncodableValue(stats.first_frame_us)},
+    {EncodableValue("speed"), EncodableValue(stats.speed)},
+    {EncodableValue("outputFps"), EncodableValue(stats.output_fps)},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+bool GrabSizeFromArgs(const EncodableValue& arguments, const char* key, size_t* out) {
+  EncodableValue value = GrabEncodableValueFromArgs(arguments, key);
+  if (value.IsInt()) {
+    *out = std::max(value.IntValue(), 0);
+  } else if (value.IsLong()) {
+    *out = std::max<int64_t>(value.LongValue(), 0);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void VideoPlayerPlugin::SetFrameCacheLimit(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  size_t bytes;
+  if (!GrabSizeFromArgs(arguments, "bytes", &bytes)) {
+    result->Error("Bad Arguments", "bytes must be an integer");
+    return;
+  }
+  FrameCache::Shared().SetLimit(bytes);
+  result->Success();
+}
+
+void VideoPlayerPlugin::SetMemoryBudget(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  size_t bytes;
+  if (!GrabSizeFromArgs(arguments, "bytes", &bytes)) {
+    result->Error("Bad Arguments", "bytes must be an integer");
+    return;
+  }
+  MemoryGovernor::Shared().SetBudget(bytes);
+  result->Success();
+}
+
+void VideoPlayerPlugin::SetSessionPoolLimits(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  size_t sessions, bytes;
+  if (!GrabSizeFromArgs(arguments, "sessions", &sessions) || !GrabSizeFromArgs(arguments, "bytes", &bytes)) {
+    result->Error("Bad Arguments", "sessions and bytes must be integers");
+    return;
+  }
+  DeleteManagers(session_pool->SetLimits(sessions, bytes));
+  result->Success();
+}
+
+void VideoPlayerPlugin::MemoryStats(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  MemoryReport report = MemoryGovernor::Shared().Report();
+  flutter::EncodableList players;
+  for (auto &usage : report.clients) {
+    EncodableMap reservations;
+    for (auto &reservation : usage.reservations) {
+      reservations[EncodableValue(reservation.first)] =
+          EncodableValue(static_cast<int64_t>(reservation.second));
+    }
+    EncodableMap player = {
+      {EncodableValue("name"), EncodableValue(usage.name)},
+      {EncodableValue("priority"), EncodableValue(usage.priority)},
+      {EncodableValue("total"), EncodableValue(static_cast<int64_t>(usage.total))},
+      {EncodableValue("reservations"), EncodableValue(reservations)},
+    };
+    players.push_back(EncodableValue(player));
+  }
+
+  EncodableMap encodables = {
+    {EncodableValue("budget"), EncodableValue(static_cast<int64_t>(report.budget))},
+    {EncodableValue("total"), EncodableValue(static_cast<int64_t>(report.total))},
+    {EncodableValue("reliefs"), EncodableValue(static_cast<int64_t>(report.reliefs))},
+    {EncodableValue("players"), EncodableValue(players)},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::AnalyzeFrames(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  if (uri_val == "") {
+    result->Error("Asset arguments do not exist");
+    return;
+  }
+
+  // Luma alone is what most checks need, and a quarter of the bytes.
+  OfflineOptions options;
+  GrabIntFromArgs(arguments, "width", &options.width);
+  GrabIntFromArgs(arguments, "height", &options.height);
+  EncodableValue format = GrabEncodableValueFromArgs(arguments, "format");
+  options.pix_fmt = (format.IsString() && format.StringValue() == "rgba") ?
+      AV_PIX_FMT_RGBA : AV_PIX_FMT_GRAY8;
+  int chunk_frames = 32;
+  GrabIntFromArgs(arguments, "chunkFrames", &chunk_frames);
+  chunk_frames = std::max(chunk_frames, 1);
+
+  auto decoder = std::make_shared<OfflineDecoder>();
+  if (decoder->Open(uri_val, options) < 0) {
+    result->Error("Cannot open file for analysis");
+    return;
+  }
+  int64_t analysis_id;
+  {
+    std::lock_guard<std::mutex> lock(analyses_mutex);
+    analysis_id = next_analysis_id++;
+    analyses->insert({analysis_id, decoder});
+  }
+
+  // The analysis starts when Dart listens on its channel, so that no chunk
+  // is sent before anyone is there to receive it.
+  char channel_name[256];
+  sprintf(channel_name, kAnalysisIdFormat, kChannelName, analysis_id);
+  auto channel = std::make_unique<FlutterMethdodChannelEV>(
+      messenger, channel_name,
+      &flutter::StandardMethodCodec::GetInstance());
+  auto *channel_pointer = channel.get();
+  channel_pointer->SetMethodCallHandler(
+      [plugin_pointer = this, channel_name = string(channel_name), analysis_id, chunk_frames](
+          const auto &call, auto result) {
+        plugin_pointer->HandleAnalysisListener(call, std::move(result), channel_name, analysis_id,
+                                               chunk_frames);
+      });
+
+  EncodableMap encodables = {
+    {EncodableValue("analysisId"), EncodableValue(analysis_id)},
+    {EncodableValue("width"), EncodableValue(decoder->Width())},
+    {EncodableValue("height"), EncodableValue(decoder->Height())},
+    {EncodableValue("duration"), EncodableValue(decoder->Duration() / 1000)},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+const char* SceneIndexStateName(SceneIndexer::State state) {
+  switch (state) {
+    case SceneIndexer::State::kIdle:
+    case SceneIndexer::State::kBuilding:
+      return "building";
+    case SceneIndexer::State::kReady:
+      return "ready";
+    case SceneIndexer::State::kCancelled:
+      return "cancelled";
+    default:
+      return "failed";
+  }
+}
+
+void VideoPlayerPlugin::BuildSceneIndex(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  if (uri_val == "") {
+    result->Error("Asset arguments do not exist");
+    return;
+  }
+
+  std::shared_ptr<SceneIndexer> indexer, finished;
+  {
+    std::lock_guard<std::mutex> lock(scene_indexers_mutex);
+    auto it = scene_indexers->find(uri_val);
+    if (it != scene_indexers->end()) {
+      SceneIndexer::State state = it->second->GetState();
+      if (state == SceneIndexer::State::kFailed || state == SceneIndexer::State::kCancelled) {
+        // Asked again, so try again; the old worker is done and joins at once.
+        finished = it->second;
+        scene_indexers->erase(it);
+      } else {
+        indexer = it->second;
+      }
+    }
+    if (!indexer) {
+      indexer = std::make_shared<SceneIndexer>(uri_val);
+      indexer->Start();
+      scene_indexers->insert({uri_val, indexer});
+    }
+  }
+
+  EncodableMap encodables = {
+    {EncodableValue("state"), EncodableValue(SceneIndexStateName(indexer->GetState()))},
+    {EncodableValue("progress"), EncodableValue(indexer->Progress())},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::SceneIndexOf(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  std::shared_ptr<SceneIndexer> indexer;
+  {
+    std::lock_guard<std::mutex> lock(scene_indexers_mutex);
+    auto it = scene_indexers->find(uri_val);
+    if (it != scene_indexers->end()) {
+      indexer = it->second;
+    }
+  }
+  if (!indexer) {
+    result->Error("No scene index for this uri; call buildSceneIndex first");
+    return;
+  }
+
+  EncodableMap encodables = {
+    {EncodableValue("state"), EncodableValue(SceneIndexStateName(indexer->GetState()))},
+    {EncodableValue("progress"), EncodableValue(indexer->Progress())},
+  };
+  std::shared_ptr<const SceneIndex> index = indexer->Index();
+  if (index) {
+    // Thumbnails are packed RGBA, one per cut.
+    std::vector<int64_t> cuts;
+    flutter::EncodableList scores, thumbnails;
+    for (const SceneCut& cut : index->cuts) {
+      cuts.push_back(cut.time_us / 1000);
+      scores.push_back(EncodableValue(static_cast<double>(cut.score)));
+      thumbnails.push_back(EncodableValue(cut.thumbnail));
+    }
+    encodables[EncodableValue("cuts")] = EncodableValue(cuts);
+    encodables[EncodableValue("scores")] = EncodableValue(scores);
+    encodables[EncodableValue("thumbnailWidth")] = EncodableValue(index->thumbnail_width);
+    encodables[EncodableValue("thumbnailHeight")] = EncodableValue(index->thumbnail_height);
+    encodables[EncodableValue("thumbnails")] = EncodableValue(thumbnails);
+  }
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::CancelSceneIndex(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  std::lock_guard<std::mutex> lock(scene_indexers_mutex);
+  auto it = scene_indexers->find(uri_val);
+  if (it != scene_indexers->end()) {
+    // Kept, so that sceneIndex reports the cancellation; the worker notices
+    // within a frame and nothing is written to the cache.
+    it->second->Cancel();
+  }
   result->Success();
 }
 
+void VideoPlayerPlugin::SnapToScene(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  EncodableValue location = GrabEncodableValueFromArgs(arguments, "location");
+  if (!location.IsInt() && !location.IsLong()) {
+    result->Error("Missing location");
+    return;
+  }
+  int64_t location_ms = location.IsInt()? location.IntValue():location.LongValue();
+  int window_ms = 1000;
+  GrabIntFromArgs(arguments, "window", &window_ms);
+
+  std::shared_ptr<const SceneIndex> index;
+  {
+    std::lock_guard<std::mutex> lock(scene_indexers_mutex);
+    auto it = scene_indexers->find(uri_val);
+    if (it != scene_indexers->end()) {
+      index = it->second->Index();
+    }
+  }
+  // Without an index yet, scrubbing simply does not snap.
+  int64_t snapped_ms = index ?
+      index->Snap(location_ms * 1000, static_cast<int64_t>(window_ms) * 1000) / 1000 : location_ms;
+  EncodableValue value(snapped_ms);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::GetWaveformOf(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  if (uri_val == "") {
+    result->Error("Asset arguments do not exist");
+    return;
+  }
+  int buckets = 0;
+  if (!GrabIntFromArgs(arguments, "buckets", &buckets) || buckets <= 0) {
+    result->Error("Missing buckets");
+    return;
+  }
+
+  // A long file takes a while to summarize the first time, so the work is
+  // done on a worker rather than holding up the platform thread.
+  std::shared_ptr<FlutterResponderEV> responder(std::move(result));
+  WaveformPool().Submit([uri_val, buckets, responder]() {
+    Waveform waveform;
+    if (GetWaveform(uri_val, buckets, &waveform) < 0) {
+      RunOnPlatformThread([responder]() {
+        responder->Error("Cannot read the audio of this file");
+      });
+      return;
+    }
+    EncodableMap encodables = {
+      {EncodableValue("duration"), EncodableValue(waveform.duration_us / 1000)},
+      {EncodableValue("sampleRate"), EncodableValue(waveform.sample_rate)},
+      {EncodableValue("channels"), EncodableValue(waveform.channels)},
+      {EncodableValue("min"), EncodableValue(std::vector<double>(waveform.min.begin(), waveform.min.end()))},
+      {EncodableValue("max"), EncodableValue(std::vector<double>(waveform.max.begin(), waveform.max.end()))},
+      {EncodableValue("rms"), EncodableValue(std::vector<double>(waveform.rms.begin(), waveform.rms.end()))},
+    };
+    EncodableValue value(encodables);
+    RunOnPlatformThread([responder, value]() {
+      responder->Success(&value);
+    });
+  });
+}
+
+EncodableValue EncodeMediaInfo(const MediaInfo& info) {
+  if (info.error < 0) {
+    EncodableMap encodables = {
+      {EncodableValue("error"), EncodableValue(info.error)},
+    };
+    return EncodableValue(encodables);
+  }
+  EncodableMap encodables = {
+    {EncodableValue("duration"), EncodableValue(info.duration_us / 1000)},
+    {EncodableValue("bitRate"), EncodableValue(info.bit_rate)},
+    {EncodableValue("format"), EncodableValue(info.format)},
+  };
+  if (info.has_video) {
+    encodables[EncodableValue("width")] = EncodableValue(info.width);
+    encodables[EncodableValue("height")] = EncodableValue(info.height);
+    encodables[EncodableValue("rotation")] = EncodableValue(info.rotation);
+    encodables[EncodableValue("frameRate")] = EncodableValue(info.frame_rate);
+    encodables[EncodableValue("videoCodec")] = EncodableValue(info.video_codec);
+  }
+  if (info.has_audio) {
+    encodables[EncodableValue("sampleRate")] = EncodableValue(info.sample_rate);
+    encodables[EncodableValue("channels")] = EncodableValue(info.channels);
+    encodables[EncodableValue("audioCodec")] = EncodableValue(info.audio_codec);
+  }
+  return EncodableValue(encodables);
+}
+
+// Reads what a library screen shows about many files at once, without a
+// player or a decoder for any of them. Replies with one map per uri, in
+// order; a file that cannot be read gets only an error code.
+void VideoPlayerPlugin::Probe(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  EncodableValue uris = GrabEncodableValueFromArgs(arguments, "uris");
+  if (!uris.IsList()) {
+    result->Error("Missing uris");
+    return;
+  }
+  std::vector<string> paths;
+  for (const EncodableValue& uri : uris.ListValue()) {
+    if (!uri.IsString()) {
+      result->Error("Every uri must be a string");
+      return;
+    }
+    paths.push_back(uri.StringValue());
+  }
+
+  // The last probe to finish hands the reply to the platform thread, so no
+  // thread waits on the others.
+  std::shared_ptr<FlutterResponderEV> responder(std::move(result));
+  ProbeMediaBatch(ProbePool(), paths, [responder](std::vector<MediaInfo>& infos) {
+    flutter::EncodableList encodables;
+    for (const MediaInfo& info : infos) {
+      encodables.push_back(EncodeMediaInfo(info));
+    }
+    EncodableValue value(encodables);
+    RunOnPlatformThread([responder, value]() {
+      responder->Success(&value);
+    });
+  });
+}
+
+void VideoPlayerPlugin::ExportClip(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  EncodableValue output = GrabEncodableValueFromArgs(arguments, "output");
+  if (uri_val == "" || !output.IsString()) {
+    result->Error("Missing uri or output");
+    return;
+  }
+
+  TrimOptions options;
+  int start_ms = 0, end_ms = 0, priority = 0;
+  if (GrabIntFromArgs(arguments, "start", &start_ms)) {
+    options.start_us = static_cast<int64_t>(start_ms) * 1000;
+  }
+  if (GrabIntFromArgs(arguments, "end", &end_ms) && end_ms > start_ms) {
+    options.end_us = static_cast<int64_t>(end_ms) * 1000;
+  }
+  EncodableValue mode = GrabEncodableValueFromArgs(arguments, "mode");
+  if (mode.IsString() && mode.StringValue() == "exact") {
+    options.mode = TrimMode::kExact;
+  }
+  EncodableValue audio = GrabEncodableValueFromArgs(arguments, "audio");
+  options.audio = !audio.IsBool() || audio.BoolValue();
+  GrabIntFromArgs(arguments, "priority", &priority);
+
+  StartExport(priority, [uri_val, output = output.StringValue(), options](
+      const std::atomic<bool>& cancelled, const string& channel_name) {
+    TrimResult trim;
+    ClipRemuxer remuxer(uri_val, output, options);
+    int ret = remuxer.Run(cancelled, [&channel_name](double progress) {
+      SendProgress(channel_name, progress);
+    }, &trim);
+    EncodableMap encodables = {
+      {EncodableValue("event"), EncodableValue(ret >= 0 ? "done" : ret == AVERROR_EXIT ? "cancelled" : "error")},
+      {EncodableValue("start"), EncodableValue(trim.start_us / 1000)},
+      {EncodableValue("end"), EncodableValue(trim.end_us / 1000)},
+      {EncodableValue("exact"), EncodableValue(trim.exact)},
+      {EncodableValue("packets"), EncodableValue(trim.packets)},
+    };
+    SendEvent(channel_name, EncodableValue(encodables));
+  }, std::move(result));
+}
+
+void VideoPlayerPlugin::TranscodeClip(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  string uri_val = GetAssetURIFromArgs(arguments);
+  EncodableValue output = GrabEncodableValueFromArgs(arguments, "output");
+  if (uri_val == "" || !output.IsString()) {
+    result->Error("Missing uri or output");
+    return;
+  }
+
+  TranscodeOptions options;
+  EncodableValue codec = GrabEncodableValueFromArgs(arguments, "codec");
+  if (codec.IsString() && codec.StringValue() == "mjpeg") {
+    options.codec = AV_CODEC_ID_MJPEG;
+  } else if (codec.IsString() && codec.StringValue() != "mpeg4") {
+    result->Error("Unsupported codec; use mpeg4 or mjpeg");
+    return;
+  }
+  int start_ms = 0, end_ms = 0, priority = 0;
+  GrabIntFromArgs(arguments, "width", &options.width);
+  GrabIntFromArgs(arguments, "height", &options.height);
+  EncodableValue bit_rate = GrabEncodableValueFromArgs(arguments, "bitRate");
+  if (bit_rate.IsInt() || bit_rate.IsLong()) {
+    options.bit_rate = bit_rate.IsInt() ? bit_rate.IntValue() : bit_rate.LongValue();
+  }
+  if (GrabIntFromArgs(arguments, "start", &start_ms)) {
+    options.start_us = static_cast<int64_t>(start_ms) * 1000;
+  }
+  if (GrabIntFromArgs(arguments, "end", &end_ms) && end_ms > start_ms) {
+    options.end_us = static_cast<int64_t>(end_ms) * 1000;
+  }
+  EncodableValue audio = GrabEncodableValueFromArgs(arguments, "audio");
+  options.audio = !audio.IsBool() || audio.BoolValue();
+  GrabIntFromArgs(arguments, "priority", &priority);
+
+  StartExport(priority, [uri_val, output = output.StringValue(), options](
+      const std::atomic<bool>& cancelled, const string& channel_name) {
+    TranscodeResult transcode;
+    ClipTranscoder transcoder(uri_val, output, options);
+    int ret = transcoder.Run(cancelled, [&channel_name](double progress) {
+      SendProgress(channel_name, progress);
+    }, &transcode);
+    EncodableMap encodables = {
+      {EncodableValue("event"), EncodableValue(ret >= 0 ? "done" : ret == AVERROR_EXIT ? "cancelled" : "error")},
+      {EncodableValue("width"), EncodableValue(transcode.width)},
+      {EncodableValue("height"), EncodableValue(transcode.height)},
+      {EncodableValue("frames"), EncodableValue(transcode.frames)},
+      {EncodableValue("audio"), EncodableValue(transcode.audio)},
+      {EncodableValue("elapsedUs"), EncodableValue(transcode.elapsed_us)},
+    };
+    SendEvent(channel_name, EncodableValue(encodables));
+  }, std::move(result));
+}
+
+// Starts the player's scrub proxy on the export queue, or reports on it when
+// called again.
+void VideoPlayerPlugin::BuildScrubProxy(const EncodableValue& arguments, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t texture_id = GrabEncodableValueFromArgs(arguments, "textureId").LongValue();
+  auto it = managers_by_texture_id->find(texture_id);
+  if (it == managers_by_texture_id->end()) {
+    result->Error("Unknown textureId");
+    return;
+  }
+  std::shared_ptr<ScrubProxyJob> job = it->second->BuildScrubProxy(JobQueue::Exports(), kScrubProxyPriority);
+  if (!job) {
+    result->Error("Scrub proxies are only built for files");
+    return;
+  }
+
+  const char* state;
+  switch (job->GetState()) {
+    case ScrubProxyJob::State::kIdle:
+    case ScrubProxyJob::State::kBuilding:
+      state = "building";
+      break;
+    case ScrubProxyJob::State::kReady:
+      state = "ready";
+      break;
+    case ScrubProxyJob::State::kCancelled:
+      state = "cancelled";
+      break;
+    default:
+      state = "failed";
+      break;
+  }
+  EncodableMap encodables = {
+    {EncodableValue("state"), EncodableValue(state)},
+    {EncodableValue("progress"), EncodableValue(job->Progress())},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::StartExport(int priority, ExportTask task, std::unique_ptr<FlutterResponderEV> result) {
+  int64_t export_id;
+  char channel_name[256];
+  {
+    std::lock_guard<std::mutex> lock(exports_mutex);
+    export_id = next_export_id++;
+    sprintf(channel_name, kExportIdFormat, kChannelName, export_id);
+    // However the job ends, it is forgotten once it has reported.
+    JobQueue::Task run = [this, export_id, name = string(channel_name), task = std::move(task)](
+        const std::atomic<bool>& cancelled) {
+      task(cancelled, name);
+      FinishExport(export_id);
+    };
+    JobQueue::Dropped dropped = [this, export_id, name = string(channel_name)]() {
+      EncodableMap encodables = {
+        {EncodableValue("event"), EncodableValue("cancelled")},
+      };
+      SendEvent(name, EncodableValue(encodables));
+      FinishExport(export_id);
+    };
+    exports->insert({export_id, PendingExport{priority, std::move(run), std::move(dropped), -1}});
+  }
+
+  auto channel = std::make_unique<FlutterMethdodChannelEV>(
+      messenger, channel_name,
+      &flutter::StandardMethodCodec::GetInstance());
+  channel->SetMethodCallHandler(
+      [plugin_pointer = this, export_id](const auto &call, auto result) {
+        plugin_pointer->HandleExportListener(call, std::move(result), export_id);
+      });
+
+  EncodableMap encodables = {
+    {EncodableValue("exportId"), EncodableValue(export_id)},
+  };
+  EncodableValue value(encodables);
+  result->Success(&value);
+}
+
+void VideoPlayerPlugin::SendProgress(const string& channel_name, double progress) {
+  EncodableMap encodables = {
+    {EncodableValue("event"), EncodableValue("progress")},
+    {EncodableValue("progress"), EncodableValue(progress)},
+  };
+  SendEvent(channel_name, EncodableValue(encodables));
+}
+
+void VideoPlayerPlugin::FinishExport(int64_t export_id) {
+  std::lock_guard<std::mutex> lock(exports_mutex);
+  exports->erase(export_id);
+}
+
+void VideoPlayerPlugin::HandleExportListener(
+    const FlutterMethdodCallEV &method_call,
+    std::unique_ptr<FlutterResponderEV> result,
+    int64_t export_id) {
+  string method_name = method_call.method_name();
+  cout << "Method called: " << method_name << endl;
+  if (method_name.compare("listen") == 0) {
+    // Queued only now, so that no event is sent before anyone listens.
+    std::lock_guard<std::mutex> lock(exports_mutex);
+    auto it = exports->find(export_id);
+    if (it != exports->end() && it->second.job_id < 0) {
+      it->second.job_id = JobQueue::Exports().Submit(it->second.priority, it->second.task, it->second.dropped);
+    }
+    result->Success();
+  } else if (method_name.compare("cancel") == 0) {
+    int64_t job_id = -1;
+    {
+      std::lock_guard<std::mutex> lock(exports_mutex);
+      auto it = exports->find(export_id);
+      if (it != exports->end()) {
+        job_id = it->second.job_id;
+        if (job_id < 0) {
+          exports->erase(it);
+        }
+      }
+    }
+    // Outside the lock: a job that has not started reports it on this
+    // thread.
+    if (job_id >= 0) {
+      JobQueue::Exports().Cancel(job_id);
+    }
+    result->Success();
+  } else {
+    result->NotImplemented();
+  }
+}
+
+void VideoPlayerPlugin::SendEvent(const string& channel_name, const EncodableValue& value) {
+  std::unique_ptr<std::vector<uint8_t>> message = flutter::StandardMethodCodec::GetInstance().EncodeSuccessEnvelope(&value);
+  FlutterDesktopMessengerSend(reinterpret_cast<FlutterDesktopMessengerRef>(messenger), channel_name.c_str(), &(*message)[0], message->size());
+}
+
+// static
+void VideoPlayerPlugin::RunOnPlatformThread(std::function<void()> task) {
+  // The runner pumps the GLib main loop between engine events, on the
+  // platform thread, for the GTK-based plugins.
+  g_idle_add([](gpointer data) -> gboolean {
+    std::unique_ptr<std::function<void()>> task(static_cast<std::function<void()>*>(data));
+    (*task)();
+    return G_SOURCE_REMOVE;
+  }, new std::function<void()>(std::move(task)));
+}
+
+void VideoPlayerPlugin::RunAnalysis(const string& channel_name, int64_t analysis_id, int chunk_frames) {
+  std::shared_ptr<OfflineDecoder> decoder;
+  {
+    std::lock_guard<std::mutex> lock(analyses_mutex);
+    auto it = analyses->find(analysis_id);
+    if (it == analyses->end()) {
+      return;
+    }
+    decoder = it->second;
+  }
+
+  int width = decoder->Width();
+  int height = decoder->Height();
+  AVPixelFormat format = decoder->Format();
+  int frame_bytes = av_image_get_buffer_size(format, width, height, 1);
+  std::vector<uint8_t> data;
+  std::vector<int64_t> times;
+  auto flush = [&]() {
+    if (times.empty()) {
+      return;
+    }
+    EncodableMap encodables = {
+      {EncodableValue("event"), EncodableValue("frames")},
+      {EncodableValue("width"), EncodableValue(width)},
+      {EncodableValue("height"), EncodableValue(height)},
+      {EncodableValue("times"), EncodableValue(times)},
+      {EncodableValue("data"), EncodableValue(data)},
+    };
+    SendEvent(channel_name, EncodableValue(encodables));
+    times.clear();
+    data.clear();
+  };
+
+  int ret = decoder->Run([&](const AVFrame *frame, int64_t time_us) {
+    // Rows are packed tightly, one frame after another.
+    size_t offset = data.size();
+    data.resize(offset + frame_bytes);
+    av_image_copy_to_buffer(&data[offset], frame_bytes, frame->data, frame->linesize,
+                            format, width, height, 1);
+    times.push_back(time_us);
+    if (static_cast<int>(times.size()) >= chunk_frames) {
+      flush();
+    }
+    return true;
+  });
+  flush();
+
+  const OfflineStats &stats = decoder->Stats();
+  EncodableMap encodables = {
+    {EncodableValue("event"), EncodableValue(ret >= 0 ? "done" : ret == AVERROR_EXIT ? "cancelled" : "error")},
+    {EncodableValue("frames"), EncodableValue(static_cast<int64_t>(stats.frames))},
+    {EncodableValue("segments"), EncodableValue(stats.segments)},
+    {EncodableValue("elapsedUs"), EncodableValue(stats.elapsed_us)},
+  };
+  SendEvent(channel_name, EncodableValue(encodables));
+
+  std::lock_guard<std::mutex> lock(analyses_mutex);
+  analyses->erase(analysis_id);
+}
+
+void VideoPlayerPlugin::HandleAnalysisListener(
+    const FlutterMethdodCallEV &method_call,
+    std::unique_ptr<FlutterResponderEV> result,
+    const string& channel_name,
+    int64_t analysis_id,
+    int chunk_frames) {
+  string method_name = method_call.method_name();
+  cout << "Method called: " << method_name << endl;
+  if (method_name.compare("listen") == 0) {
+    std::thread t(&VideoPlayerPlugin::RunAnalysis, this, channel_name, analysis_id, chunk_frames);
+    t.detach();
+    result->Success();
+  } else if (method_name.compare("cancel") == 0) {
+    std::lock_guard<std::mutex> lock(analyses_mutex);
+    auto it = analyses->find(analysis_id);
+    if (it != analyses->end()) {
+      it->second->Cancel();
+    }
+    result->Success();
+  } else {
+    result->NotImplemented();
+  }
+}
+
 void VideoPlayerPlugin::HandleListener(
     const FlutterMethdodCallEV &method_call,
     std::unique_ptr<FlutterResponderEV> result,
@@ -250,12 +1554,32 @@ void VideoPlayerPlugin::HandleListener(
   string method_name = method_call.method_name();
   cout << "Method called: " << method_name << endl;
   if (method_name.compare("listen") == 0) {
-    managers_by_uri->find(uri)->second->Init(uri.c_str(), AV_PIX_FMT_RGBA, 1280, 720);
+    auto it = managers_by_uri->find(uri);
+    if (it == managers_by_uri->end()) {
+      // Every texture of the player was disposed before Dart listened.
+      result->Error("Unknown player");
+      return;
+    }
+    FFMPEGManager *fman = it->second;
+    const FFMPEGOptions &options = fman->Options();
+    string filename = FilenameFromUriKey(uri);
+    // A player shared with another texture or taken back from the session
+    // pool is open already.
+    if (!fman->IsOpen()) {
+      fman->Init(filename.c_str(), AV_PIX_FMT_RGBA, options.width, options.height);
+      // With a posterPosition from create, decodes that frame now and keeps
+      // the pipeline primed behind it, so the texture is not blank until
+      // play and play starts at once.
+      if (fman->IsOpen() && !fman->IsRunning() && options.poster_us >= 0 && !options.live) {
+        fman->Preroll(options.poster_us);
+        StartLoop(fman);
+      }
+    }
     EncodableMap encodables = {
       {EncodableValue("event"), EncodableValue("initialized")},
       {EncodableValue("duration"), EncodableValue(1)},
-      {EncodableValue("width"), EncodableValue(1280)},
-      {EncodableValue("height"), EncodableValue(720)},
+      {EncodableValue("width"), EncodableValue(options.width)},
+      {EncodableValue("height"), EncodableValue(options.height)},
     };
     EncodableValue value(encodables);
     std::unique_ptr<std::vector<uint8_t>> message = flutter::StandardMethodCodec::GetInstance().EncodeSuccessEnvelope(&value);
@@ -290,16 +1614,58 @@ void VideoPlayerPlugin::HandleMethodCall(
     Create(*method_call.arguments(), std::move(result));
   } else if (method_name.compare(kPlayMethod) == 0) {
     Play(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetPlaybackSpeedMethod) == 0) {
+    SetPlaybackSpeed(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetFilterMethod) == 0) {
+    SetFilter(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetRegionMethod) == 0) {
+    SetRegion(*method_call.arguments(), std::move(result));
   } else if (method_name.compare(kSetVolumeMethod) == 0) {
-    result->Success();
+    SetVolume(*method_call.arguments(), std::move(result));
   } else if (method_name.compare(kSetLoopingMethod) == 0) {
-    result->Success();
+    SetLooping(*method_call.arguments(), std::move(result));
   } else if (method_name.compare(kPauseMethod) == 0) {
     Pause(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSeekToMethod) == 0) {
+    SeekTo(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kStepForwardMethod) == 0) {
+    Step(*method_call.arguments(), 1, std::move(result));
+  } else if (method_name.compare(kStepBackwardMethod) == 0) {
+    Step(*method_call.arguments(), -1, std::move(result));
   } else if (method_name.compare(kPositionMethod) == 0) {
     Position(*method_call.arguments(), std::move(result));
   } else if (method_name.compare(kDisposeMethod) == 0) {
     Dispose(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kStatsMethod) == 0) {
+    Stats(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetFrameCacheLimitMethod) == 0) {
+    SetFrameCacheLimit(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetMemoryBudgetMethod) == 0) {
+    SetMemoryBudget(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kMemoryStatsMethod) == 0) {
+    MemoryStats(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kAnalyzeFramesMethod) == 0) {
+    AnalyzeFrames(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kBuildSceneIndexMethod) == 0) {
+    BuildSceneIndex(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSceneIndexMethod) == 0) {
+    SceneIndexOf(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kCancelSceneIndexMethod) == 0) {
+    CancelSceneIndex(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSnapToSceneMethod) == 0) {
+    SnapToScene(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kGetWaveformMethod) == 0) {
+    GetWaveformOf(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kExportClipMethod) == 0) {
+    ExportClip(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kTranscodeClipMethod) == 0) {
+    TranscodeClip(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kBuildScrubProxyMethod) == 0) {
+    BuildScrubProxy(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kProbeMethod) == 0) {
+    Probe(*method_call.arguments(), std::move(result));
+  } else if (method_name.compare(kSetSessionPoolLimitsMethod) == 0) {
+    SetSessionPoolLimits(*method_call.arguments(), std::move(result));
   } else {
     result->NotImplemented();
   }
@@ -315,3 +1681,47 @@ void VideoPlayerPluginRegisterWithRegistrar(
   plugins_video_player::VideoPlayerPlugin::RegisterWithRegistrar(
       plugin_registrar);
 }
+
+int64_t VideoPlayerAddFrameTap(int64_t texture_id,
+                               VideoPlayerFrameTapCallback callback,
+                               void* user_data) {
+  return plugins_video_player::VideoPlayerPlugin::AddFrameTap(
+      texture_id, [callback, user_data](const VideoFramePtr& frame) {
+        // The lease points at the shared frame for as long as it is lent.
+        VideoPlayerFrame lent = {
+          frame->data.data(), frame->width, frame->height, frame->linesize,
+          static_cast<int64_t>(frame->time * AV_TIME_BASE),
+          const_cast<VideoFramePtr*>(&frame),
+        };
+        callback(&lent, user_data);
+      });
+}
+
+void VideoPlayerRemoveFrameTap(int64_t tap_id) {
+  plugins_video_player::VideoPlayerPlugin::RemoveFrameTap(tap_id);
+}
+
+bool VideoPlayerGetFrameTapStats(int64_t tap_id, uint64_t* delivered,
+                                 uint64_t* dropped) {
+  FrameTapStats stats;
+  if (!plugins_video_player::VideoPlayerPlugin::GetFrameTapStats(tap_id, &stats)) {
+    return false;
+  }
+  *delivered = stats.delivered;
+  *dropped = stats.dropped;
+  return true;
+}
+
+VideoPlayerFrame* VideoPlayerRetainFrame(const VideoPlayerFrame* frame) {
+  VideoPlayerFrame* retained = new VideoPlayerFrame(*frame);
+  retained->lease = new VideoFramePtr(*static_cast<VideoFramePtr*>(frame->lease));
+  return retained;
+}
+
+void VideoPlayerReleaseFrame(VideoPlayerFrame* frame) {
+  if (!frame) {
+    return;
+  }
+  delete static_cast<VideoFramePtr*>(frame->lease);
+  delete frame;
+}
@@ -17,6 +17,8 @@
 // A plugin for communicating with a native color picker panel.
 
 #include <flutter_plugin_registrar.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #ifdef FLUTTER_PLUGIN_IMPL
 #define FLUTTER_PLUGIN_EXPORT __attribute__((visibility("default")))
@@ -31,6 +33,45 @@ extern "C" {
 FLUTTER_PLUGIN_EXPORT void VideoPlayerPluginRegisterWithRegistrar(
     FlutterDesktopPluginRegistrarRef registrar);
 
+// A frame being shown by a player, lent to a frame tap: RGBA rows of
+// |stride| bytes. The pixels are the player's own and must not be written.
+// They stay valid until the tap callback returns, or until
+// VideoPlayerReleaseFrame for a frame from VideoPlayerRetainFrame.
+typedef struct VideoPlayerFrame {
+  const uint8_t* pixels;
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  // Presentation time in the stream.
+  int64_t time_us;
+  // Keeps the pixels alive. Owned by the plugin.
+  void* lease;
+} VideoPlayerFrame;
+
+typedef void (*VideoPlayerFrameTapCallback)(const VideoPlayerFrame* frame,
+                                            void* user_data);
+
+// Calls |callback| with the frames the player behind |texture_id| shows,
+// on a thread belonging to the tap. A tap still busy with one frame misses
+// the ones published meanwhile; presentation never waits for it. Returns
+// an id for VideoPlayerRemoveFrameTap, or -1 for an unknown texture.
+FLUTTER_PLUGIN_EXPORT int64_t VideoPlayerAddFrameTap(
+    int64_t texture_id, VideoPlayerFrameTapCallback callback, void* user_data);
+
+// Waits for a callback in progress, after which |user_data| may be freed.
+// Must not be called from the tap's own callback.
+FLUTTER_PLUGIN_EXPORT void VideoPlayerRemoveFrameTap(int64_t tap_id);
+
+// Frames the tap has received, and frames it missed by being busy.
+FLUTTER_PLUGIN_EXPORT bool VideoPlayerGetFrameTapStats(int64_t tap_id,
+                                                       uint64_t* delivered,
+                                                       uint64_t* dropped);
+
+// Keeps a lent frame beyond the callback, still without copying it.
+FLUTTER_PLUGIN_EXPORT VideoPlayerFrame* VideoPlayerRetainFrame(
+    const VideoPlayerFrame* frame);
+FLUTTER_PLUGIN_EXPORT void VideoPlayerReleaseFrame(VideoPlayerFrame* frame);
+
 #if defined(__cplusplus)
 }  // extern "C"
 #endif